@@ -0,0 +1,426 @@
+/**
+ * @file ftp_stub.c
+ * @brief Minimal loopback FTP server used by the benchmark suite
+ *
+ * Implements just enough of RFC 959 for the client's download paths:
+ * USER, PASS, TYPE, MODE S, SIZE, MDTM, REST, EPSV, PASV, RETR, FEAT,
+ * NOOP and QUIT. Every control connection gets its own thread. Replies
+ * can be delayed to emulate round-trip latency (see reply()), the
+ * banner and the login reply can be made multi-line, and data can be
+ * paced to a bandwidth cap.
+ */
+
+#include "ftp_stub.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STUB_LINE_SIZE 1024         /**< Longest command accepted */
+#define STUB_CHUNK_SIZE (64 * 1024) /**< Bytes per send() on the data connection */
+
+static struct StubConfig stub;
+static char pattern[STUB_CHUNK_SIZE];  /**< Contents repeated in every file */
+
+/**
+ * @struct StubSession
+ * @brief State of one control connection
+ */
+struct StubSession {
+    int ctrl;              /**< Control socket */
+    int listener;          /**< Passive listener, -1 if none */
+    long long rest;        /**< Pending restart offset */
+    char buffer[STUB_LINE_SIZE];  /**< Bytes received on the control connection */
+    size_t used;                  /**< Bytes in buffer */
+    char line[STUB_LINE_SIZE];    /**< Last command, without its line ending */
+    int delay;                    /**< Next reply pays the latency */
+};
+
+/**
+ * @brief Sleeps for a number of milliseconds
+ */
+static void sleepMs(double ms)
+{
+    struct timespec ts;
+
+    if (ms <= 0)
+        return;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1e6);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+/**
+ * @brief Returns a monotonic timestamp in seconds
+ */
+static double stubNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Writes a whole buffer
+ *
+ * @return int 0 on success, -1 if the peer went away
+ */
+static int sendAll(int sock, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = send(sock, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a reply, after the configured latency if it starts a round-trip
+ *
+ * The latency models a round-trip, not server think time: it is paid by
+ * the first reply to a command the server had to wait for. Commands
+ * that arrived in the same burst (a pipelined login) and follow-up
+ * replies such as 226 go out at once.
+ *
+ * @param s Session
+ * @param code Reply code
+ * @param lines Lines of the reply; extra lines use the "code-" form
+ * @param text Reply text
+ */
+static void reply(struct StubSession *s, int code, int lines, const char *text)
+{
+    char buffer[STUB_LINE_SIZE * 4];
+    int length = 0;
+
+    if (s->delay)
+        sleepMs(stub.latencyMs);
+    s->delay = 0;
+    for (int i = 1; i < lines && length < (int)sizeof(buffer) - 64; i++)
+        length += snprintf(buffer + length, sizeof(buffer) - length, "%d-line %d of %d\r\n", code, i, lines);
+    length += snprintf(buffer + length, sizeof(buffer) - length, "%d %s\r\n", code, text);
+    sendAll(s->ctrl, buffer, length < (int)sizeof(buffer) ? length : (int)sizeof(buffer) - 1);
+}
+
+/**
+ * @brief Reads one command line from the control connection
+ *
+ * @return int 0 with the line in s->line, -1 on end of connection
+ */
+static int readCommand(struct StubSession *s)
+{
+    for (;;)
+    {
+        char *end = memchr(s->buffer, '\n', s->used);
+        if (end)
+        {
+            size_t length = end - s->buffer + 1;
+            size_t text = end > s->buffer && end[-1] == '\r' ? length - 2 : length - 1;
+            memcpy(s->line, s->buffer, text);
+            s->line[text] = '\0';
+            // Keep the bytes after this line for the next call
+            memmove(s->buffer, end + 1, s->used - length);
+            s->used -= length;
+            return 0;
+        }
+        if (s->used == sizeof(s->buffer))
+            return -1;
+
+        ssize_t n = recv(s->ctrl, s->buffer + s->used, sizeof(s->buffer) - s->used, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        s->used += n;
+        s->delay = 1;
+    }
+}
+
+/**
+ * @brief Returns the size of a requested file
+ *
+ * @param path Requested path; a base name starting with digits gives the size
+ */
+static long long fileSizeOf(const char *path)
+{
+    const char *name = strrchr(path, '/');
+
+    name = name ? name + 1 : path;
+    return isdigit((unsigned char)*name) ? atoll(name) : stub.fileSize;
+}
+
+/**
+ * @brief Opens a passive listener on an ephemeral loopback port
+ *
+ * @return int Port, -1 on failure
+ */
+static int openPassive(struct StubSession *s)
+{
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+
+    if (s->listener >= 0)
+        close(s->listener);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((s->listener = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(s->listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(s->listener, 1) != 0 ||
+        getsockname(s->listener, (struct sockaddr *)&addr, &length) != 0)
+        return -1;
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Sends a synthetic file over the passive data connection
+ *
+ * @param s Session with an open passive listener
+ * @param path Requested path
+ */
+static void sendFile(struct StubSession *s, const char *path)
+{
+    long long size = fileSizeOf(path), offset = s->rest, sent = 0;
+    double start;
+    int data;
+
+    s->rest = 0;
+    if (s->listener < 0)
+    {
+        reply(s, 425, 1, "Use PASV first");
+        return;
+    }
+    reply(s, 150, 1, "Opening BINARY mode data connection");
+    data = accept(s->listener, NULL, NULL);
+    close(s->listener);
+    s->listener = -1;
+    if (data < 0)
+    {
+        reply(s, 425, 1, "Cannot open data connection");
+        return;
+    }
+
+    start = stubNow();
+    while (offset + sent < size)
+    {
+        // Byte i of every file is pattern[i % STUB_CHUNK_SIZE], from any REST offset
+        size_t at = (offset + sent) % STUB_CHUNK_SIZE;
+        size_t chunk = size - offset - sent < (long long)(STUB_CHUNK_SIZE - at) ? size - offset - sent
+                                                                             : STUB_CHUNK_SIZE - at;
+        if (sendAll(data, pattern + at, chunk) != 0)
+            break;
+        sent += chunk;
+
+        // Pace to the bandwidth cap
+        if (stub.rate > 0)
+            sleepMs((sent / (double)stub.rate - (stubNow() - start)) * 1000.0);
+    }
+
+    close(data);
+    if (offset + sent < size)
+        reply(s, 426, 1, "Connection closed; transfer aborted");
+    else
+        reply(s, 226, 1, "Transfer complete");
+}
+
+/**
+ * @brief Serves one control connection
+ *
+ * @param arg Heap-allocated control socket
+ * @return void* Always NULL
+ */
+static void *serveSession(void *arg)
+{
+    struct StubSession s = { .ctrl = *(int *)arg, .listener = -1, .delay = 1 };
+    char text[STUB_LINE_SIZE + 64];
+    int one = 1;
+
+    free(arg);
+    // Replies go out as soon as they are written, as with a real server
+    // answering a pipelined burst; Nagle would hold each behind an ACK
+    setsockopt(s.ctrl, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    reply(&s, 220, stub.replyLines, "Benchmark stub ready");
+
+    while (readCommand(&s) == 0)
+    {
+        char *cmd = s.line, *argument = strchr(s.line, ' ');
+        if (argument)
+            *argument++ = '\0';
+        else
+            argument = "";
+
+        if (strcasecmp(cmd, "USER") == 0)
+            reply(&s, 331, 1, "Password required");
+        else if (strcasecmp(cmd, "PASS") == 0)
+            reply(&s, 230, stub.replyLines, "Logged in");
+        else if (strcasecmp(cmd, "TYPE") == 0 || strcasecmp(cmd, "NOOP") == 0 ||
+                 (strcasecmp(cmd, "MODE") == 0 && strcasecmp(argument, "S") == 0))
+            reply(&s, 200, 1, "Command okay");
+        else if (strcasecmp(cmd, "SIZE") == 0)
+        {
+            snprintf(text, sizeof(text), "%lld", fileSizeOf(argument));
+            reply(&s, 213, 1, text);
+        }
+        else if (strcasecmp(cmd, "MDTM") == 0)
+            reply(&s, 213, 1, "20250101000000");
+        else if (strcasecmp(cmd, "REST") == 0)
+        {
+            s.rest = atoll(argument);
+            reply(&s, 350, 1, "Restarting");
+        }
+        else if (strcasecmp(cmd, "EPSV") == 0 || strcasecmp(cmd, "PASV") == 0)
+        {
+            int port = openPassive(&s);
+            if (port < 0)
+                reply(&s, 425, 1, "Cannot open passive listener");
+            else if (strcasecmp(cmd, "EPSV") == 0)
+            {
+                snprintf(text, sizeof(text), "Entering Extended Passive Mode (|||%d|)", port);
+                reply(&s, 229, 1, text);
+            }
+            else
+            {
+                snprintf(text, sizeof(text), "Entering Passive Mode (127,0,0,1,%d,%d)", port >> 8, port & 0xff);
+                reply(&s, 227, 1, text);
+            }
+        }
+        else if (strcasecmp(cmd, "RETR") == 0)
+            sendFile(&s, argument);
+        else if (strcasecmp(cmd, "FEAT") == 0)
+        {
+            if (s.delay)
+                sleepMs(stub.latencyMs);
+            s.delay = 0;
+            const char *features = "211-Features:\r\n SIZE\r\n MDTM\r\n REST STREAM\r\n EPSV\r\n211 End\r\n";
+            sendAll(s.ctrl, features, strlen(features));
+        }
+        else if (strcasecmp(cmd, "QUIT") == 0)
+        {
+            reply(&s, 221, 1, "Goodbye");
+            break;
+        }
+        else
+            reply(&s, 502, 1, "Command not implemented");
+    }
+
+    if (s.listener >= 0)
+        close(s.listener);
+    close(s.ctrl);
+    return NULL;
+}
+
+/**
+ * @brief Accepts control connections and hands each to a thread
+ *
+ * @param arg Listening socket
+ * @return void* Never returns while the listener is open
+ */
+static void *acceptLoop(void *arg)
+{
+    int listener = (int)(long)arg;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;)
+    {
+        pthread_t thread;
+        int *sock = malloc(sizeof(int));
+
+        if (!sock || (*sock = accept(listener, NULL, NULL)) < 0)
+        {
+            free(sock);
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        if (pthread_create(&thread, &attr, serveSession, sock) != 0)
+        {
+            close(*sock);
+            free(sock);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+/**
+ * @brief Checks a downloaded file against the contents the stub serves
+ *
+ * @param path Local file
+ * @param size Size of the file on the stub
+ * @return int 0 if the file has that size and the stub's bytes, -1 otherwise
+ */
+int stubCheckFile(const char *path, long long size)
+{
+    static __thread char buffer[STUB_CHUNK_SIZE];
+    long long pos = 0;
+    ssize_t n = 0;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+    // Reads stop at pattern boundaries, so each one is a single memcmp()
+    while (pos < size && (n = read(fd, buffer, STUB_CHUNK_SIZE - pos % STUB_CHUNK_SIZE)) > 0 &&
+           memcmp(buffer, pattern + pos % STUB_CHUNK_SIZE, n) == 0)
+        pos += n;
+    if (pos == size)
+        n = read(fd, buffer, 1);
+    close(fd);
+    return pos == size && n == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Starts the stub server on an ephemeral loopback port
+ *
+ * @param config Server behaviour; copied
+ * @return int Listening port, -1 on failure
+ */
+int stubStart(const struct StubConfig *config)
+{
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    pthread_t thread;
+    int listener;
+
+    stub = *config;
+    if (stub.replyLines < 1)
+        stub.replyLines = 1;
+
+    // The pattern only has to be deterministic, not meaningful
+    for (size_t i = 0; i < sizeof(pattern); i++)
+        pattern[i] = (char)(i * 31 + 7);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 64) != 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &length) != 0 ||
+        pthread_create(&thread, NULL, acceptLoop, (void *)(long)listener) != 0)
+    {
+        if (listener >= 0)
+            close(listener);
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return ntohs(addr.sin_port);
+}
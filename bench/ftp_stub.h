@@ -0,0 +1,47 @@
+/**
+ * @file ftp_stub.h
+ * @brief Minimal loopback FTP server used by the benchmark suite
+ *
+ * The stub serves synthetic files on 127.0.0.1 so the client can be
+ * measured without a remote server. Any path can be retrieved: a file
+ * name that starts with digits ("1048576.bin") is served with that many
+ * bytes, any other name with the configured default size. Contents are
+ * a fixed pattern, so no disk I/O is involved on the server side; byte
+ * i of every file is the same, whatever REST offset it is sent from,
+ * so stubCheckFile() can verify a download.
+ */
+
+#ifndef FTP_STUB_H
+#define FTP_STUB_H
+
+/**
+ * @struct StubConfig
+ * @brief Behaviour of the stub server
+ */
+struct StubConfig {
+    long long fileSize;  /**< Size of files whose name carries no size */
+    int latencyMs;       /**< Delay before every control reply */
+    long long rate;      /**< Data bandwidth cap in bytes per second, 0 for none */
+    int replyLines;      /**< Lines of the multi-line banner and login replies */
+};
+
+/**
+ * @brief Starts the stub server on an ephemeral loopback port
+ *
+ * Connections are served by detached threads until the process exits.
+ *
+ * @param config Server behaviour; copied
+ * @return int Listening port, -1 on failure
+ */
+int stubStart(const struct StubConfig *config);
+
+/**
+ * @brief Checks a downloaded file against the contents the stub serves
+ *
+ * @param path Local file
+ * @param size Size of the file on the stub
+ * @return int 0 if the file has that size and the stub's bytes, -1 otherwise
+ */
+int stubCheckFile(const char *path, long long size);
+
+#endif
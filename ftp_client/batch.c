@@ -0,0 +1,436 @@
+/**
+ * @file batch.c
+ * @brief Batch download mode for FTP client
+ *
+ * This file implements downloading every URL listed in a manifest (one
+ * URL per line, blank lines and lines starting with '#' ignored). URLs
+ * are grouped by host and credentials, and each group is served by a
+ * single authenticated control connection:
+ *
+ *   connect -> USER/PASS -> TYPE I -> { PASV -> RETR -> 226 } x N -> QUIT
+ *
+ * so the TCP handshake, banner and login are paid once per host instead
+ * of once per file, and the DNS lookup is served by the resolver cache.
+ * Files are fetched in manifest order within each group. A failed
+ * transfer does not stop the batch; if the control connection is no
+ * longer usable afterwards it is replaced.
+ *
+ * With a concurrency level set, the groups are instead handed to the
+ * event engine, which runs many such sessions from a single thread.
+ * With scheduler slots set, every file goes to the priority scheduler,
+ * which honours an optional priority after each URL ("<url> 10"; higher
+ * first, 0 by default) and caps the connections opened per host.
+ *
+ * Entries are kept as compact URL records in an arena, with hosts and
+ * credentials interned, so a manifest of millions of lines costs little
+ * more than its paths; each record is expanded only while its file is
+ * fetched. A URL ending in ";type=a" is fetched in ASCII type.
+ */
+
+#include "ftp_client.h"
+
+/**
+ * @struct BatchEntry
+ * @brief One manifest line and its processing state
+ */
+struct BatchEntry {
+    struct UrlRecord url;        /**< Parsed URL, strings in the manifest's arena */
+    int priority;                /**< Scheduling priority, higher first */
+    int done;                    /**< Non-zero once the entry has been attempted */
+    struct SessionTrace trace;   /**< Phase timings of this entry's download */
+};
+
+/**
+ * @brief Reads and parses every URL of a manifest
+ *
+ * A line holds a URL optionally followed by an integer priority. Lines
+ * that fail to parse, and directory URLs (";type=d"), are reported and
+ * skipped. Every host is handed to the resolver as soon as it is seen,
+ * so lookups overlap with reading the manifest and with earlier
+ * transfers.
+ *
+ * @param manifest Path of the manifest, "-" for standard input
+ * @param arena Arena receiving the URL strings
+ * @param entries Receives a newly allocated array of entries
+ * @param count Receives the number of entries
+ * @return int 0 on success, -1 if the manifest cannot be read
+ */
+static int readManifest(const char *manifest, struct UrlArena *arena,
+                        struct BatchEntry **entries, int *count)
+{
+    FILE *in = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    char line[MAX_LENGTH * 2];
+    int capacity = 0;
+
+    if (!in)
+    {
+        logMessage("Cannot open manifest %s: %s\n", manifest, strerror(errno));
+        return -1;
+    }
+
+    *entries = NULL;
+    *count = 0;
+    while (fgets(line, sizeof(line), in))
+    {
+        // Trim surrounding whitespace; a priority may follow the URL
+        char *url = line + strspn(line, " \t");
+        char *rest = url + strcspn(url, " \t\r\n");
+        int priority = *rest ? atoi(rest + 1) : 0;
+        *rest = '\0';
+        if (url[0] == '\0' || url[0] == '#')
+            continue;
+
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            struct BatchEntry *grown = realloc(*entries, capacity * sizeof(**entries));
+            if (!grown)
+                break;
+            *entries = grown;
+        }
+
+        struct BatchEntry *entry = &(*entries)[*count];
+        memset(entry, 0, sizeof(*entry));
+        traceBegin(&entry->trace);
+        entry->priority = priority;
+        if (parseRecord(arena, url, &entry->url) != 0)
+        {
+            logMessage("Skipping invalid URL: %s\n", url);
+            continue;
+        }
+        if (entry->url.type == 'd')
+        {
+            logMessage("Skipping directory URL: %s\n", url);
+            continue;
+        }
+
+        // Resolve hosts while the rest of the manifest is read
+        resolverPrefetch(entry->url.host);
+        (*count)++;
+    }
+
+    if (in != stdin)
+        fclose(in);
+    return 0;
+}
+
+/**
+ * @brief Checks whether two entries can share a control connection
+ *
+ * Host and credentials are interned in one arena, so comparing the
+ * pointers compares the strings.
+ */
+static int sameSession(const struct UrlRecord *a, const struct UrlRecord *b)
+{
+    return a->host == b->host && a->port == b->port &&
+           a->user == b->user && a->password == b->password;
+}
+
+/**
+ * @brief Opens an authenticated binary-mode control connection
+ *
+ * With pipelining enabled the login also enters passive mode; the data
+ * address is stored in dataAddr/dataPort for the first transfer and
+ * *passive is set.
+ *
+ * @param url URL holding the server address and credentials
+ * @param opts Transfer options (pipelined login)
+ * @param dataAddr Receives the pending data address when pipelining
+ * @param dataPort Receives the pending data port when pipelining
+ * @param passive Set to 1 when a passive address is pending
+ * @param saved Incremented by the round-trips saved by pipelining
+ * @return int Control socket on success, -1 on failure
+ */
+static int openBatchSession(struct URL *url, const struct TransferOptions *opts,
+                            char *dataAddr, int *dataPort, int *passive, int *saved)
+{
+    int sock = createSocket(url->host, url->port);
+    if (sock < 0)
+        return -1;
+    traceStep(TRACE_CONNECT);
+
+    *passive = 0;
+    if (opts && opts->pipelined)
+    {
+        if (authenticatePipelined(sock, url->user, url->password, dataAddr, dataPort, saved) != 0)
+        {
+            closeConnection(sock);
+            return -1;
+        }
+        *passive = 1;
+    }
+    else if (authenticate(sock, url->user, url->password) != 0 || setBinaryMode(sock) != 0)
+    {
+        closeConnection(sock);
+        return -1;
+    }
+
+    // One MODE Z negotiation covers every file of the session
+    if (opts && opts->compress)
+        setCompressedMode(sock);
+
+    return sock;
+}
+
+/**
+ * @brief Runs one PASV/RETR cycle on an open control connection
+ *
+ * @param ctrlSock Authenticated control socket
+ * @param url URL of the file to fetch
+ * @param opts Transfer options, may be NULL
+ * @param dataAddr Data address, already set when *passive is non-zero
+ * @param dataPort Data port, already set when *passive is non-zero
+ * @param passive Non-zero if PASV was already answered; cleared on use
+ * @return int 0 on success, -1 on failure
+ */
+int fetchBatchFile(int ctrlSock, struct URL *url, const struct TransferOptions *opts,
+                   char *dataAddr, int *dataPort, int *passive)
+{
+    struct TransferOptions fileOpts = {0};
+
+    if (opts)
+        fileOpts = *opts;
+
+    // The server converts text files, so sizes, offsets and digests do not apply
+    int ascii = url->type == 'a';
+    if (ascii)
+    {
+        fileOpts.resume = fileOpts.preallocate = 0;
+        fileOpts.offset = fileOpts.expectedSize = 0;
+        fileOpts.checksumType = CHECKSUM_NONE;
+        fileOpts.mdtm[0] = '\0';
+    }
+    else if (prepareDownload(ctrlSock, url, &fileOpts) == 1)
+        return 0;
+
+    if (!*passive && enterPassiveMode(ctrlSock, dataAddr, dataPort) != 0)
+        return -1;
+    *passive = 0;
+
+    int dataSock = createSocketWith(dataAddr, *dataPort, &fileOpts.socket);
+    if (dataSock < 0)
+        return -1;
+    traceStep(TRACE_DATA_CONNECT);
+
+    int result = -1;
+    struct Checksum sum;
+    checksumAttach(&fileOpts, &sum);
+    requestRestart(ctrlSock, &fileOpts.offset);
+    if ((!ascii || setTransferType(ctrlSock, 'A') == 0) &&
+        requestFile(ctrlSock, url->resource) == 0)
+        result = retrieveFile(ctrlSock, dataSock, url, &fileOpts);
+    if (result == 0)
+        result = verifyChecksum(ctrlSock, url, fileOpts.checksum);
+    if (ascii && setBinaryMode(ctrlSock) != 0)
+        result = -1;
+
+    if (result == 0 && fileOpts.resume)
+        clearResume(url);
+    if (result == 0 && fileOpts.cache)
+        cacheStore(fileOpts.cache, url, &fileOpts);
+
+    close(dataSock);
+    return result;
+}
+
+/**
+ * @brief Downloads the manifest entries with the event engine
+ *
+ * Each host group is split round-robin into several sessions so that up
+ * to opts->concurrency sessions run at once from a single thread.
+ *
+ * @param entries Manifest entries
+ * @param count Number of entries
+ * @param concurrency Total number of concurrent sessions
+ * @return int 0 if every file was downloaded, -1 otherwise
+ */
+static int downloadBatchEvented(struct BatchEntry *entries, int count, int concurrency)
+{
+    struct SessionEngine engine;
+    const struct UrlRecord **records = malloc(count * sizeof(*records));
+    int groups = 0, used = 0, result = -1;
+
+    if (!records || engineInit(&engine, concurrency) != 0)
+    {
+        free(records);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+        if (!entries[i].done)
+        {
+            groups++;
+            for (int j = i; j < count; j++)
+                if (sameSession(&entries[i].url, &entries[j].url))
+                    entries[j].done = 1;
+        }
+    for (int i = 0; i < count; i++)
+        entries[i].done = 0;
+
+    int perHost = concurrency / (groups ? groups : 1);
+    if (perHost < 1)
+        perHost = 1;
+
+    // Lay out each session's files contiguously in records; the engine
+    // expands a record only when its file starts
+    for (int i = 0; i < count; i++)
+    {
+        if (entries[i].done)
+            continue;
+
+        int files = 0;
+        for (int j = i; j < count; j++)
+            if (!entries[j].done && sameSession(&entries[i].url, &entries[j].url))
+                files++;
+
+        int sessions = files < perHost ? files : perHost;
+        for (int k = 0; k < sessions; k++)
+        {
+            int first = used, seen = 0;
+            for (int j = i; j < count; j++)
+                if (!entries[j].done && sameSession(&entries[i].url, &entries[j].url) &&
+                    seen++ % sessions == k)
+                    records[used++] = &entries[j].url;
+            engineAdd(&engine, records + first, used - first);
+        }
+
+        for (int j = i; j < count; j++)
+            if (sameSession(&entries[i].url, &entries[j].url))
+                entries[j].done = 1;
+    }
+
+    result = engineRun(&engine);
+    engineFree(&engine);
+    free(records);
+    return result;
+}
+
+/**
+ * @brief Downloads the manifest entries with the priority scheduler
+ *
+ * @param entries Manifest entries
+ * @param count Number of entries
+ * @param opts Transfer options (slots, per-host connections, rate limits)
+ * @return int 0 if every file was downloaded, -1 otherwise
+ */
+static int downloadBatchScheduled(struct BatchEntry *entries, int count,
+                                  const struct TransferOptions *opts)
+{
+    struct Scheduler scheduler;
+    int result = -1;
+
+    if (schedulerInit(&scheduler, opts) != 0)
+        return -1;
+
+    for (int i = 0; i < count; i++)
+        if (schedulerAdd(&scheduler, &entries[i].url, entries[i].priority) != 0)
+            break;
+    if (scheduler.queued == count)
+        result = schedulerRun(&scheduler);
+
+    schedulerFree(&scheduler);
+    return result;
+}
+
+/**
+ * @brief Downloads every URL listed in a manifest
+ *
+ * Entries are grouped by host and credentials in order of first
+ * appearance. Each group keeps one control connection open until its
+ * queue is empty and only then closes it with closeConnection().
+ *
+ * @param manifest Path of the manifest file, "-" for standard input
+ * @param opts Transfer options applied to every file
+ * @return int 0 if every file was downloaded, -1 otherwise
+ */
+int downloadBatch(const char *manifest, const struct TransferOptions *opts)
+{
+    struct BatchEntry *entries;
+    struct UrlArena arena;
+    struct LatencyReport latency = {0};
+    struct URL host, url;
+    char dataAddr[BUFFER_SIZE];
+    int dataPort, passive;
+    int count, succeeded = 0, failed = 0, sessions = 0, saved = 0;
+
+    urlArenaInit(&arena);
+    if (readManifest(manifest, &arena, &entries, &count) != 0)
+        return -1;
+
+    logMessage("\n=== BATCH DOWNLOAD ===\n");
+    logMessage("Manifest entries: %d (%zu interned strings, %zu KiB of URL data)\n",
+               count, arena.interned, arena.bytes / 1024);
+
+    if (opts && (opts->concurrency > 0 || opts->slots > 0))
+    {
+        int result = opts->concurrency > 0 ? downloadBatchEvented(entries, count, opts->concurrency)
+                                           : downloadBatchScheduled(entries, count, opts);
+        free(entries);
+        urlArenaFree(&arena);
+        return result;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (entries[i].done)
+            continue;
+
+        // Connection setup is charged to the first file of the host
+        urlFromRecord(&entries[i].url, &host);
+        traceResume(&entries[i].trace);
+        traceAttach(&entries[i].trace);
+        int ctrlSock = openBatchSession(&host, opts, dataAddr, &dataPort, &passive, &saved);
+        sessions++;
+
+        // Drain the whole queue of this host over the same connection
+        for (int j = i; j < count; j++)
+        {
+            if (entries[j].done || !sameSession(&entries[i].url, &entries[j].url))
+                continue;
+            entries[j].done = 1;
+
+            if (j != i)
+                traceResume(&entries[j].trace);
+            traceAttach(&entries[j].trace);
+            urlFromRecord(&entries[j].url, &url);
+            if (ctrlSock >= 0 && fetchBatchFile(ctrlSock, &url, opts, dataAddr, &dataPort, &passive) == 0)
+            {
+                latencyRecord(&latency, host.host, &entries[j].trace);
+                succeeded++;
+                continue;
+            }
+
+            failed++;
+            logMessage("Failed to download %s from %s\n", url.resource, host.host);
+
+            // Replace the connection if the failure left it unusable
+            if (ctrlSock >= 0 && resyncControl(ctrlSock) != 0)
+            {
+                releaseReplyReader(ctrlSock);
+                close(ctrlSock);
+                ctrlSock = -1;
+            }
+            if (ctrlSock < 0)
+            {
+                ctrlSock = openBatchSession(&host, opts, dataAddr, &dataPort, &passive, &saved);
+                sessions++;
+            }
+        }
+
+        if (ctrlSock >= 0)
+            closeConnection(ctrlSock);
+    }
+
+    traceAttach(NULL);
+    latencyPrint(&latency);
+    latencyFree(&latency);
+
+    logMessage("\nBatch completed: %d downloaded, %d failed, %d control connections\n",
+               succeeded, failed, sessions);
+    if (opts && opts->pipelined)
+        logMessage("Pipelined login saved %d round-trips\n", saved);
+
+    free(entries);
+    urlArenaFree(&arena);
+    return failed == 0 ? 0 : -1;
+}
@@ -0,0 +1,612 @@
+/**
+ * @file cache.c
+ * @brief Local content cache for FTP client
+ *
+ * This file implements an on-disk cache of downloaded files, keyed by
+ * host, port and resource. Before RETR, an entry is revalidated with
+ * SIZE and MDTM; if the server still reports the same size and
+ * modification time, the cached blob is placed at downloads/<file> and
+ * no data connection is opened:
+ *
+ *   SIZE + MDTM -> entry matches -> CRC32 matches -> reflink, or copy -> done
+ *               -> otherwise     -> RETR -> store a blob of the new file
+ *
+ * The cache directory holds one blob per entry, named after the 64-bit
+ * FNV-1a hash of its key, and an append-only index of fixed-size
+ * records (size, MDTM, CRC32 of the blob, last use). Every store, hit
+ * and eviction appends a record under flock(), so concurrent runs
+ * sharing the cache do not rewrite each other's index; the index is
+ * replayed on open and compacted when it grows to several times its
+ * live entries.
+ *
+ * Blobs are evicted least recently used first once their total size
+ * exceeds the capacity. Blobs never share an inode with downloads/: a
+ * reflink shares blocks copy-on-write, anything else is a copy, so a
+ * later download writing into downloads/<file> cannot change the cache.
+ * Every hit still re-reads the blob against its stored CRC32. Servers
+ * that answer neither SIZE nor MDTM are never cached.
+ */
+
+#define _GNU_SOURCE
+#include "ftp_client.h"
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+/**
+ * @brief Hashes the key of a URL: host, port and resource
+ *
+ * @param url URL
+ * @return uint64_t FNV-1a hash, never 0 (0 marks an empty slot)
+ */
+static uint64_t cacheKey(const struct URL *url)
+{
+    char port[16];
+    const char *parts[] = { url->host, port, url->resource };
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    snprintf(port, sizeof(port), "%d", url->port);
+    for (int i = 0; i < 3; i++)
+    {
+        // The terminating NUL separates the parts
+        for (const char *p = parts[i]; ; p++)
+        {
+            hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+            if (!*p)
+                break;
+        }
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * @brief Builds the path of a blob, or of a temporary file next to it
+ *
+ * @param c Cache
+ * @param key Entry key
+ * @param suffix Appended to the name, "" for the blob itself
+ * @param path Buffer of MAX_LENGTH + 64 bytes
+ */
+static void blobPath(const struct ContentCache *c, uint64_t key, const char *suffix, char *path)
+{
+    snprintf(path, MAX_LENGTH + 64, "%s/%016llx%s", c->dir, (unsigned long long)key, suffix);
+}
+
+/**
+ * @brief Converts an MDTM reply to a number (YYYYMMDDHHMMSS)
+ *
+ * @param mdtm Timestamp from MDTM
+ * @return long long The number, 0 if the timestamp is malformed
+ */
+static long long mdtmNumber(const char *mdtm)
+{
+    long long value = 0;
+    int digits = 0;
+
+    for (; *mdtm >= '0' && *mdtm <= '9' && digits < 14; mdtm++, digits++)
+        value = value * 10 + (*mdtm - '0');
+    return digits == 14 ? value : 0;
+}
+
+/**
+ * @brief Finds the slot of a key: its record, or the empty slot it would go to
+ *
+ * @param c Cache
+ * @param key Key
+ * @return struct CacheRecord* Slot
+ */
+static struct CacheRecord *findSlot(struct ContentCache *c, uint64_t key)
+{
+    struct CacheRecord *tomb = NULL;
+    size_t mask = c->slots - 1;
+
+    for (size_t i = key & mask; ; i = (i + 1) & mask)
+    {
+        struct CacheRecord *r = &c->records[i];
+        if (r->key == key)
+            return r;
+        // Removed entries keep their key as tombstones so probing goes on
+        if (r->key == 0)
+            return tomb ? tomb : r;
+        if (r->size < 0 && !tomb)
+            tomb = r;
+    }
+}
+
+/**
+ * @brief Doubles the table once live entries and tombstones fill half of it
+ *
+ * @param c Cache
+ * @return int 0 on success, -1 if out of memory
+ */
+static int growTable(struct ContentCache *c)
+{
+    if ((c->used + 1) * 2 <= c->slots)
+        return 0;
+
+    struct CacheRecord *old = c->records;
+    size_t oldSlots = c->slots;
+    size_t slots = CACHE_INITIAL_SLOTS;
+    while (slots < (size_t)(c->count + 1) * 4)
+        slots *= 2;
+
+    if (!(c->records = calloc(slots, sizeof(*c->records))))
+    {
+        c->records = old;
+        return -1;
+    }
+    c->slots = slots;
+    c->used = c->count;
+    for (size_t i = 0; i < oldSlots; i++)
+        if (old[i].key && old[i].size >= 0)
+            *findSlot(c, old[i].key) = old[i];
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Applies an index record to the table
+ *
+ * @param c Cache
+ * @param record Entry to store, or removal (size < 0)
+ */
+static void applyRecord(struct ContentCache *c, const struct CacheRecord *record)
+{
+    if (growTable(c) != 0)
+        return;
+
+    struct CacheRecord *slot = findSlot(c, record->key);
+    int live = slot->key == record->key && slot->size >= 0;
+    if (live)
+    {
+        c->bytes -= slot->size;
+        c->count--;
+    }
+    else if (slot->key == 0)
+        c->used++;
+
+    if (record->size >= 0)
+    {
+        *slot = *record;
+        c->bytes += record->size;
+        c->count++;
+    }
+    else if (live)
+        slot->size = -1;
+}
+
+/**
+ * @brief Takes the exclusive lock of the index file
+ *
+ * Another run may have compacted the index since it was opened, leaving
+ * this run holding the replaced file; the current one is then opened
+ * and locked instead, so no record is appended to a file nobody reads.
+ *
+ * @param c Cache
+ */
+static void lockIndex(struct ContentCache *c)
+{
+    char path[MAX_LENGTH + 64];
+    struct stat held, current;
+
+    snprintf(path, sizeof(path), "%s/index", c->dir);
+    for (;;)
+    {
+        flock(c->indexFd, LOCK_EX);
+        if (fstat(c->indexFd, &held) != 0 || stat(path, &current) != 0 ||
+            (held.st_dev == current.st_dev && held.st_ino == current.st_ino))
+            return;
+
+        int fd = open(path, O_RDWR | O_APPEND);
+        if (fd < 0)
+            return;
+        close(c->indexFd);
+        c->indexFd = fd;
+    }
+}
+
+/**
+ * @brief Appends a record to the index and applies it
+ *
+ * @param c Cache, locked
+ * @param record Record to append
+ */
+static void logRecord(struct ContentCache *c, const struct CacheRecord *record)
+{
+    applyRecord(c, record);
+    lockIndex(c);
+    if (write(c->indexFd, record, sizeof(*record)) == sizeof(*record))
+        c->logged++;
+    flock(c->indexFd, LOCK_UN);
+}
+
+/**
+ * @brief Rewrites the index with only the live entries
+ *
+ * Runs under the exclusive lock taken to replay the index. Every append
+ * takes the same lock and then checks that the index was not replaced,
+ * so records of other runs go to the new file, not the renamed-over one.
+ *
+ * @param c Cache, with the index locked
+ */
+static void compactIndex(struct ContentCache *c)
+{
+    char path[MAX_LENGTH + 64], temp[MAX_LENGTH + 64];
+    snprintf(path, sizeof(path), "%s/index", c->dir);
+    snprintf(temp, sizeof(temp), "%s/index.%d", c->dir, (int)getpid());
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return;
+    for (size_t i = 0; i < c->slots; i++)
+    {
+        if (c->records[i].key && c->records[i].size >= 0 &&
+            write(fd, &c->records[i], sizeof(c->records[i])) != sizeof(c->records[i]))
+        {
+            close(fd);
+            unlink(temp);
+            return;
+        }
+    }
+    if (rename(temp, path) != 0)
+    {
+        close(fd);
+        unlink(temp);
+        return;
+    }
+    close(fd);
+
+    close(c->indexFd);
+    c->indexFd = open(path, O_RDWR | O_APPEND);
+    c->logged = c->count;
+}
+
+/**
+ * @brief Evicts least recently used blobs until the total fits the capacity
+ *
+ * @param c Cache, locked
+ */
+static void evict(struct ContentCache *c)
+{
+    if (c->bytes <= c->capacity)
+        return;
+
+    struct CacheRecord *live = malloc(c->count * sizeof(*live));
+    int n = 0;
+    if (!live)
+        return;
+    for (size_t i = 0; i < c->slots; i++)
+        if (c->records[i].key && c->records[i].size >= 0)
+            live[n++] = c->records[i];
+
+    // Oldest first; ties do not matter
+    for (int gap = n / 2; gap > 0; gap /= 2)
+        for (int i = gap; i < n; i++)
+            for (int j = i; j >= gap && live[j - gap].lastUsed > live[j].lastUsed; j -= gap)
+            {
+                struct CacheRecord t = live[j];
+                live[j] = live[j - gap];
+                live[j - gap] = t;
+            }
+
+    for (int i = 0; i < n && c->bytes > c->capacity; i++)
+    {
+        char path[MAX_LENGTH + 64];
+        struct CacheRecord removal = live[i];
+        blobPath(c, removal.key, "", path);
+        unlink(path);
+        removal.size = -1;
+        logRecord(c, &removal);
+        c->evictions++;
+    }
+    free(live);
+}
+
+/**
+ * @brief Opens a cache directory, creating it if needed, and loads its index
+ *
+ * @param c Cache to initialize
+ * @param dir Cache directory
+ * @param capacity Largest total size of the blobs, in bytes
+ * @return int 0 on success, -1 on failure
+ */
+int cacheOpen(struct ContentCache *c, const char *dir, long long capacity)
+{
+    char path[MAX_LENGTH + 64];
+    struct CacheRecord record;
+    long records = 0;
+
+    memset(c, 0, sizeof(*c));
+    snprintf(c->dir, sizeof(c->dir), "%s", dir);
+    c->capacity = capacity;
+    c->slots = CACHE_INITIAL_SLOTS;
+    if (!(c->records = calloc(c->slots, sizeof(*c->records))))
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/index", dir);
+    if ((mkdir(dir, 0755) != 0 && errno != EEXIST) ||
+        (c->indexFd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0)
+    {
+        logMessage("Cannot open cache %s: %s\n", dir, strerror(errno));
+        free(c->records);
+        return -1;
+    }
+
+    // Replay the index; a torn last record is ignored
+    lockIndex(c);
+    FILE *in = fdopen(dup(c->indexFd), "rb");
+    while (in && fread(&record, sizeof(record), 1, in) == 1)
+    {
+        if (record.magic == CACHE_RECORD_MAGIC && record.key)
+            applyRecord(c, &record);
+        records++;
+    }
+    if (in)
+        fclose(in);
+    c->logged = records;
+
+    if (c->logged > 4 * c->count + CACHE_INITIAL_SLOTS)
+        compactIndex(c);
+    flock(c->indexFd, LOCK_UN);
+    evict(c);
+
+    pthread_mutex_init(&c->lock, NULL);
+    logMessage("Cache %s: %d entries, %.2f of %.2f MB\n", dir, c->count,
+               c->bytes / (1024.0 * 1024.0), capacity / (1024.0 * 1024.0));
+    return 0;
+}
+
+/**
+ * @brief Copies the rest of a file through a user-space buffer
+ *
+ * @param in Source, positioned at the first byte to copy
+ * @param out Destination
+ * @return ssize_t 0 on success, -1 on failure
+ */
+static ssize_t copyBuffered(int in, int out)
+{
+    char *buffer = malloc(ALIGNED_BUFFER_SIZE);
+    ssize_t n = -1;
+
+    if (!buffer)
+        return -1;
+    while ((n = read(in, buffer, ALIGNED_BUFFER_SIZE)) > 0)
+    {
+        for (ssize_t done = 0, w; done < n; done += w)
+            if ((w = write(out, buffer + done, n - done)) < 0)
+            {
+                free(buffer);
+                return -1;
+            }
+    }
+    free(buffer);
+    return n;
+}
+
+/**
+ * @brief Places a copy of a file at a new path
+ *
+ * A reflink shares the blocks copy-on-write; where the filesystem
+ * cannot reflink, the bytes are copied with copy_file_range(), or with
+ * read() and write() when the two paths are on different filesystems.
+ * The two paths never share an inode, so writing one cannot change the
+ * other.
+ *
+ * @param from Existing file
+ * @param to New path, replaced if it exists
+ * @return const char* "reflink" or "copy", NULL on failure
+ */
+static const char *placeCopy(const char *from, const char *to)
+{
+    int in = open(from, O_RDONLY);
+    if (in < 0)
+        return NULL;
+
+    unlink(to);
+    int out = open(to, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out >= 0 && ioctl(out, FICLONE, in) == 0)
+    {
+        close(in);
+        close(out);
+        return "reflink";
+    }
+
+    ssize_t n = 0;
+    long long copied = 0;
+    if (out >= 0)
+        while ((n = copy_file_range(in, NULL, out, NULL, SPLICE_CHUNK_SIZE, 0)) > 0)
+            copied += n;
+
+    // copy_file_range() fails across filesystems and on older kernels
+    if (out >= 0 && n < 0 && copied == 0 &&
+        (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL))
+        n = copyBuffered(in, out);
+    int error = errno;
+    close(in);
+    if (out < 0 || close(out) != 0 || n < 0)
+    {
+        unlink(to);
+        errno = error;
+        return NULL;
+    }
+    return "copy";
+}
+
+/**
+ * @brief Revalidates the cache entry of a file and serves it on a hit
+ *
+ * Asks for SIZE and MDTM, and on a matching entry whose blob still has
+ * the stored CRC32 places the blob at downloads/<file>. With a digest
+ * requested, a hit is also checked against the server's: CRC32 from the
+ * stored value, other digests by reading the blob. On a miss the size
+ * and MDTM are left in opts for cacheStore().
+ *
+ * @param c Cache
+ * @param ctrlSock Control socket
+ * @param url URL of the file
+ * @param opts Transfer options; expectedSize and mdtm are filled in
+ * @return int 1 if the file was served from the cache, 0 otherwise
+ */
+int cacheLookup(struct ContentCache *c, int ctrlSock, struct URL *url, struct TransferOptions *opts)
+{
+    char mdtm[MDTM_LENGTH], blob[MAX_LENGTH + 64], dest[MAX_LENGTH + 16];
+    long long size;
+    struct stat st;
+
+    logMessage("\n=== CACHE CHECK ===\n");
+    snprintf(dest, sizeof(dest), "downloads/%s", url->file);
+    if (getFileSize(ctrlSock, url->resource, &size) != 0 || getModificationTime(ctrlSock, url->resource, mdtm) != 0 ||
+        !mdtmNumber(mdtm))
+    {
+        logMessage("Server did not report SIZE and MDTM, not cached\n");
+        pthread_mutex_lock(&c->lock);
+        c->misses++;
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    opts->expectedSize = size;
+    snprintf(opts->mdtm, sizeof(opts->mdtm), "%s", mdtm);
+
+    uint64_t key = cacheKey(url);
+    blobPath(c, key, "", blob);
+
+    pthread_mutex_lock(&c->lock);
+    struct CacheRecord *r = findSlot(c, key);
+    struct CacheRecord entry = *r;
+    int found = r->key == key && r->size >= 0;
+    pthread_mutex_unlock(&c->lock);
+
+    // A blob removed by another run, or cut short, is a miss
+    int fresh = found && entry.size == size && entry.mdtm == mdtmNumber(mdtm) &&
+                stat(blob, &st) == 0 && st.st_size == size;
+    const char *method = NULL;
+    if (fresh)
+    {
+        // A blob damaged on disk is a miss, and is replaced by the download
+        struct Checksum crc;
+        checksumInit(&crc, CHECKSUM_CRC32);
+        int fd = open(blob, O_RDONLY);
+        fresh = fd >= 0 && checksumFile(&crc, fd, size) == 0 && (crc.crc ^ 0xFFFFFFFF) == entry.crc32;
+        if (fd >= 0)
+            close(fd);
+        if (!fresh)
+            logMessage("Cached copy does not match its CRC32\n");
+    }
+    if (fresh && opts->checksumType != CHECKSUM_NONE)
+    {
+        struct Checksum sum;
+        checksumInit(&sum, opts->checksumType);
+        int fd = open(blob, O_RDONLY);
+        if (opts->checksumType == CHECKSUM_CRC32)
+        {
+            sum.crc = entry.crc32 ^ 0xFFFFFFFF;
+            sum.length = size;
+        }
+        fresh = (opts->checksumType == CHECKSUM_CRC32 || (fd >= 0 && checksumFile(&sum, fd, size) == 0)) &&
+                compareChecksum(ctrlSock, url->resource, &sum) == 0;
+        if (fd >= 0)
+            close(fd);
+    }
+    if (fresh && !(method = placeCopy(blob, dest)))
+        logMessage("Cannot copy %s from the cache: %s\n", dest, strerror(errno));
+
+    pthread_mutex_lock(&c->lock);
+    if (method)
+    {
+        entry.lastUsed = time(NULL);
+        logRecord(c, &entry);
+        c->hits++;
+        c->savedBytes += size;
+    }
+    else
+        c->misses++;
+    pthread_mutex_unlock(&c->lock);
+
+    if (method)
+    {
+        logMessage("Cache hit: %s (%lld bytes, %s)\n", dest, size, method);
+        return 1;
+    }
+
+    logMessage(found ? "Cache entry is stale\n" : "Not in cache\n");
+    return 0;
+}
+
+/**
+ * @brief Stores a completed download in the cache
+ *
+ * Does nothing unless cacheLookup() revalidated the file (opts->mdtm
+ * set) and the local file has the size SIZE reported.
+ *
+ * @param c Cache
+ * @param url URL of the file
+ * @param opts Transfer options of the download
+ * @return int 0 if the file was stored or is not cacheable, -1 on failure
+ */
+int cacheStore(struct ContentCache *c, struct URL *url, const struct TransferOptions *opts)
+{
+    char dest[MAX_LENGTH + 16], blob[MAX_LENGTH + 64], temp[MAX_LENGTH + 64], suffix[48];
+    struct CacheRecord record;
+    struct Checksum sum;
+    struct stat st;
+
+    snprintf(dest, sizeof(dest), "downloads/%s", url->file);
+    if (!opts->mdtm[0] || stat(dest, &st) != 0 || st.st_size != opts->expectedSize ||
+        opts->expectedSize > c->capacity)
+        return 0;
+
+    uint64_t key = cacheKey(url);
+    snprintf(suffix, sizeof(suffix), ".%d.%lu.tmp", (int)getpid(), (unsigned long)pthread_self());
+    blobPath(c, key, "", blob);
+    blobPath(c, key, suffix, temp);
+
+    // The blob is hashed once here, while its data is still in the page cache
+    int fd = open(dest, O_RDONLY);
+    checksumInit(&sum, CHECKSUM_CRC32);
+    if (fd < 0 || checksumFile(&sum, fd, st.st_size) != 0 || !placeCopy(dest, temp) || rename(temp, blob) != 0)
+    {
+        logMessage("Cannot store %s in the cache: %s\n", dest, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        unlink(temp);
+        return -1;
+    }
+    close(fd);
+
+    memset(&record, 0, sizeof(record));
+    record.key = key;
+    record.size = st.st_size;
+    record.mdtm = mdtmNumber(opts->mdtm);
+    record.lastUsed = time(NULL);
+    record.crc32 = sum.crc ^ 0xFFFFFFFF;
+    record.magic = CACHE_RECORD_MAGIC;
+
+    pthread_mutex_lock(&c->lock);
+    logRecord(c, &record);
+    c->stored++;
+    evict(c);
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+/**
+ * @brief Prints the cache statistics and releases the cache
+ *
+ * @param c Cache opened by cacheOpen()
+ */
+void cacheClose(struct ContentCache *c)
+{
+    long lookups = c->hits + c->misses;
+
+    logMessage("\n=== CACHE ===\n");
+    logMessage("Hits: %ld of %ld lookups (%.1f%%), %.2f MB not downloaded\n", c->hits, lookups,
+               lookups ? 100.0 * c->hits / lookups : 0.0, c->savedBytes / (1024.0 * 1024.0));
+    logMessage("Stored: %ld, evicted: %ld, now %d entries, %.2f of %.2f MB\n", c->stored, c->evictions,
+               c->count, c->bytes / (1024.0 * 1024.0), c->capacity / (1024.0 * 1024.0));
+
+    close(c->indexFd);
+    free(c->records);
+    pthread_mutex_destroy(&c->lock);
+}
@@ -0,0 +1,644 @@
+/**
+ * @file checksum.c
+ * @brief Inline integrity checking for FTP client
+ *
+ * This file implements the digests computed inside the receive loops,
+ * while the received bytes are still in cache, so no second pass over
+ * the file is needed:
+ *
+ * - CRC32C (Castagnoli): the SSE4.2 crc32 instruction on x86-64 or the
+ *   ARMv8 CRC32C instructions, slicing-by-8 tables otherwise.
+ * - CRC32 (IEEE 802.3, as returned by XCRC): the ARMv8 CRC32
+ *   instructions, slicing-by-8 tables otherwise (x86 has no instruction
+ *   for this polynomial).
+ * - SHA-256: the SHA-NI extensions on x86-64, a portable implementation
+ *   otherwise.
+ *
+ * The implementation is picked once from the CPU features at runtime.
+ * After the transfer the digest is compared with the one computed by
+ * the server, asked for with HASH (draft-bryan-ftpext-hash) when FEAT
+ * lists the algorithm, or with XCRC / XSHA256. A mismatch fails the
+ * transfer and removes the corrupt file; a server that can compute
+ * neither only gets the local digest printed.
+ */
+
+#include "ftp_client.h"
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/** SHA-256 round constants */
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/** Slicing-by-8 tables of the reflected CRC32 and CRC32C polynomials */
+static uint32_t crcTables[2][8][256];
+
+/** Implementations selected for this CPU */
+static uint32_t (*crc32cUpdate)(uint32_t crc, const unsigned char *data, size_t length);
+static uint32_t (*crc32Update)(uint32_t crc, const unsigned char *data, size_t length);
+static void (*sha256Blocks)(uint32_t state[8], const unsigned char *data, size_t blocks);
+static const char *crcEngine = "tables", *shaEngine = "portable";
+static pthread_once_t dispatchOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Fills the slicing-by-8 tables of a reflected polynomial
+ */
+static void buildCrcTables(uint32_t table[8][256], uint32_t poly)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ poly : crc >> 1;
+        table[0][i] = crc;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++)
+            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+}
+
+/**
+ * @brief Table-driven CRC update, eight bytes per step
+ */
+static uint32_t crcSliced(uint32_t table[8][256], uint32_t crc, const unsigned char *p, size_t n)
+{
+    while (n >= 8)
+    {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+        p += 8;
+        n -= 8;
+    }
+    while (n--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+static uint32_t crc32Sliced(uint32_t crc, const unsigned char *p, size_t n)
+{
+    return crcSliced(crcTables[0], crc, p, n);
+}
+
+static uint32_t crc32cSliced(uint32_t crc, const unsigned char *p, size_t n)
+{
+    return crcSliced(crcTables[1], crc, p, n);
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * @brief Portable SHA-256 compression of whole 64-byte blocks
+ */
+static void sha256Portable(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+    uint32_t w[64];
+
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+                   (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K256[i] + w[i];
+            uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint64_t c = crc;
+
+    for (; n > 0 && ((uintptr_t)p & 7); n--)
+        c = _mm_crc32_u8(c, *p++);
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; n > 0; n--)
+        c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+
+/**
+ * @brief SHA-256 compression with the SHA-NI extensions
+ *
+ * The state is kept as the ABEF/CDGH register pairs the sha256rnds2
+ * instruction expects; each iteration of the inner loop runs four
+ * rounds and schedules the message words needed three groups later.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256ShaNi(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    __m128i state0, msg, m[4];
+
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);              // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);        // EFGH
+    state0 = _mm_alignr_epi8(tmp, state1, 8);        // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);     // CDGH
+
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        __m128i abef = state0, cdgh = state1;
+
+        for (int i = 0; i < 16; i++)
+        {
+            if (i < 4)
+                m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+
+            msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&K256[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            if (i >= 3 && i <= 14)
+            {
+                __m128i next = _mm_add_epi32(m[(i + 1) & 3], _mm_alignr_epi8(m[i & 3], m[(i - 1) & 3], 4));
+                m[(i + 1) & 3] = _mm_sha256msg2_epu32(next, m[i & 3]);
+            }
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+            if (i >= 1 && i <= 12)
+                m[(i - 1) & 3] = _mm_sha256msg1_epu32(m[(i - 1) & 3], m[i & 3]);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);           // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);        // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);     // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);        // HGFE
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+/**
+ * @brief Checks CPUID leaf 7 for the SHA extensions
+ */
+static int cpuHasShaNi(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b >> 29) & 1;
+}
+#elif defined(__aarch64__)
+/**
+ * @brief CRC32C with the ARMv8 CRC32 instructions
+ */
+__attribute__((target("+crc")))
+static uint32_t crc32cArm(uint32_t crc, const unsigned char *p, size_t n)
+{
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+    }
+    for (; n > 0; n--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+
+/**
+ * @brief CRC32 (IEEE) with the ARMv8 CRC32 instructions
+ */
+__attribute__((target("+crc")))
+static uint32_t crc32Arm(uint32_t crc, const unsigned char *p, size_t n)
+{
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32d(crc, v);
+    }
+    for (; n > 0; n--)
+        crc = __crc32b(crc, *p++);
+    return crc;
+}
+#endif
+
+/**
+ * @brief Picks the fastest implementations the CPU supports
+ */
+static void selectImplementations(void)
+{
+    buildCrcTables(crcTables[0], 0xEDB88320);
+    buildCrcTables(crcTables[1], 0x82F63B78);
+    crc32Update = crc32Sliced;
+    crc32cUpdate = crc32cSliced;
+    sha256Blocks = sha256Portable;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32cUpdate = crc32cSse42;
+        crcEngine = "SSE4.2";
+    }
+    if (cpuHasShaNi() && __builtin_cpu_supports("sse4.1"))
+    {
+        sha256Blocks = sha256ShaNi;
+        shaEngine = "SHA-NI";
+    }
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        crc32Update = crc32Arm;
+        crc32cUpdate = crc32cArm;
+        crcEngine = "ARMv8 CRC";
+    }
+#endif
+}
+
+/**
+ * @brief Returns the printable name of a checksum type
+ */
+static const char *checksumName(enum ChecksumType type)
+{
+    switch (type)
+    {
+    case CHECKSUM_CRC32:  return "CRC32";
+    case CHECKSUM_CRC32C: return "CRC32C";
+    case CHECKSUM_SHA256: return "SHA-256";
+    default:              return "none";
+    }
+}
+
+/**
+ * @brief Parses a checksum name given on the command line
+ *
+ * @param name "crc32", "crc32c" or "sha256"
+ * @return enum ChecksumType Type, CHECKSUM_NONE if unknown
+ */
+enum ChecksumType checksumType(const char *name)
+{
+    if (strcasecmp(name, "crc32") == 0)
+        return CHECKSUM_CRC32;
+    if (strcasecmp(name, "crc32c") == 0)
+        return CHECKSUM_CRC32C;
+    if (strcasecmp(name, "sha256") == 0 || strcasecmp(name, "sha-256") == 0)
+        return CHECKSUM_SHA256;
+    return CHECKSUM_NONE;
+}
+
+/**
+ * @brief Starts a new digest
+ *
+ * @param sum Digest state
+ * @param type Algorithm
+ */
+void checksumInit(struct Checksum *sum, enum ChecksumType type)
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    pthread_once(&dispatchOnce, selectImplementations);
+    memset(sum, 0, sizeof(*sum));
+    sum->type = type;
+    sum->crc = 0xFFFFFFFF;
+    memcpy(sum->state, initial, sizeof(initial));
+}
+
+/**
+ * @brief Adds received bytes to a digest
+ *
+ * Called by the receive loops on every chunk, right after it was read.
+ *
+ * @param sum Digest state
+ * @param data Received bytes
+ * @param length Number of bytes
+ */
+void checksumUpdate(struct Checksum *sum, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+
+    sum->length += length;
+    switch (sum->type)
+    {
+    case CHECKSUM_CRC32:
+        sum->crc = crc32Update(sum->crc, p, length);
+        return;
+    case CHECKSUM_CRC32C:
+        sum->crc = crc32cUpdate(sum->crc, p, length);
+        return;
+    case CHECKSUM_SHA256:
+        break;
+    default:
+        return;
+    }
+
+    // Complete a pending partial block first, then hash in place
+    if (sum->used > 0)
+    {
+        size_t take = 64 - sum->used < length ? 64 - sum->used : length;
+        memcpy(sum->block + sum->used, p, take);
+        sum->used += take;
+        p += take;
+        length -= take;
+        if (sum->used < 64)
+            return;
+        sha256Blocks(sum->state, sum->block, 1);
+        sum->used = 0;
+    }
+    if (length >= 64)
+    {
+        sha256Blocks(sum->state, p, length / 64);
+        p += length & ~(size_t)63;
+        length &= 63;
+    }
+    memcpy(sum->block, p, length);
+    sum->used = length;
+}
+
+/**
+ * @brief Adds the first bytes of an existing file to a digest
+ *
+ * Used when a download resumes, so the digest still covers the whole file.
+ *
+ * @param sum Digest state
+ * @param fd File descriptor
+ * @param length Bytes to read from the start of the file
+ * @return int 0 on success, -1 on a read error
+ */
+int checksumFile(struct Checksum *sum, int fd, long long length)
+{
+    char buffer[BUFFER_SIZE * 64];
+    long long offset = 0;
+
+    while (offset < length)
+    {
+        size_t want = length - offset < (long long)sizeof(buffer) ? length - offset : sizeof(buffer);
+        ssize_t n = pread(fd, buffer, want, offset);
+        if (n <= 0)
+            return -1;
+        checksumUpdate(sum, buffer, n);
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finishes a digest and formats it in hexadecimal
+ *
+ * @param sum Digest state; must not be updated afterwards
+ * @param hex Buffer of CHECKSUM_HEX_LENGTH bytes
+ */
+void checksumFinal(struct Checksum *sum, char *hex)
+{
+    if (sum->type != CHECKSUM_SHA256)
+    {
+        snprintf(hex, CHECKSUM_HEX_LENGTH, "%08X", sum->crc ^ 0xFFFFFFFF);
+        return;
+    }
+
+    // Padding: 0x80, zeros, then the bit length in big-endian
+    unsigned char tail[72] = { 0x80 };
+    long long length = sum->length;
+    uint64_t bits = length * 8;
+    size_t pad = (sum->used < 56 ? 56 : 120) - sum->used;
+    for (int i = 0; i < 8; i++)
+        tail[pad + i] = bits >> (56 - 8 * i);
+    checksumUpdate(sum, tail, pad + 8);
+    sum->length = length;
+
+    for (int i = 0; i < 8; i++)
+        snprintf(hex + 8 * i, CHECKSUM_HEX_LENGTH - 8 * i, "%08x", sum->state[i]);
+}
+
+/**
+ * @brief Starts the integrity stage of a download when one is requested
+ *
+ * @param opts Transfer options; checksum is pointed at sum or cleared
+ * @param sum Digest state owned by the caller for the whole transfer
+ */
+void checksumAttach(struct TransferOptions *opts, struct Checksum *sum)
+{
+    opts->checksum = NULL;
+    if (opts->checksumType == CHECKSUM_NONE)
+        return;
+
+    checksumInit(sum, opts->checksumType);
+    opts->checksum = sum;
+    logMessage("Checksum: %s (%s)\n", checksumName(sum->type),
+               sum->type == CHECKSUM_SHA256 ? shaEngine
+               : sum->type == CHECKSUM_CRC32 && crc32Update == crc32Sliced ? "tables" : crcEngine);
+}
+
+/**
+ * @brief Asks the server for its digest of a file
+ *
+ * @param sock Control socket
+ * @param type Algorithm
+ * @param path Remote path
+ * @param hex Buffer of CHECKSUM_HEX_LENGTH bytes for the server's digest
+ * @return int 0 on success, 1 if the server cannot compute it, -1 on failure
+ */
+static int serverChecksum(int sock, enum ChecksumType type, const char *path, char *hex)
+{
+    unsigned flags = serverFeatures(sock);
+    unsigned hashFlag = type == CHECKSUM_SHA256 ? CONN_HASH_SHA256
+                      : type == CHECKSUM_CRC32 ? CONN_HASH_CRC32 : CONN_HASH_CRC32C;
+    const char *command = type == CHECKSUM_SHA256 ? "XSHA256" : type == CHECKSUM_CRC32 ? "XCRC" : NULL;
+    unsigned commandFlag = type == CHECKSUM_SHA256 ? CONN_XSHA256 : CONN_XCRC;
+    char cmd[BUFFER_SIZE];
+    struct FTPReply reply;
+    int length;
+
+    if (flags & hashFlag)
+    {
+        // HASH works on the algorithm selected with OPTS HASH
+        length = snprintf(cmd, sizeof(cmd), "OPTS HASH %s\r\n", checksumName(type));
+        write(sock, cmd, length);
+        if (readReply(sock, &reply) != SV_COMMAND_OK)
+            return -1;
+
+        length = snprintf(cmd, sizeof(cmd), "HASH %s\r\n", path);
+        if (length >= (int)sizeof(cmd))
+            return -1;
+        write(sock, cmd, length);
+        // "213 <algo> <start>-<end> <hex> <path>"; the algorithm must be the one asked for
+        char algo[16];
+        if (readReply(sock, &reply) == SV_FILE_STATUS &&
+            sscanf(reply.text, "%*d %15s %*s %64s", algo, hex) == 2 &&
+            strcasecmp(algo, checksumName(type)) == 0)
+            return 0;
+        logMessage("HASH did not return %s\n", checksumName(type));
+    }
+
+    if (command && (flags & commandFlag))
+    {
+        length = snprintf(cmd, sizeof(cmd), "%s %s\r\n", command, path);
+        if (length >= (int)sizeof(cmd))
+            return -1;
+        write(sock, cmd, length);
+        // "250 <hex>"
+        int code = readReply(sock, &reply);
+        if ((code != 250 && code != SV_FILE_STATUS) || sscanf(reply.text, "%*d %64s", hex) != 1)
+            return -1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Compares a local digest with the server's digest of a remote file
+ *
+ * @param sock Control socket
+ * @param path Remote path
+ * @param sum Digest of the local bytes
+ * @return int 0 if the digests match or the server cannot tell, 1 on a
+ *         mismatch, -1 if the server's digest is unavailable
+ */
+int compareChecksum(int sock, const char *path, struct Checksum *sum)
+{
+    char local[CHECKSUM_HEX_LENGTH], remote[CHECKSUM_HEX_LENGTH];
+
+    logMessage("\n=== INTEGRITY CHECK ===\n");
+    checksumFinal(sum, local);
+    logMessage("Local %s: %s (%lld bytes)\n", checksumName(sum->type), local, sum->length);
+
+    int result = serverChecksum(sock, sum->type, path, remote);
+    if (result > 0)
+    {
+        logMessage("Server cannot compute %s, digest not verified\n", checksumName(sum->type));
+        return 0;
+    }
+    if (result < 0)
+    {
+        logMessage("Server digest unavailable\n");
+        return -1;
+    }
+
+    logMessage("Server %s: %s\n", checksumName(sum->type), remote);
+    int match = sum->type == CHECKSUM_SHA256 ? strcasecmp(local, remote) == 0
+                                             : strtoul(local, NULL, 16) == strtoul(remote, NULL, 16);
+    if (!match)
+    {
+        logMessage("Checksum mismatch\n");
+        return 1;
+    }
+
+    logMessage("Checksum verified\n");
+    return 0;
+}
+
+/**
+ * @brief Compares two servers' digests of a copied file
+ *
+ * Used after a server-to-server copy, where no byte passes through the
+ * client: each server hashes its own copy and the digests are compared.
+ *
+ * @param sourceSock Control socket of the source server
+ * @param sourcePath Path of the file on the source
+ * @param destSock Control socket of the destination server
+ * @param destPath Path of the copy on the destination
+ * @param type Algorithm
+ * @return int 0 if the digests match or a server cannot tell, 1 on a
+ *         mismatch, -1 if a digest is unavailable
+ */
+int compareServerChecksums(int sourceSock, const char *sourcePath, int destSock, const char *destPath,
+                           enum ChecksumType type)
+{
+    char source[CHECKSUM_HEX_LENGTH], dest[CHECKSUM_HEX_LENGTH];
+
+    logMessage("\n=== INTEGRITY CHECK ===\n");
+    int sourceResult = serverChecksum(sourceSock, type, sourcePath, source);
+    int destResult = sourceResult < 0 ? -1 : serverChecksum(destSock, type, destPath, dest);
+    if (sourceResult < 0 || destResult < 0)
+    {
+        logMessage("Server digest unavailable\n");
+        return -1;
+    }
+    if (sourceResult > 0 || destResult > 0)
+    {
+        logMessage("%s server cannot compute %s, digest not verified\n",
+                   sourceResult > 0 ? "Source" : "Destination", checksumName(type));
+        return 0;
+    }
+
+    logMessage("Source %s: %s\nDestination %s: %s\n", checksumName(type), source, checksumName(type), dest);
+    int match = type == CHECKSUM_SHA256 ? strcasecmp(source, dest) == 0
+                                        : strtoul(source, NULL, 16) == strtoul(dest, NULL, 16);
+    if (!match)
+    {
+        logMessage("Checksum mismatch\n");
+        return 1;
+    }
+
+    logMessage("Checksum verified\n");
+    return 0;
+}
+
+/**
+ * @brief Compares the digest of a finished download with the server's
+ *
+ * Must be called after the transfer was confirmed (226), on the same
+ * control connection. On a mismatch the local file is removed.
+ *
+ * @param sock Control socket
+ * @param url URL of the downloaded file
+ * @param sum Digest of the received bytes, NULL if no checksum was requested
+ * @return int 0 if the digests match or the server cannot tell, -1 on a mismatch or error
+ */
+int verifyChecksum(int sock, struct URL *url, struct Checksum *sum)
+{
+    if (!sum)
+        return 0;
+
+    int result = compareChecksum(sock, url->resource, sum);
+    if (result > 0)
+    {
+        char filepath[MAX_LENGTH + 16];
+        snprintf(filepath, sizeof(filepath), "downloads/%s", url->file);
+        logMessage("Removing %s\n", filepath);
+        remove(filepath);
+    }
+    return result == 0 ? 0 : -1;
+}
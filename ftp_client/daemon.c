@@ -0,0 +1,665 @@
+/**
+ * @file daemon.c
+ * @brief Warm-session daemon for FTP client
+ *
+ * This file implements a long-running mode that keeps authenticated
+ * control connections open between downloads, so that a run does not
+ * pay process startup, DNS, the TCP handshake, the banner and USER/PASS
+ * again for every file. Clients submit URLs over a UNIX domain socket,
+ * one per line, and get one reply line per URL:
+ *
+ *   OK <bytes> <local path> warm|cold <milliseconds>
+ *   ERR <reason>
+ *
+ * Idle connections are pooled per host, port and credentials (at most
+ * DAEMON_MAX_IDLE each). A connection that goes back to the pool asks
+ * for its next passive address right away, so a request served warm
+ * only needs the data connection and RETR:
+ *
+ *   take warm connection -> data connect -> RETR -> 226 -> reply
+ *                                          -> PASV (for the next file) -> pool
+ *
+ * A passive address older than DAEMON_PASSIVE_TTL is not trusted and is
+ * asked for again. A keepalive thread sends NOOP on connections idle for
+ * DAEMON_KEEPALIVE seconds and closes the ones idle for
+ * DAEMON_IDLE_TIMEOUT. A warm connection the server closed meanwhile is
+ * replaced by a cold one and the file is fetched again.
+ *
+ * Every client connection is served by its own thread, up to
+ * DAEMON_MAX_CLIENTS at once. SIGINT and SIGTERM stop the daemon: the
+ * socket is removed, client connections are shut down for reading so
+ * that idle clients do not hold the daemon up, running requests finish,
+ * and pooled connections are closed with QUIT.
+ */
+
+#include "ftp_client.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/**
+ * @struct WarmConnection
+ * @brief Idle authenticated control connection
+ */
+struct WarmConnection {
+    int sock;                    /**< Control socket */
+    long long idleSince;         /**< traceNow() when it was last used or kept alive */
+    long long passiveAt;         /**< traceNow() of the pending PASV answer, 0 if none */
+    char dataAddr[BUFFER_SIZE];  /**< Pending passive address */
+    int dataPort;                /**< Pending passive port */
+};
+
+/**
+ * @struct WarmHost
+ * @brief Idle connections to one server with one set of credentials
+ */
+struct WarmHost {
+    char host[MAX_LENGTH];                         /**< Server hostname */
+    int port;                                      /**< Control port */
+    char user[MAX_LENGTH];                         /**< Username */
+    char password[MAX_LENGTH];                     /**< Password */
+    struct WarmConnection idle[DAEMON_MAX_IDLE];   /**< Idle connections, most recent last */
+    int idleCount;                                 /**< Entries used in idle */
+    struct WarmHost *next;                         /**< Next host of the pool */
+};
+
+/**
+ * @struct WarmPool
+ * @brief State shared by every thread of the daemon
+ */
+struct WarmPool {
+    const struct TransferOptions *opts;  /**< Options applied to every download */
+    struct WarmHost *hosts;              /**< Hosts with pooled connections */
+    int clients;                         /**< Client connections being served */
+    int sockets[DAEMON_MAX_CLIENTS];     /**< Sockets of those connections */
+    long served;                         /**< Files downloaded */
+    long warm;                           /**< Files served on a pooled connection */
+    long failed;                         /**< Requests that failed */
+    pthread_mutex_t lock;                /**< Protects everything above */
+};
+
+/**
+ * @struct DaemonClient
+ * @brief Client connection handed to its thread
+ */
+struct DaemonClient {
+    struct WarmPool *pool;  /**< Pool of the daemon */
+    int sock;               /**< Accepted UNIX socket */
+};
+
+/** Set by SIGINT/SIGTERM */
+static volatile sig_atomic_t stopping = 0;
+
+static void stopDaemon(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/**
+ * @brief Finds the pool entry of a server and credentials, creating it if needed
+ *
+ * Called with the pool locked.
+ *
+ * @param pool Pool
+ * @param url Server and credentials
+ * @return struct WarmHost* Entry, NULL if out of memory
+ */
+static struct WarmHost *findHost(struct WarmPool *pool, const struct URL *url)
+{
+    struct WarmHost *h;
+
+    for (h = pool->hosts; h; h = h->next)
+        if (h->port == url->port && strcmp(h->host, url->host) == 0 &&
+            strcmp(h->user, url->user) == 0 && strcmp(h->password, url->password) == 0)
+            return h;
+
+    if (!(h = calloc(1, sizeof(*h))))
+        return NULL;
+    snprintf(h->host, sizeof(h->host), "%s", url->host);
+    snprintf(h->user, sizeof(h->user), "%s", url->user);
+    snprintf(h->password, sizeof(h->password), "%s", url->password);
+    h->port = url->port;
+    h->next = pool->hosts;
+    pool->hosts = h;
+    return h;
+}
+
+/**
+ * @brief Takes the most recently used idle connection of a server
+ *
+ * @param pool Pool
+ * @param url Server and credentials
+ * @param conn Receives the connection
+ * @return int 0 if a connection was taken, -1 if none is idle
+ */
+static int takeWarm(struct WarmPool *pool, const struct URL *url, struct WarmConnection *conn)
+{
+    int found = -1;
+
+    pthread_mutex_lock(&pool->lock);
+    struct WarmHost *h = findHost(pool, url);
+    if (h && h->idleCount > 0)
+    {
+        *conn = h->idle[--h->idleCount];
+        found = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return found;
+}
+
+/**
+ * @brief Drops a control connection that may no longer be answering
+ *
+ * @param sock Control socket
+ */
+static void dropConnection(int sock)
+{
+    releaseReplyReader(sock);
+    close(sock);
+}
+
+/**
+ * @brief Returns a connection to the pool, asking for its next passive address first
+ *
+ * @param pool Pool
+ * @param url Server and credentials of the connection
+ * @param conn Connection; closed if the pool is full or PASV fails
+ */
+static void releaseWarm(struct WarmPool *pool, const struct URL *url, struct WarmConnection *conn)
+{
+    if (!conn->passiveAt)
+    {
+        if (enterPassiveMode(conn->sock, conn->dataAddr, &conn->dataPort) != 0)
+        {
+            dropConnection(conn->sock);
+            return;
+        }
+        conn->passiveAt = traceNow();
+    }
+    conn->idleSince = traceNow();
+
+    pthread_mutex_lock(&pool->lock);
+    struct WarmHost *h = findHost(pool, url);
+    if (h && h->idleCount < DAEMON_MAX_IDLE)
+    {
+        h->idle[h->idleCount++] = *conn;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (conn)
+        closeConnection(conn->sock);
+}
+
+/**
+ * @brief Opens an authenticated binary-mode control connection
+ *
+ * @param url Server and credentials
+ * @param opts Options of the daemon (pipelined login, MODE Z)
+ * @param conn Receives the connection
+ * @return int 0 on success, -1 on failure
+ */
+static int openCold(struct URL *url, const struct TransferOptions *opts, struct WarmConnection *conn)
+{
+    int saved = 0;
+
+    memset(conn, 0, sizeof(*conn));
+    if ((conn->sock = createSocket(url->host, url->port)) < 0)
+        return -1;
+
+    int failed = opts->pipelined
+        ? authenticatePipelined(conn->sock, url->user, url->password, conn->dataAddr, &conn->dataPort, &saved) != 0
+        : authenticate(conn->sock, url->user, url->password) != 0 || setBinaryMode(conn->sock) != 0;
+    if (failed)
+    {
+        closeConnection(conn->sock);
+        return -1;
+    }
+    if (opts->pipelined)
+        conn->passiveAt = traceNow();
+    if (opts->compress)
+        setCompressedMode(conn->sock);
+    return 0;
+}
+
+/**
+ * @brief Fetches a file on a connection, retrying once if its passive address went stale
+ *
+ * @param pool Pool
+ * @param url File to fetch
+ * @param conn Connection; its pending passive address is used when fresh
+ * @return int 0 on success, 1 if the file failed on a usable connection,
+ *             -1 if the connection was dropped
+ */
+static int fetchOn(struct WarmPool *pool, struct URL *url, struct WarmConnection *conn)
+{
+    int passive = conn->passiveAt && traceNow() - conn->passiveAt < DAEMON_PASSIVE_TTL * 1e9;
+    int prepared = passive;
+
+    conn->passiveAt = 0;
+    if (fetchBatchFile(conn->sock, url, pool->opts, conn->dataAddr, &conn->dataPort, &passive) == 0)
+        return 0;
+    int synced = resyncControl(conn->sock) == 0;
+
+    // A server may have stopped listening on a prepared passive port
+    if (synced && prepared)
+    {
+        if (fetchBatchFile(conn->sock, url, pool->opts, conn->dataAddr, &conn->dataPort, &passive) == 0)
+            return 0;
+        synced = resyncControl(conn->sock) == 0;
+    }
+    if (synced)
+        return 1;
+    dropConnection(conn->sock);
+    return -1;
+}
+
+/**
+ * @brief Sends a reply line to a client and logs it
+ *
+ * @param sock Client socket
+ * @param text URL the reply is for
+ * @param reply Reply, without the newline
+ * @return int 0 on success, -1 if the client is gone
+ */
+static int sendReply(int sock, const char *text, const char *reply)
+{
+    char line[MAX_LENGTH * 2 + 2];
+    int length = snprintf(line, sizeof(line), "%s\n", reply);
+
+    logMessage("%s -> %s", text, line);
+    return write(sock, line, length) == length ? 0 : -1;
+}
+
+/**
+ * @brief Downloads one URL, on a pooled connection when one is idle, and replies
+ *
+ * The reply goes out before the connection is prepared for its next
+ * file, so the client does not wait for that PASV.
+ *
+ * @param pool Pool
+ * @param sock Client socket
+ * @param text URL as submitted
+ * @return int 0 on success, -1 if the client is gone
+ */
+static int serveUrl(struct WarmPool *pool, int sock, const char *text)
+{
+    struct WarmConnection conn;
+    struct URL url;
+    char reply[MAX_LENGTH * 2];
+    long long start = traceNow();
+    int warm, result = -1;
+
+    memset(&url, 0, sizeof(url));
+    if (parse(text, &url) != 0 || url.type == 'd')
+        return sendReply(sock, text, url.type == 'd' ? "ERR directory URLs are not supported" : "ERR parse error");
+
+    // A warm connection may have been closed by the server since it was pooled
+    warm = takeWarm(pool, &url, &conn) == 0;
+    if (warm && (result = fetchOn(pool, &url, &conn)) < 0)
+    {
+        logMessage("Pooled connection to %s was closed, reconnecting\n", url.host);
+        warm = 0;
+    }
+    if (!warm && openCold(&url, pool->opts, &conn) == 0)
+        result = fetchOn(pool, &url, &conn);
+
+    pthread_mutex_lock(&pool->lock);
+    if (result == 0)
+    {
+        pool->served++;
+        pool->warm += warm;
+    }
+    else
+        pool->failed++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (result == 0)
+    {
+        struct stat st;
+        char path[MAX_LENGTH + 16];
+        snprintf(path, sizeof(path), "downloads/%s", url.file);
+        snprintf(reply, sizeof(reply), "OK %lld %s %s %.1f", stat(path, &st) == 0 ? (long long)st.st_size : 0LL,
+                 path, warm ? "warm" : "cold", (traceNow() - start) / 1e6);
+    }
+    else
+        snprintf(reply, sizeof(reply), "ERR cannot download %s", url.resource);
+
+    int sent = sendReply(sock, text, reply);
+    if (result >= 0)
+        releaseWarm(pool, &url, &conn);
+    return sent;
+}
+
+/**
+ * @brief Forgets a client connection, before its socket is closed
+ *
+ * @param pool Pool of the daemon
+ * @param sock Socket of the client
+ */
+static void removeClient(struct WarmPool *pool, int sock)
+{
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->clients; i++)
+        if (pool->sockets[i] == sock)
+        {
+            pool->sockets[i] = pool->sockets[--pool->clients];
+            break;
+        }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Thread body serving one client connection
+ *
+ * @param arg DaemonClient, freed here
+ * @return void* NULL
+ */
+static void *serveClient(void *arg)
+{
+    struct DaemonClient *client = arg;
+    struct WarmPool *pool = client->pool;
+    FILE *in = fdopen(client->sock, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+
+    while (in && (length = getline(&line, &capacity, in)) > 0)
+    {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        if (length > 0 && serveUrl(pool, client->sock, line) != 0)
+            break;
+    }
+
+    // Forgotten first, so shutdown never reaches a reused descriptor
+    free(line);
+    removeClient(pool, client->sock);
+    if (in)
+        fclose(in);
+    else
+        close(client->sock);
+    free(client);
+    return NULL;
+}
+
+/**
+ * @brief Thread body sending NOOP on idle connections and closing stale ones
+ *
+ * A connection is taken out of the pool while its NOOP is in flight, so
+ * it is never used by a request at the same time.
+ *
+ * @param arg WarmPool
+ * @return void* NULL
+ */
+static void *keepAlive(void *arg)
+{
+    struct WarmPool *pool = arg;
+
+    while (!stopping)
+    {
+        sleep(1);
+        pthread_mutex_lock(&pool->lock);
+        for (struct WarmHost *h = pool->hosts; h; h = h->next)
+        {
+            for (int i = 0; i < h->idleCount; )
+            {
+                struct WarmConnection conn = h->idle[i];
+                long long idle = traceNow() - conn.idleSince;
+                if (idle < DAEMON_KEEPALIVE * 1e9)
+                {
+                    i++;
+                    continue;
+                }
+
+                memmove(&h->idle[i], &h->idle[i + 1], (h->idleCount - i - 1) * sizeof(conn));
+                h->idleCount--;
+                pthread_mutex_unlock(&pool->lock);
+
+                // NOOP keeps both the server's idle timer and the NAT mapping alive
+                if (idle >= DAEMON_IDLE_TIMEOUT * 1e9)
+                    closeConnection(conn.sock);
+                else if (resyncControl(conn.sock) != 0)
+                    dropConnection(conn.sock);
+                else
+                {
+                    conn.idleSince = traceNow();
+                    pthread_mutex_lock(&pool->lock);
+                    if (h->idleCount < DAEMON_MAX_IDLE)
+                    {
+                        memmove(&h->idle[1], &h->idle[0], h->idleCount * sizeof(conn));
+                        h->idle[0] = conn;
+                        h->idleCount++;
+                        conn.sock = -1;
+                    }
+                    pthread_mutex_unlock(&pool->lock);
+                    if (conn.sock >= 0)
+                        closeConnection(conn.sock);
+                }
+
+                // The list may have changed while unlocked; scan it again
+                pthread_mutex_lock(&pool->lock);
+                i = 0;
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fills a UNIX socket address
+ *
+ * @param addr Address to fill
+ * @param path Socket path
+ * @return int 0 on success, -1 if the path is too long
+ */
+static int socketAddress(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        logMessage("Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * @brief Creates the listening socket, replacing a stale one left by a dead daemon
+ *
+ * @param path Socket path
+ * @return int Listening socket, -1 on failure
+ */
+static int listenOn(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (socketAddress(&addr, path) != 0)
+        return -1;
+
+    // A path that still accepts connections belongs to a running daemon
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        logMessage("A daemon is already listening on %s\n", path);
+        close(sock);
+        return -1;
+    }
+    if (sock >= 0)
+        close(sock);
+    unlink(path);
+
+    // Only the owner may submit downloads
+    mode_t mask = umask(0077);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 64) != 0)
+    {
+        logMessage("Cannot listen on %s: %s\n", path, strerror(errno));
+        umask(mask);
+        if (sock >= 0)
+            close(sock);
+        return -1;
+    }
+    umask(mask);
+    return sock;
+}
+
+/**
+ * @brief Runs the warm-session daemon until SIGINT or SIGTERM
+ *
+ * @param socketPath Path of the UNIX socket to listen on
+ * @param opts Options applied to every download
+ * @return int 0 on a clean shutdown, -1 on failure
+ */
+int runDaemon(const char *socketPath, const struct TransferOptions *opts)
+{
+    logMessage("\n=== WARM-SESSION DAEMON ===\n");
+    struct WarmPool pool;
+    struct sigaction action;
+    pthread_t keeper;
+
+    int listener = listenOn(socketPath);
+    if (listener < 0)
+        return -1;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.opts = opts;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopDaemon;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pthread_create(&keeper, NULL, keepAlive, &pool);
+    logMessage("Listening on %s\n", socketPath);
+
+    while (!stopping)
+    {
+        struct pollfd pfd = { listener, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        int sock = accept(listener, NULL, NULL);
+        if (sock < 0)
+            continue;
+
+        struct DaemonClient *client = malloc(sizeof(*client));
+        pthread_mutex_lock(&pool.lock);
+        int busy = pool.clients >= DAEMON_MAX_CLIENTS;
+        if (!busy && client)
+            pool.sockets[pool.clients++] = sock;
+        pthread_mutex_unlock(&pool.lock);
+
+        pthread_t thread;
+        if (busy || !client)
+        {
+            const char *reply = "ERR busy\n";
+            write(sock, reply, strlen(reply));
+            close(sock);
+            free(client);
+            continue;
+        }
+        client->pool = &pool;
+        client->sock = sock;
+        if (pthread_create(&thread, NULL, serveClient, client) != 0)
+        {
+            removeClient(&pool, sock);
+            close(sock);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listener);
+    unlink(socketPath);
+    pthread_join(keeper, NULL);
+
+    // Idle clients see end of file; running requests finish and reply
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < pool.clients; i++)
+        shutdown(pool.sockets[i], SHUT_RD);
+    pthread_mutex_unlock(&pool.lock);
+
+    // Let running requests finish before their connections are closed
+    for (;;)
+    {
+        pthread_mutex_lock(&pool.lock);
+        int clients = pool.clients;
+        pthread_mutex_unlock(&pool.lock);
+        if (clients == 0)
+            break;
+        usleep(100000);
+    }
+
+    while (pool.hosts)
+    {
+        struct WarmHost *h = pool.hosts;
+        pool.hosts = h->next;
+        for (int i = 0; i < h->idleCount; i++)
+            closeConnection(h->idle[i].sock);
+        free(h);
+    }
+    pthread_mutex_destroy(&pool.lock);
+
+    logMessage("\nDaemon stopped: %ld files served (%ld on warm connections), %ld failed\n",
+               pool.served, pool.warm, pool.failed);
+    return 0;
+}
+
+/**
+ * @brief Submits URLs to a running daemon and prints its replies
+ *
+ * @param socketPath Path of the daemon's UNIX socket
+ * @param urls URLs to download
+ * @param count Number of URLs
+ * @return int 0 if every URL was downloaded, -1 otherwise
+ */
+int submitToDaemon(const char *socketPath, char *const *urls, int count)
+{
+    struct sockaddr_un addr;
+    char reply[MAX_LENGTH * 2];
+    int sock, ok = 0, replies = 0;
+
+    if (socketAddress(&addr, socketPath) != 0)
+        return -1;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        logMessage("Cannot reach the daemon at %s: %s\n", socketPath, strerror(errno));
+        if (sock >= 0)
+            close(sock);
+        return -1;
+    }
+
+    // Every URL is sent up front; the daemon answers them in order
+    for (int i = 0; i < count; i++)
+    {
+        if (write(sock, urls[i], strlen(urls[i])) < 0 || write(sock, "\n", 1) != 1)
+        {
+            close(sock);
+            return -1;
+        }
+    }
+    shutdown(sock, SHUT_WR);
+
+    FILE *in = fdopen(sock, "r");
+    while (in && fgets(reply, sizeof(reply), in))
+    {
+        logMessage("%s", reply);
+        ok += strncmp(reply, "OK ", 3) == 0;
+        replies++;
+    }
+    if (in)
+        fclose(in);
+    else
+        close(sock);
+    return ok == count && replies == count ? 0 : -1;
+}
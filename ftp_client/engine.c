@@ -0,0 +1,802 @@
+/**
+ * @file engine.c
+ * @brief Event-driven FTP session engine for FTP client
+ *
+ * This file implements a non-blocking session engine built on epoll, so
+ * a single thread can keep many FTP transfers in flight. Each session is
+ * a state machine driven by readiness events on its control and data
+ * sockets:
+ *
+ *   RESOLVING -> CONNECTING -> BANNER -> USER -> PASS -> TYPE -> EPSV ->
+ *   DATA_CONNECTING -> RETR -> TRANSFER (data EOF + 226) -> EPSV ... -> QUIT
+ *
+ * EPSV is answered with a port only, so the data connection goes to the
+ * address the control connection reached; a server that rejects EPSV is
+ * sent PASV instead for the rest of the session. Host names come from
+ * the resolver cache (prefetched when the session is queued); a session
+ * whose lookup is still in flight waits in RESOLVING and checks again
+ * every ENGINE_RESOLVE_POLL_MS, so a slow lookup never stalls the loop.
+ * The control connection races the addresses of the host like the
+ * blocking path does: a new attempt starts every HAPPY_EYEBALLS_DELAY_MS,
+ * or at once when one fails, and the first to connect wins. The epoll
+ * timeout is bounded by the earliest pending timer.
+ *
+ * A session owns a queue of files on the same host and loops back to
+ * PASV after each completed transfer, so the login is paid once per
+ * session. The queue holds compact URL records; a running session
+ * expands only the file it is fetching into its struct URL. Control replies are parsed incrementally with the same
+ * ReplyReader used by the blocking functions. Failures of a single file
+ * (e.g. 550 on RETR) skip to the next file; connection-level failures
+ * fail the rest of the session's queue.
+ *
+ * engineFetch() is a synchronous wrapper that runs one session to
+ * completion.
+ */
+
+#include "ftp_client.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+
+/**
+ * @enum SessionState
+ * @brief Protocol phase of an engine session
+ */
+enum SessionState {
+    SESSION_IDLE = 0,         /**< Not started yet */
+    SESSION_RESOLVING,        /**< Waiting for the host's lookup */
+    SESSION_CONNECTING,       /**< Control connect() in progress */
+    SESSION_BANNER,           /**< Waiting for 220 */
+    SESSION_USER,             /**< USER sent */
+    SESSION_PASS,             /**< PASS sent */
+    SESSION_TYPE,             /**< TYPE I sent */
+    SESSION_EPSV,             /**< EPSV sent */
+    SESSION_PASV,             /**< PASV sent */
+    SESSION_DATA_CONNECTING,  /**< Data connect() in progress */
+    SESSION_RETR,             /**< RETR sent, waiting for 150 */
+    SESSION_TRANSFER,         /**< Receiving data and/or waiting for 226 */
+    SESSION_QUIT,             /**< QUIT sent */
+    SESSION_DONE,             /**< Finished, all sockets closed */
+};
+
+/**
+ * @struct EngineSession
+ * @brief State of one non-blocking FTP session
+ */
+struct EngineSession {
+    const struct UrlRecord **records; /**< Files fetched by this session (same host) */
+    struct URL *url;              /**< Current file, allocated while the session runs */
+    int count;                    /**< Number of files */
+    int next;                     /**< Index of the file being fetched */
+    enum SessionState state;      /**< Current protocol phase */
+    struct ResolvedHost addrs;    /**< Addresses of the host */
+    int candidate;                /**< Next address to try */
+    int attempts[RESOLVER_MAX_ADDRS]; /**< Control connects racing each other */
+    int pending;                  /**< Number of racing connects */
+    long long nextAttempt;        /**< Time the next address starts or the lookup is checked, 0 if none */
+    int ctrlSock;                 /**< Control socket, -1 if closed */
+    int dataSock;                 /**< Data socket, -1 if closed */
+    int fd;                       /**< Output file, -1 if closed */
+    struct ReplyReader reader;    /**< Incremental reply parser */
+    char out[BUFFER_SIZE];        /**< Pending command bytes */
+    size_t outLen;                /**< Length of the pending command */
+    size_t outSent;               /**< Bytes of the command already sent */
+    long long received;           /**< Bytes of the current file */
+    int dataDone;                 /**< Data connection reached EOF */
+    int replyDone;                /**< 226 received for the current file */
+    struct SessionTrace trace;    /**< Phase timings of the current file */
+};
+
+/** Tag stored in epoll events: session index and socket kind */
+#define ENGINE_TAG(index, isData) (((uint64_t)(index) << 1) | (isData))
+
+/**
+ * @brief Starts a non-blocking TCP connect
+ *
+ * @param target Server IPv4 or IPv6 address
+ * @param length Length of target
+ * @param port Server port
+ * @return int Socket with connect() in progress, -1 on failure
+ */
+static int connectNonBlocking(const struct sockaddr_storage *target, socklen_t length, int port)
+{
+    struct sockaddr_storage addr = *target;
+    int sock;
+
+    if (addr.ss_family == AF_INET6)
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in *)&addr)->sin_port = htons(port);
+
+    if ((sock = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    if (connect(sock, (struct sockaddr *)&addr, length) < 0 && errno != EINPROGRESS)
+    {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * @brief Adds or updates a socket in the epoll set
+ */
+static int engineWatch(struct SessionEngine *engine, int sock, uint32_t events, uint64_t tag, int op)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = tag;
+    return epoll_ctl(engine->epfd, op, sock, &ev);
+}
+
+/**
+ * @brief Closes the data socket and output file of a session
+ */
+static void sessionCloseData(struct EngineSession *s)
+{
+    if (s->dataSock >= 0)
+        close(s->dataSock);
+    if (s->fd >= 0)
+        close(s->fd);
+    s->dataSock = s->fd = -1;
+}
+
+/**
+ * @brief Arms or clears the timer that starts the next address of a session
+ *
+ * @param when Monotonic time in nanoseconds, 0 to clear
+ */
+static void sessionSetTimer(struct SessionEngine *engine, struct EngineSession *s, long long when)
+{
+    engine->racing += (when != 0) - (s->nextAttempt != 0);
+    s->nextAttempt = when;
+}
+
+/**
+ * @brief Starts a control connect() to the next candidate address
+ *
+ * Candidates whose connect() fails at once are skipped. While addresses
+ * remain, the timer is armed to start the next one.
+ *
+ * @return int 0 if a connect is in progress, -1 once every address failed
+ */
+static int sessionAttempt(struct SessionEngine *engine, struct EngineSession *s, int index)
+{
+    sessionSetTimer(engine, s, 0);
+    while (s->candidate < s->addrs.count)
+    {
+        int i = s->candidate++;
+        int sock = connectNonBlocking(&s->addrs.addrs[i], s->addrs.lengths[i], s->records[0]->port);
+        if (sock < 0)
+            continue;
+        if (engineWatch(engine, sock, EPOLLOUT, ENGINE_TAG(index, 0), EPOLL_CTL_ADD) != 0)
+        {
+            close(sock);
+            continue;
+        }
+        s->attempts[s->pending++] = sock;
+        break;
+    }
+
+    if (s->candidate < s->addrs.count)
+        sessionSetTimer(engine, s, traceNow() + HAPPY_EYEBALLS_DELAY_MS * 1000000LL);
+    return s->pending > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Settles the connect race of a session's control connection
+ *
+ * Every racing socket is checked without blocking; the first connected
+ * one becomes the control socket and the others are closed.
+ *
+ * @return int 0 if the race continues or was won, -1 once every address failed
+ */
+static int sessionOnConnect(struct SessionEngine *engine, struct EngineSession *s, int index)
+{
+    struct pollfd fds[RESOLVER_MAX_ADDRS];
+    int failed = 0, kept = 0;
+
+    for (int i = 0; i < s->pending; i++)
+    {
+        fds[i].fd = s->attempts[i];
+        fds[i].events = POLLOUT;
+    }
+    if (poll(fds, s->pending, 0) < 0)
+        return -1;
+
+    for (int i = 0; i < s->pending; i++)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        if (!fds[i].revents || s->ctrlSock >= 0)
+        {
+            s->attempts[kept++] = fds[i].fd;
+            continue;
+        }
+        if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0)
+            s->ctrlSock = fds[i].fd;
+        else
+        {
+            close(fds[i].fd);
+            failed = 1;
+        }
+    }
+    s->pending = kept;
+
+    if (s->ctrlSock < 0)
+    {
+        // A failed attempt lets the next address start without waiting
+        if (failed && s->candidate < s->addrs.count)
+            return sessionAttempt(engine, s, index);
+        return s->pending > 0 ? 0 : -1;
+    }
+
+    // Losers of the race
+    for (int i = 0; i < s->pending; i++)
+        close(s->attempts[i]);
+    s->pending = 0;
+    sessionSetTimer(engine, s, 0);
+
+    s->reader.sock = s->ctrlSock;
+    traceMark(&s->trace, TRACE_CONNECT);
+    s->state = SESSION_BANNER;
+    return engineWatch(engine, s->ctrlSock, EPOLLIN, ENGINE_TAG(index, 0), EPOLL_CTL_MOD);
+}
+
+/**
+ * @brief Ends a session, counting its unfinished files as failed
+ */
+static void sessionEnd(struct SessionEngine *engine, struct EngineSession *s, const char *reason)
+{
+    if (reason)
+    {
+        logMessage("Session %s: %s\n", s->records[0]->host, reason);
+        if (s->next < s->count)
+            engine->failed += s->count - s->next;
+    }
+
+    sessionCloseData(s);
+    if (s->ctrlSock >= 0)
+        close(s->ctrlSock);
+    s->ctrlSock = -1;
+    for (int i = 0; i < s->pending; i++)
+        close(s->attempts[i]);
+    s->pending = 0;
+    sessionSetTimer(engine, s, 0);
+    replyReaderFree(&s->reader);
+    free(s->url);
+    s->url = NULL;
+    s->state = SESSION_DONE;
+    engine->active--;
+}
+
+/**
+ * @brief Flushes as much of the pending command as the socket accepts
+ *
+ * @return int 0 on progress, -1 if the connection failed
+ */
+static int sessionFlush(struct SessionEngine *engine, struct EngineSession *s, int index)
+{
+    while (s->outSent < s->outLen)
+    {
+        ssize_t n = write(s->ctrlSock, s->out + s->outSent, s->outLen - s->outSent);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        s->outSent += n;
+    }
+
+    // Only ask for writability while bytes are pending
+    uint32_t events = EPOLLIN | (s->outSent < s->outLen ? EPOLLOUT : 0);
+    return engineWatch(engine, s->ctrlSock, events, ENGINE_TAG(index, 0), EPOLL_CTL_MOD);
+}
+
+/**
+ * @brief Queues a command on the control connection
+ */
+static int sessionSend(struct SessionEngine *engine, struct EngineSession *s, int index,
+                       enum SessionState state, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    int length = vsnprintf(s->out, sizeof(s->out), fmt, args);
+    va_end(args);
+    if (length < 0 || length >= (int)sizeof(s->out))
+        return -1;
+
+    s->outLen = length;
+    s->outSent = 0;
+    s->state = state;
+    return sessionFlush(engine, s, index);
+}
+
+/**
+ * @brief Starts the next file of the queue, or quits when it is empty
+ */
+static int sessionNextFile(struct SessionEngine *engine, struct EngineSession *s, int index)
+{
+    if (s->next < s->count)
+    {
+        urlFromRecord(s->records[s->next], s->url);
+        traceMark(&s->trace, TRACE_SETUP);
+        if (s->reader.flags & CONN_NO_EPSV)
+            return sessionSend(engine, s, index, SESSION_PASV, "PASV\r\n");
+        return sessionSend(engine, s, index, SESSION_EPSV, "EPSV\r\n");
+    }
+    return sessionSend(engine, s, index, SESSION_QUIT, "QUIT\r\n");
+}
+
+/**
+ * @brief Records the outcome of the current file and moves on
+ */
+static int sessionFileDone(struct SessionEngine *engine, struct EngineSession *s, int index, int ok)
+{
+    struct URL *url = s->url;
+
+    sessionCloseData(s);
+    if (ok)
+    {
+        engine->succeeded++;
+        engine->bytes += s->received;
+        latencyRecord(&engine->latency, url->host, &s->trace);
+        logMessage("Completed %s (%lld bytes)\n", url->resource, s->received);
+    }
+    else
+    {
+        engine->failed++;
+        logMessage("Failed %s\n", url->resource);
+    }
+
+    // Later files of the session start timing from here
+    traceBegin(&s->trace);
+    s->next++;
+    return sessionNextFile(engine, s, index);
+}
+
+/**
+ * @brief Starts the data connection of the current file
+ *
+ * @param target Data address, port excluded
+ * @param length Length of target
+ * @param port Data port
+ * @return int 0 on success, -1 on failure
+ */
+static int sessionConnectData(struct SessionEngine *engine, struct EngineSession *s, int index,
+                              const struct sockaddr_storage *target, socklen_t length, int port)
+{
+    traceMark(&s->trace, TRACE_PASV);
+    if ((s->dataSock = connectNonBlocking(target, length, port)) < 0 ||
+        engineWatch(engine, s->dataSock, EPOLLOUT, ENGINE_TAG(index, 1), EPOLL_CTL_ADD) != 0)
+        return -1;
+    s->state = SESSION_DATA_CONNECTING;
+    return 0;
+}
+
+/**
+ * @brief Advances the state machine on a complete control reply
+ *
+ * @return int 0 to continue, -1 if the session must end
+ */
+static int sessionOnReply(struct SessionEngine *engine, struct EngineSession *s, int index,
+                          const struct FTPReply *reply)
+{
+    const struct UrlRecord *login = s->records[0];
+    struct ResolvedHost data;
+    struct sockaddr_storage peer;
+    socklen_t peerLength = sizeof(peer);
+    char dataAddr[BUFFER_SIZE], filepath[MAX_LENGTH + 16];
+    int dataPort;
+
+    switch (s->state)
+    {
+    case SESSION_BANNER:
+        if (reply->code != SV_READY4AUTH)
+            return -1;
+        traceMark(&s->trace, TRACE_BANNER);
+        return sessionSend(engine, s, index, SESSION_USER, "USER %s\r\n", login->user);
+
+    case SESSION_USER:
+        if (reply->code == SV_READY4PASS)
+            return sessionSend(engine, s, index, SESSION_PASS, "PASS %s\r\n", login->password);
+        if (reply->code != SV_LOGINSUCCESS)
+            return -1;
+        traceMark(&s->trace, TRACE_AUTH);
+        return sessionSend(engine, s, index, SESSION_TYPE, "TYPE I\r\n");
+
+    case SESSION_PASS:
+        if (reply->code != SV_LOGINSUCCESS && reply->code != 202)
+            return -1;
+        traceMark(&s->trace, TRACE_AUTH);
+        return sessionSend(engine, s, index, SESSION_TYPE, "TYPE I\r\n");
+
+    case SESSION_TYPE:
+        if (reply->code != SV_COMMAND_OK)
+            return -1;
+        return sessionNextFile(engine, s, index);
+
+    case SESSION_EPSV:
+        if (reply->code >= 500 && reply->code <= 599)
+        {
+            s->reader.flags |= CONN_NO_EPSV;
+            return sessionSend(engine, s, index, SESSION_PASV, "PASV\r\n");
+        }
+        if (reply->code != SV_EXT_PASSIVE || parseExtendedPassiveReply(reply->text, &dataPort) != 0 ||
+            getpeername(s->ctrlSock, (struct sockaddr *)&peer, &peerLength) != 0)
+            return -1;
+        return sessionConnectData(engine, s, index, &peer, peerLength, dataPort);
+
+    case SESSION_PASV:
+        if (reply->code != SV_PASSIVE || parsePassiveReply(reply->text, dataAddr, &dataPort) != 0 ||
+            resolveHost(dataAddr, &data) != 0)
+            return -1;
+        return sessionConnectData(engine, s, index, &data.addrs[0], data.lengths[0], dataPort);
+
+    case SESSION_RETR:
+        if (reply->code != SV_READY4TRANSFER && reply->code != 125)
+            return sessionFileDone(engine, s, index, 0);
+        // Only an accepted RETR may replace an existing local copy
+        snprintf(filepath, sizeof(filepath), "downloads/%s", s->url->file);
+        if ((s->fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+            engineWatch(engine, s->dataSock, EPOLLIN, ENGINE_TAG(index, 1), EPOLL_CTL_ADD) != 0)
+            return -1;
+        s->state = SESSION_TRANSFER;
+        return 0;
+
+    case SESSION_TRANSFER:
+        if (reply->code != SV_TRANSFER_COMPLETE && reply->code != 250)
+            return sessionFileDone(engine, s, index, 0);
+        traceMark(&s->trace, TRACE_FINISH);
+        s->replyDone = 1;
+        return s->dataDone ? sessionFileDone(engine, s, index, 1) : 0;
+
+    case SESSION_QUIT:
+        sessionEnd(engine, s, NULL);
+        return 0;
+
+    default:
+        // Replies are not expected while connecting
+        return -1;
+    }
+}
+
+/**
+ * @brief Handles readiness of a session's control socket
+ */
+static int sessionOnControl(struct SessionEngine *engine, struct EngineSession *s, int index, uint32_t events)
+{
+    struct FTPReply reply;
+    int result;
+
+    if (s->state == SESSION_CONNECTING)
+        return sessionOnConnect(engine, s, index);
+
+    if (events & EPOLLOUT && sessionFlush(engine, s, index) != 0)
+        return -1;
+
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return 0;
+
+    ssize_t bytes = replyReaderFill(&s->reader);
+    if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        // The server may close right after 221
+        if (s->state == SESSION_QUIT)
+        {
+            sessionEnd(engine, s, NULL);
+            return 0;
+        }
+        return -1;
+    }
+
+    // Several replies may arrive in one read
+    while (s->state != SESSION_DONE && (result = replyReaderParse(&s->reader, &reply)) != 0)
+    {
+        if (result < 0 || sessionOnReply(engine, s, index, &reply) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handles readiness of a session's data socket
+ */
+static int sessionOnData(struct SessionEngine *engine, struct EngineSession *s, int index)
+{
+    if (s->state == SESSION_DATA_CONNECTING)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        if (getsockopt(s->dataSock, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+            return -1;
+        traceMark(&s->trace, TRACE_DATA_CONNECT);
+
+        // Data waits in the socket until 150 has opened the file
+        s->received = 0;
+        s->dataDone = s->replyDone = 0;
+        if (epoll_ctl(engine->epfd, EPOLL_CTL_DEL, s->dataSock, NULL) != 0)
+            return -1;
+        return sessionSend(engine, s, index, SESSION_RETR, "RETR %s\r\n", s->url->resource);
+    }
+
+    // One read per event keeps sessions fair to each other
+    ssize_t bytes = read(s->dataSock, engine->buffer, ENGINE_READ_SIZE);
+    if (bytes < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    if (bytes == 0)
+    {
+        traceMark(&s->trace, TRACE_DRAIN);
+        epoll_ctl(engine->epfd, EPOLL_CTL_DEL, s->dataSock, NULL);
+        close(s->dataSock);
+        s->dataSock = -1;
+        s->dataDone = 1;
+        return s->replyDone ? sessionFileDone(engine, s, index, 1) : 0;
+    }
+
+    for (ssize_t done = 0, n; done < bytes; done += n)
+        if ((n = write(s->fd, engine->buffer + done, bytes - done)) < 0)
+            return -1;
+    if (s->received == 0)
+        traceMark(&s->trace, TRACE_FIRST_BYTE);
+    s->received += bytes;
+    return 0;
+}
+
+/**
+ * @brief Starts the control connection once the host has resolved
+ *
+ * While the lookup is in flight the session waits in RESOLVING, with
+ * its timer armed to check again.
+ */
+static void sessionResolve(struct SessionEngine *engine, struct EngineSession *s, int index)
+{
+    int result = resolverPoll(s->records[0]->host, &s->addrs);
+
+    sessionSetTimer(engine, s, 0);
+    if (result > 0)
+    {
+        s->state = SESSION_RESOLVING;
+        sessionSetTimer(engine, s, traceNow() + ENGINE_RESOLVE_POLL_MS * 1000000LL);
+        return;
+    }
+    if (result != 0)
+    {
+        sessionEnd(engine, s, "cannot resolve host");
+        return;
+    }
+    if (!s->addrs.numeric)
+        traceMark(&s->trace, TRACE_DNS);
+    s->state = SESSION_CONNECTING;
+    if (sessionAttempt(engine, s, index) != 0)
+        sessionEnd(engine, s, "connect failed");
+}
+
+/**
+ * @brief Starts a queued session
+ */
+static void sessionStart(struct SessionEngine *engine, int index)
+{
+    struct EngineSession *s = &engine->sessions[index];
+
+    engine->active++;
+    traceBegin(&s->trace);
+    replyReaderInit(&s->reader, -1);
+    if (!(s->url = malloc(sizeof(*s->url))))
+    {
+        sessionEnd(engine, s, "out of memory");
+        return;
+    }
+    sessionResolve(engine, s, index);
+}
+
+/**
+ * @brief Returns the epoll timeout until the earliest lookup or connect race timer
+ *
+ * @param started Number of sessions started so far
+ * @return int Timeout in milliseconds, -1 when no timer is armed
+ */
+static int engineTimeout(struct SessionEngine *engine, int started)
+{
+    long long earliest = 0;
+
+    if (engine->racing == 0)
+        return -1;
+    for (int i = 0; i < started; i++)
+    {
+        long long when = engine->sessions[i].nextAttempt;
+        if (when && (!earliest || when < earliest))
+            earliest = when;
+    }
+
+    long long wait = earliest - traceNow();
+    return wait <= 0 ? 0 : (int)((wait + 999999) / 1000000);
+}
+
+/**
+ * @brief Checks the lookups and starts the next address of every race
+ *        whose timer expired
+ *
+ * @param started Number of sessions started so far
+ */
+static void engineFireTimers(struct SessionEngine *engine, int started)
+{
+    long long now = engine->racing ? traceNow() : 0;
+
+    for (int i = 0; engine->racing > 0 && i < started; i++)
+    {
+        struct EngineSession *s = &engine->sessions[i];
+        if (!s->nextAttempt || s->nextAttempt > now)
+            continue;
+        if (s->state == SESSION_RESOLVING)
+            sessionResolve(engine, s, i);
+        else if (sessionAttempt(engine, s, i) != 0)
+            sessionEnd(engine, s, "connect failed");
+    }
+}
+
+/**
+ * @brief Initializes an empty engine
+ *
+ * @param engine Engine to initialize
+ * @param maxActive Maximum number of sessions running at once
+ * @return int 0 on success, -1 on failure
+ */
+int engineInit(struct SessionEngine *engine, int maxActive)
+{
+    memset(engine, 0, sizeof(*engine));
+    engine->maxActive = maxActive > 0 ? maxActive : 1;
+    if ((engine->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+    if (!(engine->buffer = malloc(ENGINE_READ_SIZE)))
+    {
+        close(engine->epfd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues a session that fetches a list of files from one host
+ *
+ * All records must share host and credentials. The records, and the
+ * arena holding their strings, must stay valid until engineRun()
+ * returns.
+ *
+ * @param engine Engine to add the session to
+ * @param records Files to fetch, in order
+ * @param count Number of files
+ * @return int 0 on success, -1 on failure
+ */
+int engineAdd(struct SessionEngine *engine, const struct UrlRecord **records, int count)
+{
+    if (count <= 0)
+        return -1;
+
+    if (engine->count == engine->capacity)
+    {
+        int capacity = engine->capacity ? engine->capacity * 2 : 16;
+        struct EngineSession *grown = realloc(engine->sessions, capacity * sizeof(*grown));
+        if (!grown)
+            return -1;
+        engine->sessions = grown;
+        engine->capacity = capacity;
+    }
+
+    struct EngineSession *s = &engine->sessions[engine->count++];
+    memset(s, 0, sizeof(*s));
+    s->records = records;
+    s->count = count;
+    s->ctrlSock = s->dataSock = s->fd = -1;
+
+    // Resolve while earlier sessions run
+    resolverPrefetch(records[0]->host);
+    return 0;
+}
+
+/**
+ * @brief Runs every queued session to completion
+ *
+ * At most maxActive sessions run at once; a new one starts whenever
+ * another finishes.
+ *
+ * @param engine Engine holding the sessions
+ * @return int 0 if every file was downloaded, -1 otherwise
+ */
+int engineRun(struct SessionEngine *engine)
+{
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    int started = 0;
+
+    logMessage("\n=== EVENT ENGINE ===\n");
+    logMessage("Sessions: %d (up to %d concurrent)\n", engine->count, engine->maxActive);
+
+    while (started < engine->count || engine->active > 0)
+    {
+        while (started < engine->count && engine->active < engine->maxActive)
+            sessionStart(engine, started++);
+        if (engine->active == 0)
+            continue;
+
+        int ready = epoll_wait(engine->epfd, events, ENGINE_MAX_EVENTS, engineTimeout(engine, started));
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        engineFireTimers(engine, started);
+        for (int i = 0; i < ready; i++)
+        {
+            int index = events[i].data.u64 >> 1;
+            int isData = events[i].data.u64 & 1;
+            struct EngineSession *s = &engine->sessions[index];
+
+            // Events queued before the session ended in this same batch
+            if (s->state == SESSION_DONE || (isData && s->dataSock < 0))
+                continue;
+
+            int result = isData ? sessionOnData(engine, s, index)
+                                : sessionOnControl(engine, s, index, events[i].events);
+            if (result != 0 && s->state != SESSION_DONE)
+                sessionEnd(engine, s, "protocol or connection error");
+        }
+    }
+
+    logMessage("Engine finished: %d downloaded, %d failed, %.2f MB\n",
+               engine->succeeded, engine->failed, engine->bytes / (1024.0 * 1024.0));
+    latencyPrint(&engine->latency);
+    return engine->failed == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Releases the resources of an engine
+ *
+ * @param engine Engine to release
+ */
+void engineFree(struct SessionEngine *engine)
+{
+    free(engine->sessions);
+    free(engine->buffer);
+    latencyFree(&engine->latency);
+    if (engine->epfd >= 0)
+        close(engine->epfd);
+    memset(engine, 0, sizeof(*engine));
+    engine->epfd = -1;
+}
+
+/**
+ * @brief Downloads a single file by running a one-session engine
+ *
+ * Synchronous wrapper over the event engine for callers that want the
+ * blocking download semantics.
+ *
+ * @param url URL of the file
+ * @return int 0 on success, -1 on failure
+ */
+int engineFetch(struct URL *url)
+{
+    struct SessionEngine engine;
+    struct UrlRecord record = { url->host, url->user, url->password, url->resource, url->file,
+                                url->port, url->type };
+    const struct UrlRecord *records[1] = { &record };
+
+    if (engineInit(&engine, 1) != 0)
+        return -1;
+
+    int result = engineAdd(&engine, records, 1) == 0 ? engineRun(&engine) : -1;
+    engineFree(&engine);
+    return result;
+}
@@ -7,7 +7,7 @@
  * and download files. It supports both anonymous and authenticated
  * connections using the following URL formats:
  * - ftp://<host>/<url-path>
- * - ftp://[<user>:<password>@]<host>/<url-path>
+ * - ftp://[<user>:<password>@]<host>[:<port>]/<url-path>[;type=<a|i|d>]
  */
 
 #ifndef FTP_CLIENT_H
@@ -22,43 +22,109 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <string.h>
-#include <regex.h>
 #include <termios.h>
 #include <errno.h>
 #include <pwd.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 
 /* Constants for buffer sizes and default values */
 #define MAX_LENGTH 500        /**< Maximum length for string buffers */
 #define FTP_PORT 21          /**< Default FTP control port */
 #define BUFFER_SIZE 1024     /**< Size for general purpose buffers */
 #define DEFAULT_PORT 21      /**< Default port for FTP connections */
+#define SPLICE_CHUNK_SIZE (1024 * 1024)    /**< Bytes moved per splice() round */
+#define ALIGNED_BUFFER_SIZE (1024 * 1024)  /**< Buffer size of the aligned copy engine */
+#define BUFFER_ALIGNMENT 4096              /**< Alignment of large transfer buffers */
+#define URING_DEPTH 8                      /**< Linked receive/write pairs per io_uring batch */
+#define MMAP_WINDOW_SIZE (64 * 1024 * 1024) /**< File range mapped at once by the mmap engine */
+#define ENGINE_READ_SIZE (256 * 1024) /**< Data read size of the event engine */
+#define ENGINE_MAX_EVENTS 256        /**< epoll events handled per wakeup */
+#define ENGINE_RESOLVE_POLL_MS 5     /**< Interval at which the engine checks a lookup in flight */
+#define MDTM_LENGTH 32       /**< Buffer size for an MDTM timestamp */
+#define REPLY_BUFFER_SIZE 4096 /**< Initial size and read chunk of the reply reader */
+#define MAX_REPLY_SIZE 65536 /**< Largest single server reply accepted */
+#define RESOLVER_MAX_ADDRS 8          /**< Addresses kept per host name */
+#define RESOLVER_TTL 60.0             /**< Seconds a resolved name stays cached */
+#define RESOLVER_NEGATIVE_TTL 5.0     /**< Seconds a failed lookup stays cached */
+#define HAPPY_EYEBALLS_DELAY_MS 250   /**< Delay before racing the next address */
+#define CHECKSUM_HEX_LENGTH 65      /**< Buffer size for a hexadecimal digest */
+#define INFLATE_BUFFER_SIZE (256 * 1024) /**< Input and output buffer size of the MODE Z inflater */
+#define METRICS_SAMPLE_INTERVAL 1.0 /**< Seconds between progress reports */
+#define METRICS_STALL_SECONDS 1.0   /**< Gap without data counted as a stall */
+
+/* Latency histograms: LATENCY_SUB_BUCKETS linear buckets per power of two */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (2 * LATENCY_SUB_BUCKETS + (63 - LATENCY_SUB_BITS - 1) * LATENCY_SUB_BUCKETS)
+
+/** Connection flag: the server rejected EPSV, use PASV */
+#define CONN_NO_EPSV 1
+/** Connection flags learned from FEAT (CONN_FEATURES marks FEAT as sent) */
+#define CONN_FEATURES 2
+#define CONN_HASH_SHA256 4
+#define CONN_HASH_CRC32 8
+#define CONN_HASH_CRC32C 16
+#define CONN_XCRC 32
+#define CONN_XSHA256 64
+#define CONN_MODE_Z 128
+/** Connection flag: MODE Z is active, data transfers carry a zlib stream */
+#define CONN_COMPRESSED 256
 
 /** Pattern for parsing passive mode response */
 #define PASV_PORT_PATTERN "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)"
 
 /* FTP Server Response Codes */
+#define SV_COMMAND_OK 200      /**< Command okay */
+#define SV_FILE_STATUS 213     /**< File status (SIZE/MDTM reply) */
 #define SV_READY4AUTH 220      /**< Server ready for authentication */
 #define SV_READY4PASS 331      /**< Username OK, need password */
 #define SV_LOGINSUCCESS 230    /**< User logged in successfully */
 #define SV_PASSIVE 227         /**< Entering passive mode */
+#define SV_EXT_PASSIVE 229     /**< Entering extended passive mode (EPSV) */
 #define SV_READY4TRANSFER 150  /**< File status okay; opening data connection */
 #define SV_TRANSFER_COMPLETE 226/**< Transfer completed successfully */
 #define SV_GOODBYE 221         /**< Server saying goodbye */
+#define SV_PENDING_INFO 350    /**< Requested action pending further information (REST) */
+
+/* Segmented download tuning */
+#define MAX_SEGMENTS 16                 /**< Upper bound for parallel segments (-j) */
+#define SEGMENT_READ_SIZE 65536         /**< Read size used by segment workers */
+#define MIN_SEGMENT_SIZE (1024 * 1024)  /**< Smallest range worth its own session or steal */
+
+/* Mirror mode tuning */
+#define MIRROR_DEFAULT_WORKERS 4        /**< Worker sessions when -w is not given */
+#define MIRROR_MAX_WORKERS 64           /**< Upper bound for worker sessions (-w) */
+#define MIRROR_MAX_PATTERNS 32          /**< Include or exclude globs accepted */
+#define MLSD_MAX_LINE 4096              /**< Longest MLSD line kept; longer ones are skipped */
 
-/* URL Parsing Regular Expressions */
-#define AT "@"                 /**< Separator for user:pass@host */
-#define BAR "/"                /**< Path separator */
-/** Regex for extracting host from URL without credentials */
-#define HOST_REGEX "%*[^/]//%[^/]"
-/** Regex for extracting host from URL with credentials */
-#define HOST_AT_REGEX "%*[^/]//%*[^@]@%[^/]"
-/** Regex for extracting resource path */
-#define RESOURCE_REGEX "%*[^/]//%*[^/]/%s"
-/** Regex for extracting username */
-#define USER_REGEX "%*[^/]//%[^:/]"
-/** Regex for extracting password */
-#define PASS_REGEX "%*[^/]//%*[^:]:%[^@\n$]"
+/* Scheduler and rate shaping tuning */
+#define SCHEDULER_HOST_CONNECTIONS 2    /**< Connections per host when -C is not given */
+#define SCHEDULER_MAX_ATTEMPTS 5        /**< 421 refusals before a job is given up */
+#define SCHEDULER_BACKOFF 1.0           /**< Seconds before the first retry of a refused host */
+#define SCHEDULER_MAX_BACKOFF 30.0      /**< Longest wait before retrying a refused host */
+#define SHAPER_READ_SIZE (64 * 1024)    /**< Largest read while a rate limit applies */
+#define SHAPER_BURST_SECONDS 0.25       /**< Credit a rate limit accumulates while idle */
+
+/* Warm-session daemon tuning */
+#define DAEMON_MAX_IDLE 4               /**< Idle connections kept per host and credentials */
+#define DAEMON_MAX_CLIENTS 64           /**< Client connections served at once */
+#define DAEMON_KEEPALIVE 30.0           /**< Seconds idle before a NOOP keepalive */
+#define DAEMON_IDLE_TIMEOUT 300.0       /**< Seconds idle before a pooled connection is closed */
+#define DAEMON_PASSIVE_TTL 10.0         /**< Seconds a prepared PASV answer is trusted */
+#define CACHE_DEFAULT_CAPACITY (1024LL * 1024 * 1024) /**< Default size limit of the content cache */
+#define CACHE_INITIAL_SLOTS 1024        /**< Initial slots of the cache table */
+#define CACHE_RECORD_MAGIC 0x46435231   /**< Marks a valid cache index record */
+#define HEDGE_WINDOW 3.0                /**< Seconds below the throughput floor that fire a hedge */
+#define HEDGE_POLL_INTERVAL 0.25        /**< Seconds between throughput checks */
+#define UNPACK_RING_SIZE (8 * 1024 * 1024) /**< Bytes buffered between the receive loop and the unpack stage */
+
+/* URL records */
+#define URL_ARENA_BLOCK (64 * 1024)     /**< Bytes per block of a URL arena */
+#define URL_INTERN_SLOTS 64             /**< Initial slots of an arena's intern table */
+
+/* Reply Parsing Formats */
 /** Regex for extracting response code */
 #define RESPCODE_REGEX "%d"
 /** Regex for parsing passive mode response */
@@ -74,6 +140,7 @@
  * 
  * This structure holds all the components extracted from an FTP URL,
  * including server information, credentials, and requested resource details.
+ * The host is resolved when a connection is made, through the resolver cache.
  */
 struct URL {
     char host[MAX_LENGTH];     /**< Server hostname (e.g., 'ftp.up.pt') */
@@ -81,11 +148,395 @@ struct URL {
     char file[MAX_LENGTH];     /**< File name extracted from resource path */
     char user[MAX_LENGTH];     /**< Username for authentication */
     char password[MAX_LENGTH]; /**< Password for authentication */
-    char ip[MAX_LENGTH];       /**< Resolved IP address of the host */
+    int port;                  /**< Control port, FTP_PORT unless the URL gives one */
+    char type;                 /**< ";type=" code: 'a', 'i', 'd', or 0 if not given */
+};
+
+/**
+ * @struct UrlRecord
+ * @brief Compact form of a parsed URL
+ *
+ * The strings are views into a UrlArena and stay valid until it is
+ * freed. Host, user and password are interned: records on the same
+ * server with the same credentials share those pointers.
+ */
+struct UrlRecord {
+    const char *host;      /**< Server hostname, lowercase */
+    const char *user;      /**< Username for authentication */
+    const char *password;  /**< Password for authentication */
+    const char *resource;  /**< Resource path */
+    const char *file;      /**< Last segment of resource */
+    unsigned short port;   /**< Control port */
+    char type;             /**< ";type=" code, or 0 */
+};
+
+/**
+ * @struct UrlArena
+ * @brief Block allocator and intern table behind URL records
+ */
+struct UrlArena {
+    char *block;           /**< Current block; starts with a pointer to the previous one */
+    size_t used;           /**< Bytes used in the current block */
+    size_t size;           /**< Size of the current block */
+    const char **table;    /**< Interned strings, open addressing */
+    size_t tableSize;      /**< Slots in table, a power of two */
+    size_t interned;       /**< Strings in table */
+    size_t bytes;          /**< Bytes allocated for blocks */
+};
+
+/**
+ * @struct FTPReply
+ * @brief Complete server reply returned by the reply reader
+ *
+ * The text is a view into the reader's buffer holding every line of the
+ * reply (without the final CRLF). It is valid until the next read on the
+ * same connection.
+ */
+struct FTPReply {
+    int code;          /**< Three-digit reply code */
+    const char *text;  /**< Full reply text, NUL-terminated */
+    size_t length;     /**< Length of text in bytes */
+};
+
+/**
+ * @struct ReplyReader
+ * @brief Buffered reader and multi-line reply parser for a control connection
+ */
+struct ReplyReader {
+    int sock;          /**< Control socket data is read from */
+    char *buf;         /**< Receive buffer */
+    size_t cap;        /**< Allocated size of buf */
+    size_t start;      /**< Start of the reply being parsed */
+    size_t end;        /**< End of buffered data */
+    size_t lineStart;  /**< Start of the line being parsed */
+    size_t scan;       /**< Position where the newline search resumes */
+    int code;          /**< Code of the reply being parsed */
+    int multiCode;     /**< Opening code while inside a multi-line block, 0 otherwise */
+    int lastCode;      /**< Code of the last complete reply, 0 before the first */
+    unsigned flags;    /**< Per-connection protocol flags (CONN_*) */
+};
+
+/**
+ * @struct ResolvedHost
+ * @brief Addresses of a host, in the order connections should try them
+ */
+struct ResolvedHost {
+    struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];  /**< Candidate addresses */
+    socklen_t lengths[RESOLVER_MAX_ADDRS];              /**< Length of each address */
+    int count;                                          /**< Number of candidates */
+    int numeric;                                        /**< Host was a numeric address */
+};
+
+/**
+ * @enum TransferEngine
+ * @brief Strategy used to move data from the data socket to the file
+ */
+enum TransferEngine {
+    ENGINE_STDIO = 0,  /**< read() into a small buffer and fwrite() */
+    ENGINE_SPLICE,     /**< splice() through a pipe, aligned-buffer fallback */
+    ENGINE_MMAP,       /**< read() straight into a shared file mapping, needs SIZE */
+    ENGINE_URING       /**< io_uring batches of linked receives and writes, aligned-buffer fallback */
+};
+
+/**
+ * @enum MetricsFormat
+ * @brief Output format of progress reports
+ */
+enum MetricsFormat {
+    METRICS_TEXT = 0,    /**< Human-readable progress line on stdout */
+    METRICS_JSON,        /**< One JSON object per line */
+    METRICS_PROMETHEUS   /**< Prometheus text exposition format */
+};
+
+/**
+ * @enum TracePhase
+ * @brief Protocol phases timed by a session trace, in protocol order
+ */
+enum TracePhase {
+    TRACE_DNS = 0,       /**< Host name resolution */
+    TRACE_CONNECT,       /**< Control connection handshake */
+    TRACE_BANNER,        /**< Wait for the 220 greeting */
+    TRACE_AUTH,          /**< USER/PASS exchange */
+    TRACE_SETUP,         /**< Commands between login and PASV (TYPE, SIZE, MDTM) */
+    TRACE_PASV,          /**< PASV round-trip */
+    TRACE_DATA_CONNECT,  /**< Data connection handshake */
+    TRACE_FIRST_BYTE,    /**< REST/RETR until the first data byte */
+    TRACE_DRAIN,         /**< First to last data byte */
+    TRACE_FINISH,        /**< Wait for the 226 confirmation */
+    TRACE_PHASES         /**< Number of phases */
+};
+
+/**
+ * @struct SessionTrace
+ * @brief Nanosecond time spent in each phase of a session
+ */
+struct SessionTrace {
+    long long phase[TRACE_PHASES];  /**< Accumulated duration per phase */
+    long long last;                 /**< Time of the previous mark */
+    unsigned seen;                  /**< Bit per phase marked at least once */
+};
+
+/**
+ * @struct LatencyHistogram
+ * @brief Log-linear histogram of durations in nanoseconds
+ */
+struct LatencyHistogram {
+    unsigned counts[LATENCY_BUCKETS];  /**< Samples per bucket */
+    long long count;                   /**< Total samples */
+};
+
+/**
+ * @struct HostLatency
+ * @brief Per-phase latency histograms of one host
+ */
+struct HostLatency {
+    char host[MAX_LENGTH];                        /**< Host name */
+    struct LatencyHistogram phase[TRACE_PHASES];  /**< One histogram per phase */
+    struct LatencyHistogram total;                /**< Sum of all phases */
+};
+
+/**
+ * @struct LatencyReport
+ * @brief Latency histograms of a batch run, grouped by host
+ */
+struct LatencyReport {
+    struct HostLatency **hosts;  /**< Hosts in order of first record */
+    int count;                   /**< Number of hosts */
+    int capacity;                /**< Allocated entries in hosts */
+};
+
+/**
+ * @enum ChecksumType
+ * @brief Digest computed over the received bytes
+ */
+enum ChecksumType {
+    CHECKSUM_NONE = 0,  /**< No integrity check */
+    CHECKSUM_CRC32,     /**< CRC32 (IEEE), as returned by XCRC */
+    CHECKSUM_CRC32C,    /**< CRC32C (Castagnoli) */
+    CHECKSUM_SHA256     /**< SHA-256 */
+};
+
+/**
+ * @struct Checksum
+ * @brief Running digest of one download
+ */
+struct Checksum {
+    enum ChecksumType type;   /**< Algorithm */
+    uint32_t crc;             /**< CRC state, inverted */
+    uint32_t state[8];        /**< SHA-256 state */
+    unsigned char block[64];  /**< Pending partial SHA-256 block */
+    size_t used;              /**< Bytes in block */
+    long long length;         /**< Bytes hashed */
+};
+
+/**
+ * @struct CacheRecord
+ * @brief Cache index record, also the on-disk format of the index
+ */
+struct CacheRecord {
+    uint64_t key;       /**< Hash of host, port and resource, 0 for an empty slot */
+    int64_t size;       /**< File size, -1 for a removed entry */
+    int64_t mdtm;       /**< Modification time as YYYYMMDDHHMMSS */
+    int64_t lastUsed;   /**< Time of the last store or hit */
+    uint32_t crc32;     /**< CRC32 of the blob */
+    uint32_t magic;     /**< CACHE_RECORD_MAGIC */
+};
+
+/**
+ * @struct ContentCache
+ * @brief On-disk cache of downloaded files
+ */
+struct ContentCache {
+    char dir[MAX_LENGTH];        /**< Cache directory */
+    long long capacity;          /**< Largest total size of the blobs */
+    int indexFd;                 /**< Index, opened for appending */
+    struct CacheRecord *records; /**< Open-addressing table of entries */
+    size_t slots;                /**< Table size, a power of two */
+    size_t used;                 /**< Slots holding an entry or a tombstone */
+    int count;                   /**< Live entries */
+    long long bytes;             /**< Total size of the live entries */
+    long logged;                 /**< Records in the index file */
+    long hits;                   /**< Lookups served from the cache */
+    long misses;                 /**< Lookups that went to the server */
+    long stored;                 /**< Files added */
+    long evictions;              /**< Entries evicted */
+    long long savedBytes;        /**< Bytes served from the cache */
+    pthread_mutex_t lock;        /**< Guards the table and counters */
+};
+
+/**
+ * @struct TokenBucket
+ * @brief Bandwidth limit shared by concurrent transfers
+ *
+ * Transfers charge the bucket after every read and sleep off any
+ * deficit. Tokens may go negative, so concurrent readers queue behind
+ * each other and receive equal shares of the rate.
+ */
+struct TokenBucket {
+    pthread_mutex_t lock;  /**< Protects the fields below */
+    double rate;           /**< Bytes per second, 0 for unlimited */
+    double burst;          /**< Largest credit in bytes */
+    double tokens;         /**< Available bytes, negative while readers wait */
+    double last;           /**< Time tokens were last refilled */
+};
+
+/**
+ * @struct SocketOptions
+ * @brief Socket tunables applied before connect()
+ */
+struct SocketOptions {
+    int rcvbuf;  /**< SO_RCVBUF in bytes, 0 for the system default */
+};
+
+struct Hedge;
+struct Unpacker;
+
+/**
+ * @struct TransferOptions
+ * @brief Tunables for a single file download
+ */
+struct TransferOptions {
+    enum TransferEngine engine;  /**< Receive engine to use */
+    int pipelined;               /**< Pipeline USER/PASS/TYPE I/PASV at login */
+    int resume;                  /**< Continue partial downloads (SIZE/MDTM/REST) */
+    long long offset;            /**< Restart offset: append from here instead of truncating */
+    int concurrency;             /**< Sessions run by the event engine, 0 for blocking mode */
+    size_t readSize;             /**< Bytes per read(), 0 for the engine default */
+    int preallocate;             /**< Reserve the file's blocks with fallocate() before receiving */
+    long long expectedSize;      /**< Remote size reported by SIZE, 0 if unknown */
+    struct SocketOptions socket; /**< Options for the data connection */
+    enum MetricsFormat metricsFormat; /**< Progress report format */
+    const char *metricsPath;     /**< Report destination, NULL for the terminal */
+    int compress;                /**< Negotiate MODE Z when the server offers it */
+    enum ChecksumType checksumType; /**< Digest to verify, CHECKSUM_NONE for none */
+    struct Checksum *checksum;   /**< Digest of the current file, NULL when not hashing */
+    struct TokenBucket *rateLimit;     /**< Bandwidth limit of the whole run, NULL for none */
+    struct TokenBucket *hostRateLimit; /**< Bandwidth limit of the file's host, NULL for none */
+    int slots;                   /**< Transfers run at once by the scheduler, 0 for a sequential batch */
+    int hostConnections;         /**< Scheduler connections per host, 0 for the default */
+    struct ContentCache *cache;  /**< Content cache, NULL for none */
+    char mdtm[MDTM_LENGTH];      /**< MDTM of the current file from the cache check, empty if unknown */
+    long long minRate;           /**< Throughput floor in bytes/s that fires a hedged session, 0 for none */
+    struct Hedge *hedge;         /**< Hedge watching the current transfer, NULL for none */
+    const char *unpackDir;       /**< Extract archives here while they download, NULL for none */
+    int keepArchive;             /**< Keep the archive in downloads/ when extracting it */
+    struct Unpacker *unpack;     /**< Unpack stage of the current file, NULL for none */
+};
+
+/**
+ * @struct MirrorOptions
+ * @brief Settings of a recursive mirror
+ */
+struct MirrorOptions {
+    int workers;                          /**< Worker sessions, 0 for the default */
+    char *include[MIRROR_MAX_PATTERNS];   /**< Globs a file must match, if any are given */
+    int includeCount;                     /**< Number of include globs */
+    char *exclude[MIRROR_MAX_PATTERNS];   /**< Globs of files and directories to skip */
+    int excludeCount;                     /**< Number of exclude globs */
+};
+
+/**
+ * @struct TransferMetrics
+ * @brief Counters and sampling state of one transfer
+ */
+struct TransferMetrics {
+    const char *name;            /**< Name reported for the transfer */
+    enum MetricsFormat format;   /**< Report format */
+    const char *path;            /**< Report destination, NULL for the terminal */
+    FILE *out;                   /**< Open JSON-lines stream */
+    long long bytes;             /**< Bytes received (after decompression) */
+    long long wireBytes;         /**< Compressed bytes read off the socket, 0 in stream mode */
+    long long size;              /**< Expected size, 0 if unknown */
+    long long sampleBytes;       /**< Bytes at the previous sample */
+    double start;                /**< Monotonic start time in seconds */
+    double lastSample;           /**< Time of the previous sample */
+    double nextSample;           /**< Time the next sample is due */
+    double lastChunk;            /**< Time data last arrived */
+    double rate;                 /**< Bytes per second over the last interval */
+    int stalls;                  /**< Gaps without data of METRICS_STALL_SECONDS or more */
+    int upload;                  /**< Bytes are sent rather than received */
+    struct Hedge *hedge;         /**< Hedge told about progress, NULL for none */
+};
+
+/**
+ * @struct ScheduledJob
+ * @brief File waiting in the scheduler
+ */
+struct ScheduledJob {
+    struct UrlRecord url;  /**< File to fetch; strings owned by the caller's arena */
+    int priority;          /**< Higher priorities run first */
+    unsigned long order;   /**< Submission order, breaks priority ties */
+    int attempts;          /**< Times the host refused the job with 421 */
+};
+
+/**
+ * @struct SchedulerHost
+ * @brief Queue and connection accounting of one server
+ */
+struct SchedulerHost {
+    char host[MAX_LENGTH];        /**< Host name */
+    int port;                     /**< Control port */
+    struct ScheduledJob **queue;  /**< Binary heap of waiting jobs, best first */
+    int count;                    /**< Jobs in queue */
+    int capacity;                 /**< Allocated entries in queue */
+    int connections;              /**< Control connections open or being opened */
+    int limit;                    /**< Connection cap, lowered when the server refuses */
+    double retryAt;               /**< No new connection before this monotonic time */
+    int done;                     /**< Files downloaded */
+    struct TokenBucket bucket;    /**< Bandwidth limit of the host */
+};
+
+/**
+ * @struct Scheduler
+ * @brief Priority scheduler running transfers over a pool of sessions
+ */
+struct Scheduler {
+    struct SchedulerHost **hosts;        /**< Hosts in order of first job */
+    int hostCount;                       /**< Number of hosts */
+    int hostCapacity;                    /**< Allocated entries in hosts */
+    const struct TransferOptions *opts;  /**< Options of every transfer */
+    int slots;                           /**< Worker sessions */
+    int queued;                          /**< Jobs waiting in all queues */
+    int running;                         /**< Jobs being transferred */
+    int succeeded;                       /**< Files downloaded */
+    int failed;                          /**< Files given up */
+    int refused;                         /**< 421 refusals, each requeued or failed */
+    unsigned long order;                 /**< Next submission number */
+    pthread_mutex_t lock;                /**< Protects the scheduler and its hosts */
+    pthread_cond_t wake;                 /**< Signalled when a job finishes or is queued */
+};
+
+struct EngineSession;
+
+/**
+ * @struct SessionEngine
+ * @brief Single-threaded epoll engine driving many non-blocking sessions
+ */
+struct SessionEngine {
+    int epfd;                        /**< epoll instance */
+    struct EngineSession *sessions;  /**< Queued sessions */
+    int count;                       /**< Number of queued sessions */
+    int capacity;                    /**< Allocated session slots */
+    int maxActive;                   /**< Concurrent session limit */
+    int active;                      /**< Sessions currently running */
+    int racing;                      /**< Sessions with a connect race or lookup timer armed */
+    int succeeded;                   /**< Files downloaded */
+    int failed;                      /**< Files that failed */
+    long long bytes;                 /**< Bytes downloaded */
+    char *buffer;                    /**< Shared receive buffer */
+    struct LatencyReport latency;    /**< Phase latencies of completed files, per host */
 };
 
 /* Function Prototypes */
 
+/**
+ * @brief Emits a status message: stdout in the executable, the installed
+ *        handler (or nowhere) in the library
+ *
+ * @param format printf-style format
+ */
+void logMessage(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
 /**
  * @brief Parses an FTP URL into its components
  * 
@@ -93,16 +544,116 @@ struct URL {
  * @param url Pointer to URL structure to store parsed components
  * @return int 0 on success, -1 on failure
  */
-int parse(char *input, struct URL *url);
+int parse(const char *input, struct URL *url);
+
+/**
+ * @brief Initializes an empty URL arena
+ *
+ * @param a Arena
+ */
+void urlArenaInit(struct UrlArena *a);
+
+/**
+ * @brief Releases a URL arena and every string it holds
+ *
+ * @param a Arena
+ */
+void urlArenaFree(struct UrlArena *a);
+
+/**
+ * @brief Parses an FTP URL into a compact record backed by an arena
+ *
+ * @param a Arena holding the strings
+ * @param input The FTP URL to parse
+ * @param record Receives the components
+ * @return int 0 on success, -1 on failure
+ */
+int parseRecord(struct UrlArena *a, const char *input, struct UrlRecord *record);
+
+/**
+ * @brief Expands a compact record into a struct URL
+ *
+ * @param record Record filled by parseRecord()
+ * @param url Receives the components
+ */
+void urlFromRecord(const struct UrlRecord *record, struct URL *url);
 
 /**
  * @brief Creates and connects a socket to the specified address
  * 
- * @param ip Server IP address
+ * @param host Server host name or IPv4/IPv6 address
+ * @param port Server port number
+ * @return int Socket file descriptor on success, -1 on failure
+ */
+int createSocket(char *host, int port);
+
+/**
+ * @brief Creates and connects a socket, applying options before connect()
+ *
+ * @param host Server host name or IPv4/IPv6 address
  * @param port Server port number
+ * @param opts Socket options, NULL for system defaults
  * @return int Socket file descriptor on success, -1 on failure
  */
-int createSocket(char *ip, int port);
+int createSocketWith(char *host, int port, const struct SocketOptions *opts);
+
+/**
+ * @brief Sets the connect and idle deadlines of sockets created from now on
+ *
+ * @param connectSeconds Time allowed to establish a connection, 0 for no limit
+ * @param idleSeconds Time a connection may stay silent, 0 for no limit
+ */
+void setSocketDeadlines(double connectSeconds, double idleSeconds);
+
+/**
+ * @brief Returns the idle deadline set by setSocketDeadlines()
+ *
+ * @return double Seconds, 0 for no limit
+ */
+double socketIdleDeadline(void);
+
+/**
+ * @brief Returns the numeric address of the peer of a connected socket
+ *
+ * @param sock Connected socket
+ * @param addr Buffer receiving the address
+ * @param size Size of addr
+ * @return int 0 on success, -1 on failure
+ */
+int socketPeerAddress(int sock, char *addr, size_t size);
+
+/**
+ * @brief Returns the address family of the peer of a connected socket
+ *
+ * @param sock Connected socket
+ * @return int AF_INET or AF_INET6, -1 on failure
+ */
+int socketPeerFamily(int sock);
+
+/**
+ * @brief Starts resolving a host in the background unless it is cached
+ *
+ * @param host Host name
+ */
+void resolverPrefetch(const char *host);
+
+/**
+ * @brief Returns the addresses of a host, from the cache when possible
+ *
+ * @param host Host name or numeric IPv4/IPv6 address
+ * @param out Receives the addresses in connection order
+ * @return int 0 on success, -1 if the name does not resolve
+ */
+int resolveHost(const char *host, struct ResolvedHost *out);
+
+/**
+ * @brief Returns the addresses of a host without waiting for a lookup
+ *
+ * @param host Host name or numeric IPv4/IPv6 address
+ * @param out Receives the addresses in connection order
+ * @return int 0 on success, 1 while a lookup is in flight, -1 if the name does not resolve
+ */
+int resolverPoll(const char *host, struct ResolvedHost *out);
 
 /**
  * @brief Closes an FTP connection properly
@@ -132,6 +683,39 @@ int authenticate(int sock, const char *user, const char *pass);
  */
 int enterPassiveMode(int sock, char *addr, int *port);
 
+/**
+ * @brief Logs in, selects binary type and enters passive mode in one round-trip
+ *
+ * @param sock Control socket
+ * @param user Username
+ * @param pass Password
+ * @param addr Buffer to store data connection address
+ * @param port Pointer to store data connection port
+ * @param saved Incremented by the number of round-trips saved
+ * @return int 0 on success, -1 on failure
+ */
+int authenticatePipelined(int sock, const char *user, const char *pass,
+                          char *addr, int *port, int *saved);
+
+/**
+ * @brief Parses the address and port of a 227 passive mode reply
+ *
+ * @param text Reply text
+ * @param addr Buffer to store data connection address
+ * @param port Pointer to store data connection port
+ * @return int 0 on success, -1 on failure
+ */
+int parsePassiveReply(const char *text, char *addr, int *port);
+
+/**
+ * @brief Parses the port of a 229 extended passive mode reply
+ *
+ * @param text Reply text
+ * @param port Pointer to store data connection port
+ * @return int 0 on success, -1 on failure
+ */
+int parseExtendedPassiveReply(const char *text, int *port);
+
 /**
  * @brief Reads and parses server response
  * 
@@ -141,6 +725,87 @@ int enterPassiveMode(int sock, char *addr, int *port);
  */
 int getServerResponse(int sock, char *buffer);
 
+/**
+ * @brief Reads the next complete (possibly multi-line) reply
+ *
+ * @param sock Control socket
+ * @param reply Receives the reply code and a view of the full message
+ * @return int Response code on success, -1 on failure
+ */
+int readReply(int sock, struct FTPReply *reply);
+
+/**
+ * @brief Returns the protocol flags recorded for a control connection
+ *
+ * @param sock Control socket
+ * @return unsigned Bitwise OR of CONN_* flags
+ */
+unsigned connectionFlags(int sock);
+
+/**
+ * @brief Records a protocol flag for a control connection
+ *
+ * @param sock Control socket
+ * @param flag CONN_* flag to set
+ */
+void setConnectionFlag(int sock, unsigned flag);
+
+/**
+ * @brief Returns the code of the last reply read on a control connection
+ *
+ * @param sock Control socket
+ * @return int Reply code, 0 if no reply was read
+ */
+int lastReplyCode(int sock);
+
+/**
+ * @brief Drops the buffered reader attached to a control socket
+ *
+ * @param sock Control socket
+ */
+void releaseReplyReader(int sock);
+
+/**
+ * @brief Initializes a reply reader for a control socket
+ *
+ * @param reader Reader to initialize
+ * @param sock Control socket
+ */
+void replyReaderInit(struct ReplyReader *reader, int sock);
+
+/**
+ * @brief Releases the buffer of a reply reader
+ *
+ * @param reader Reader to release
+ */
+void replyReaderFree(struct ReplyReader *reader);
+
+/**
+ * @brief Reads the next chunk of control data into the reader
+ *
+ * @param reader Reader to fill
+ * @return ssize_t Bytes read, 0 on end of stream, -1 on error
+ */
+ssize_t replyReaderFill(struct ReplyReader *reader);
+
+/**
+ * @brief Extracts the next complete reply from buffered data
+ *
+ * @param reader Reader holding buffered data
+ * @param reply Receives the reply code and message view
+ * @return int 1 if a reply was extracted, 0 if more data is needed, -1 on malformed input
+ */
+int replyReaderParse(struct ReplyReader *reader, struct FTPReply *reply);
+
+/**
+ * @brief Blocks until the reader holds a complete reply
+ *
+ * @param reader Reader attached to the control socket
+ * @param reply Receives the reply code and message view
+ * @return int Response code on success, -1 on failure
+ */
+int replyReaderNext(struct ReplyReader *reader, struct FTPReply *reply);
+
 /**
  * @brief Downloads a file from the server
  * 
@@ -151,6 +816,162 @@ int getServerResponse(int sock, char *buffer);
  */
 int downloadFile(int ctrlSock, int dataSock, char *filename);
 
+/**
+ * @brief Downloads a file from the server with explicit transfer options
+ *
+ * @param ctrlSock Control socket
+ * @param dataSock Data socket
+ * @param filename Name of file to save
+ * @param opts Transfer options, NULL for defaults
+ * @return int 0 on success, -1 on failure
+ */
+int downloadFileWith(int ctrlSock, int dataSock, char *filename, const struct TransferOptions *opts);
+
+/**
+ * @brief Receives data with read() and fwrite() through a small buffer
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor
+ * @param opts Transfer options (read size)
+ * @param metrics Metrics updated per chunk
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveStdio(int dataSock, int fd, const struct TransferOptions *opts,
+                       struct TransferMetrics *metrics);
+
+/**
+ * @brief Receives data with read() and write() through a large aligned buffer
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor
+ * @param opts Transfer options (read size)
+ * @param metrics Metrics updated per chunk
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveAligned(int dataSock, int fd, const struct TransferOptions *opts,
+                         struct TransferMetrics *metrics);
+
+/**
+ * @brief Receives data with splice() so it never enters user space
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor
+ * @param opts Transfer options (read size)
+ * @param metrics Metrics updated per chunk
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveSplice(int dataSock, int fd, const struct TransferOptions *opts,
+                        struct TransferMetrics *metrics);
+
+/**
+ * @brief Receives data with read() straight into a shared mapping of the file
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor, opened read-write
+ * @param opts Transfer options (expected size, offset, read size)
+ * @param metrics Metrics updated per chunk
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveMmap(int dataSock, int fd, const struct TransferOptions *opts,
+                      struct TransferMetrics *metrics);
+
+/**
+ * @brief Receives data through io_uring in batches of linked receives and writes
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor
+ * @param opts Transfer options (read size)
+ * @param metrics Metrics updated per chunk
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveUring(int dataSock, int fd, const struct TransferOptions *opts,
+                       struct TransferMetrics *metrics);
+
+/**
+ * @brief Inflates a MODE Z data connection into a sink with bounded memory
+ *
+ * @param dataSock Data socket carrying the zlib stream
+ * @param opts Transfer options (read size, rate limits), may be NULL
+ * @param sink Called with every inflated block; returns 0, or -1 to abort
+ * @param ctx Passed to sink
+ * @param metrics Metrics updated with wire and inflated bytes, may be NULL
+ * @return long long Inflated bytes, -1 on failure
+ */
+long long inflateStream(int dataSock, const struct TransferOptions *opts,
+                        int (*sink)(void *ctx, const char *data, size_t length), void *ctx,
+                        struct TransferMetrics *metrics);
+
+/**
+ * @brief Receives a MODE Z transfer, inflating it on the way to the file
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor
+ * @param opts Transfer options (read size, checksum)
+ * @param metrics Metrics updated per chunk with wire and inflated bytes
+ * @return long long Inflated bytes written, -1 on failure
+ */
+long long receiveInflate(int dataSock, int fd, const struct TransferOptions *opts,
+                         struct TransferMetrics *metrics);
+
+/**
+ * @brief Sends a byte range of a file with sendfile() so it never enters user space
+ *
+ * @param dataSock Data socket
+ * @param fd Source file descriptor
+ * @param offset First byte to send
+ * @param length Bytes to send
+ * @param opts Transfer options (rate limits), may be NULL
+ * @param metrics Metrics updated per chunk, may be NULL
+ * @return long long Bytes sent, -1 on failure
+ */
+long long sendFileRange(int dataSock, int fd, long long offset, long long length,
+                        const struct TransferOptions *opts, struct TransferMetrics *metrics);
+
+/**
+ * @brief Reserves disk blocks for the part of a file still to be received
+ *
+ * @param fd Destination file descriptor
+ * @param offset First byte to reserve
+ * @param size Final size of the file
+ * @return int 0 on success, -1 if the filesystem cannot preallocate
+ */
+int preallocateFile(int fd, long long offset, long long size);
+
+/**
+ * @brief Starts collecting metrics for a transfer
+ *
+ * @param m Metrics to initialize
+ * @param name Name reported for the transfer
+ * @param size Expected size in bytes, 0 if unknown
+ * @param opts Transfer options selecting format and destination, may be NULL
+ */
+void metricsStart(struct TransferMetrics *m, const char *name, long long size,
+                  const struct TransferOptions *opts);
+
+/**
+ * @brief Accounts for received bytes, reporting when the sample timer expires
+ *
+ * @param m Metrics
+ * @param bytes Bytes received since the last call
+ */
+void metricsAdd(struct TransferMetrics *m, long long bytes);
+
+/**
+ * @brief Accounts for compressed bytes read off the data connection
+ *
+ * @param m Metrics
+ * @param bytes Compressed bytes read since the last call
+ */
+void metricsAddWire(struct TransferMetrics *m, long long bytes);
+
+/**
+ * @brief Emits the final report of a transfer
+ *
+ * @param m Metrics
+ * @param ok Non-zero if the transfer succeeded
+ */
+void metricsFinish(struct TransferMetrics *m, int ok);
+
 /**
  * @brief Requests a file from the server
  * 
@@ -160,4 +981,618 @@ int downloadFile(int ctrlSock, int dataSock, char *filename);
  */
 int requestFile(int sock, char *path);
 
+/**
+ * @brief Asks the server to receive a file (STOR or APPE)
+ *
+ * @param sock Control socket
+ * @param path Remote path of the file
+ * @param append Append to the remote file (APPE) instead of replacing it
+ * @return int 0 if the server is ready for the data, -1 on failure
+ */
+int requestStore(int sock, const char *path, int append);
+
+/**
+ * @brief Requests a machine-readable directory listing (MLSD)
+ *
+ * @param sock Control socket
+ * @param path Directory to list, "" for the current directory
+ * @return int 0 if the server starts the listing, -1 on failure
+ */
+int requestListing(int sock, const char *path);
+
+/**
+ * @brief Switches the session to binary (image) transfer type
+ *
+ * @param sock Control socket
+ * @return int 0 on success, -1 on failure
+ */
+int setBinaryMode(int sock);
+
+/**
+ * @brief Sets the representation type of the following transfers
+ *
+ * @param sock Control socket
+ * @param type 'A' for ASCII, 'I' for image
+ * @return int 0 on success, -1 on failure
+ */
+int setTransferType(int sock, char type);
+
+/**
+ * @brief Learns the extensions the server offers with FEAT, once per connection
+ *
+ * @param sock Control socket
+ * @return unsigned Connection flags including the CONN_HASH_*, CONN_X* and CONN_MODE_Z bits
+ */
+unsigned serverFeatures(int sock);
+
+/**
+ * @brief Switches the session to compressed (deflate) transfer mode
+ *
+ * @param sock Control socket
+ * @return int 0 if MODE Z is active, 1 if the server does not offer it
+ */
+int setCompressedMode(int sock);
+
+/**
+ * @brief Queries the size of a remote file with SIZE
+ *
+ * @param sock Control socket
+ * @param path Path of the remote file
+ * @param size Pointer to store the file size in bytes
+ * @return int 0 on success, -1 if the server does not report a size
+ */
+int getFileSize(int sock, const char *path, long long *size);
+
+/**
+ * @brief Runs the resume check or SIZE query a download needs before RETR
+ *
+ * @param ctrlSock Control socket in binary mode
+ * @param url URL of the file
+ * @param opts Transfer options; offset and expectedSize are filled in
+ * @return int 1 if the local file is already complete, 0 otherwise
+ */
+int prepareDownload(int ctrlSock, struct URL *url, struct TransferOptions *opts);
+
+/**
+ * @brief Sets the restart offset for the next transfer with REST
+ *
+ * @param sock Control socket
+ * @param offset Byte offset the next RETR should start from
+ * @return int 0 if the server accepted the offset, -1 otherwise
+ */
+int restartAt(int sock, long long offset);
+
+/**
+ * @brief Reads the 226 reply that confirms a completed transfer
+ *
+ * @param sock Control socket
+ * @return int 0 if the server confirmed the transfer, -1 otherwise
+ */
+int finishTransfer(int sock);
+
+/**
+ * @brief Re-synchronizes a control connection with NOOP
+ *
+ * @param sock Control socket
+ * @return int 0 if the connection is usable, -1 otherwise
+ */
+int resyncControl(int sock);
+
+/**
+ * @brief Queries the modification time of a remote file with MDTM
+ *
+ * @param sock Control socket
+ * @param path Path of the remote file
+ * @param mdtm Buffer of MDTM_LENGTH bytes for the timestamp
+ * @return int 0 on success, -1 on failure
+ */
+int getModificationTime(int sock, const char *path, char *mdtm);
+
+/**
+ * @brief Decides where a download should restart
+ *
+ * @param ctrlSock Control socket
+ * @param url URL of the file
+ * @param offset Receives the restart offset (0 for a full download)
+ * @param size Receives the remote size, 0 if SIZE failed; may be NULL
+ * @return int 1 if the local file is already complete, 0 otherwise
+ */
+int checkResume(int ctrlSock, struct URL *url, long long *offset, long long *size);
+
+/**
+ * @brief Sends REST for a resumed download, resetting the offset if rejected
+ *
+ * @param ctrlSock Control socket
+ * @param offset Restart offset, set to 0 on rejection
+ */
+void requestRestart(int ctrlSock, long long *offset);
+
+/**
+ * @brief Removes the resume metadata of a completed download
+ *
+ * @param url URL of the downloaded file
+ */
+void clearResume(struct URL *url);
+
+/**
+ * @brief Downloads a file over several parallel control+data sessions
+ *
+ * Falls back to a single-stream download when the server does not
+ * support SIZE or REST, or when the file is too small to split.
+ *
+ * @param url Parsed URL of the file to download
+ * @param segments Number of parallel segments (1..MAX_SEGMENTS)
+ * @param opts Transfer options (progress reporting), may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int downloadSegmented(struct URL *url, int segments, const struct TransferOptions *opts);
+
+/**
+ * @brief Uploads a local file to the path of a URL (STOR, or APPE to resume)
+ *
+ * @param url Destination
+ * @param localPath File to send
+ * @param opts Transfer options (resume, checksum, rate limits), may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int uploadFile(struct URL *url, const char *localPath, const struct TransferOptions *opts);
+
+/**
+ * @brief Uploads a file over several parallel sessions with REST + STOR
+ *
+ * Falls back to a single stream when the server rejects REST before
+ * STOR, when the file is too small to split, or when the assembled
+ * remote file has the wrong size.
+ *
+ * @param url Destination
+ * @param localPath File to send
+ * @param segments Number of parallel segments (1..MAX_SEGMENTS)
+ * @param opts Transfer options, may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int uploadSegmented(struct URL *url, const char *localPath, int segments,
+                    const struct TransferOptions *opts);
+
+/**
+ * @brief Copies a file from one FTP server to another (FXP), the data
+ *        going directly between the servers
+ *
+ * @param source URL of the file on the source server
+ * @param destination Destination URL; a trailing '/' keeps the file name
+ * @param opts Transfer options (checksum type), may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int copyRemoteFile(struct URL *source, const char *destination, const struct TransferOptions *opts);
+
+/**
+ * @brief Copies every "<source-url> <destination-url>" pair of a manifest
+ *        server to server, reusing the control connections between pairs
+ *
+ * @param manifest Path of the manifest file, "-" for standard input
+ * @param opts Transfer options applied to every copy
+ * @return int 0 if every file was copied, -1 otherwise
+ */
+int copyBatch(const char *manifest, const struct TransferOptions *opts);
+
+/**
+ * @brief Downloads every URL listed in a manifest, reusing one
+ *        authenticated control connection per host and credentials
+ *
+ * @param manifest Path of the manifest file, "-" for standard input
+ * @param opts Transfer options applied to every file
+ * @return int 0 if every file was downloaded, -1 otherwise
+ */
+int downloadBatch(const char *manifest, const struct TransferOptions *opts);
+
+/**
+ * @brief Runs the warm-session daemon until SIGINT or SIGTERM
+ *
+ * @param socketPath Path of the UNIX socket to listen on
+ * @param opts Options applied to every download
+ * @return int 0 on a clean shutdown, -1 on failure
+ */
+int runDaemon(const char *socketPath, const struct TransferOptions *opts);
+
+/**
+ * @brief Submits URLs to a running daemon and prints its replies
+ *
+ * @param socketPath Path of the daemon's UNIX socket
+ * @param urls URLs to download
+ * @param count Number of URLs
+ * @return int 0 if every URL was downloaded, -1 otherwise
+ */
+int submitToDaemon(const char *socketPath, char *const *urls, int count);
+
+/**
+ * @brief Opens a cache directory, creating it if needed, and loads its index
+ *
+ * @param c Cache to initialize
+ * @param dir Cache directory
+ * @param capacity Largest total size of the blobs, in bytes
+ * @return int 0 on success, -1 on failure
+ */
+int cacheOpen(struct ContentCache *c, const char *dir, long long capacity);
+
+/**
+ * @brief Revalidates the cache entry of a file with SIZE and MDTM and serves it on a hit
+ *
+ * @param c Cache
+ * @param ctrlSock Control socket
+ * @param url URL of the file
+ * @param opts Transfer options; expectedSize and mdtm are filled in
+ * @return int 1 if the file was served from the cache, 0 otherwise
+ */
+int cacheLookup(struct ContentCache *c, int ctrlSock, struct URL *url, struct TransferOptions *opts);
+
+/**
+ * @brief Stores a completed download in the cache
+ *
+ * @param c Cache
+ * @param url URL of the file
+ * @param opts Transfer options of the download
+ * @return int 0 if the file was stored or is not cacheable, -1 on failure
+ */
+int cacheStore(struct ContentCache *c, struct URL *url, const struct TransferOptions *opts);
+
+/**
+ * @brief Prints the cache statistics and releases the cache
+ *
+ * @param c Cache opened by cacheOpen()
+ */
+void cacheClose(struct ContentCache *c);
+
+/**
+ * @brief Receives a requested file and reads its end-of-transfer reply, hedging a slow transfer
+ *
+ * @param ctrlSock Control socket, RETR already accepted
+ * @param dataSock Data socket
+ * @param url URL of the file
+ * @param opts Transfer options; minRate enables hedging
+ * @return int 0 if the file was received, -1 on failure
+ */
+int retrieveFile(int ctrlSock, int dataSock, struct URL *url, const struct TransferOptions *opts);
+
+/**
+ * @brief Records the bytes received so far by the transfer a hedge watches
+ *
+ * @param h Hedge
+ * @param bytes Bytes received since the transfer started
+ */
+void hedgeProgress(struct Hedge *h, long long bytes);
+
+/**
+ * @brief Prints how many transfers were watched and how many hedges fired and won
+ */
+void hedgeReport(void);
+
+/**
+ * @brief Starts the unpack stage for a file if its name is an archive
+ *
+ * @param name File name, which selects the format (.tar.gz, .tgz, .tar.xz, .txz, .tar, .gz, .xz)
+ * @param dir Directory to extract into, created if needed
+ * @param keep Non-zero if the archive itself is kept on disk
+ * @return struct Unpacker* Stage, NULL if the name is not an archive or the stage cannot start
+ */
+struct Unpacker *unpackStart(const char *name, const char *dir, int keep);
+
+/**
+ * @brief Hands received bytes to the unpack stage, waiting while its ring is full
+ *
+ * @param u Unpacker
+ * @param data Bytes received
+ * @param length Number of bytes
+ * @return int 0 on success, -1 if the stage failed and the archive is not kept
+ */
+int unpackFeed(struct Unpacker *u, const void *data, size_t length);
+
+/**
+ * @brief Ends the unpack stage and reports what it extracted
+ *
+ * @param u Unpacker from unpackStart()
+ * @param ok Non-zero if the whole file was received
+ * @return int 0 if the archive was fully extracted, -1 otherwise
+ */
+int unpackFinish(struct Unpacker *u, int ok);
+
+/**
+ * @brief Runs one PASV/RETR cycle on an open control connection
+ *
+ * @param ctrlSock Authenticated control socket
+ * @param url URL of the file to fetch
+ * @param opts Transfer options, may be NULL
+ * @param dataAddr Data address, already set when *passive is non-zero
+ * @param dataPort Data port, already set when *passive is non-zero
+ * @param passive Non-zero if PASV was already answered; cleared on use
+ * @return int 0 on success, -1 on failure
+ */
+int fetchBatchFile(int ctrlSock, struct URL *url, const struct TransferOptions *opts,
+                   char *dataAddr, int *dataPort, int *passive);
+
+/**
+ * @brief Initializes a scheduler
+ *
+ * @param s Scheduler
+ * @param opts Transfer options: slots, hostConnections and rate limits
+ * @return int 0 on success, -1 on failure
+ */
+int schedulerInit(struct Scheduler *s, const struct TransferOptions *opts);
+
+/**
+ * @brief Queues a file
+ *
+ * @param s Scheduler
+ * @param url File to fetch; the record is copied, its strings must outlive the run
+ * @param priority Higher priorities run first
+ * @return int 0 on success, -1 if out of memory
+ */
+int schedulerAdd(struct Scheduler *s, const struct UrlRecord *url, int priority);
+
+/**
+ * @brief Runs every queued file to completion
+ *
+ * @param s Scheduler
+ * @return int 0 if every file was downloaded, -1 otherwise
+ */
+int schedulerRun(struct Scheduler *s);
+
+/**
+ * @brief Releases a scheduler
+ *
+ * @param s Scheduler
+ */
+void schedulerFree(struct Scheduler *s);
+
+/**
+ * @brief Initializes a token bucket
+ *
+ * @param b Bucket
+ * @param rate Bytes per second, 0 for unlimited
+ */
+void bucketInit(struct TokenBucket *b, long long rate);
+
+/**
+ * @brief Releases a token bucket
+ *
+ * @param b Bucket
+ */
+void bucketDestroy(struct TokenBucket *b);
+
+/**
+ * @brief Charges received bytes to the transfer's rate limits, sleeping
+ *        until they allow the next read
+ *
+ * @param opts Transfer options holding the limits, may be NULL
+ * @param bytes Bytes just received
+ */
+void throttleTransfer(const struct TransferOptions *opts, size_t bytes);
+
+/**
+ * @brief Parses the root URL of a mirror, whose path may be empty or end with '/'
+ *
+ * @param input URL given on the command line
+ * @param url Receives the parsed URL; resource is the root path
+ * @return int 0 on success, -1 on parsing failure
+ */
+int parseMirrorUrl(const char *input, struct URL *url);
+
+/**
+ * @brief Mirrors a remote directory tree into downloads/ with a pool of
+ *        work-stealing worker sessions
+ *
+ * @param url Root URL from parseMirrorUrl()
+ * @param mirror Worker count and include/exclude globs
+ * @param opts Transfer options applied to every file
+ * @return int 0 if every entry was mirrored, -1 otherwise
+ */
+int downloadMirror(struct URL *url, const struct MirrorOptions *mirror, const struct TransferOptions *opts);
+
+/**
+ * @brief Parses a checksum name given on the command line
+ *
+ * @param name "crc32", "crc32c" or "sha256"
+ * @return enum ChecksumType Type, CHECKSUM_NONE if unknown
+ */
+enum ChecksumType checksumType(const char *name);
+
+/**
+ * @brief Starts a new digest
+ *
+ * @param sum Digest state
+ * @param type Algorithm
+ */
+void checksumInit(struct Checksum *sum, enum ChecksumType type);
+
+/**
+ * @brief Adds received bytes to a digest
+ *
+ * @param sum Digest state
+ * @param data Received bytes
+ * @param length Number of bytes
+ */
+void checksumUpdate(struct Checksum *sum, const void *data, size_t length);
+
+/**
+ * @brief Adds the first bytes of an existing file to a digest
+ *
+ * @param sum Digest state
+ * @param fd File descriptor
+ * @param length Bytes to read from the start of the file
+ * @return int 0 on success, -1 on a read error
+ */
+int checksumFile(struct Checksum *sum, int fd, long long length);
+
+/**
+ * @brief Finishes a digest and formats it in hexadecimal
+ *
+ * @param sum Digest state
+ * @param hex Buffer of CHECKSUM_HEX_LENGTH bytes
+ */
+void checksumFinal(struct Checksum *sum, char *hex);
+
+/**
+ * @brief Starts the integrity stage of a download when one is requested
+ *
+ * @param opts Transfer options; checksum is pointed at sum or cleared
+ * @param sum Digest state owned by the caller for the whole transfer
+ */
+void checksumAttach(struct TransferOptions *opts, struct Checksum *sum);
+
+/**
+ * @brief Compares the digest of a finished download with the server's
+ *
+ * @param sock Control socket
+ * @param url URL of the downloaded file
+ * @param sum Digest of the received bytes, NULL if no checksum was requested
+ * @return int 0 if the digests match or the server cannot tell, -1 on a mismatch or error
+ */
+int verifyChecksum(int sock, struct URL *url, struct Checksum *sum);
+
+/**
+ * @brief Compares a local digest with the server's digest of a remote file
+ *
+ * @param sock Control socket
+ * @param path Remote path of the file
+ * @param sum Digest of the local bytes
+ * @return int 0 if the digests match or the server cannot tell, 1 on a mismatch, -1 on error
+ */
+int compareChecksum(int sock, const char *path, struct Checksum *sum);
+
+/**
+ * @brief Compares the source's and the destination's digests of a copied file
+ *
+ * @param sourceSock Control socket of the source server
+ * @param sourcePath Path of the file on the source
+ * @param destSock Control socket of the destination server
+ * @param destPath Path of the copy on the destination
+ * @param type Algorithm
+ * @return int 0 if the digests match or a server cannot tell, 1 on a mismatch, -1 on error
+ */
+int compareServerChecksums(int sourceSock, const char *sourcePath, int destSock, const char *destPath,
+                           enum ChecksumType type);
+
+/**
+ * @brief Initializes an event engine
+ *
+ * @param engine Engine to initialize
+ * @param maxActive Maximum number of concurrent sessions
+ * @return int 0 on success, -1 on failure
+ */
+int engineInit(struct SessionEngine *engine, int maxActive);
+
+/**
+ * @brief Queues a session fetching several files from one host
+ *
+ * @param engine Engine
+ * @param records Files to fetch (same host and credentials)
+ * @param count Number of files
+ * @return int 0 on success, -1 on failure
+ */
+int engineAdd(struct SessionEngine *engine, const struct UrlRecord **records, int count);
+
+/**
+ * @brief Runs all queued sessions to completion
+ *
+ * @param engine Engine
+ * @return int 0 if every file was downloaded, -1 otherwise
+ */
+int engineRun(struct SessionEngine *engine);
+
+/**
+ * @brief Releases an event engine
+ *
+ * @param engine Engine
+ */
+void engineFree(struct SessionEngine *engine);
+
+/**
+ * @brief Downloads one file through the event engine (blocking wrapper)
+ *
+ * @param url URL of the file
+ * @return int 0 on success, -1 on failure
+ */
+int engineFetch(struct URL *url);
+
+/**
+ * @brief Returns the monotonic clock in nanoseconds
+ *
+ * @return long long Nanoseconds
+ */
+long long traceNow(void);
+
+/**
+ * @brief Returns the monotonic clock in seconds
+ *
+ * @return double Seconds
+ */
+double traceSeconds(void);
+
+/**
+ * @brief Clears a trace and starts timing from now
+ *
+ * @param t Trace
+ */
+void traceBegin(struct SessionTrace *t);
+
+/**
+ * @brief Restarts the clock of a trace, keeping recorded phases
+ *
+ * @param t Trace
+ */
+void traceResume(struct SessionTrace *t);
+
+/**
+ * @brief Charges a phase with the time elapsed since the previous mark
+ *
+ * @param t Trace
+ * @param phase Phase that just ended
+ */
+void traceMark(struct SessionTrace *t, enum TracePhase phase);
+
+/**
+ * @brief Attaches a trace to the calling thread for traceStep()
+ *
+ * @param t Trace, NULL to detach
+ * @return struct SessionTrace* Previously attached trace
+ */
+struct SessionTrace *traceAttach(struct SessionTrace *t);
+
+/**
+ * @brief Marks a phase on the trace attached to the calling thread, if any
+ *
+ * @param phase Phase that just ended
+ */
+void traceStep(enum TracePhase phase);
+
+/**
+ * @brief Prints the per-phase breakdown of a trace
+ *
+ * @param t Trace
+ * @param label Name of the traced session or file
+ */
+void tracePrint(const struct SessionTrace *t, const char *label);
+
+/**
+ * @brief Adds a completed trace to the histograms of its host
+ *
+ * @param report Report
+ * @param host Host name
+ * @param t Completed trace
+ * @return int 0 on success, -1 if out of memory
+ */
+int latencyRecord(struct LatencyReport *report, const char *host, const struct SessionTrace *t);
+
+/**
+ * @brief Prints p50/p99/p999 of every phase, per host
+ *
+ * @param report Report
+ */
+void latencyPrint(const struct LatencyReport *report);
+
+/**
+ * @brief Releases a latency report
+ *
+ * @param report Report
+ */
+void latencyFree(struct LatencyReport *report);
+
 #endif /* FTP_CLIENT_H */ 
\ No newline at end of file
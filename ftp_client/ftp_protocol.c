@@ -13,67 +13,41 @@
  */
 
 #include "ftp_client.h"
+#include <fcntl.h>
 
 /**
  * @brief Reads and processes a server response
  *
- * This function reads the server's response line by line and processes
- * the FTP response code. FTP responses consist of a 3-digit code
- * followed by a message. Multi-line responses are supported, where
- * intermediate lines are indicated by a hyphen after the code (e.g., "230-").
+ * Reads one complete server reply through the connection's buffered
+ * reply reader and copies its text into the caller's buffer. FTP
+ * responses consist of a 3-digit code followed by a message; multi-line
+ * responses ("230-" ... "230 ") are returned as a single reply.
  *
  * Example responses:
  * - "230 User logged in"
  * - "230- Welcome message\r\n230 Login successful"
  *
  * @param sock Socket to read from
- * @param buffer Buffer to store the response
- * @return int Response code (200-599) on success, 0 for continuation, -1 on error
+ * @param buffer Buffer of BUFFER_SIZE bytes to store the response
+ * @return int Response code (100-599) on success, -1 on error
  */
 int getServerResponse(int sock, char *buffer)
 {
-    char byte;
-    char code[4];
-    int index = 0;
-    ssize_t bytes_read;
-    char temp_buffer[BUFFER_SIZE];
+    struct FTPReply reply;
 
-    memset(buffer, 0, BUFFER_SIZE);
-    memset(temp_buffer, 0, BUFFER_SIZE);
-
-    // Read response line character by character
-    while ((bytes_read = read(sock, &byte, 1)) > 0)
+    int responseCode = readReply(sock, &reply);
+    if (responseCode < 0)
     {
-        buffer[index++] = byte;
-        // Check for end of line (\r\n)
-        if (index >= 2 && buffer[index - 1] == '\n' && buffer[index - 2] == '\r')
-        {
-            break;
-        }
-        if (index >= BUFFER_SIZE - 1)
-            return -1;
-    }
-
-    if (bytes_read <= 0 || index < 3)
-    {
-        printf("Error reading from server\n");
+        buffer[0] = '\0';
         return -1;
     }
 
-    printf("Server Response: %s", buffer);
+    // Long multi-line replies are truncated to the caller's buffer
+    size_t length = reply.length < BUFFER_SIZE - 1 ? reply.length : BUFFER_SIZE - 1;
+    memcpy(buffer, reply.text, length);
+    buffer[length] = '\0';
 
-    // Check if line starts with a response code (digit)
-    if (buffer[0] >= '0' && buffer[0] <= '9')
-    {
-        memcpy(code, buffer, 3);
-        code[3] = '\0';
-        return atoi(code);
-    }
-    else
-    {
-        // Return 0 for continuation lines in multi-line responses
-        return 0;
-    }
+    return responseCode;
 }
 
 /**
@@ -81,10 +55,11 @@ int getServerResponse(int sock, char *buffer)
  *
  * Performs the FTP authentication sequence:
  * 1. Waits for server welcome message (220)
- * 2. Sends USER command and waits for response (331)
- * 3. Sends PASS command and waits for response (230)
+ * 2. Sends USER command and waits for response (331, or 230 if no
+ *    password is required)
+ * 3. Sends PASS command and waits for response (230 or 202)
  *
- * The function handles multi-line responses at each step.
+ * Multi-line responses are handled by the reply reader.
  * Authentication fails if any step returns an unexpected response code.
  *
  * @param sock Control socket
@@ -94,76 +69,198 @@ int getServerResponse(int sock, char *buffer)
  */
 int authenticate(int sock, const char *user, const char *pass)
 {
-    printf("\n=== SERVER WELCOME ===\n");
+    logMessage("\n=== SERVER WELCOME ===\n");
     char cmd[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
+    struct FTPReply reply;
     int responseCode;
 
     // Wait for server welcome message
-    do {
-        responseCode = getServerResponse(sock, response);
-        if (responseCode < 0) return -1;
-    } while (responseCode == 0 || response[3] == '-');
+    if (readReply(sock, &reply) != SV_READY4AUTH)
+        return -1;
+    traceStep(TRACE_BANNER);
 
-    printf("\n=== AUTHENTICATION ===\n");
+    logMessage("\n=== AUTHENTICATION ===\n");
     // Send username
-    printf("Sending USER command...\n");
-    sprintf(cmd, "USER %s\r\n", user);
+    logMessage("Sending USER command...\n");
+    snprintf(cmd, sizeof(cmd), "USER %s\r\n", user);
     write(sock, cmd, strlen(cmd));
-    
-    do {
-        responseCode = getServerResponse(sock, response);
-        if (responseCode < 0) return -1;
-    } while (responseCode == 0 || response[3] == '-');
 
-    // Send password
-    printf("Sending PASS command...\n");
-    sprintf(cmd, "PASS %s\r\n", pass);
-    write(sock, cmd, strlen(cmd));
-    
-    do {
-        responseCode = getServerResponse(sock, response);
-        if (responseCode < 0) return -1;
-    } while (responseCode == 0 || response[3] == '-');
+    responseCode = readReply(sock, &reply);
+    if (responseCode == SV_READY4PASS)
+    {
+        // Send password
+        logMessage("Sending PASS command...\n");
+        snprintf(cmd, sizeof(cmd), "PASS %s\r\n", pass);
+        write(sock, cmd, strlen(cmd));
 
-    printf("Authentication successful!\n");
+        responseCode = readReply(sock, &reply);
+    }
+
+    if (responseCode != SV_LOGINSUCCESS && responseCode != 202)
+    {
+        logMessage("Login rejected by server\n");
+        return -1;
+    }
+
+    traceStep(TRACE_AUTH);
+    logMessage("Authentication successful!\n");
     return 0;
 }
 
 /**
- * @brief Enters passive mode for data transfer
+ * @brief Extracts the data connection port from a 229 reply
  *
- * Sends the PASV command and parses the server's response to get
- * the data connection address and port. The response format is:
- * "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)"
- * where h1-h4 form the IP address and p1,p2 form the port number.
+ * The reply format is "229 Entering Extended Passive Mode (|||port|)"
+ * (RFC 2428). The delimiter may be any printable character; the three
+ * empty fields mean the data connection goes to the control peer.
  *
- * Port calculation: port = p1*256 + p2
+ * @param text Text of the 229 reply
+ * @param port Pointer to store the data connection port
+ * @return int 0 on success, -1 if the reply cannot be parsed
+ */
+int parseExtendedPassiveReply(const char *text, int *port)
+{
+    const char *paren = strchr(text, '(');
+    char d[4];
+    int value;
+
+    if (!paren || sscanf(paren + 1, "%c%c%c%d%c", &d[0], &d[1], &d[2], &value, &d[3]) != 5 ||
+        d[1] != d[0] || d[2] != d[0] || d[3] != d[0] || value <= 0 || value > 65535)
+    {
+        logMessage("Error parsing extended passive mode response: %s\n", text);
+        return -1;
+    }
+
+    *port = value;
+    return 0;
+}
+
+/**
+ * @brief Resolves the data connection target of a 229 reply
+ *
+ * @param sock Control socket, whose peer receives the data connection
+ * @param text Text of the 229 reply
+ * @param addr Buffer to store the data connection address
+ * @param port Pointer to store the data connection port
+ * @return int 0 on success, -1 on failure
+ */
+static int extendedPassiveTarget(int sock, const char *text, char *addr, int *port)
+{
+    if (parseExtendedPassiveReply(text, port) != 0 ||
+        socketPeerAddress(sock, addr, INET6_ADDRSTRLEN) != 0)
+        return -1;
+
+    logMessage("Extended passive mode: connecting to %s:%d\n", addr, *port);
+    return 0;
+}
+
+/**
+ * @brief Logs in and enters passive mode with pipelined commands
+ *
+ * After the 220 banner, USER, PASS, TYPE I and PASV are written in a
+ * single send() and their replies are matched in order, so the whole
+ * session setup costs one round-trip instead of four. Every queued reply
+ * is read even after a failure so the control connection stays in sync;
+ * the first unexpected reply decides the error. If the server accepts
+ * USER without a password (230), the reply to PASS may be 503 and is
+ * ignored. Over IPv6, where PASV cannot describe the data address, EPSV
+ * is pipelined instead.
  *
  * @param sock Control socket
+ * @param user Username for authentication
+ * @param pass Password for authentication
  * @param addr Buffer to store the data connection IP address
  * @param port Pointer to store the data connection port
+ * @param saved Incremented by the number of round-trips saved
  * @return int 0 on success, -1 on failure
  */
-int enterPassiveMode(int sock, char *addr, int *port)
+int authenticatePipelined(int sock, const char *user, const char *pass,
+                          char *addr, int *port, int *saved)
 {
-    printf("\n=== PASSIVE MODE ===\n");
-    char cmd[] = "PASV\r\n";
-    char response[BUFFER_SIZE];
-    int ip[4], p[2];
+    logMessage("\n=== SERVER WELCOME ===\n");
+    char cmd[BUFFER_SIZE * 2];
+    struct FTPReply reply;
+    int failed = 0;
+    int extended = socketPeerFamily(sock) == AF_INET6;
+    const char *passive = extended ? "EPSV" : "PASV";
 
-    write(sock, cmd, strlen(cmd));
-    int responseCode = getServerResponse(sock, response);
-    if (responseCode != SV_PASSIVE)
+    // Commands must not be sent before the server greets us
+    if (readReply(sock, &reply) != SV_READY4AUTH)
+        return -1;
+    traceStep(TRACE_BANNER);
+
+    logMessage("\n=== PIPELINED LOGIN ===\n");
+    logMessage("Sending USER, PASS, TYPE I and %s in one batch...\n", passive);
+    int length = snprintf(cmd, sizeof(cmd), "USER %s\r\nPASS %s\r\nTYPE I\r\n%s\r\n",
+                          user, pass, passive);
+    if (length >= (int)sizeof(cmd) || write(sock, cmd, length) != length)
+        return -1;
+
+    // USER: 331 asks for the password, 230 means no password is needed
+    int userCode = readReply(sock, &reply);
+    if (userCode != SV_READY4PASS && userCode != SV_LOGINSUCCESS)
+        failed = 1;
+    if (userCode < 0)
+        return -1;
+
+    // PASS: 230/202, or 503 when USER already logged us in
+    int passCode = readReply(sock, &reply);
+    if (passCode < 0)
+        return -1;
+    if (!failed && passCode != SV_LOGINSUCCESS && passCode != 202 &&
+        !(userCode == SV_LOGINSUCCESS && passCode == 503))
     {
-        printf("Error entering passive mode. Server response: %s\n", response);
+        logMessage("Login rejected by server\n");
+        failed = 1;
+    }
+
+    // TYPE I
+    int typeCode = readReply(sock, &reply);
+    if (typeCode < 0)
+        return -1;
+    if (!failed && typeCode != SV_COMMAND_OK)
+        failed = 1;
+
+    // PASV/EPSV: always drained, only parsed when everything before succeeded
+    int pasvCode = readReply(sock, &reply);
+    if (pasvCode < 0)
+        return -1;
+    if (!failed)
+        failed = extended ? pasvCode != SV_EXT_PASSIVE || extendedPassiveTarget(sock, reply.text, addr, port) != 0
+                          : pasvCode != SV_PASSIVE || parsePassiveReply(reply.text, addr, port) != 0;
+    if (failed)
+    {
+        logMessage("Pipelined session setup failed\n");
         return -1;
     }
 
-    // Parse the passive mode response
-    if (sscanf(response, PASV_PORT_PATTERN, &ip[0], &ip[1], &ip[2], &ip[3], &p[0], &p[1]) != 6)
+    // Four commands answered in one round-trip; PASV is part of the login
+    traceStep(TRACE_AUTH);
+    *saved += 3;
+    logMessage("Authentication successful! Pipelining saved 3 round-trips\n");
+    return 0;
+}
+
+/**
+ * @brief Extracts the data connection address from a 227 reply
+ *
+ * The reply format is "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)"
+ * where h1-h4 form the IP address and p1,p2 form the port number.
+ *
+ * Port calculation: port = p1*256 + p2
+ *
+ * @param text Text of the 227 reply
+ * @param addr Buffer to store the data connection IP address
+ * @param port Pointer to store the data connection port
+ * @return int 0 on success, -1 if the reply cannot be parsed
+ */
+int parsePassiveReply(const char *text, char *addr, int *port)
+{
+    int ip[4], p[2];
+
+    if (sscanf(text, PASV_PORT_PATTERN, &ip[0], &ip[1], &ip[2], &ip[3], &p[0], &p[1]) != 6)
     {
-        printf("Error parsing passive mode response: %s\n", response);
+        logMessage("Error parsing passive mode response: %s\n", text);
         return -1;
     }
 
@@ -171,68 +268,215 @@ int enterPassiveMode(int sock, char *addr, int *port)
     sprintf(addr, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
     *port = p[0] * 256 + p[1];
 
-    printf("Passive mode: connecting to %s:%d\n", addr, *port);
+    logMessage("Passive mode: connecting to %s:%d\n", addr, *port);
     return 0;
 }
 
+/**
+ * @brief Enters passive mode for data transfer
+ *
+ * Sends EPSV (RFC 2428), which works over IPv4 and IPv6, and falls back
+ * to PASV when the server rejects it with a 5xx reply. The rejection is
+ * remembered for the connection so later transfers go straight to PASV.
+ *
+ * @param sock Control socket
+ * @param addr Buffer to store the data connection IP address
+ * @param port Pointer to store the data connection port
+ * @return int 0 on success, -1 on failure
+ */
+int enterPassiveMode(int sock, char *addr, int *port)
+{
+    logMessage("\n=== PASSIVE MODE ===\n");
+    char cmd[] = "PASV\r\n";
+    char extCmd[] = "EPSV\r\n";
+    struct FTPReply reply;
+    int responseCode;
+
+    // Everything since login (TYPE, SIZE, MDTM...) is session setup
+    traceStep(TRACE_SETUP);
+    if (!(connectionFlags(sock) & CONN_NO_EPSV))
+    {
+        write(sock, extCmd, strlen(extCmd));
+        responseCode = readReply(sock, &reply);
+        if (responseCode == SV_EXT_PASSIVE)
+        {
+            traceStep(TRACE_PASV);
+            return extendedPassiveTarget(sock, reply.text, addr, port);
+        }
+        if (responseCode < 500 || responseCode > 599)
+        {
+            logMessage("Error entering extended passive mode. Server response: %s\n",
+                       responseCode < 0 ? "" : reply.text);
+            return -1;
+        }
+        logMessage("EPSV not supported, falling back to PASV\n");
+        setConnectionFlag(sock, CONN_NO_EPSV);
+    }
+
+    write(sock, cmd, strlen(cmd));
+    responseCode = readReply(sock, &reply);
+    if (responseCode != SV_PASSIVE)
+    {
+        logMessage("Error entering passive mode. Server response: %s\n", responseCode < 0 ? "" : reply.text);
+        return -1;
+    }
+
+    traceStep(TRACE_PASV);
+    return parsePassiveReply(reply.text, addr, port);
+}
+
 /**
  * @brief Downloads a file from the FTP server
  *
+ * Equivalent to downloadFileWith() using the default stdio engine.
+ *
+ * @param ctrlSock Control socket (for status messages)
+ * @param dataSock Data socket (for file transfer)
+ * @param filename Name to save the file as
+ * @return int 0 on successful download, -1 on failure
+ */
+int downloadFile(int ctrlSock, int dataSock, char *filename)
+{
+    return downloadFileWith(ctrlSock, dataSock, filename, NULL);
+}
+
+/**
+ * @brief Downloads a file from the FTP server with explicit options
+ *
  * Handles the data transfer process after the connection is established:
- * 1. Creates a local file in the downloads directory
- * 2. Reads data from the data socket in chunks
- * 3. Writes the data to the local file
- * 4. Displays progress and transfer speed
+ * 1. Creates a local file in the downloads directory (or reopens it at
+ *    opts->offset when resuming)
+ * 2. Moves data from the data socket to the file with the selected engine,
+ *    or through the inflate stage when MODE Z is active
+ * 3. Displays progress and transfer speed
  *
- * The function automatically creates a 'downloads' directory
- * and saves the file there with the original filename.
+ * The file is saved in the 'downloads' directory with the original
+ * filename. With opts->unpackDir set, an archive is also handed to the
+ * unpack stage as it arrives; unless opts->keepArchive is set the
+ * engine then writes to /dev/null and only the extracted files remain.
  *
  * @param ctrlSock Control socket (for status messages)
  * @param dataSock Data socket (for file transfer)
  * @param filename Name to save the file as
+ * @param opts Transfer options, NULL for defaults
  * @return int 0 on successful download, -1 on failure
  */
-int downloadFile(int ctrlSock, int dataSock, char *filename)
+int downloadFileWith(int ctrlSock, int dataSock, char *filename, const struct TransferOptions *opts)
 {
-    printf("\n=== FILE DOWNLOAD ===\n");
-    FILE *file;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes;
+    logMessage("\n=== FILE DOWNLOAD ===\n");
+    struct TransferOptions defaults = {0}, unpacking;
+    struct TransferMetrics metrics;
     char filepath[MAX_LENGTH];
-    size_t total_bytes = 0;
-    time_t start_time = time(NULL);
-    
+    long long total_bytes;
+    int fd;
+
+    if (!opts)
+        opts = &defaults;
+
     // Prepare file path in downloads directory
     snprintf(filepath, sizeof(filepath), "downloads/%s", filename);
-    
-    if (!(file = fopen(filepath, "wb")))
+
+    if (opts->unpackDir && opts->offset > 0)
+        logMessage("Not unpacking %s: a resumed archive cannot be extracted from the middle\n",
+                   filename);
+    else if (opts->unpackDir)
+    {
+        unpacking = *opts;
+        if ((unpacking.unpack = unpackStart(filename, opts->unpackDir, opts->keepArchive)))
+        {
+            if (!opts->keepArchive)
+            {
+                // Nothing to map or reserve: the bytes only pass through
+                snprintf(filepath, sizeof(filepath), "/dev/null");
+                if (unpacking.engine == ENGINE_MMAP)
+                    unpacking.engine = ENGINE_STDIO;
+                unpacking.preallocate = 0;
+            }
+            opts = &unpacking;
+        }
+    }
+
+    // A resumed download keeps the first offset bytes and appends after them
+    int flags = opts->offset > 0 ? O_CREAT : O_CREAT | O_TRUNC;
+    // Shared mappings and hashing the kept prefix need read access
+    flags |= opts->engine == ENGINE_MMAP || (opts->checksum && opts->offset > 0) ? O_RDWR : O_WRONLY;
+    if ((fd = open(filepath, flags, 0644)) < 0 ||
+        (opts->offset > 0 && (ftruncate(fd, opts->offset) != 0 ||
+                              lseek(fd, opts->offset, SEEK_SET) < 0)))
     {
-        printf("Cannot create file in Downloads folder: %s (Error: %s)\n", 
-               filepath, strerror(errno));
+        logMessage("Cannot create file in Downloads folder: %s (Error: %s)\n", 
+                   filepath, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        if (opts->unpack)
+            unpackFinish(opts->unpack, 0);
         return -1;
     }
 
-    printf("Downloading to: %s\n", filepath);
-    
-    // Read data in chunks and write to file
-    while ((bytes = read(dataSock, buffer, BUFFER_SIZE)) > 0)
+    if (opts->offset > 0)
     {
-        fwrite(buffer, bytes, 1, file);
-        total_bytes += bytes;
-        
-        // Calculate and display transfer speed
-        time_t current_time = time(NULL);
-        double elapsed = difftime(current_time, start_time);
-        if (elapsed > 0) {
-            double speed = total_bytes / (1024.0 * 1024.0) / elapsed;
-            printf("\rDownloaded: %.2f MB (%.2f MB/s)", 
-                   total_bytes / (1024.0 * 1024.0), speed);
-            fflush(stdout);
+        logMessage("Resuming %s at byte %lld\n", filepath, opts->offset);
+        // The digest covers the whole file, including the part already on disk
+        if (opts->checksum && checksumFile(opts->checksum, fd, opts->offset) != 0)
+        {
+            logMessage("Cannot read %s to checksum it\n", filepath);
+            close(fd);
+            return -1;
         }
     }
-    printf("\nDownload completed. Total: %.2f MB\n", total_bytes / (1024.0 * 1024.0));
+    else if (!opts->unpack || opts->keepArchive)
+        logMessage("Downloading to: %s\n", filepath);
+
+    // Metrics count the bytes of this transfer, not the part kept by a resume
+    metricsStart(&metrics, filename,
+                 opts->expectedSize > opts->offset ? opts->expectedSize - opts->offset : 0, opts);
 
-    fclose(file);
+    // Reserve the blocks up front when SIZE told us how many are needed
+    if (opts->preallocate && opts->expectedSize > 0)
+        preallocateFile(fd, opts->offset, opts->expectedSize);
+
+    // MODE Z data must be inflated in user space, whatever the engine
+    if (connectionFlags(ctrlSock) & CONN_COMPRESSED)
+        total_bytes = receiveInflate(dataSock, fd, opts, &metrics);
+    else switch (opts->engine)
+    {
+    case ENGINE_SPLICE:
+        total_bytes = receiveSplice(dataSock, fd, opts, &metrics);
+        break;
+    case ENGINE_MMAP:
+        total_bytes = receiveMmap(dataSock, fd, opts, &metrics);
+        break;
+    case ENGINE_URING:
+        total_bytes = receiveUring(dataSock, fd, opts, &metrics);
+        break;
+    default:
+        total_bytes = receiveStdio(dataSock, fd, opts, &metrics);
+        break;
+    }
+
+    close(fd);
+    traceStep(TRACE_DRAIN);
+    // The stage has to see the end of the file before its result counts
+    if (opts->unpack && unpackFinish(opts->unpack, total_bytes >= 0) != 0 && total_bytes >= 0)
+    {
+        metricsFinish(&metrics, 0);
+        return -1;
+    }
+    if (total_bytes < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            logMessage("\nTransfer failed: no data for %.1f s\n", socketIdleDeadline());
+        else
+            logMessage("\nTransfer failed: %s\n", strerror(errno));
+        metricsFinish(&metrics, 0);
+        return -1;
+    }
+    metricsFinish(&metrics, 1);
+
+    logMessage("\nDownload completed. Total: %.2f MB\n", total_bytes / (1024.0 * 1024.0));
+    if (metrics.wireBytes > 0)
+        logMessage("On the wire: %.2f MB (%.1f:1 compression)\n",
+                   metrics.wireBytes / (1024.0 * 1024.0), (double)metrics.bytes / metrics.wireBytes);
     return 0;
 }
 
@@ -253,16 +497,355 @@ int requestFile(int sock, char *path)
     char cmd[BUFFER_SIZE];
     char response[BUFFER_SIZE];
 
-    printf("Requesting file: %s\n", path);
+    logMessage("Requesting file: %s\n", path);
     sprintf(cmd, "RETR %s\r\n", path);
     write(sock, cmd, strlen(cmd));
 
     int responseCode = getServerResponse(sock, response);
     if (responseCode != SV_READY4TRANSFER && responseCode != 125)
     {
-        printf("Error requesting file. Server response: %s\n", response);
+        logMessage("Error requesting file. Server response: %s\n", response);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Asks the server to receive a file
+ *
+ * Sends "STOR <path>", which creates or overwrites the file (from the
+ * REST offset, if one is pending), or "APPE <path>", which appends to
+ * it. Accepts 150 and 125 like requestFile().
+ *
+ * @param sock Control socket
+ * @param path Remote path of the file
+ * @param append Non-zero for APPE
+ * @return int 0 if the server is ready to receive, -1 on failure
+ */
+int requestStore(int sock, const char *path, int append)
+{
+    char cmd[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+
+    logMessage("%s file: %s\n", append ? "Appending to" : "Storing", path);
+    int length = snprintf(cmd, sizeof(cmd), "%s %s\r\n", append ? "APPE" : "STOR", path);
+    if (length >= (int)sizeof(cmd))
+        return -1;
+    write(sock, cmd, length);
+
+    int responseCode = getServerResponse(sock, response);
+    if (responseCode != SV_READY4TRANSFER && responseCode != 125)
+    {
+        logMessage("Error storing file. Server response: %s\n", response);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Requests a machine-readable directory listing
+ *
+ * Sends "MLSD <path>" (RFC 3659). The listing arrives on the data
+ * connection, one "fact=value;...; name" line per entry, and ends with
+ * 226 on the control connection.
+ *
+ * @param sock Control socket
+ * @param path Directory to list, "" for the current directory
+ * @return int 0 if server starts the listing, -1 on failure
+ */
+int requestListing(int sock, const char *path)
+{
+    char cmd[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+
+    logMessage("Listing directory: %s\n", path[0] ? path : ".");
+    int length = path[0] ? snprintf(cmd, sizeof(cmd), "MLSD %s\r\n", path)
+                         : snprintf(cmd, sizeof(cmd), "MLSD\r\n");
+    if (length >= (int)sizeof(cmd))
+        return -1;
+    write(sock, cmd, length);
+
+    int responseCode = getServerResponse(sock, response);
+    if (responseCode != SV_READY4TRANSFER && responseCode != 125)
+    {
+        logMessage("Error listing directory. Server response: %s\n", response);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Sets the representation type of the following transfers
+ *
+ * Sends "TYPE A" or "TYPE I". Image type keeps SIZE and REST offsets
+ * in raw bytes; ASCII type is only used when a URL asks for it with
+ * ";type=a".
+ *
+ * @param sock Control socket
+ * @param type 'A' for ASCII, 'I' for image
+ * @return int 0 if the server accepted the type (200), -1 on failure
+ */
+int setTransferType(int sock, char type)
+{
+    char cmd[16];
+    char response[BUFFER_SIZE];
+
+    snprintf(cmd, sizeof(cmd), "TYPE %c\r\n", type);
+    write(sock, cmd, strlen(cmd));
+    int responseCode = getServerResponse(sock, response);
+    if (responseCode != SV_COMMAND_OK)
+    {
+        logMessage("Error setting transfer type %c. Server response: %s\n", type, response);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Switches the session to binary (image) transfer type
+ *
+ * Sends "TYPE I" so that SIZE and REST offsets are expressed in raw
+ * bytes, as required for segmented and resumed transfers.
+ *
+ * @param sock Control socket
+ * @return int 0 if the server accepted the type (200), -1 on failure
+ */
+int setBinaryMode(int sock)
+{
+    return setTransferType(sock, 'I');
+}
+
+/**
+ * @brief Learns the extensions the server offers, once per connection
+ *
+ * Sends FEAT (RFC 2389) and records in the connection flags the
+ * features the client can use: "HASH <algo>[*];...", XCRC, XSHA256 and
+ * "MODE Z". Later calls return the cached flags without a round-trip.
+ *
+ * @param sock Control socket
+ * @return unsigned Connection flags including the CONN_HASH_*, CONN_X* and CONN_MODE_Z bits
+ */
+unsigned serverFeatures(int sock)
+{
+    char cmd[] = "FEAT\r\n";
+    struct FTPReply reply;
+    unsigned flags = connectionFlags(sock);
+
+    if (flags & CONN_FEATURES)
+        return flags;
+
+    write(sock, cmd, strlen(cmd));
+    if (readReply(sock, &reply) == 211)
+    {
+        for (const char *line = reply.text; line; line = strchr(line, '\n'))
+        {
+            line += strspn(line, "\n\r ");
+            if (strncasecmp(line, "HASH ", 5) == 0)
+            {
+                const char *end = line + strcspn(line, "\r\n");
+                for (const char *algo = line + 5; algo < end; algo += strcspn(algo, ";\r\n") + 1)
+                {
+                    size_t length = strcspn(algo, "*;\r\n");
+                    if (length == 7 && strncasecmp(algo, "SHA-256", 7) == 0)
+                        setConnectionFlag(sock, CONN_HASH_SHA256);
+                    else if (length == 6 && strncasecmp(algo, "CRC32C", 6) == 0)
+                        setConnectionFlag(sock, CONN_HASH_CRC32C);
+                    else if (length == 5 && strncasecmp(algo, "CRC32", 5) == 0)
+                        setConnectionFlag(sock, CONN_HASH_CRC32);
+                }
+            }
+            else if (strncasecmp(line, "XCRC", 4) == 0 && strchr("\r\n ", line[4]))
+                setConnectionFlag(sock, CONN_XCRC);
+            else if (strncasecmp(line, "XSHA256", 7) == 0 && strchr("\r\n ", line[7]))
+                setConnectionFlag(sock, CONN_XSHA256);
+            else if (strncasecmp(line, "MODE Z", 6) == 0 && strchr("\r\n ", line[6]))
+                setConnectionFlag(sock, CONN_MODE_Z);
+        }
+    }
+
+    setConnectionFlag(sock, CONN_FEATURES);
+    return connectionFlags(sock);
+}
+
+/**
+ * @brief Switches the session to compressed (deflate) transfer mode
+ *
+ * Sends "MODE Z" when FEAT lists it. Every later transfer on the
+ * connection, listings included, then carries a zlib stream that the
+ * receive path inflates. A server without MODE Z keeps stream mode.
+ *
+ * @param sock Control socket
+ * @return int 0 if MODE Z is active, 1 if the server does not offer it
+ */
+int setCompressedMode(int sock)
+{
+    char cmd[] = "MODE Z\r\n";
+    char response[BUFFER_SIZE];
+
+    if (connectionFlags(sock) & CONN_COMPRESSED)
+        return 0;
+    if (!(serverFeatures(sock) & CONN_MODE_Z))
+    {
+        logMessage("Server does not offer MODE Z, using stream mode\n");
+        return 1;
+    }
+
+    write(sock, cmd, strlen(cmd));
+    int responseCode = getServerResponse(sock, response);
+    if (responseCode != SV_COMMAND_OK)
+    {
+        logMessage("MODE Z refused, using stream mode. Server response: %s\n", response);
+        return 1;
+    }
+
+    setConnectionFlag(sock, CONN_COMPRESSED);
+    return 0;
+}
+
+/**
+ * @brief Queries the size of a remote file
+ *
+ * Sends the SIZE command (RFC 3659). The reply has the form
+ * "213 <size>" where size is the number of octets the file would
+ * occupy when transferred in the current TYPE.
+ *
+ * @param sock Control socket
+ * @param path Path of the remote file
+ * @param size Pointer to store the file size
+ * @return int 0 on success, -1 if SIZE is unsupported or fails
+ */
+int getFileSize(int sock, const char *path, long long *size)
+{
+    char cmd[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+
+    snprintf(cmd, sizeof(cmd), "SIZE %s\r\n", path);
+    write(sock, cmd, strlen(cmd));
+
+    int responseCode = getServerResponse(sock, response);
+    if (responseCode != SV_FILE_STATUS || sscanf(response, "%*d %lld", size) != 1)
+    {
+        logMessage("Server did not report file size: %s\n", response);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Collects what a download needs to know before RETR
+ *
+ * With a content cache, the file is first looked up there and served
+ * without RETR on a hit. In resume mode this runs the resume check;
+ * otherwise, when the file is preallocated or written through mmap, it
+ * only asks for the SIZE.
+ * A server without SIZE leaves opts->expectedSize at 0, which turns
+ * preallocation off and sends the mmap engine to its buffered fallback.
+ * Must be called on a binary-mode session.
+ *
+ * @param ctrlSock Control socket
+ * @param url URL of the file
+ * @param opts Transfer options; offset and expectedSize are filled in
+ * @return int 1 if the local file is already complete or came from the cache, 0 otherwise
+ */
+int prepareDownload(int ctrlSock, struct URL *url, struct TransferOptions *opts)
+{
+    opts->expectedSize = 0;
+    opts->mdtm[0] = '\0';
+    if (opts->cache && cacheLookup(opts->cache, ctrlSock, url, opts) == 1)
+        return 1;
+    if (opts->resume)
+        return checkResume(ctrlSock, url, &opts->offset, &opts->expectedSize);
+
+    if ((opts->preallocate || opts->engine == ENGINE_MMAP) && !opts->expectedSize &&
+        getFileSize(ctrlSock, url->resource, &opts->expectedSize) != 0)
+    {
+        logMessage("Continuing without preallocation\n");
+        opts->expectedSize = 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sets the restart marker for the next transfer
+ *
+ * Sends "REST <offset>". A server supporting stream-mode restart
+ * answers 350 and starts the following RETR at that byte offset.
+ *
+ * @param sock Control socket
+ * @param offset Byte offset to restart from
+ * @return int 0 if the server accepted the marker (350), -1 otherwise
+ */
+int restartAt(int sock, long long offset)
+{
+    char cmd[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+
+    snprintf(cmd, sizeof(cmd), "REST %lld\r\n", offset);
+    write(sock, cmd, strlen(cmd));
+
+    int responseCode = getServerResponse(sock, response);
+    if (responseCode != SV_PENDING_INFO)
+    {
+        logMessage("Server rejected REST %lld: %s\n", offset, response);
         return -1;
     }
 
     return 0;
-} 
\ No newline at end of file
+}
+
+/**
+ * @brief Waits for the end-of-transfer reply after the data connection closed
+ *
+ * The server confirms a complete transfer with 226 (or 250) once it has
+ * closed the data connection. Reading it keeps the control connection in
+ * sync so it can be reused for the next transfer.
+ *
+ * @param sock Control socket
+ * @return int 0 if the transfer was confirmed, -1 otherwise
+ */
+int finishTransfer(int sock)
+{
+    char response[BUFFER_SIZE];
+
+    int responseCode = getServerResponse(sock, response);
+    if (responseCode != SV_TRANSFER_COMPLETE && responseCode != 250)
+    {
+        logMessage("Transfer not confirmed by server: %s\n", response);
+        return -1;
+    }
+
+    traceStep(TRACE_FINISH);
+    return 0;
+}
+
+/**
+ * @brief Brings a control connection back in sync after an aborted RETR
+ *
+ * Closing the data connection early, or a failed command, may leave
+ * replies in flight (426, 451 or even 226 depending on the server).
+ * Sending NOOP and discarding replies until its 200 arrives consumes
+ * whatever the server sent, leaving the connection ready for the next
+ * command.
+ *
+ * @param sock Control socket
+ * @return int 0 on success, -1 if the connection is unusable
+ */
+int resyncControl(int sock)
+{
+    char cmd[] = "NOOP\r\n";
+    char response[BUFFER_SIZE];
+    int responseCode;
+
+    write(sock, cmd, strlen(cmd));
+    do {
+        responseCode = getServerResponse(sock, response);
+        if (responseCode < 0) return -1;
+    } while (responseCode != SV_COMMAND_OK);
+
+    return 0;
+}
@@ -0,0 +1,317 @@
+/**
+ * @file fxp.c
+ * @brief Server-to-server (FXP) copies for FTP client
+ *
+ * This file implements copying files from one FTP server to another
+ * without the data passing through the client. The client holds a
+ * control connection to each server and points the source's data
+ * connection at the destination:
+ *
+ *   destination: connect -> USER/PASS -> TYPE I -> EPSV|PASV ---------> STOR -> 150 ... 226
+ *   source:      connect -> USER/PASS -> TYPE I -> SIZE -> PORT|EPRT -> RETR -> 150 ... 226
+ *
+ * The destination listens, the source connects to it in active mode,
+ * and the file goes straight from one server to the other; the client
+ * only reads the replies. RETR is sent before STOR so that a file the
+ * source cannot send leaves the destination untouched: the source's
+ * connection waits in the destination's listen queue until STOR
+ * accepts it. Without a data stream there is no progress to report; the
+ * copy is checked with SIZE on both sides afterwards, and with -H by
+ * comparing the two servers' digests.
+ *
+ * Many servers refuse PORT to an address other than the client's (the
+ * protection against FTP bounce attacks), which rules the copy out; the
+ * refusal is reported as such.
+ *
+ * A copy manifest lists one "<source-url> <destination-url>" pair per
+ * line. A destination ending in '/' is a directory that receives the
+ * file under its source name. Consecutive pairs with the same servers
+ * and credentials reuse both control connections.
+ */
+
+#include "ftp_client.h"
+
+/**
+ * @struct CopySession
+ * @brief Control connection to one end of a copy, kept between files
+ */
+struct CopySession {
+    struct URL url;  /**< Server and credentials the connection logged in with */
+    int sock;        /**< Control socket, -1 if not connected */
+};
+
+/**
+ * @brief Makes sure a session is logged in to the server of a URL
+ *
+ * An open connection to the same server with the same credentials is
+ * kept; any other one is closed first.
+ *
+ * @param s Session
+ * @param url URL of the next file on this end
+ * @return int 0 on success, -1 on failure
+ */
+static int openCopySession(struct CopySession *s, const struct URL *url)
+{
+    if (s->sock >= 0 && s->url.port == url->port && strcmp(s->url.host, url->host) == 0 &&
+        strcmp(s->url.user, url->user) == 0 && strcmp(s->url.password, url->password) == 0)
+        return 0;
+
+    if (s->sock >= 0)
+        closeConnection(s->sock);
+    s->url = *url;
+    if ((s->sock = createSocket(s->url.host, s->url.port)) < 0)
+        return -1;
+    if (authenticate(s->sock, s->url.user, s->url.password) != 0)
+    {
+        closeConnection(s->sock);
+        s->sock = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Closes a session, e.g. after a failure left replies in flight
+ */
+static void closeCopySession(struct CopySession *s)
+{
+    if (s->sock >= 0)
+        closeConnection(s->sock);
+    s->sock = -1;
+}
+
+/**
+ * @brief Tells the source where to open its data connection
+ *
+ * Sends "PORT h1,h2,h3,h4,p1,p2" for an IPv4 address, IPv4-mapped ones
+ * included, and "EPRT |2|addr|port|" (RFC 2428) for an IPv6 one.
+ *
+ * @param sock Control socket of the source
+ * @param addr Address the destination listens on
+ * @param port Port the destination listens on
+ * @return int 0 if the source accepted the address (200), -1 otherwise
+ */
+static int sendActiveTarget(int sock, const char *addr, int port)
+{
+    char cmd[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    int ip[4], length;
+
+    if (strncmp(addr, "::ffff:", 7) == 0 && strchr(addr + 7, '.'))
+        addr += 7;
+    if (sscanf(addr, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]) == 4 && !strchr(addr, ':'))
+        length = snprintf(cmd, sizeof(cmd), "PORT %d,%d,%d,%d,%d,%d\r\n",
+                          ip[0], ip[1], ip[2], ip[3], port / 256, port % 256);
+    else
+        length = snprintf(cmd, sizeof(cmd), "EPRT |2|%s|%d|\r\n", addr, port);
+    if (length >= (int)sizeof(cmd))
+        return -1;
+
+    logMessage("Pointing the source at %s:%d\n", addr, port);
+    write(sock, cmd, length);
+    int responseCode = getServerResponse(sock, response);
+    if (responseCode != SV_COMMAND_OK)
+    {
+        logMessage("Source refused the destination's address: %s\n", response);
+        logMessage("(servers that only connect back to the client cannot copy to another server)\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies one file between two logged-in sessions
+ *
+ * On failure a session whose replies may be out of step is closed, so
+ * that the next copy starts from a fresh connection.
+ *
+ * @param src Session on the source server
+ * @param dst Session on the destination server
+ * @param source URL of the file to copy
+ * @param dest URL of the copy
+ * @param opts Transfer options (checksum type), may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+static int copyFile(struct CopySession *src, struct CopySession *dst, struct URL *source,
+                    struct URL *dest, const struct TransferOptions *opts)
+{
+    char type = source->type == 'a' ? 'A' : 'I';
+    char dataAddr[BUFFER_SIZE];
+    long long size = -1, copied;
+    int dataPort;
+
+    logMessage("\n=== SERVER-TO-SERVER COPY ===\n");
+    logMessage("%s:%d/%s -> %s:%d/%s\n", source->host, source->port, source->resource,
+               dest->host, dest->port, dest->resource);
+    if (setTransferType(src->sock, type) != 0 || setTransferType(dst->sock, type) != 0)
+        return -1;
+
+    // Byte counts only mean the same thing on both ends in image type
+    if (type == 'I' && getFileSize(src->sock, source->resource, &size) != 0)
+        size = -1;
+
+    if (enterPassiveMode(dst->sock, dataAddr, &dataPort) != 0 ||
+        sendActiveTarget(src->sock, dataAddr, dataPort) != 0)
+        return -1;
+
+    long long start = traceNow();
+    if (requestFile(src->sock, source->resource) != 0)
+        return -1;
+    if (requestStore(dst->sock, dest->resource, 0) != 0)
+    {
+        // Dropping the destination's listener resets the source's connection
+        closeCopySession(dst);
+        if (resyncControl(src->sock) != 0)
+            closeCopySession(src);
+        return -1;
+    }
+
+    logMessage("Waiting for the servers to finish...\n");
+    int sent = finishTransfer(src->sock);
+    int stored = finishTransfer(dst->sock);
+    if (sent != 0 || stored != 0)
+    {
+        logMessage("Copy failed: %s did not confirm the transfer\n", sent != 0 ? "source" : "destination");
+        return -1;
+    }
+    double seconds = (traceNow() - start) / 1e9;
+
+    if (type == 'I' && getFileSize(dst->sock, dest->resource, &copied) == 0)
+    {
+        if (size >= 0 && copied != size)
+        {
+            logMessage("Copy is %lld bytes, the source has %lld\n", copied, size);
+            return -1;
+        }
+        logMessage("Copy completed. Total: %.2f MB in %.2f s (%.2f MB/s)\n", copied / (1024.0 * 1024.0),
+                   seconds, seconds > 0 ? copied / (1024.0 * 1024.0) / seconds : 0.0);
+    }
+    else
+        logMessage("Copy completed in %.2f s\n", seconds);
+
+    if (opts && opts->checksumType != CHECKSUM_NONE && type == 'I' &&
+        compareServerChecksums(src->sock, source->resource, dst->sock, dest->resource,
+                               opts->checksumType) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Parses the destination of a copy
+ *
+ * A destination ending in '/' (or naming only a server) is a directory:
+ * the copy keeps the source's file name.
+ *
+ * @param input Destination URL
+ * @param source Parsed source URL
+ * @param dest Receives the destination URL
+ * @return int 0 on success, -1 on parsing failure
+ */
+static int parseCopyTarget(const char *input, const struct URL *source, struct URL *dest)
+{
+    const char *scheme = strstr(input, "//");
+    size_t length = strlen(input);
+
+    memset(dest, 0, sizeof(*dest));
+    if (!scheme || (strchr(scheme + 2, '/') && input[length - 1] != '/'))
+        return parse(input, dest);
+
+    if (parseMirrorUrl(input, dest) != 0)
+        return -1;
+    int written = dest->resource[0]
+                ? snprintf(dest->file, sizeof(dest->file), "%s/%s", dest->resource, source->file)
+                : snprintf(dest->file, sizeof(dest->file), "%s", source->file);
+    if (written >= (int)sizeof(dest->file))
+        return -1;
+    strcpy(dest->resource, dest->file);
+    strcpy(dest->file, source->file);
+    return 0;
+}
+
+/**
+ * @brief Copies a file from one FTP server to another
+ *
+ * @param source URL of the file on the source server
+ * @param destination Destination URL; a trailing '/' keeps the file name
+ * @param opts Transfer options (checksum type), may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int copyRemoteFile(struct URL *source, const char *destination, const struct TransferOptions *opts)
+{
+    struct CopySession src = { .sock = -1 }, dst = { .sock = -1 };
+    struct URL dest;
+
+    if (parseCopyTarget(destination, source, &dest) != 0)
+    {
+        logMessage("Invalid destination URL: %s\n", destination);
+        return -1;
+    }
+
+    int result = openCopySession(&src, source) == 0 && openCopySession(&dst, &dest) == 0
+               ? copyFile(&src, &dst, source, &dest, opts) : -1;
+    closeCopySession(&src);
+    closeCopySession(&dst);
+    return result;
+}
+
+/**
+ * @brief Copies every pair of URLs listed in a manifest
+ *
+ * Each line holds "<source-url> <destination-url>"; blank lines and
+ * lines starting with '#' are ignored. A failed copy does not stop the
+ * batch.
+ *
+ * @param manifest Path of the manifest, "-" for standard input
+ * @param opts Transfer options applied to every copy
+ * @return int 0 if every file was copied, -1 otherwise
+ */
+int copyBatch(const char *manifest, const struct TransferOptions *opts)
+{
+    FILE *in = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    struct CopySession src = { .sock = -1 }, dst = { .sock = -1 };
+    char line[MAX_LENGTH * 4];
+    int copied = 0, failed = 0;
+
+    if (!in)
+    {
+        logMessage("Cannot open manifest %s: %s\n", manifest, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in))
+    {
+        struct URL source, dest;
+
+        // Split the line into the two URLs
+        char *from = line + strspn(line, " \t");
+        char *end = from + strcspn(from, " \t\r\n");
+        char *to = end + strspn(end, " \t");
+        to[strcspn(to, " \t\r\n")] = '\0';
+        *end = '\0';
+        if (from[0] == '\0' || from[0] == '#')
+            continue;
+
+        memset(&source, 0, sizeof(source));
+        if (to[0] == '\0' || parse(from, &source) != 0 || source.type == 'd' ||
+            parseCopyTarget(to, &source, &dest) != 0)
+        {
+            logMessage("Skipping invalid copy: %s %s\n", from, to);
+            failed++;
+            continue;
+        }
+
+        if (openCopySession(&src, &source) == 0 && openCopySession(&dst, &dest) == 0 &&
+            copyFile(&src, &dst, &source, &dest, opts) == 0)
+            copied++;
+        else
+            failed++;
+    }
+
+    if (in != stdin)
+        fclose(in);
+    closeCopySession(&src);
+    closeCopySession(&dst);
+
+    logMessage("\nCopy batch completed: %d copied, %d failed\n", copied, failed);
+    return failed == 0 ? 0 : -1;
+}
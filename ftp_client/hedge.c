@@ -0,0 +1,355 @@
+/**
+ * @file hedge.c
+ * @brief Hedged retrieval of slow transfers for FTP client
+ *
+ * A transfer that stalls or crawls holds up everything waiting for it.
+ * With a throughput floor set, retrieveFile() runs a monitor thread next
+ * to the receive loop. Once the transfer has moved less than the floor
+ * over the last HEDGE_WINDOW seconds, the monitor opens a second session
+ * and fetches the rest of the file with REST from the byte the first
+ * one has reached:
+ *
+ *   primary:  RETR ---------- slow ..........................
+ *   hedge:                    login, REST n, RETR ------ 226   wins
+ *
+ * Both sessions write the same bytes at the same offsets, so the file
+ * is complete as soon as either of them finishes. The first to finish
+ * wins; the other one's data connection is shut down, which ends its
+ * receive loop. A hedge that wins leaves the primary control connection
+ * with a 426 or 226 in flight, which is drained before returning.
+ *
+ * Hedging is skipped where the two sessions could not write the same
+ * bytes: ASCII transfers, MODE Z, and the mmap engine, which truncates
+ * the file to what it received. Unpacking also needs the bytes in
+ * order, so archives extracted on the fly are not hedged either.
+ */
+
+#include "ftp_client.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/**
+ * @enum HedgeWinner
+ * @brief Session that completed the file
+ */
+enum HedgeWinner {
+    HEDGE_NONE = 0,  /**< Neither yet */
+    HEDGE_PRIMARY,   /**< The original session */
+    HEDGE_SECOND     /**< The hedged session */
+};
+
+/**
+ * @struct Hedge
+ * @brief Monitor of one transfer and its hedged session
+ */
+struct Hedge {
+    struct URL *url;                   /**< File being transferred */
+    const struct TransferOptions *opts; /**< Options of the primary session */
+    int primarySock;                   /**< Primary data socket, shut down when the hedge wins */
+    long long progress;                /**< Bytes received by the primary, updated atomically */
+    int ctrlSock;                      /**< Hedge control socket, -1 when none */
+    int dataSock;                      /**< Hedge data socket, -1 when none */
+    int stop;                          /**< The primary returned: fire no hedge */
+    int cancel;                        /**< The primary won: abandon the hedge */
+    enum HedgeWinner winner;           /**< Session that finished first */
+    pthread_mutex_t lock;              /**< Guards the fields above except progress */
+    pthread_cond_t wake;               /**< Signalled when the primary returns */
+    pthread_t monitor;                 /**< Monitor thread, runs the hedge too */
+};
+
+/** Transfers watched, hedges fired and hedges that finished first */
+static long hedgesWatched, hedgesFired, hedgesWon;
+
+/**
+ * @brief Publishes a socket of the hedge so the primary can cancel it
+ *
+ * @param h Hedge
+ * @param slot h->ctrlSock or h->dataSock
+ * @param sock Socket, -1 if it could not be created
+ * @return int 0 if the hedge goes on, -1 if it failed or was cancelled
+ */
+static int trackSocket(struct Hedge *h, int *slot, int sock)
+{
+    pthread_mutex_lock(&h->lock);
+    *slot = sock;
+    int cancel = h->cancel;
+    pthread_mutex_unlock(&h->lock);
+    return sock >= 0 && !cancel ? 0 : -1;
+}
+
+/**
+ * @brief Closes the hedge's sockets once the primary can no longer touch them
+ *
+ * @param h Hedge
+ */
+static void closeHedge(struct Hedge *h)
+{
+    pthread_mutex_lock(&h->lock);
+    int ctrl = h->ctrlSock, data = h->dataSock, cancel = h->cancel;
+    h->ctrlSock = h->dataSock = -1;
+    pthread_mutex_unlock(&h->lock);
+
+    if (data >= 0)
+        close(data);
+    if (ctrl >= 0 && !cancel)
+        closeConnection(ctrl);
+    else if (ctrl >= 0)
+    {
+        releaseReplyReader(ctrl);
+        close(ctrl);
+    }
+}
+
+/**
+ * @brief Fetches the rest of the file on a second session
+ *
+ * @param h Hedge
+ * @param offset Byte to restart from
+ * @return int 0 if the whole rest was received and confirmed, -1 otherwise
+ */
+static int runHedge(struct Hedge *h, long long offset)
+{
+    const struct TransferOptions *opts = h->opts;
+    struct URL *url = h->url;
+    char dataAddr[BUFFER_SIZE], path[MAX_LENGTH + 16];
+    int dataPort, fd = -1, result = -1;
+    char *buffer = NULL;
+    ssize_t bytes = -1;
+
+    if (trackSocket(h, &h->ctrlSock, createSocket(url->host, url->port)) != 0 ||
+        authenticate(h->ctrlSock, url->user, url->password) != 0 || setBinaryMode(h->ctrlSock) != 0 ||
+        enterPassiveMode(h->ctrlSock, dataAddr, &dataPort) != 0 ||
+        trackSocket(h, &h->dataSock, createSocketWith(dataAddr, dataPort, &opts->socket)) != 0 ||
+        (offset > 0 && restartAt(h->ctrlSock, offset) != 0) ||
+        requestFile(h->ctrlSock, url->resource) != 0)
+    {
+        closeHedge(h);
+        return -1;
+    }
+
+    // The primary created the file; the hedge only writes its own range
+    snprintf(path, sizeof(path), "downloads/%s", url->file);
+    if ((fd = open(path, O_WRONLY)) >= 0 && (buffer = malloc(ALIGNED_BUFFER_SIZE)))
+    {
+        long long pos = offset;
+        while ((bytes = read(h->dataSock, buffer, ALIGNED_BUFFER_SIZE)) > 0)
+        {
+            if (pwrite(fd, buffer, bytes, pos) != bytes)
+            {
+                bytes = -1;
+                break;
+            }
+            pos += bytes;
+        }
+        // A shutdown by the winning primary also reads as end of file
+        if (bytes == 0 && (!opts->expectedSize || pos == opts->expectedSize) &&
+            finishTransfer(h->ctrlSock) == 0)
+            result = 0;
+        logMessage("\nHedged session received %.2f MB\n", (pos - offset) / (1024.0 * 1024.0));
+    }
+
+    free(buffer);
+    if (fd >= 0)
+        close(fd);
+    if (result == 0)
+    {
+        pthread_mutex_lock(&h->lock);
+        if (h->winner == HEDGE_NONE)
+        {
+            h->winner = HEDGE_SECOND;
+            shutdown(h->primarySock, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+    closeHedge(h);
+    return result;
+}
+
+/**
+ * @brief Watches the primary's throughput and fires the hedge below the floor
+ *
+ * @param arg Hedge
+ * @return void* NULL
+ */
+static void *monitorTransfer(void *arg)
+{
+    struct Hedge *h = arg;
+    double markTime = traceSeconds();
+    long long markBytes = 0;
+
+    pthread_mutex_lock(&h->lock);
+    while (!h->stop)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(HEDGE_POLL_INTERVAL * 1e9);
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&h->wake, &h->lock, &deadline);
+
+        double now = traceSeconds();
+        long long bytes = __atomic_load_n(&h->progress, __ATOMIC_RELAXED);
+        if (h->stop || now - markTime < HEDGE_WINDOW)
+            continue;
+
+        // Judge the last window only, so an early burst does not hide a stall
+        double rate = (bytes - markBytes) / (now - markTime);
+        markTime = now;
+        markBytes = bytes;
+        if (rate >= h->opts->minRate)
+            continue;
+
+        pthread_mutex_unlock(&h->lock);
+
+        long long offset = h->opts->offset + bytes;
+        __atomic_add_fetch(&hedgesFired, 1, __ATOMIC_RELAXED);
+        logMessage("\n=== HEDGE ===\n");
+        logMessage("%s at %.2f MB/s, below %.2f MB/s for %.0f s: second session from byte %lld\n",
+                   h->url->file, rate / (1024.0 * 1024.0), h->opts->minRate / (1024.0 * 1024.0),
+                   HEDGE_WINDOW, offset);
+        if (runHedge(h, offset) == 0)
+            logMessage("Hedged session finished first\n");
+
+        pthread_mutex_lock(&h->lock);
+        break;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return NULL;
+}
+
+/**
+ * @brief Records the bytes received so far by the transfer a hedge watches
+ *
+ * Called by metricsAdd() on the receiving thread.
+ *
+ * @param h Hedge
+ * @param bytes Bytes received since the transfer started
+ */
+void hedgeProgress(struct Hedge *h, long long bytes)
+{
+    __atomic_store_n(&h->progress, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Settles the race once the primary's receive loop has returned
+ *
+ * A primary that completed wins unless the hedge got there first, and
+ * cancels a hedge still running. One that failed leaves the file to a
+ * hedge already under way and waits for it.
+ *
+ * @param h Hedge
+ * @param completed Non-zero if the primary received the whole file
+ * @return enum HedgeWinner Session that finished first, HEDGE_NONE if neither
+ */
+static enum HedgeWinner settleHedge(struct Hedge *h, int completed)
+{
+    pthread_mutex_lock(&h->lock);
+    h->stop = 1;
+    if (completed && h->winner == HEDGE_NONE)
+        h->winner = HEDGE_PRIMARY;
+    if (h->winner == HEDGE_PRIMARY)
+    {
+        h->cancel = 1;
+        if (h->ctrlSock >= 0)
+            shutdown(h->ctrlSock, SHUT_RDWR);
+        if (h->dataSock >= 0)
+            shutdown(h->dataSock, SHUT_RDWR);
+    }
+    pthread_cond_signal(&h->wake);
+    pthread_mutex_unlock(&h->lock);
+
+    pthread_join(h->monitor, NULL);
+    pthread_mutex_destroy(&h->lock);
+    pthread_cond_destroy(&h->wake);
+    return h->winner;
+}
+
+/**
+ * @brief Computes a digest again over the whole downloaded file
+ *
+ * @param sum Digest to reset and fill
+ * @param file File name in the downloads directory
+ * @return int 0 on success, -1 if the file cannot be read
+ */
+static int rehashFile(struct Checksum *sum, const char *file)
+{
+    char path[MAX_LENGTH + 16];
+    struct stat st;
+    int result = -1;
+
+    snprintf(path, sizeof(path), "downloads/%s", file);
+    int fd = open(path, O_RDONLY);
+    checksumInit(sum, sum->type);
+    if (fd >= 0 && fstat(fd, &st) == 0)
+        result = checksumFile(sum, fd, st.st_size);
+    if (fd >= 0)
+        close(fd);
+    return result;
+}
+
+/**
+ * @brief Receives a requested file and reads its end-of-transfer reply, hedging a slow transfer
+ *
+ * Without a throughput floor this is downloadFileWith() followed by
+ * finishTransfer(). With one, a hedged session may finish the file; the
+ * primary control connection is then resynchronized, and an inline
+ * digest, which only saw the primary's bytes, is computed again from
+ * the file.
+ *
+ * @param ctrlSock Control socket, RETR already accepted
+ * @param dataSock Data socket
+ * @param url URL of the file
+ * @param opts Transfer options; minRate enables hedging
+ * @return int 0 if the file was received, -1 on failure
+ */
+int retrieveFile(int ctrlSock, int dataSock, struct URL *url, const struct TransferOptions *opts)
+{
+    struct TransferOptions primary = *opts;
+    struct Hedge h;
+
+    // Both sessions must produce the same bytes at the same offsets
+    if (opts->minRate <= 0 || url->type == 'a' || opts->engine == ENGINE_MMAP ||
+        opts->unpackDir || (connectionFlags(ctrlSock) & CONN_COMPRESSED))
+        return downloadFileWith(ctrlSock, dataSock, url->file, opts) == 0 ? finishTransfer(ctrlSock) : -1;
+
+    memset(&h, 0, sizeof(h));
+    h.url = url;
+    h.opts = opts;
+    h.primarySock = dataSock;
+    h.ctrlSock = h.dataSock = -1;
+    pthread_mutex_init(&h.lock, NULL);
+    pthread_cond_init(&h.wake, NULL);
+    if (pthread_create(&h.monitor, NULL, monitorTransfer, &h) != 0)
+    {
+        pthread_mutex_destroy(&h.lock);
+        pthread_cond_destroy(&h.wake);
+        return downloadFileWith(ctrlSock, dataSock, url->file, opts) == 0 ? finishTransfer(ctrlSock) : -1;
+    }
+    __atomic_add_fetch(&hedgesWatched, 1, __ATOMIC_RELAXED);
+
+    primary.hedge = &h;
+    int result = downloadFileWith(ctrlSock, dataSock, url->file, &primary);
+    enum HedgeWinner winner = settleHedge(&h, result == 0);
+    if (winner != HEDGE_SECOND)
+        return winner == HEDGE_PRIMARY ? finishTransfer(ctrlSock) : -1;
+
+    __atomic_add_fetch(&hedgesWon, 1, __ATOMIC_RELAXED);
+    if (opts->checksum && rehashFile(opts->checksum, url->file) != 0)
+        return -1;
+
+    // The primary's RETR ends with 426 (or 226) after its data connection was shut down
+    return resyncControl(ctrlSock);
+}
+
+/**
+ * @brief Prints how many transfers were watched and how many hedges fired and won
+ */
+void hedgeReport(void)
+{
+    logMessage("\n=== HEDGING ===\n");
+    logMessage("Transfers watched: %ld, hedges fired: %ld, won: %ld\n",
+               hedgesWatched, hedgesFired, hedgesWon);
+}
@@ -0,0 +1,350 @@
+/**
+ * @file libftpclient.c
+ * @brief Reusable sessions of the embeddable client library
+ *
+ * A session wraps one authenticated control connection and serves
+ * downloads into caller sinks:
+ *
+ *   open:  connect -> USER/PASS -> TYPE I [-> MODE Z]
+ *   fetch: PASV -> [REST] -> RETR -> read() -> sink -> 226
+ *   close: QUIT
+ *
+ * The receive loop reads either into the session's buffer, allocated
+ * once and reused by every fetch, or straight into memory supplied by
+ * the sink, and hands each chunk on without copying it. Nothing on that
+ * path prints; status messages go through logMessage(), which is silent
+ * in the library unless the caller installs a handler.
+ *
+ * Writes to a control connection the server has closed would raise
+ * SIGPIPE and kill the embedding process, so the signal is blocked in
+ * the calling thread for the duration of each call and a SIGPIPE raised
+ * meanwhile is discarded.
+ */
+
+#include "ftp_client.h"
+#include "libftpclient.h"
+#include <signal.h>
+#include <pthread.h>
+
+/**
+ * @struct FTPSession
+ * @brief State of one library session
+ */
+struct FTPSession {
+    struct URL url;                  /**< Server and credentials */
+    struct FTPSessionOptions options; /**< Tunables given at open */
+    struct SocketOptions socket;     /**< Options of data connections */
+    int ctrlSock;                    /**< Control socket, -1 when disconnected */
+    char dataAddr[BUFFER_SIZE];      /**< Pending passive address */
+    int dataPort;                    /**< Pending passive port */
+    int passive;                     /**< Pipelined login left a PASV answer pending */
+    size_t readSize;                 /**< Bytes per read() */
+    char *buffer;                    /**< Receive buffer, allocated on first use */
+};
+
+/**
+ * @brief Blocks SIGPIPE in the calling thread
+ *
+ * @param saved Receives the previous signal mask
+ * @return int Non-zero if a SIGPIPE was already pending
+ */
+static int blockSigpipe(sigset_t *saved)
+{
+    sigset_t set, pending;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigpending(&pending);
+    pthread_sigmask(SIG_BLOCK, &set, saved);
+    return sigismember(&pending, SIGPIPE);
+}
+
+/**
+ * @brief Discards a SIGPIPE raised by the library and restores the mask
+ *
+ * @param saved Mask returned by blockSigpipe()
+ * @param wasPending Value returned by blockSigpipe()
+ */
+static void restoreSigpipe(const sigset_t *saved, int wasPending)
+{
+    sigset_t set, pending;
+    struct timespec zero = {0, 0};
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigpending(&pending);
+    if (!wasPending && sigismember(&pending, SIGPIPE))
+        while (sigtimedwait(&set, NULL, &zero) < 0 && errno == EINTR)
+            ;
+    pthread_sigmask(SIG_SETMASK, saved, NULL);
+}
+
+/**
+ * @brief Opens and authenticates the control connection of a session
+ *
+ * @param s Session
+ * @return int 0 on success, -1 on failure
+ */
+static int sessionConnect(struct FTPSession *s)
+{
+    int saved = 0, result;
+
+    s->passive = 0;
+    s->ctrlSock = createSocket(s->url.host, s->url.port);
+    if (s->ctrlSock < 0)
+        return -1;
+
+    if (s->options.pipelined)
+    {
+        result = authenticatePipelined(s->ctrlSock, s->url.user, s->url.password,
+                                       s->dataAddr, &s->dataPort, &saved);
+        s->passive = result == 0;
+    }
+    else
+        result = authenticate(s->ctrlSock, s->url.user, s->url.password) != 0 ||
+                 setBinaryMode(s->ctrlSock) != 0 ? -1 : 0;
+
+    if (result != 0)
+    {
+        closeConnection(s->ctrlSock);
+        s->ctrlSock = -1;
+        return -1;
+    }
+
+    if (s->options.compress)
+        setCompressedMode(s->ctrlSock);
+    return 0;
+}
+
+/**
+ * @brief Brings the control connection back in sync after a failure
+ *
+ * A connection that does not answer NOOP is dropped; the next call
+ * reconnects.
+ *
+ * @param s Session
+ */
+static void sessionRecover(struct FTPSession *s)
+{
+    s->passive = 0;
+    if (s->ctrlSock >= 0 && resyncControl(s->ctrlSock) != 0)
+    {
+        releaseReplyReader(s->ctrlSock);
+        close(s->ctrlSock);
+        s->ctrlSock = -1;
+    }
+}
+
+/**
+ * @brief Reads a stream-mode transfer into a sink
+ *
+ * @param s Session
+ * @param dataSock Data socket
+ * @param sink Destination
+ * @return long long Bytes delivered, -1 on failure or abort
+ */
+static long long sessionReceive(struct FTPSession *s, int dataSock, const struct FTPSink *sink)
+{
+    long long total = 0;
+
+    if (!sink->acquire && !s->buffer &&
+        posix_memalign((void **)&s->buffer, BUFFER_ALIGNMENT, s->readSize) != 0)
+    {
+        s->buffer = NULL;
+        return -1;
+    }
+
+    for (;;)
+    {
+        size_t length = s->readSize;
+        char *buffer = sink->acquire ? sink->acquire(sink->ctx, &length) : s->buffer;
+        if (!buffer || length == 0)
+            return -1;
+
+        ssize_t n = read(dataSock, buffer, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0 ? total : -1;
+
+        if (sink->consume(sink->ctx, buffer, n) != 0)
+            return -1;
+        total += n;
+    }
+}
+
+/**
+ * @brief Runs one PASV/RETR cycle into a sink
+ *
+ * @param s Connected session
+ * @param path Remote path
+ * @param offset Restart offset
+ * @param sink Destination
+ * @param started Set once the server accepted RETR
+ * @return long long Bytes delivered, -1 on failure
+ */
+static long long sessionRetrieve(struct FTPSession *s, char *path, long long offset,
+                                 const struct FTPSink *sink, int *started)
+{
+    if (!s->passive && enterPassiveMode(s->ctrlSock, s->dataAddr, &s->dataPort) != 0)
+        return -1;
+    s->passive = 0;
+
+    int dataSock = createSocketWith(s->dataAddr, s->dataPort, &s->socket);
+    if (dataSock < 0)
+        return -1;
+
+    // Data from the wrong offset is worse than none
+    long long total = -1;
+    if ((offset == 0 || restartAt(s->ctrlSock, offset) == 0) &&
+        requestFile(s->ctrlSock, path) == 0)
+    {
+        *started = 1;
+        if (connectionFlags(s->ctrlSock) & CONN_COMPRESSED)
+        {
+            struct TransferOptions opts = {0};
+            opts.readSize = s->readSize;
+            total = inflateStream(dataSock, &opts, sink->consume, sink->ctx, NULL);
+        }
+        else
+            total = sessionReceive(s, dataSock, sink);
+    }
+
+    close(dataSock);
+    if (total >= 0 && finishTransfer(s->ctrlSock) != 0)
+        total = -1;
+    return total;
+}
+
+/**
+ * @brief Connects and logs in to a server
+ *
+ * @param url Server URL; any path is ignored
+ * @param options Session tunables, NULL for defaults
+ * @return struct FTPSession* Session handle, NULL on failure
+ */
+struct FTPSession *ftpSessionOpen(const char *url, const struct FTPSessionOptions *options)
+{
+    struct FTPSession *s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+
+    if (parseMirrorUrl(url, &s->url) != 0)
+    {
+        logMessage("Invalid URL: %s\n", url);
+        free(s);
+        return NULL;
+    }
+
+    if (options)
+        s->options = *options;
+    s->readSize = s->options.readSize ? s->options.readSize : ENGINE_READ_SIZE;
+    s->socket.rcvbuf = s->options.rcvbuf;
+
+    sigset_t mask;
+    int pending = blockSigpipe(&mask);
+    int result = sessionConnect(s);
+    restoreSigpipe(&mask, pending);
+
+    if (result != 0)
+    {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * @brief Downloads a file into a sink, reconnecting once if the control
+ *        connection turns out to be closed before the transfer starts
+ *
+ * @param session Session
+ * @param path Remote path
+ * @param offset Byte to start from, 0 for the whole file
+ * @param sink Destination
+ * @return long long Bytes delivered, -1 on failure or abort
+ */
+long long ftpSessionFetch(struct FTPSession *session, const char *path, long long offset,
+                          const struct FTPSink *sink)
+{
+    char resource[MAX_LENGTH];
+    long long total = -1;
+
+    if (!session || !sink || !sink->consume || offset < 0 ||
+        snprintf(resource, sizeof(resource), "%s", path) >= (int)sizeof(resource))
+        return -1;
+
+    sigset_t mask;
+    int pending = blockSigpipe(&mask);
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int started = 0;
+
+        if (session->ctrlSock < 0 && sessionConnect(session) != 0)
+            break;
+        total = sessionRetrieve(session, resource, offset, sink, &started);
+        if (total >= 0)
+            break;
+
+        sessionRecover(session);
+        // Only a dead connection is retried, and only if no data was delivered
+        if (started || session->ctrlSock >= 0)
+            break;
+        logMessage("Control connection lost, reconnecting\n");
+    }
+    restoreSigpipe(&mask, pending);
+    return total;
+}
+
+/**
+ * @brief Queries the size of a remote file
+ *
+ * @param session Session
+ * @param path Remote path
+ * @param size Receives the size in bytes
+ * @return int 0 on success, -1 if the server does not report a size
+ */
+int ftpSessionSize(struct FTPSession *session, const char *path, long long *size)
+{
+    int result = -1;
+
+    if (!session || !size)
+        return -1;
+
+    sigset_t mask;
+    int pending = blockSigpipe(&mask);
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (session->ctrlSock < 0 && sessionConnect(session) != 0)
+            break;
+        if ((result = getFileSize(session->ctrlSock, path, size)) == 0)
+            break;
+
+        sessionRecover(session);
+        if (session->ctrlSock >= 0)
+            break;
+    }
+    restoreSigpipe(&mask, pending);
+    return result;
+}
+
+/**
+ * @brief Logs out and releases a session
+ *
+ * @param session Session, may be NULL
+ */
+void ftpSessionClose(struct FTPSession *session)
+{
+    if (!session)
+        return;
+
+    if (session->ctrlSock >= 0)
+    {
+        sigset_t mask;
+        int pending = blockSigpipe(&mask);
+        closeConnection(session->ctrlSock);
+        restoreSigpipe(&mask, pending);
+    }
+    free(session->buffer);
+    free(session);
+}
@@ -0,0 +1,60 @@
+/**
+ * @file log.c
+ * @brief Status output of the FTP client
+ *
+ * Every message of the protocol and transfer code goes through
+ * logMessage(). The download executable prints to stdout. The library
+ * build (FTP_LIBRARY) starts silent, so an embedding program sees no
+ * output unless it installs a handler, and a dropped message costs one
+ * branch: nothing is formatted.
+ */
+
+#include "ftp_client.h"
+#include "libftpclient.h"
+#include <stdarg.h>
+
+static void (*logHandler)(void *ctx, const char *message);
+static void *logContext;
+#ifdef FTP_LIBRARY
+static int logEnabled = 0;
+#else
+static int logEnabled = 1;
+#endif
+
+/**
+ * @brief Emits a status message
+ *
+ * @param format printf-style format
+ */
+void logMessage(const char *format, ...)
+{
+    va_list args;
+
+    if (!logEnabled)
+        return;
+
+    va_start(args, format);
+    if (logHandler)
+    {
+        // Long server replies are truncated
+        char message[BUFFER_SIZE * 2];
+        vsnprintf(message, sizeof(message), format, args);
+        logHandler(logContext, message);
+    }
+    else
+        vprintf(format, args);
+    va_end(args);
+}
+
+/**
+ * @brief Routes status messages to a callback
+ *
+ * @param handler Called with every message, NULL to drop messages
+ * @param ctx Passed to handler
+ */
+void ftpSetLogHandler(void (*handler)(void *ctx, const char *message), void *ctx)
+{
+    logHandler = handler;
+    logContext = ctx;
+    logEnabled = handler != NULL;
+}
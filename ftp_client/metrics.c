@@ -0,0 +1,269 @@
+/**
+ * @file metrics.c
+ * @brief Transfer metrics and progress reporting for FTP client
+ *
+ * This file implements the instrumentation used by every receive path.
+ * Receive loops only call metricsAdd() per chunk, which adds the byte
+ * count and reads the monotonic clock (a vDSO call, no system call).
+ * Reports are produced on a timer, at most once per
+ * METRICS_SAMPLE_INTERVAL, in one of three formats:
+ *
+ * - Text: the "\rDownloaded: X MB (Y MB/s)" line on stdout (default).
+ * - JSON lines: one object per sample on stderr or appended to a file:
+ *     {"event":"progress","file":"a.iso","bytes":1048576,"size":4194304,
+ *      "elapsed":1.002,"throughput":1046483,"rate":1046483,"stalls":0}
+ *   and a final "done" event with "ok":true or false.
+ * - Prometheus text exposition: gauges and counters labelled by file,
+ *   written to stderr or atomically replacing a file (write + rename),
+ *   which suits the node_exporter textfile collector.
+ *
+ * Throughput is the average since the start; rate is the instantaneous
+ * rate over the last sample interval. A stall is counted every time no
+ * data arrived for METRICS_STALL_SECONDS or longer.
+ */
+
+#include "ftp_client.h"
+
+/**
+ * @brief Writes a string with JSON / Prometheus label escaping
+ *
+ * Both formats escape backslash, double quote and newline the same way;
+ * other control characters are dropped.
+ *
+ * @param out Output stream
+ * @param text String to write
+ */
+static void writeEscaped(FILE *out, const char *text)
+{
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+            fprintf(out, "\\%c", *text);
+        else if (*text == '\n')
+            fputs("\\n", out);
+        else if ((unsigned char)*text >= 0x20)
+            fputc(*text, out);
+    }
+}
+
+/**
+ * @brief Writes one JSON-lines event
+ *
+ * @param m Metrics
+ * @param out Output stream
+ * @param elapsed Seconds since the start
+ * @param event "progress" or "done"
+ * @param ok Outcome, only written for "done"
+ */
+static void writeJson(const struct TransferMetrics *m, FILE *out, double elapsed,
+                      const char *event, int ok)
+{
+    fprintf(out, "{\"event\":\"%s\",\"file\":\"", event);
+    writeEscaped(out, m->name);
+    fprintf(out, "\",\"bytes\":%lld,\"size\":%lld,\"elapsed\":%.3f,"
+                 "\"throughput\":%.0f,\"rate\":%.0f,\"stalls\":%d",
+            m->bytes, m->size, elapsed, elapsed > 0 ? m->bytes / elapsed : 0.0,
+            m->rate, m->stalls);
+    if (m->wireBytes > 0)
+        fprintf(out, ",\"wire_bytes\":%lld", m->wireBytes);
+    if (strcmp(event, "done") == 0)
+        fprintf(out, ",\"ok\":%s", ok ? "true" : "false");
+    fputs("}\n", out);
+    fflush(out);
+}
+
+/**
+ * @brief Writes one metric line of the Prometheus text format
+ */
+static void writePromMetric(FILE *out, const struct TransferMetrics *m, const char *name,
+                            const char *type, const char *help, double value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s{file=\"", name, help, name, type, name);
+    writeEscaped(out, m->name);
+    fprintf(out, "\"} %.17g\n", value);
+}
+
+/**
+ * @brief Writes a full Prometheus exposition of the transfer
+ *
+ * With a path the exposition goes to "<path>.tmp" and is renamed over
+ * the target, so scrapers never read a half-written file.
+ *
+ * @param m Metrics
+ * @param elapsed Seconds since the start
+ * @param done Non-zero once the transfer has ended
+ */
+static void writePrometheus(const struct TransferMetrics *m, double elapsed, int done)
+{
+    char tmp[MAX_LENGTH + 16];
+    FILE *out = stderr;
+
+    if (m->path)
+    {
+        snprintf(tmp, sizeof(tmp), "%s.tmp", m->path);
+        if (!(out = fopen(tmp, "w")))
+            return;
+    }
+
+    writePromMetric(out, m, "ftp_transfer_bytes_total", "counter",
+                    "Bytes received", m->bytes);
+    if (m->wireBytes > 0)
+        writePromMetric(out, m, "ftp_transfer_wire_bytes_total", "counter",
+                        "Compressed bytes read from the data connection", m->wireBytes);
+    writePromMetric(out, m, "ftp_transfer_size_bytes", "gauge",
+                    "Size reported by SIZE, 0 if unknown", m->size);
+    writePromMetric(out, m, "ftp_transfer_elapsed_seconds", "gauge",
+                    "Time since the transfer started", elapsed);
+    writePromMetric(out, m, "ftp_transfer_throughput_bytes_per_second", "gauge",
+                    "Average rate since the start", elapsed > 0 ? m->bytes / elapsed : 0);
+    writePromMetric(out, m, "ftp_transfer_rate_bytes_per_second", "gauge",
+                    "Rate over the last sample interval", m->rate);
+    writePromMetric(out, m, "ftp_transfer_stalls_total", "counter",
+                    "Gaps without data of at least the stall threshold", m->stalls);
+    writePromMetric(out, m, "ftp_transfer_done", "gauge",
+                    "1 once the transfer has ended", done);
+
+    if (m->path)
+    {
+        fclose(out);
+        rename(tmp, m->path);
+    }
+    else
+        fflush(out);
+}
+
+/**
+ * @brief Starts collecting metrics for a transfer
+ *
+ * @param m Metrics to initialize
+ * @param name Name reported for the transfer (the file name)
+ * @param size Expected size in bytes, 0 if unknown
+ * @param opts Transfer options selecting format and destination, may be NULL
+ */
+void metricsStart(struct TransferMetrics *m, const char *name, long long size,
+                  const struct TransferOptions *opts)
+{
+    memset(m, 0, sizeof(*m));
+    m->name = name;
+    m->size = size;
+    m->format = opts ? opts->metricsFormat : METRICS_TEXT;
+    m->path = opts ? opts->metricsPath : NULL;
+    m->hedge = opts ? opts->hedge : NULL;
+    m->start = m->lastSample = m->lastChunk = traceSeconds();
+    m->nextSample = m->start + METRICS_SAMPLE_INTERVAL;
+
+    if (m->format == METRICS_JSON)
+        m->out = m->path ? fopen(m->path, "a") : stderr;
+}
+
+/**
+ * @brief Emits a report of the current state
+ *
+ * @param m Metrics
+ * @param now Current monotonic time in seconds
+ */
+static void metricsSample(struct TransferMetrics *m, double now)
+{
+    double elapsed = now - m->start;
+    double interval = now - m->lastSample;
+
+    m->rate = interval > 0 ? (m->bytes - m->sampleBytes) / interval : 0;
+    m->sampleBytes = m->bytes;
+    m->lastSample = now;
+    m->nextSample = now + METRICS_SAMPLE_INTERVAL;
+
+    switch (m->format)
+    {
+    case METRICS_JSON:
+        if (m->out)
+            writeJson(m, m->out, elapsed, "progress", 0);
+        break;
+    case METRICS_PROMETHEUS:
+        writePrometheus(m, elapsed, 0);
+        break;
+    default:
+        if (elapsed > 0)
+        {
+            logMessage("\r%s: %.2f MB (%.2f MB/s)", m->upload ? "Uploaded" : "Downloaded",
+                       m->bytes / (1024.0 * 1024.0), m->bytes / (1024.0 * 1024.0) / elapsed);
+            fflush(stdout);
+        }
+        break;
+    }
+}
+
+/**
+ * @brief Accounts for received bytes and reports when the sample timer expires
+ *
+ * Called once per chunk by the receive loops; a call with 0 bytes only
+ * checks the timer.
+ *
+ * @param m Metrics
+ * @param bytes Bytes received since the last call
+ */
+void metricsAdd(struct TransferMetrics *m, long long bytes)
+{
+    double now = traceSeconds();
+
+    if (bytes > 0)
+    {
+        if (m->bytes == 0)
+            traceStep(TRACE_FIRST_BYTE);
+        if (now - m->lastChunk >= METRICS_STALL_SECONDS)
+            m->stalls++;
+        m->lastChunk = now;
+        m->bytes += bytes;
+        if (m->hedge)
+            hedgeProgress(m->hedge, m->bytes);
+    }
+
+    if (now >= m->nextSample)
+        metricsSample(m, now);
+}
+
+/**
+ * @brief Accounts for compressed bytes read off the data connection
+ *
+ * Called by the MODE Z receive path next to metricsAdd(), which counts
+ * the inflated bytes.
+ *
+ * @param m Metrics
+ * @param bytes Compressed bytes read since the last call
+ */
+void metricsAddWire(struct TransferMetrics *m, long long bytes)
+{
+    m->wireBytes += bytes;
+}
+
+/**
+ * @brief Emits the final report of a transfer and releases its output
+ *
+ * @param m Metrics
+ * @param ok Non-zero if the transfer succeeded
+ */
+void metricsFinish(struct TransferMetrics *m, int ok)
+{
+    double now = traceSeconds();
+    double interval = now - m->lastSample;
+
+    if (interval > 0)
+        m->rate = (m->bytes - m->sampleBytes) / interval;
+
+    switch (m->format)
+    {
+    case METRICS_JSON:
+        if (m->out)
+        {
+            writeJson(m, m->out, now - m->start, "done", ok);
+            if (m->out != stderr)
+                fclose(m->out);
+            m->out = NULL;
+        }
+        break;
+    case METRICS_PROMETHEUS:
+        writePrometheus(m, now - m->start, 1);
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,790 @@
+/**
+ * @file mirror.c
+ * @brief Recursive mirror mode for FTP client
+ *
+ * This file implements copying a whole remote directory tree into
+ * downloads/. Directories are walked with MLSD (RFC 3659) and every
+ * directory and file found becomes a work item for a pool of worker
+ * sessions, each with its own authenticated control connection:
+ *
+ *   directory: PASV -> MLSD <dir> -> parse listing -> queue entries -> 226
+ *   file:      PASV -> RETR <file> -> receive -> 226
+ *
+ * Work is distributed by work stealing. Every worker owns a deque: the
+ * entries of a listing it runs are pushed at the bottom of its own deque
+ * as they are parsed, and it pops from the bottom (depth first, keeping
+ * the queue small). Idle workers steal from the top of other deques,
+ * taking the oldest items, so a large directory being listed by one
+ * worker is drained by all of them while the listing is still arriving.
+ *
+ * The MLSD listing is parsed as a stream, straight from the receive
+ * buffer; only lines split across two reads are copied. Include and
+ * exclude globs are applied while listing, so excluded directories are
+ * never entered.
+ */
+
+#include "ftp_client.h"
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/**
+ * @struct MirrorItem
+ * @brief One directory to list or file to fetch
+ */
+struct MirrorItem {
+    long long size;     /**< Size from the listing, 0 if unknown */
+    int directory;      /**< Non-zero for a directory */
+    char path[];        /**< Remote path, also the path under downloads/ */
+};
+
+/**
+ * @struct MirrorDeque
+ * @brief Work deque owned by one worker
+ *
+ * A ring buffer of items; the owner pushes and pops at the tail, thieves
+ * take from the head.
+ */
+struct MirrorDeque {
+    struct MirrorItem **items;  /**< Ring buffer */
+    int head;                   /**< Index of the oldest item */
+    int count;                  /**< Number of items */
+    int capacity;               /**< Allocated slots */
+    pthread_mutex_t lock;       /**< Protects every field above */
+};
+
+/**
+ * @struct MirrorJob
+ * @brief Shared state for all workers of one mirror
+ */
+struct MirrorJob {
+    struct URL *url;                       /**< Root URL (host, credentials, root path) */
+    const struct MirrorOptions *mirror;    /**< Worker count and globs */
+    const struct TransferOptions *opts;    /**< Options applied to every file */
+    size_t rootLength;                     /**< Length of the root path prefix */
+    struct MirrorDeque *deques;            /**< One deque per worker */
+    int count;                             /**< Number of workers */
+    int outstanding;                       /**< Items queued or being processed */
+    int queued;                            /**< Items sitting in deques */
+    int alive;                             /**< Workers still running */
+    int files, directories, failed, skipped, steals;  /**< Statistics */
+    long long bytes;                       /**< Bytes of the files fetched */
+    pthread_mutex_t lock;                  /**< Protects the counters above */
+    pthread_cond_t wake;                   /**< Signalled on new work or completion */
+};
+
+/**
+ * @struct MirrorWorker
+ * @brief Per-thread state of a mirror worker
+ */
+struct MirrorWorker {
+    struct MirrorJob *job;  /**< Job the worker belongs to */
+    int index;              /**< Index of the worker's deque */
+    int ctrlSock;           /**< Control connection, -1 if not connected */
+    pthread_t thread;       /**< Worker thread */
+};
+
+/**
+ * @enum MlsdType
+ * @brief Kind of a listed entry, from its "type" fact
+ */
+enum MlsdType {
+    MLSD_OTHER = 0,  /**< cdir, pdir, links and anything else */
+    MLSD_FILE,       /**< Regular file */
+    MLSD_DIR         /**< Subdirectory */
+};
+
+/**
+ * @struct MlsdEntry
+ * @brief One parsed MLSD line; the name points into the receive buffer
+ */
+struct MlsdEntry {
+    const char *name;      /**< Entry name, not NUL-terminated */
+    size_t nameLength;     /**< Length of name */
+    enum MlsdType type;    /**< Entry type */
+    long long size;        /**< "size" fact, 0 if absent */
+};
+
+/**
+ * @struct MlsdParser
+ * @brief Streaming MLSD parser state
+ */
+struct MlsdParser {
+    char line[MLSD_MAX_LINE];  /**< Start of a line split across reads */
+    size_t length;             /**< Bytes held in line */
+    int overflow;              /**< Current line is too long and is skipped */
+};
+
+/**
+ * @brief Compares a fact name, case-insensitively as RFC 3659 requires
+ */
+static int factIs(const char *fact, size_t length, const char *name)
+{
+    return strlen(name) == length && strncasecmp(fact, name, length) == 0;
+}
+
+/**
+ * @brief Parses one MLSD line of the form "fact=value;fact=value; name"
+ *
+ * @param line Line without its line terminator
+ * @param length Length of line
+ * @param entry Receives the entry
+ * @return int 0 on success, -1 for a malformed line
+ */
+static int parseMlsdLine(const char *line, size_t length, struct MlsdEntry *entry)
+{
+    const char *end = line + length;
+    const char *space = memchr(line, ' ', length);
+
+    if (!space || space + 1 >= end)
+        return -1;
+
+    entry->name = space + 1;
+    entry->nameLength = end - entry->name;
+    entry->type = MLSD_OTHER;
+    entry->size = 0;
+
+    for (const char *fact = line; fact < space;)
+    {
+        const char *semi = memchr(fact, ';', space - fact);
+        const char *stop = semi ? semi : space;
+        const char *eq = memchr(fact, '=', stop - fact);
+
+        if (eq)
+        {
+            const char *value = eq + 1;
+            size_t valueLength = stop - value;
+
+            if (factIs(fact, eq - fact, "type"))
+            {
+                if (factIs(value, valueLength, "file"))
+                    entry->type = MLSD_FILE;
+                else if (factIs(value, valueLength, "dir"))
+                    entry->type = MLSD_DIR;
+            }
+            else if (factIs(fact, eq - fact, "size"))
+            {
+                long long size = 0;
+                for (const char *p = value; p < stop && *p >= '0' && *p <= '9'; p++)
+                    size = size * 10 + (*p - '0');
+                entry->size = size;
+            }
+        }
+        fact = stop + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Feeds received listing data to the parser
+ *
+ * Complete lines are parsed in place; a partial line at the end of the
+ * chunk is kept until the rest arrives.
+ *
+ * @param parser Parser state
+ * @param data Received bytes
+ * @param length Number of bytes
+ * @param onEntry Called for every parsed entry
+ * @param ctx Passed to onEntry
+ */
+static void mlsdFeed(struct MlsdParser *parser, const char *data, size_t length,
+                     void (*onEntry)(void *ctx, const struct MlsdEntry *entry), void *ctx)
+{
+    struct MlsdEntry entry;
+
+    while (length > 0)
+    {
+        const char *newline = memchr(data, '\n', length);
+        size_t chunk = newline ? (size_t)(newline - data) : length;
+
+        if (parser->overflow || parser->length + chunk >= sizeof(parser->line))
+        {
+            // Too long for any name we could store: skip to the next line
+            parser->overflow = 1;
+            parser->length = 0;
+        }
+        else if (!newline || parser->length > 0)
+        {
+            memcpy(parser->line + parser->length, data, chunk);
+            parser->length += chunk;
+        }
+
+        if (!newline)
+            return;
+
+        if (!parser->overflow)
+        {
+            const char *line = parser->length > 0 ? parser->line : data;
+            size_t lineLength = parser->length > 0 ? parser->length : chunk;
+            if (lineLength > 0 && line[lineLength - 1] == '\r')
+                lineLength--;
+            if (lineLength > 0 && parseMlsdLine(line, lineLength, &entry) == 0)
+                onEntry(ctx, &entry);
+        }
+
+        parser->length = 0;
+        parser->overflow = 0;
+        data += chunk + 1;
+        length -= chunk + 1;
+    }
+}
+
+/**
+ * @brief Appends an item at the tail of a deque
+ *
+ * @return int 0 on success, -1 if out of memory
+ */
+static int dequePush(struct MirrorDeque *d, struct MirrorItem *item)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->capacity)
+    {
+        int capacity = d->capacity ? d->capacity * 2 : 64;
+        struct MirrorItem **grown = malloc(capacity * sizeof(*grown));
+        if (grown)
+        {
+            // Unwrap the ring into the new buffer
+            for (int i = 0; i < d->count; i++)
+                grown[i] = d->items[(d->head + i) % d->capacity];
+            free(d->items);
+            d->items = grown;
+            d->head = 0;
+            d->capacity = capacity;
+        }
+    }
+    if (d->count < d->capacity)
+        d->items[(d->head + d->count++) % d->capacity] = item;
+    else
+        result = -1;
+    pthread_mutex_unlock(&d->lock);
+    return result;
+}
+
+/**
+ * @brief Removes the newest item (owner) or the oldest item (thief)
+ *
+ * @param d Deque
+ * @param steal Non-zero to take from the head
+ * @return struct MirrorItem* Item, NULL if the deque is empty
+ */
+static struct MirrorItem *dequeTake(struct MirrorDeque *d, int steal)
+{
+    struct MirrorItem *item = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->count > 0)
+    {
+        if (steal)
+        {
+            item = d->items[d->head];
+            d->head = (d->head + 1) % d->capacity;
+        }
+        else
+            item = d->items[(d->head + d->count - 1) % d->capacity];
+        d->count--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return item;
+}
+
+/**
+ * @brief Queues a work item on a worker's deque and wakes an idle worker
+ *
+ * @param job Mirror job
+ * @param index Deque to push to
+ * @param path Remote path
+ * @param directory Non-zero for a directory
+ * @param size Size from the listing
+ * @return int 0 on success, -1 if out of memory
+ */
+static int mirrorQueue(struct MirrorJob *job, int index, const char *path, int directory, long long size)
+{
+    size_t length = strlen(path);
+    struct MirrorItem *item = malloc(sizeof(*item) + length + 1);
+
+    if (!item)
+        return -1;
+    item->size = size;
+    item->directory = directory;
+    memcpy(item->path, path, length + 1);
+
+    // Counted before it is visible so the job cannot look finished
+    pthread_mutex_lock(&job->lock);
+    job->outstanding++;
+    pthread_mutex_unlock(&job->lock);
+
+    if (dequePush(&job->deques[index], item) != 0)
+    {
+        free(item);
+        pthread_mutex_lock(&job->lock);
+        job->outstanding--;
+        pthread_mutex_unlock(&job->lock);
+        return -1;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->queued++;
+    pthread_cond_signal(&job->wake);
+    pthread_mutex_unlock(&job->lock);
+    return 0;
+}
+
+/**
+ * @brief Returns the next item for a worker, stealing when its deque is empty
+ *
+ * Blocks while other workers are still busy and may produce more work.
+ *
+ * @param w Worker
+ * @return struct MirrorItem* Item, NULL once the whole tree is done
+ */
+static struct MirrorItem *mirrorNext(struct MirrorWorker *w)
+{
+    struct MirrorJob *job = w->job;
+
+    for (;;)
+    {
+        struct MirrorItem *item = dequeTake(&job->deques[w->index], 0);
+        int stolen = 0;
+
+        // Oldest items of other workers, starting after our own index
+        for (int k = 1; !item && k < job->count; k++)
+            if ((item = dequeTake(&job->deques[(w->index + k) % job->count], 1)))
+                stolen = 1;
+
+        pthread_mutex_lock(&job->lock);
+        if (item)
+        {
+            job->queued--;
+            job->steals += stolen;
+            pthread_mutex_unlock(&job->lock);
+            return item;
+        }
+        if (job->outstanding == 0)
+        {
+            pthread_mutex_unlock(&job->lock);
+            return NULL;
+        }
+        if (job->queued == 0)
+            pthread_cond_wait(&job->wake, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+/**
+ * @brief Marks an item as processed and wakes everyone when the tree is done
+ */
+static void mirrorDone(struct MirrorJob *job, struct MirrorItem *item, int ok)
+{
+    pthread_mutex_lock(&job->lock);
+    if (!ok)
+        job->failed++;
+    else if (item->directory)
+        job->directories++;
+    else
+    {
+        job->files++;
+        job->bytes += item->size;
+    }
+    if (--job->outstanding == 0)
+        pthread_cond_broadcast(&job->wake);
+    pthread_mutex_unlock(&job->lock);
+    free(item);
+}
+
+/**
+ * @brief Checks a path relative to the mirror root against a list of globs
+ *
+ * Patterns without a '/' are matched against the last path component,
+ * the others against the whole relative path.
+ *
+ * @return int Non-zero if any pattern matches
+ */
+static int matchesAny(char *const *patterns, int count, const char *relative)
+{
+    const char *base = strrchr(relative, '/');
+
+    base = base ? base + 1 : relative;
+    for (int i = 0; i < count; i++)
+    {
+        const char *subject = strchr(patterns[i], '/') ? relative : base;
+        if (fnmatch(patterns[i], subject, FNM_PATHNAME) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Creates downloads/<path> and any missing parent directory
+ *
+ * @param path Directory path relative to downloads/
+ * @return int 0 on success, -1 on failure
+ */
+static int makeLocalDirectory(const char *path)
+{
+    char local[MAX_LENGTH + 16];
+
+    snprintf(local, sizeof(local), "downloads/%s", path);
+    for (char *p = local + strlen("downloads/"); ; p++)
+    {
+        if (*p != '/' && *p != '\0')
+            continue;
+
+        char saved = *p;
+        *p = '\0';
+        if (mkdir(local, 0755) != 0 && errno != EEXIST)
+        {
+            logMessage("Cannot create directory %s: %s\n", local, strerror(errno));
+            return -1;
+        }
+        if ((*p = saved) == '\0')
+            return 0;
+    }
+}
+
+/**
+ * @struct ListingContext
+ * @brief State passed to the entry callback while a directory is listed
+ */
+struct ListingContext {
+    struct MirrorWorker *worker;  /**< Worker running the listing */
+    const char *directory;        /**< Remote path of the listed directory */
+    struct MlsdParser *parser;    /**< Parser of the listing stream */
+};
+
+/**
+ * @brief Filters one listed entry and queues it on the worker's deque
+ */
+static void onListedEntry(void *ctx, const struct MlsdEntry *entry)
+{
+    struct ListingContext *listing = ctx;
+    struct MirrorJob *job = listing->worker->job;
+    const struct MirrorOptions *mirror = job->mirror;
+    char path[MAX_LENGTH];
+
+    if (entry->type == MLSD_OTHER ||
+        memchr(entry->name, '/', entry->nameLength) ||
+        (entry->nameLength == 1 && entry->name[0] == '.') ||
+        (entry->nameLength == 2 && entry->name[0] == '.' && entry->name[1] == '.'))
+        return;
+
+    // Room is kept for the "downloads/" prefix and the resume sidecar
+    int length = listing->directory[0]
+                     ? snprintf(path, sizeof(path), "%s/%.*s", listing->directory,
+                                (int)entry->nameLength, entry->name)
+                     : snprintf(path, sizeof(path), "%.*s", (int)entry->nameLength, entry->name);
+    if (length >= (int)sizeof(path) - 32)
+    {
+        logMessage("Skipping %.*s: path too long\n", (int)entry->nameLength, entry->name);
+        return;
+    }
+
+    const char *relative = path + job->rootLength;
+    if (matchesAny(mirror->exclude, mirror->excludeCount, relative) ||
+        (entry->type == MLSD_FILE && mirror->includeCount > 0 &&
+         !matchesAny(mirror->include, mirror->includeCount, relative)))
+    {
+        pthread_mutex_lock(&job->lock);
+        job->skipped++;
+        pthread_mutex_unlock(&job->lock);
+        return;
+    }
+
+    if (mirrorQueue(job, listing->worker->index, path, entry->type == MLSD_DIR, entry->size) != 0)
+    {
+        pthread_mutex_lock(&job->lock);
+        job->failed++;
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+/**
+ * @brief Feeds an inflated block of a MODE Z listing to the parser
+ */
+static int feedListing(void *ctx, const char *data, size_t length)
+{
+    struct ListingContext *listing = ctx;
+
+    mlsdFeed(listing->parser, data, length, onListedEntry, listing);
+    return 0;
+}
+
+/**
+ * @brief Lists a remote directory and queues its entries
+ *
+ * @param w Worker with an open control connection
+ * @param item Directory to list
+ * @return int 0 on success, -1 on failure
+ */
+static int listDirectory(struct MirrorWorker *w, struct MirrorItem *item)
+{
+    struct MlsdParser parser = { .length = 0, .overflow = 0 };
+    struct ListingContext listing = { w, item->path, &parser };
+    char dataAddr[BUFFER_SIZE];
+    char buffer[BUFFER_SIZE * 16];
+    int dataPort, result = -1;
+    ssize_t bytes;
+
+    if (makeLocalDirectory(item->path[0] ? item->path : ".") != 0 ||
+        enterPassiveMode(w->ctrlSock, dataAddr, &dataPort) != 0)
+        return -1;
+
+    int dataSock = createSocketWith(dataAddr, dataPort, &w->job->opts->socket);
+    if (dataSock < 0)
+        return -1;
+
+    if (requestListing(w->ctrlSock, item->path) == 0)
+    {
+        // In MODE Z the listing is compressed like any other transfer
+        if (connectionFlags(w->ctrlSock) & CONN_COMPRESSED)
+            bytes = inflateStream(dataSock, NULL, feedListing, &listing, NULL) < 0 ? -1 : 0;
+        else
+            while ((bytes = read(dataSock, buffer, sizeof(buffer))) > 0)
+                mlsdFeed(&parser, buffer, bytes, onListedEntry, &listing);
+        if (bytes == 0)
+            result = finishTransfer(w->ctrlSock);
+    }
+
+    close(dataSock);
+    return result;
+}
+
+/**
+ * @brief Fetches one file over the worker's control connection
+ *
+ * @param w Worker with an open control connection
+ * @param item File to fetch
+ * @return int 0 on success, -1 on failure
+ */
+static int fetchFile(struct MirrorWorker *w, struct MirrorItem *item)
+{
+    struct TransferOptions fileOpts = *w->job->opts;
+    struct URL url;
+    char dataAddr[BUFFER_SIZE];
+    int dataPort;
+
+    memcpy(&url, w->job->url, sizeof(url));
+    snprintf(url.resource, sizeof(url.resource), "%s", item->path);
+    snprintf(url.file, sizeof(url.file), "%s", item->path);
+
+    // The listing already gave the size; only resume needs SIZE and MDTM
+    fileOpts.expectedSize = item->size;
+    if (fileOpts.resume && prepareDownload(w->ctrlSock, &url, &fileOpts) == 1)
+        return 0;
+
+    if (enterPassiveMode(w->ctrlSock, dataAddr, &dataPort) != 0)
+        return -1;
+
+    int dataSock = createSocketWith(dataAddr, dataPort, &fileOpts.socket);
+    if (dataSock < 0)
+        return -1;
+
+    int result = -1;
+    struct Checksum sum;
+    checksumAttach(&fileOpts, &sum);
+    requestRestart(w->ctrlSock, &fileOpts.offset);
+    if (requestFile(w->ctrlSock, url.resource) == 0)
+        result = retrieveFile(w->ctrlSock, dataSock, &url, &fileOpts);
+    if (result == 0)
+        result = verifyChecksum(w->ctrlSock, &url, fileOpts.checksum);
+
+    if (result == 0 && fileOpts.resume)
+        clearResume(&url);
+
+    close(dataSock);
+    return result;
+}
+
+/**
+ * @brief Opens an authenticated binary-mode control connection
+ *
+ * @param url Root URL holding the server address and credentials
+ * @param opts Transfer options (MODE Z)
+ * @return int Control socket on success, -1 on failure
+ */
+static int openMirrorSession(struct URL *url, const struct TransferOptions *opts)
+{
+    int sock = createSocket(url->host, url->port);
+    if (sock < 0)
+        return -1;
+
+    if (authenticate(sock, url->user, url->password) != 0 || setBinaryMode(sock) != 0)
+    {
+        closeConnection(sock);
+        return -1;
+    }
+    if (opts && opts->compress)
+        setCompressedMode(sock);
+
+    return sock;
+}
+
+/**
+ * @brief Thread body of a mirror worker
+ *
+ * Processes items until the tree is done. A failed item whose failure
+ * left the control connection unusable gets a fresh connection; a
+ * worker that cannot connect at all hands its item back and exits, and
+ * the remaining workers steal its queue.
+ *
+ * @param arg Worker state
+ * @return void* Always NULL
+ */
+static void *mirrorWorker(void *arg)
+{
+    struct MirrorWorker *w = arg;
+    struct MirrorJob *job = w->job;
+    struct MirrorItem *item;
+
+    while ((item = mirrorNext(w)) != NULL)
+    {
+        if (w->ctrlSock < 0 && (w->ctrlSock = openMirrorSession(job->url, job->opts)) < 0)
+        {
+            logMessage("Mirror worker %d: cannot open a session\n", w->index);
+            if (dequePush(&job->deques[w->index], item) == 0)
+            {
+                pthread_mutex_lock(&job->lock);
+                job->queued++;
+                pthread_cond_signal(&job->wake);
+                pthread_mutex_unlock(&job->lock);
+            }
+            else
+                mirrorDone(job, item, 0);
+            break;
+        }
+
+        int ok = (item->directory ? listDirectory(w, item) : fetchFile(w, item)) == 0;
+        if (!ok)
+        {
+            logMessage("Failed to mirror %s\n", item->path);
+            if (resyncControl(w->ctrlSock) != 0)
+            {
+                releaseReplyReader(w->ctrlSock);
+                close(w->ctrlSock);
+                w->ctrlSock = -1;
+            }
+        }
+        mirrorDone(job, item, ok);
+    }
+
+    if (w->ctrlSock >= 0)
+        closeConnection(w->ctrlSock);
+
+    pthread_mutex_lock(&job->lock);
+    job->alive--;
+    pthread_cond_broadcast(&job->wake);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/**
+ * @brief Parses the root URL of a mirror
+ *
+ * Unlike a file URL the path may end with '/' or be empty
+ * (ftp://host/ mirrors the login directory).
+ *
+ * @param input URL given on the command line
+ * @param url Receives the parsed URL; resource is the root path, "" for
+ *            the login directory
+ * @return int 0 on success, -1 on parsing failure
+ */
+int parseMirrorUrl(const char *input, struct URL *url)
+{
+    char copy[MAX_LENGTH * 2];
+    size_t length = snprintf(copy, sizeof(copy) - 2, "%s", input);
+    const char *scheme = strstr(copy, "//");
+
+    if (length >= sizeof(copy) - 2 || !scheme)
+        return -1;
+
+    // Drop trailing slashes, then stand in "." for an empty path
+    while (length > 0 && copy[length - 1] == '/' && &copy[length - 1] > scheme + 1)
+        copy[--length] = '\0';
+    int empty = strchr(scheme + 2, '/') == NULL;
+    if (empty)
+        strcat(copy, "/.");
+
+    if (parse(copy, url) != 0)
+        return -1;
+    if (empty)
+        url->resource[0] = url->file[0] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Mirrors a remote directory tree into downloads/
+ *
+ * @param url Root URL from parseMirrorUrl()
+ * @param mirror Worker count and include/exclude globs
+ * @param opts Transfer options applied to every file
+ * @return int 0 if every entry was mirrored, -1 otherwise
+ */
+int downloadMirror(struct URL *url, const struct MirrorOptions *mirror, const struct TransferOptions *opts)
+{
+    logMessage("\n=== MIRROR ===\n");
+    struct TransferOptions defaults = {0};
+    struct MirrorJob job;
+    struct MirrorWorker workers[MIRROR_MAX_WORKERS];
+    int count = mirror->workers > 0 ? mirror->workers : MIRROR_DEFAULT_WORKERS;
+
+    if (count > MIRROR_MAX_WORKERS)
+        count = MIRROR_MAX_WORKERS;
+
+    memset(&job, 0, sizeof(job));
+    job.url = url;
+    job.mirror = mirror;
+    job.opts = opts ? opts : &defaults;
+    job.rootLength = url->resource[0] ? strlen(url->resource) + 1 : 0;
+    job.count = count;
+    if (!(job.deques = calloc(count, sizeof(*job.deques))))
+        return -1;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.wake, NULL);
+    for (int i = 0; i < count; i++)
+        pthread_mutex_init(&job.deques[i].lock, NULL);
+
+    logMessage("Root: %s\n", url->resource[0] ? url->resource : "(login directory)");
+    logMessage("Workers: %d\n", count);
+
+    resolverPrefetch(url->host);
+    mirrorQueue(&job, 0, url->resource, 1, 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        workers[i].job = &job;
+        workers[i].index = i;
+        workers[i].ctrlSock = -1;
+        if (pthread_create(&workers[i].thread, NULL, mirrorWorker, &workers[i]) != 0)
+        {
+            count = i;
+            break;
+        }
+        pthread_mutex_lock(&job.lock);
+        job.alive++;
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    for (int i = 0; i < count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    // Items left behind when every worker failed to connect
+    for (int i = 0; i < job.count; i++)
+    {
+        struct MirrorItem *item;
+        while ((item = dequeTake(&job.deques[i], 0)))
+        {
+            job.failed++;
+            free(item);
+        }
+        free(job.deques[i].items);
+        pthread_mutex_destroy(&job.deques[i].lock);
+    }
+    free(job.deques);
+    pthread_cond_destroy(&job.wake);
+    pthread_mutex_destroy(&job.lock);
+
+    logMessage("\nMirror completed: %d files (%.2f MB), %d directories, %d skipped, %d failed, %d steals\n",
+               job.files, job.bytes / (1024.0 * 1024.0), job.directories, job.skipped, job.failed, job.steals);
+    return job.failed == 0 && count > 0 ? 0 : -1;
+}
@@ -0,0 +1,318 @@
+/**
+ * @file reply_reader.c
+ * @brief Buffered control-channel reader for FTP client
+ *
+ * This file implements a per-connection reader for FTP server replies.
+ * Instead of one read() per byte, data is pulled from the control socket
+ * in REPLY_BUFFER_SIZE chunks and split into complete replies by a small
+ * state machine following RFC 959 section 4.2:
+ *
+ * - Single-line reply:  "NNN text\r\n"
+ * - Multi-line reply:   "NNN-first line\r\n" ... "NNN last line\r\n"
+ *   where lines in between may contain anything, including other codes.
+ *
+ * Parsing is incremental: a partial reply stays in the buffer and the
+ * scan resumes where it stopped once more data arrives, so the reader can
+ * be fed from blocking or non-blocking sockets alike. Bytes following a
+ * reply (e.g. pipelined replies) are kept for the next call.
+ *
+ * Blocking callers use readReply(), which looks up the reader attached
+ * to a control socket. Readers are dropped when the socket is created or
+ * closed so that a recycled descriptor never sees stale bytes.
+ */
+
+#include "ftp_client.h"
+#include <pthread.h>
+
+/** Readers attached to control sockets, indexed by descriptor */
+static struct ReplyReader **readerTable = NULL;
+static int readerTableSize = 0;
+static pthread_mutex_t readerTableLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Initializes a reader for a control socket
+ *
+ * @param reader Reader to initialize
+ * @param sock Control socket the reader pulls data from
+ */
+void replyReaderInit(struct ReplyReader *reader, int sock)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->sock = sock;
+}
+
+/**
+ * @brief Releases the buffer owned by a reader
+ *
+ * @param reader Reader to release
+ */
+void replyReaderFree(struct ReplyReader *reader)
+{
+    free(reader->buf);
+    replyReaderInit(reader, reader->sock);
+}
+
+/**
+ * @brief Reads the next chunk of data from the socket into the buffer
+ *
+ * Consumed bytes are discarded first; the buffer grows when a single
+ * reply does not fit, up to MAX_REPLY_SIZE.
+ *
+ * @param reader Reader to fill
+ * @return ssize_t Bytes read, 0 on end of stream, -1 on error
+ */
+ssize_t replyReaderFill(struct ReplyReader *reader)
+{
+    // Drop bytes of replies already handed out
+    if (reader->start > 0)
+    {
+        size_t shift = reader->start;
+        memmove(reader->buf, reader->buf + shift, reader->end - shift);
+        reader->end -= shift;
+        reader->scan -= shift;
+        reader->lineStart -= shift;
+        reader->start = 0;
+    }
+
+    if (reader->end == reader->cap)
+    {
+        size_t cap = reader->cap ? reader->cap * 2 : REPLY_BUFFER_SIZE;
+        if (cap > MAX_REPLY_SIZE)
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        char *buf = realloc(reader->buf, cap + 1);
+        if (!buf)
+            return -1;
+        reader->buf = buf;
+        reader->cap = cap;
+    }
+
+    ssize_t bytes = read(reader->sock, reader->buf + reader->end, reader->cap - reader->end);
+    if (bytes > 0)
+        reader->end += bytes;
+    return bytes;
+}
+
+/**
+ * @brief Extracts the next complete reply from buffered data
+ *
+ * Scans newly buffered lines only. The returned view points into the
+ * reader's buffer, is NUL-terminated (without the final CRLF) and stays
+ * valid until the next call on the same reader.
+ *
+ * @param reader Reader holding buffered data
+ * @param reply Receives the reply code and message view
+ * @return int 1 if a reply was extracted, 0 if more data is needed, -1 on malformed input
+ */
+int replyReaderParse(struct ReplyReader *reader, struct FTPReply *reply)
+{
+    char *nl;
+
+    if (!reader->buf)
+        return 0;
+
+    while ((nl = memchr(reader->buf + reader->scan, '\n', reader->end - reader->scan)) != NULL)
+    {
+        char *line = reader->buf + reader->lineStart;
+        size_t lineEnd = nl - reader->buf;
+        size_t length = lineEnd - reader->lineStart;
+        int complete = 0;
+
+        reader->scan = reader->lineStart = lineEnd + 1;
+
+        if (reader->multiCode == 0)
+        {
+            // First line of a reply: "NNN " ends it, "NNN-" opens a block
+            if (length < 3 || line[0] < '1' || line[0] > '5' ||
+                line[1] < '0' || line[1] > '9' || line[2] < '0' || line[2] > '9')
+                return -1;
+            reader->code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+            if (length > 3 && line[3] == '-')
+                reader->multiCode = reader->code;
+            else
+                complete = 1;
+        }
+        else if (length >= 3 && line[0] == reader->buf[reader->start] &&
+                 line[1] == reader->buf[reader->start + 1] &&
+                 line[2] == reader->buf[reader->start + 2] &&
+                 (length == 3 || line[3] == ' ' || line[3] == '\r'))
+        {
+            // "NNN " with the opening code closes a multi-line block
+            complete = 1;
+        }
+
+        if (complete)
+        {
+            size_t textEnd = lineEnd;
+            if (textEnd > reader->start && reader->buf[textEnd - 1] == '\r')
+                textEnd--;
+            reader->buf[textEnd] = '\0';
+
+            reply->code = reader->lastCode = reader->code;
+            reply->text = reader->buf + reader->start;
+            reply->length = textEnd - reader->start;
+
+            reader->start = reader->lineStart;
+            reader->multiCode = 0;
+            return 1;
+        }
+    }
+
+    reader->scan = reader->end;
+    return 0;
+}
+
+/**
+ * @brief Blocks until the next complete reply is available
+ *
+ * @param reader Reader attached to the control socket
+ * @param reply Receives the reply code and message view
+ * @return int Reply code on success, -1 on error or connection close
+ */
+int replyReaderNext(struct ReplyReader *reader, struct FTPReply *reply)
+{
+    int result;
+
+    while ((result = replyReaderParse(reader, reply)) == 0)
+    {
+        ssize_t bytes = replyReaderFill(reader);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return -1;
+    }
+
+    return result < 0 ? -1 : reply->code;
+}
+
+/**
+ * @brief Returns the reader attached to a control socket, creating it if needed
+ *
+ * @param sock Control socket
+ * @return struct ReplyReader* Reader, or NULL for an invalid socket or if out of memory
+ */
+static struct ReplyReader *replyReaderFor(int sock)
+{
+    struct ReplyReader *reader = NULL;
+
+    if (sock < 0)
+        return NULL;
+    pthread_mutex_lock(&readerTableLock);
+    if (sock >= readerTableSize)
+    {
+        int size = readerTableSize ? readerTableSize : 64;
+        while (size <= sock)
+            size *= 2;
+        struct ReplyReader **table = realloc(readerTable, size * sizeof(*table));
+        if (table)
+        {
+            memset(table + readerTableSize, 0, (size - readerTableSize) * sizeof(*table));
+            readerTable = table;
+            readerTableSize = size;
+        }
+    }
+    if (sock < readerTableSize)
+    {
+        if (!readerTable[sock] && (readerTable[sock] = malloc(sizeof(struct ReplyReader))))
+            replyReaderInit(readerTable[sock], sock);
+        reader = readerTable[sock];
+    }
+    pthread_mutex_unlock(&readerTableLock);
+
+    return reader;
+}
+
+/**
+ * @brief Drops the reader attached to a control socket
+ *
+ * Any buffered but unread data is discarded.
+ *
+ * @param sock Control socket
+ */
+void releaseReplyReader(int sock)
+{
+    struct ReplyReader *reader = NULL;
+
+    pthread_mutex_lock(&readerTableLock);
+    if (sock >= 0 && sock < readerTableSize)
+    {
+        reader = readerTable[sock];
+        readerTable[sock] = NULL;
+    }
+    pthread_mutex_unlock(&readerTableLock);
+
+    if (reader)
+    {
+        replyReaderFree(reader);
+        free(reader);
+    }
+}
+
+/**
+ * @brief Returns the protocol flags recorded for a control connection
+ *
+ * Flags live in the connection's reader, so they are cleared whenever
+ * the descriptor is reused for a new connection.
+ *
+ * @param sock Control socket
+ * @return unsigned Bitwise OR of CONN_* flags
+ */
+unsigned connectionFlags(int sock)
+{
+    struct ReplyReader *reader = replyReaderFor(sock);
+    return reader ? reader->flags : 0;
+}
+
+/**
+ * @brief Returns the code of the last reply read on a control connection
+ *
+ * Lets callers tell a refusal (421) from other failures after a
+ * protocol function returned -1.
+ *
+ * @param sock Control socket
+ * @return int Reply code, 0 if no reply was read
+ */
+int lastReplyCode(int sock)
+{
+    struct ReplyReader *reader = replyReaderFor(sock);
+    return reader ? reader->lastCode : 0;
+}
+
+/**
+ * @brief Records a protocol flag for a control connection
+ *
+ * @param sock Control socket
+ * @param flag CONN_* flag to set
+ */
+void setConnectionFlag(int sock, unsigned flag)
+{
+    struct ReplyReader *reader = replyReaderFor(sock);
+    if (reader)
+        reader->flags |= flag;
+}
+
+/**
+ * @brief Reads the next complete reply from a control socket
+ *
+ * @param sock Control socket
+ * @param reply Receives the reply code and message view
+ * @return int Reply code on success, -1 on failure
+ */
+int readReply(int sock, struct FTPReply *reply)
+{
+    struct ReplyReader *reader = replyReaderFor(sock);
+    if (!reader)
+        return -1;
+
+    int responseCode = replyReaderNext(reader, reply);
+    if (responseCode < 0)
+    {
+        logMessage("Error reading from server\n");
+        return -1;
+    }
+
+    logMessage("Server Response: %s\n", reply->text);
+    return responseCode;
+}
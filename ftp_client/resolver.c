@@ -0,0 +1,301 @@
+/**
+ * @file resolver.c
+ * @brief Cached host name resolution for FTP client
+ *
+ * This file implements the resolver used by every connection. Names are
+ * resolved with getaddrinfo() (IPv4 and IPv6) and kept in a process-wide
+ * cache for RESOLVER_TTL seconds; failures are cached for
+ * RESOLVER_NEGATIVE_TTL seconds so a dead name is not retried for every
+ * batch entry. getaddrinfo() does not expose record TTLs, hence the
+ * fixed lifetimes.
+ *
+ * Resolution is taken off the hot path by resolverPrefetch(), which
+ * starts a background lookup as soon as a host is known (e.g. while the
+ * batch manifest is read). resolveHost() then returns the cached answer,
+ * waits for a lookup already in flight, or resolves synchronously as a
+ * last resort. resolverPoll() never waits: it reports a lookup in flight
+ * instead, for the event engine, whose thread must not block. Numeric
+ * addresses never touch the cache.
+ *
+ * Addresses are stored in the order connections should try them: the
+ * first family getaddrinfo() prefers (RFC 6724), then alternating
+ * between IPv6 and IPv4 as recommended for Happy Eyeballs (RFC 8305).
+ */
+
+#include "ftp_client.h"
+#include <pthread.h>
+
+/**
+ * @enum CacheState
+ * @brief Lifecycle of a cache entry
+ */
+enum CacheState {
+    CACHE_PENDING = 0,  /**< Lookup in flight */
+    CACHE_READY,        /**< Addresses available */
+    CACHE_FAILED        /**< Name did not resolve */
+};
+
+/**
+ * @struct CacheEntry
+ * @brief Resolution result of one host name
+ */
+struct CacheEntry {
+    char host[MAX_LENGTH];         /**< Host name */
+    enum CacheState state;         /**< Lookup state */
+    double expires;                /**< Monotonic time the entry goes stale */
+    struct ResolvedHost result;    /**< Addresses, valid when CACHE_READY */
+};
+
+static struct CacheEntry *cache = NULL;
+static int cacheCount = 0, cacheCapacity = 0;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cacheReady = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Runs getaddrinfo() and orders the answers for connection racing
+ *
+ * @param host Host name or numeric address
+ * @param flags Extra getaddrinfo() flags (AI_NUMERICHOST)
+ * @param out Receives the addresses
+ * @return int 0 on success, -1 if the name does not resolve
+ */
+static int lookup(const char *host, int flags, struct ResolvedHost *out)
+{
+    struct addrinfo hints, *list, *ai;
+    struct addrinfo *byFamily[2][RESOLVER_MAX_ADDRS];
+    int counts[2] = {0, 0}, first = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags ? flags : AI_ADDRCONFIG;  // Literals are always usable
+    if (getaddrinfo(host, NULL, &hints, &list) != 0)
+        return -1;
+
+    // Split by family, keeping getaddrinfo()'s preference within each
+    for (ai = list; ai; ai = ai->ai_next)
+    {
+        int f = ai->ai_family == AF_INET6;
+        if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) ||
+            counts[f] == RESOLVER_MAX_ADDRS)
+            continue;
+        if (first < 0)
+            first = f;
+        byFamily[f][counts[f]++] = ai;
+    }
+
+    // Interleave families, starting with the preferred one
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; out->count < RESOLVER_MAX_ADDRS && (i < counts[0] || i < counts[1]); i++)
+    {
+        for (int k = 0; k < 2 && out->count < RESOLVER_MAX_ADDRS; k++)
+        {
+            int f = k == 0 ? first : !first;
+            if (i >= counts[f])
+                continue;
+            memcpy(&out->addrs[out->count], byFamily[f][i]->ai_addr, byFamily[f][i]->ai_addrlen);
+            out->lengths[out->count++] = byFamily[f][i]->ai_addrlen;
+        }
+    }
+
+    freeaddrinfo(list);
+    return out->count > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Finds the cache entry of a host. Must be called with the lock held.
+ */
+static struct CacheEntry *findEntry(const char *host)
+{
+    for (int i = 0; i < cacheCount; i++)
+        if (strcmp(cache[i].host, host) == 0)
+            return &cache[i];
+    return NULL;
+}
+
+/**
+ * @brief Returns a pending entry for a host, reusing a stale one if present.
+ *        Must be called with the lock held.
+ *
+ * @return struct CacheEntry* Entry, NULL if out of memory
+ */
+static struct CacheEntry *claimEntry(const char *host)
+{
+    struct CacheEntry *entry = findEntry(host);
+
+    if (!entry)
+    {
+        if (cacheCount == cacheCapacity)
+        {
+            int capacity = cacheCapacity ? cacheCapacity * 2 : 16;
+            struct CacheEntry *grown = realloc(cache, capacity * sizeof(*grown));
+            if (!grown)
+                return NULL;
+            cache = grown;
+            cacheCapacity = capacity;
+        }
+        entry = &cache[cacheCount++];
+        snprintf(entry->host, sizeof(entry->host), "%s", host);
+    }
+
+    entry->state = CACHE_PENDING;
+    return entry;
+}
+
+/**
+ * @brief Resolves a host and publishes the result in the cache
+ *
+ * @param host Host name whose entry was claimed as pending
+ */
+static void resolveInto(const char *host)
+{
+    struct ResolvedHost result;
+    int ok = lookup(host, 0, &result) == 0;
+
+    pthread_mutex_lock(&cacheLock);
+    struct CacheEntry *entry = findEntry(host);
+    if (entry)
+    {
+        entry->state = ok ? CACHE_READY : CACHE_FAILED;
+        entry->expires = traceSeconds() + (ok ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+        if (ok)
+            entry->result = result;
+    }
+    pthread_cond_broadcast(&cacheReady);
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/**
+ * @brief Thread body of a background lookup
+ *
+ * @param arg Heap copy of the host name
+ * @return void* Always NULL
+ */
+static void *prefetchThread(void *arg)
+{
+    resolveInto(arg);
+    free(arg);
+    return NULL;
+}
+
+/**
+ * @brief Starts resolving a host in the background unless it is cached
+ *
+ * @param host Host name
+ */
+void resolverPrefetch(const char *host)
+{
+    struct ResolvedHost numeric;
+    pthread_attr_t attr;
+    pthread_t thread;
+    char *copy;
+
+    if (lookup(host, AI_NUMERICHOST, &numeric) == 0 || !(copy = strdup(host)))
+        return;
+
+    pthread_mutex_lock(&cacheLock);
+    struct CacheEntry *entry = findEntry(host);
+    if ((entry && (entry->state == CACHE_PENDING || entry->expires > traceSeconds())) ||
+        !claimEntry(host))
+    {
+        pthread_mutex_unlock(&cacheLock);
+        free(copy);
+        return;
+    }
+    pthread_mutex_unlock(&cacheLock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, prefetchThread, copy) != 0)
+    {
+        // No thread: resolve here so waiters are not left hanging
+        resolveInto(copy);
+        free(copy);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**
+ * @brief Returns the addresses of a host, from the cache when possible
+ *
+ * @param host Host name or numeric IPv4/IPv6 address
+ * @param out Receives the addresses in connection order
+ * @return int 0 on success, -1 if the name does not resolve
+ */
+int resolveHost(const char *host, struct ResolvedHost *out)
+{
+    if (lookup(host, AI_NUMERICHOST, out) == 0)
+    {
+        out->numeric = 1;
+        return 0;
+    }
+
+    pthread_mutex_lock(&cacheLock);
+    for (;;)
+    {
+        struct CacheEntry *entry = findEntry(host);
+
+        if (entry && entry->state == CACHE_PENDING)
+        {
+            pthread_cond_wait(&cacheReady, &cacheLock);
+            continue;
+        }
+        if (entry && entry->expires > traceSeconds())
+        {
+            int ok = entry->state == CACHE_READY;
+            if (ok)
+                *out = entry->result;
+            pthread_mutex_unlock(&cacheLock);
+            return ok ? 0 : -1;
+        }
+
+        // Missing or stale: resolve on this thread, others wait for it
+        if (!claimEntry(host))
+        {
+            pthread_mutex_unlock(&cacheLock);
+            return lookup(host, 0, out);
+        }
+        pthread_mutex_unlock(&cacheLock);
+        resolveInto(host);
+        pthread_mutex_lock(&cacheLock);
+    }
+}
+
+/**
+ * @brief Returns the addresses of a host without waiting for a lookup
+ *
+ * A host that is not cached, or whose entry went stale, gets a
+ * background lookup as with resolverPrefetch(); the caller polls again
+ * until it completes.
+ *
+ * @param host Host name or numeric IPv4/IPv6 address
+ * @param out Receives the addresses in connection order
+ * @return int 0 on success, 1 while a lookup is in flight, -1 if the name does not resolve
+ */
+int resolverPoll(const char *host, struct ResolvedHost *out)
+{
+    if (lookup(host, AI_NUMERICHOST, out) == 0)
+    {
+        out->numeric = 1;
+        return 0;
+    }
+
+    for (int started = 0; ; started = 1)
+    {
+        pthread_mutex_lock(&cacheLock);
+        struct CacheEntry *entry = findEntry(host);
+        int known = entry && (entry->state == CACHE_PENDING || entry->expires > traceSeconds());
+        enum CacheState state = known ? entry->state : CACHE_FAILED;
+        if (known && state == CACHE_READY)
+            *out = entry->result;
+        pthread_mutex_unlock(&cacheLock);
+
+        if (known)
+            return state == CACHE_READY ? 0 : state == CACHE_PENDING ? 1 : -1;
+
+        // Without memory for an entry the prefetch did nothing: resolve here
+        if (started)
+            return lookup(host, 0, out);
+        resolverPrefetch(host);
+    }
+}
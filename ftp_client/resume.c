@@ -0,0 +1,166 @@
+/**
+ * @file resume.c
+ * @brief Resumable downloads for FTP client
+ *
+ * This file implements continuing an interrupted download instead of
+ * starting again from byte zero. When resume mode is enabled, every
+ * download records the remote file's SIZE and MDTM in a small sidecar
+ * file next to the partial download:
+ *
+ *   downloads/.<file>.resume   containing   "<size> <mdtm>\n"
+ *
+ * On the next run the partial file is only continued if the server
+ * still reports the same size and modification time (only the same
+ * size, with a warning, on servers without MDTM); the local length
+ * is then sent as "REST <len>" before RETR and the data is appended.
+ * Without a matching sidecar, or if the server rejects REST, the file
+ * is downloaded again in full. The sidecar is removed once the
+ * download completes.
+ */
+
+#include "ftp_client.h"
+#include <sys/stat.h>
+
+/**
+ * @brief Builds the path of the resume sidecar for a file
+ *
+ * The sidecar sits next to the file, so files in subdirectories (mirror
+ * mode) keep theirs in the same directory.
+ *
+ * @param file Local file path (inside downloads/)
+ * @param path Buffer of MAX_LENGTH + 32 bytes for the sidecar path
+ */
+static void resumePath(const char *file, char *path)
+{
+    const char *base = strrchr(file, '/');
+
+    if (base)
+        snprintf(path, MAX_LENGTH + 32, "downloads/%.*s/.%s.resume", (int)(base - file), file, base + 1);
+    else
+        snprintf(path, MAX_LENGTH + 32, "downloads/.%s.resume", file);
+}
+
+/**
+ * @brief Queries the last modification time of a remote file
+ *
+ * Sends the MDTM command (RFC 3659). The reply has the form
+ * "213 YYYYMMDDHHMMSS[.sss]" in UTC.
+ *
+ * @param sock Control socket
+ * @param path Path of the remote file
+ * @param mdtm Buffer of MDTM_LENGTH bytes to store the timestamp
+ * @return int 0 on success, -1 if MDTM is unsupported or fails
+ */
+int getModificationTime(int sock, const char *path, char *mdtm)
+{
+    char cmd[BUFFER_SIZE];
+    struct FTPReply reply;
+
+    snprintf(cmd, sizeof(cmd), "MDTM %s\r\n", path);
+    write(sock, cmd, strlen(cmd));
+
+    int responseCode = readReply(sock, &reply);
+    if (responseCode != SV_FILE_STATUS || sscanf(reply.text, "%*d %31s", mdtm) != 1)
+    {
+        mdtm[0] = '\0';
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Decides where a download should restart
+ *
+ * Compares the partial local file and its sidecar against the current
+ * SIZE and MDTM of the remote file, then rewrites the sidecar with the
+ * current values. Must be called on a binary-mode session, before the
+ * data connection is requested.
+ *
+ * @param ctrlSock Control socket
+ * @param url URL of the file
+ * @param offset Receives the byte offset to restart from (0 for a full download)
+ * @param remoteSize Receives the SIZE of the remote file, 0 if unknown; may be NULL
+ * @return int 1 if the local file is already complete, 0 otherwise
+ */
+int checkResume(int ctrlSock, struct URL *url, long long *offset, long long *remoteSize)
+{
+    char filepath[MAX_LENGTH + 32], metapath[MAX_LENGTH + 32];
+    char mdtm[MDTM_LENGTH] = "", savedMdtm[MDTM_LENGTH] = "";
+    long long size = -1, savedSize = -2;
+    struct stat st;
+    FILE *meta;
+
+    logMessage("\n=== RESUME CHECK ===\n");
+    *offset = 0;
+    snprintf(filepath, sizeof(filepath), "downloads/%s", url->file);
+    resumePath(url->file, metapath);
+
+    getFileSize(ctrlSock, url->resource, &size);
+    getModificationTime(ctrlSock, url->resource, mdtm);
+    if (remoteSize)
+        *remoteSize = size > 0 ? size : 0;
+
+    if ((meta = fopen(metapath, "r")))
+    {
+        if (fscanf(meta, "%lld %31s", &savedSize, savedMdtm) < 1)
+            savedSize = -2;
+        fclose(meta);
+    }
+
+    // Only continue when the remote file kept its size and MDTM; a server
+    // without MDTM leaves the size as the only evidence
+    if (size >= 0 && savedSize == size && strcmp(savedMdtm, mdtm) == 0 &&
+        stat(filepath, &st) == 0 && st.st_size > 0 && st.st_size <= size)
+    {
+        *offset = st.st_size;
+        logMessage("Partial file matches remote (%lld of %lld bytes)\n", *offset, size);
+        if (!mdtm[0])
+            logMessage("Server did not report MDTM: only the size shows the remote file is unchanged\n");
+    }
+    else if (savedSize != -2)
+        logMessage("Remote file changed or partial file invalid, downloading in full\n");
+
+    // Record what this attempt is downloading, unless it is already done
+    if (size >= 0 && *offset == size)
+    {
+        logMessage("File already complete\n");
+        remove(metapath);
+        return 1;
+    }
+    if ((meta = fopen(metapath, "w")))
+    {
+        fprintf(meta, "%lld %s\n", size, mdtm);
+        fclose(meta);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Removes the resume sidecar after a completed download
+ *
+ * @param url URL of the downloaded file
+ */
+void clearResume(struct URL *url)
+{
+    char metapath[MAX_LENGTH + 32];
+
+    resumePath(url->file, metapath);
+    remove(metapath);
+}
+
+/**
+ * @brief Sends REST for a resumed download, falling back to a full one
+ *
+ * @param ctrlSock Control socket
+ * @param offset Restart offset; reset to 0 if the server rejects REST
+ */
+void requestRestart(int ctrlSock, long long *offset)
+{
+    if (*offset > 0 && restartAt(ctrlSock, *offset) != 0)
+    {
+        logMessage("Server cannot resume, downloading in full\n");
+        *offset = 0;
+    }
+}
@@ -0,0 +1,506 @@
+/**
+ * @file scheduler.c
+ * @brief Priority scheduler with per-host connection caps
+ *
+ * The scheduler sits in front of the session layer. Files wait in one
+ * priority queue (a binary heap) per host, and a pool of opts->slots
+ * worker threads each keeps at most one control connection open:
+ *
+ *   pick best runnable job -> [connect -> USER/PASS -> TYPE I]
+ *                          -> PASV -> RETR -> 226 -> pick next job
+ *
+ * A job is runnable if its host has fewer than limit connections, or if
+ * the worker already holds a connection to that host. Among runnable
+ * jobs the highest priority wins, then the worker's own host (which
+ * saves a login), then submission order. A worker with nothing runnable
+ * closes its connection, so idle sessions do not use up server slots.
+ *
+ * A server that answers 421 (too many connections) has its cap lowered
+ * to the connections it did accept and gets no new connection for an
+ * exponentially growing backoff; the job goes back to its queue. After
+ * SCHEDULER_MAX_ATTEMPTS refusals the job fails.
+ *
+ * Bandwidth is shaped by token buckets: the run's global limit and one
+ * bucket per host, both charged by every read (see shaper.c).
+ */
+
+#include "ftp_client.h"
+
+/**
+ * @struct SchedulerWorker
+ * @brief Per-thread state of a scheduler worker
+ */
+struct SchedulerWorker {
+    struct Scheduler *s;         /**< Scheduler the worker belongs to */
+    struct SchedulerHost *host;  /**< Host of the open connection, NULL if none */
+    struct UrlRecord session;    /**< Server and credentials of the open connection */
+    int ctrlSock;                /**< Control connection, -1 if not connected */
+    char dataAddr[BUFFER_SIZE];  /**< Pending passive address after a pipelined login */
+    int dataPort;                /**< Pending passive port */
+    int passive;                 /**< A PASV answer is pending */
+    pthread_t thread;            /**< Worker thread */
+};
+
+/**
+ * @brief Orders jobs: higher priority first, then submission order
+ */
+static int jobBefore(const struct ScheduledJob *a, const struct ScheduledJob *b)
+{
+    return a->priority != b->priority ? a->priority > b->priority : a->order < b->order;
+}
+
+/**
+ * @brief Inserts a job into a host's heap
+ *
+ * @param h Host
+ * @param job Job
+ * @return int 0 on success, -1 if out of memory
+ */
+static int heapPush(struct SchedulerHost *h, struct ScheduledJob *job)
+{
+    if (h->count == h->capacity)
+    {
+        int capacity = h->capacity ? h->capacity * 2 : 16;
+        struct ScheduledJob **queue = realloc(h->queue, capacity * sizeof(*queue));
+        if (!queue)
+            return -1;
+        h->queue = queue;
+        h->capacity = capacity;
+    }
+
+    // Sift up
+    int i = h->count++;
+    while (i > 0 && jobBefore(job, h->queue[(i - 1) / 2]))
+    {
+        h->queue[i] = h->queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->queue[i] = job;
+    return 0;
+}
+
+/**
+ * @brief Removes the best job from a host's heap
+ *
+ * @param h Host with at least one job
+ * @return struct ScheduledJob* Job
+ */
+static struct ScheduledJob *heapPop(struct SchedulerHost *h)
+{
+    struct ScheduledJob *top = h->queue[0];
+    struct ScheduledJob *last = h->queue[--h->count];
+
+    // Sift the last job down from the root
+    int i = 0;
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= h->count)
+            break;
+        if (child + 1 < h->count && jobBefore(h->queue[child + 1], h->queue[child]))
+            child++;
+        if (!jobBefore(h->queue[child], last))
+            break;
+        h->queue[i] = h->queue[child];
+        i = child;
+    }
+    if (h->count > 0)
+        h->queue[i] = last;
+    return top;
+}
+
+/**
+ * @brief Returns the entry of a host, creating it on first use
+ *
+ * @param s Scheduler
+ * @param name Host name
+ * @param port Control port
+ * @return struct SchedulerHost* Host, NULL if out of memory
+ */
+static struct SchedulerHost *schedulerHost(struct Scheduler *s, const char *name, int port)
+{
+    for (int i = 0; i < s->hostCount; i++)
+        if (s->hosts[i]->port == port && strcmp(s->hosts[i]->host, name) == 0)
+            return s->hosts[i];
+
+    if (s->hostCount == s->hostCapacity)
+    {
+        int capacity = s->hostCapacity ? s->hostCapacity * 2 : 8;
+        struct SchedulerHost **hosts = realloc(s->hosts, capacity * sizeof(*hosts));
+        if (!hosts)
+            return NULL;
+        s->hosts = hosts;
+        s->hostCapacity = capacity;
+    }
+
+    struct SchedulerHost *h = calloc(1, sizeof(*h));
+    if (!h)
+        return NULL;
+    snprintf(h->host, sizeof(h->host), "%s", name);
+    h->port = port;
+    h->limit = s->opts->hostConnections > 0 ? s->opts->hostConnections : SCHEDULER_HOST_CONNECTIONS;
+    bucketInit(&h->bucket, s->opts->hostRateLimit ? (long long)s->opts->hostRateLimit->rate : 0);
+    s->hosts[s->hostCount++] = h;
+    return h;
+}
+
+/**
+ * @brief Takes the best runnable job for a worker
+ *
+ * Reserves a connection slot on the job's host unless the worker
+ * already holds one there. Called with the scheduler locked.
+ *
+ * @param s Scheduler
+ * @param w Worker
+ * @param now Current monotonic time
+ * @param wakeAt Lowered to the end of the earliest backoff that blocks a job
+ * @param host Receives the job's host
+ * @return struct ScheduledJob* Job, NULL if nothing is runnable
+ */
+static struct ScheduledJob *pickJob(struct Scheduler *s, struct SchedulerWorker *w,
+                                    double now, double *wakeAt, struct SchedulerHost **host)
+{
+    struct SchedulerHost *best = NULL;
+
+    for (int i = 0; i < s->hostCount; i++)
+    {
+        struct SchedulerHost *h = s->hosts[i];
+        if (h->count == 0)
+            continue;
+
+        int own = h == w->host;
+        if (!own && h->retryAt > now)
+        {
+            if (h->retryAt < *wakeAt)
+                *wakeAt = h->retryAt;
+            continue;
+        }
+        if (!own && h->connections >= h->limit)
+            continue;
+
+        // Equal priority: reuse the open connection before anything else
+        if (!best || jobBefore(h->queue[0], best->queue[0]) ||
+            (own && h->queue[0]->priority == best->queue[0]->priority))
+            best = h;
+    }
+
+    if (!best)
+        return NULL;
+    if (best != w->host)
+        best->connections++;
+    s->queued--;
+    s->running++;
+    *host = best;
+    return heapPop(best);
+}
+
+/**
+ * @brief Closes the worker's connection and frees its slot
+ *
+ * Called with the scheduler locked; the lock is dropped while QUIT is
+ * exchanged.
+ *
+ * @param w Worker
+ */
+static void dropConnection(struct SchedulerWorker *w)
+{
+    int sock = w->ctrlSock;
+
+    if (w->host)
+        w->host->connections--;
+    w->host = NULL;
+    w->ctrlSock = -1;
+    w->passive = 0;
+
+    if (sock >= 0)
+    {
+        pthread_mutex_unlock(&w->s->lock);
+        closeConnection(sock);
+        pthread_mutex_lock(&w->s->lock);
+    }
+}
+
+/**
+ * @brief Fetches one job over the worker's connection, opening it if needed
+ *
+ * @param w Worker whose host slot is reserved for the job
+ * @param job Job
+ * @param refused Set if the server answered 421
+ * @return int 0 on success, -1 on failure
+ */
+static int runJob(struct SchedulerWorker *w, struct ScheduledJob *job, int *refused)
+{
+    struct TransferOptions fileOpts = *w->s->opts;
+    struct URL url;
+    int saved = 0;
+
+    urlFromRecord(&job->url, &url);
+
+    // Another account on the same host needs its own login
+    if (w->ctrlSock >= 0 && (strcmp(w->session.user, job->url.user) != 0 ||
+                             strcmp(w->session.password, job->url.password) != 0))
+    {
+        closeConnection(w->ctrlSock);
+        w->ctrlSock = -1;
+    }
+    if (w->ctrlSock < 0)
+    {
+        w->passive = 0;
+        w->session = job->url;
+        w->ctrlSock = createSocket(url.host, url.port);
+        if (w->ctrlSock < 0)
+            return -1;
+
+        int failed = fileOpts.pipelined
+            ? authenticatePipelined(w->ctrlSock, url.user, url.password,
+                                    w->dataAddr, &w->dataPort, &saved) != 0
+            : authenticate(w->ctrlSock, url.user, url.password) != 0 ||
+              setBinaryMode(w->ctrlSock) != 0;
+        if (failed)
+        {
+            // A full server greets with 421 instead of 220
+            *refused = lastReplyCode(w->ctrlSock) == 421;
+            closeConnection(w->ctrlSock);
+            w->ctrlSock = -1;
+            return -1;
+        }
+        w->passive = fileOpts.pipelined;
+        if (fileOpts.compress)
+            setCompressedMode(w->ctrlSock);
+    }
+
+    fileOpts.hostRateLimit = w->host->bucket.rate > 0 ? &w->host->bucket : NULL;
+    if (fetchBatchFile(w->ctrlSock, &url, &fileOpts, w->dataAddr, &w->dataPort, &w->passive) == 0)
+        return 0;
+
+    // 421 closes the session; anything else leaves it to be re-synchronized
+    *refused = lastReplyCode(w->ctrlSock) == 421;
+    if (*refused || resyncControl(w->ctrlSock) != 0)
+    {
+        releaseReplyReader(w->ctrlSock);
+        close(w->ctrlSock);
+        w->ctrlSock = -1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Runs jobs until every queue is empty and no job is in flight
+ *
+ * @param arg Worker state
+ * @return void* NULL
+ */
+static void *schedulerWorker(void *arg)
+{
+    struct SchedulerWorker *w = arg;
+    struct Scheduler *s = w->s;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;)
+    {
+        double now = traceSeconds(), wakeAt = now + 1.0;
+        struct SchedulerHost *host;
+        struct ScheduledJob *job = pickJob(s, w, now, &wakeAt, &host);
+
+        if (!job)
+        {
+            // Nothing runnable: release the slot rather than sit on it
+            if (w->host)
+            {
+                dropConnection(w);
+                pthread_cond_broadcast(&s->wake);
+                continue;
+            }
+            if (s->queued == 0 && s->running == 0)
+                break;
+
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            double delay = wakeAt - now;
+            deadline.tv_sec += (time_t)delay;
+            deadline.tv_nsec += (long)((delay - (time_t)delay) * 1e9);
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&s->wake, &s->lock, &deadline);
+            continue;
+        }
+
+        // Moving to another host: give back the old slot first
+        if (w->host != host)
+        {
+            if (w->host)
+                dropConnection(w);
+            w->host = host;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        int refused = 0;
+        int result = runJob(w, job, &refused);
+
+        pthread_mutex_lock(&s->lock);
+        s->running--;
+        if (w->ctrlSock < 0)
+        {
+            host->connections--;
+            w->host = NULL;
+        }
+
+        if (result == 0)
+        {
+            s->succeeded++;
+            host->done++;
+            free(job);
+        }
+        else if (refused && ++job->attempts < SCHEDULER_MAX_ATTEMPTS)
+        {
+            // Stay below the connection count the server accepted, and back off
+            double backoff = SCHEDULER_BACKOFF * (1 << (job->attempts - 1));
+            s->refused++;
+            host->limit = host->connections > 1 ? host->connections : 1;
+            host->retryAt = traceSeconds() + (backoff < SCHEDULER_MAX_BACKOFF ? backoff : SCHEDULER_MAX_BACKOFF);
+            logMessage("%s refused the connection (421), limit now %d, %s requeued\n",
+                       host->host, host->limit, job->url.resource);
+            if (heapPush(host, job) == 0)
+                s->queued++;
+            else
+            {
+                s->failed++;
+                free(job);
+            }
+        }
+        else
+        {
+            s->refused += refused;
+            s->failed++;
+            logMessage("Failed to download %s from %s\n", job->url.resource, host->host);
+            free(job);
+        }
+        pthread_cond_broadcast(&s->wake);
+    }
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/**
+ * @brief Initializes a scheduler
+ *
+ * @param s Scheduler
+ * @param opts Transfer options: slots, hostConnections and rate limits
+ * @return int 0 on success, -1 on failure
+ */
+int schedulerInit(struct Scheduler *s, const struct TransferOptions *opts)
+{
+    memset(s, 0, sizeof(*s));
+    if (!opts || opts->slots < 1)
+        return -1;
+
+    s->opts = opts;
+    s->slots = opts->slots;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    return 0;
+}
+
+/**
+ * @brief Queues a file
+ *
+ * @param s Scheduler
+ * @param url File to fetch; the record is copied, its strings must outlive the run
+ * @param priority Higher priorities run first
+ * @return int 0 on success, -1 if out of memory
+ */
+int schedulerAdd(struct Scheduler *s, const struct UrlRecord *url, int priority)
+{
+    struct ScheduledJob *job = malloc(sizeof(*job));
+    int result = -1;
+
+    if (!job)
+        return -1;
+    job->url = *url;
+    job->priority = priority;
+    job->attempts = 0;
+
+    pthread_mutex_lock(&s->lock);
+    job->order = s->order++;
+    struct SchedulerHost *h = schedulerHost(s, url->host, url->port);
+    if (h && heapPush(h, job) == 0)
+    {
+        s->queued++;
+        result = 0;
+        pthread_cond_broadcast(&s->wake);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (result != 0)
+        free(job);
+    else
+        resolverPrefetch(url->host);
+    return result;
+}
+
+/**
+ * @brief Runs every queued file to completion with a pool of workers
+ *
+ * @param s Scheduler
+ * @return int 0 if every file was downloaded, -1 otherwise
+ */
+int schedulerRun(struct Scheduler *s)
+{
+    struct SchedulerWorker *workers = calloc(s->slots, sizeof(*workers));
+    int started = 0;
+
+    if (!workers)
+        return -1;
+
+    logMessage("\n=== SCHEDULER ===\n");
+    logMessage("Jobs: %d on %d hosts, %d slots\n", s->queued, s->hostCount, s->slots);
+
+    for (int i = 0; i < s->slots; i++)
+    {
+        workers[i].s = s;
+        workers[i].ctrlSock = -1;
+        if (pthread_create(&workers[i].thread, NULL, schedulerWorker, &workers[i]) != 0)
+            break;
+        started++;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    free(workers);
+
+    // Without any worker the queue was never drained
+    s->failed += s->queued;
+
+    logMessage("\nScheduler completed: %d downloaded, %d failed, %d refusals (421)\n",
+               s->succeeded, s->failed, s->refused);
+    for (int i = 0; i < s->hostCount; i++)
+        logMessage("  %-30s %6d files, connection limit %d\n",
+                   s->hosts[i]->host, s->hosts[i]->done, s->hosts[i]->limit);
+
+    return started > 0 && s->failed == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Releases a scheduler and any job still queued
+ *
+ * @param s Scheduler
+ */
+void schedulerFree(struct Scheduler *s)
+{
+    for (int i = 0; i < s->hostCount; i++)
+    {
+        struct SchedulerHost *h = s->hosts[i];
+        for (int j = 0; j < h->count; j++)
+            free(h->queue[j]);
+        free(h->queue);
+        bucketDestroy(&h->bucket);
+        free(h);
+    }
+    free(s->hosts);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+    memset(s, 0, sizeof(*s));
+}
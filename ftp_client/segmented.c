@@ -0,0 +1,487 @@
+/**
+ * @file segmented.c
+ * @brief Segmented parallel download for FTP client
+ *
+ * This file implements downloading a single file over several parallel
+ * FTP sessions. Each segment owns one control connection and fetches a
+ * byte range of the file with the sequence:
+ *
+ *   PASV -> connect data socket -> REST <offset> -> RETR -> pwrite()
+ *
+ * Ranges are assigned evenly at start. When a worker finishes its range
+ * it steals the tail of the segment with the most bytes left, split in
+ * proportion to the observed throughput of both workers, so slow
+ * segments shed work to fast ones. Ranges abandoned by a failed worker
+ * are picked up whole by the next idle worker.
+ *
+ * Servers that reject REST (or that ignore it and send the file from
+ * the start) are detected and handled with a single-stream download.
+ */
+
+#include "ftp_client.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+/**
+ * @struct Segment
+ * @brief Byte range currently owned by one worker
+ */
+struct Segment {
+    long long pos;   /**< Next byte offset to be written */
+    long long end;   /**< Exclusive end offset; shrinks when work is stolen */
+    double rate;     /**< Observed throughput in bytes per second */
+    int active;      /**< Non-zero while a worker is fetching this range */
+};
+
+/**
+ * @struct SegmentedJob
+ * @brief Shared state for all workers of one segmented download
+ */
+struct SegmentedJob {
+    struct URL *url;                     /**< File being downloaded */
+    const struct TransferOptions *opts;  /**< Rate limits, may be NULL */
+    int fd;                              /**< Output file descriptor */
+    long long size;                      /**< Remote file size from SIZE */
+    int count;                           /**< Number of workers */
+    struct Segment segs[MAX_SEGMENTS];   /**< One range per worker */
+    long long received;                  /**< Bytes written by all workers */
+    int running;                         /**< Workers still alive */
+    int abort;                           /**< Set to stop every worker */
+    int restIgnored;                     /**< Server sent more data than the range */
+    pthread_mutex_t lock;                /**< Protects every field above */
+    pthread_cond_t done;                 /**< Signalled when a worker exits */
+};
+
+/**
+ * @struct SegmentWorker
+ * @brief Per-thread state of a segment worker
+ */
+struct SegmentWorker {
+    struct SegmentedJob *job;  /**< Job the worker belongs to */
+    int index;                 /**< Index of the worker's segment */
+    int ctrlSock;              /**< Control connection, -1 if not connected */
+    pthread_t thread;          /**< Worker thread */
+    struct SessionTrace trace; /**< Phase timings of the worker's sessions */
+};
+
+/**
+ * @brief Opens an authenticated binary-mode control connection
+ *
+ * @param url Parsed URL holding the server address and credentials
+ * @return int Control socket on success, -1 on failure
+ */
+static int openSegmentSession(struct URL *url)
+{
+    int sock = createSocket(url->host, url->port);
+    if (sock < 0)
+        return -1;
+    traceStep(TRACE_CONNECT);
+
+    if (authenticate(sock, url->user, url->password) != 0 || setBinaryMode(sock) != 0)
+    {
+        closeConnection(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * @brief Picks new work for an idle worker
+ *
+ * Ranges left behind by failed workers are taken whole. Otherwise the
+ * active segment with the most bytes remaining is split, giving the
+ * thief a share proportional to its throughput. Must be called with
+ * the job lock held.
+ *
+ * @param job Shared job state
+ * @param self Index of the idle worker
+ * @return int 0 if the worker's segment now holds new work, -1 if none is left
+ */
+static int stealRange(struct SegmentedJob *job, int self)
+{
+    struct Segment *mine = &job->segs[self];
+    int victim = -1;
+    long long best = 0;
+
+    for (int i = 0; i < job->count; i++)
+    {
+        struct Segment *seg = &job->segs[i];
+        if (i == self || seg->end <= seg->pos)
+            continue;
+
+        // Orphaned range from a failed worker: take all of it
+        if (!seg->active)
+        {
+            mine->pos = seg->pos;
+            mine->end = seg->end;
+            seg->end = seg->pos;
+            return 0;
+        }
+
+        if (seg->end - seg->pos > best)
+        {
+            best = seg->end - seg->pos;
+            victim = i;
+        }
+    }
+
+    if (victim < 0 || best < 2 * MIN_SEGMENT_SIZE)
+        return -1;
+
+    // Split proportionally to throughput, keeping both halves worth a session
+    struct Segment *seg = &job->segs[victim];
+    double total = seg->rate + mine->rate;
+    long long give = total > 0 ? (long long)(best * (mine->rate / total)) : best / 2;
+    if (give < MIN_SEGMENT_SIZE)
+        give = MIN_SEGMENT_SIZE;
+    if (give > best - MIN_SEGMENT_SIZE)
+        give = best - MIN_SEGMENT_SIZE;
+
+    mine->end = seg->end;
+    mine->pos = seg->end - give;
+    seg->end = mine->pos;
+    return 0;
+}
+
+/**
+ * @brief Fetches the worker's current range over its control connection
+ *
+ * Reads until the range end (which may move down while reading) and
+ * aborts the transfer there, or until the server closes the data
+ * connection at the end of the file.
+ *
+ * @param w Worker state
+ * @return int 0 on success, -1 on failure
+ */
+static int fetchRange(struct SegmentWorker *w)
+{
+    struct SegmentedJob *job = w->job;
+    struct Segment *seg = &job->segs[w->index];
+    char dataAddr[BUFFER_SIZE];
+    char buffer[SEGMENT_READ_SIZE];
+    int dataPort, dataSock;
+    ssize_t bytes;
+    long long pos, received = 0;
+    int truncated = 0;
+
+    pthread_mutex_lock(&job->lock);
+    pos = seg->pos;
+    pthread_mutex_unlock(&job->lock);
+
+    if (enterPassiveMode(w->ctrlSock, dataAddr, &dataPort) != 0)
+        return -1;
+    if ((dataSock = createSocket(dataAddr, dataPort)) < 0)
+        return -1;
+    traceStep(TRACE_DATA_CONNECT);
+
+    // REST is always sent so a stale marker never leaks into this RETR
+    if (restartAt(w->ctrlSock, pos) != 0 || requestFile(w->ctrlSock, w->job->url->resource) != 0)
+    {
+        close(dataSock);
+        return -1;
+    }
+
+    double start = traceSeconds();
+    while ((bytes = read(dataSock, buffer, sizeof(buffer))) > 0)
+    {
+        long long n = bytes;
+
+        if (received == 0)
+            traceStep(TRACE_FIRST_BYTE);
+
+        pthread_mutex_lock(&job->lock);
+        if (pos + n >= seg->end || job->abort)
+        {
+            // Server sent past the end of the whole file: REST was ignored
+            if (pos + n > seg->end && seg->end == job->size)
+            {
+                job->restIgnored = 1;
+                job->abort = 1;
+            }
+            n = job->abort ? 0 : seg->end - pos;
+            truncated = 1;
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        if (n > 0 && pwrite(job->fd, buffer, n, pos) != n)
+        {
+            logMessage("Segment %d: write error: %s\n", w->index, strerror(errno));
+            close(dataSock);
+            return -1;
+        }
+        pos += n;
+        received += n;
+
+        pthread_mutex_lock(&job->lock);
+        seg->pos = pos;
+        seg->rate = received / (traceSeconds() - start + 1e-6);
+        job->received += n;
+        pthread_mutex_unlock(&job->lock);
+
+        if (truncated)
+            break;
+        throttleTransfer(job->opts, n);
+    }
+    close(dataSock);
+    traceStep(TRACE_DRAIN);
+
+    if (bytes < 0 || job->restIgnored)
+        return -1;
+
+    if (truncated)
+        return resyncControl(w->ctrlSock);
+
+    // Data connection closed by the server: range must be complete
+    if (finishTransfer(w->ctrlSock) != 0)
+        return -1;
+
+    pthread_mutex_lock(&job->lock);
+    int complete = seg->pos >= seg->end;
+    pthread_mutex_unlock(&job->lock);
+    return complete ? 0 : -1;
+}
+
+/**
+ * @brief Thread body of a segment worker
+ *
+ * Fetches the initial range, then keeps stealing work until none is
+ * left. A failed worker leaves its unfinished range behind for others.
+ *
+ * @param arg Pointer to the worker's SegmentWorker
+ * @return void* Always NULL
+ */
+static void *segmentWorker(void *arg)
+{
+    struct SegmentWorker *w = arg;
+    struct SegmentedJob *job = w->job;
+    int haveWork = 1;
+
+    traceAttach(&w->trace);
+
+    while (haveWork)
+    {
+        if (w->ctrlSock < 0)
+            w->ctrlSock = openSegmentSession(job->url);
+
+        int result = w->ctrlSock < 0 ? -1 : fetchRange(w);
+
+        pthread_mutex_lock(&job->lock);
+        job->segs[w->index].active = 0;
+        haveWork = result == 0 && !job->abort && stealRange(job, w->index) == 0;
+        if (haveWork)
+            job->segs[w->index].active = 1;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    if (w->ctrlSock >= 0)
+        closeConnection(w->ctrlSock);
+
+    pthread_mutex_lock(&job->lock);
+    job->running--;
+    pthread_cond_signal(&job->done);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/**
+ * @brief Downloads the whole file over one already-authenticated session
+ *
+ * @param ctrlSock Control socket
+ * @param url Parsed URL of the file
+ * @param opts Transfer options, may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+static int downloadSingleStream(int ctrlSock, struct URL *url, const struct TransferOptions *opts)
+{
+    char dataAddr[BUFFER_SIZE];
+    int dataPort;
+
+    if (enterPassiveMode(ctrlSock, dataAddr, &dataPort) != 0)
+        return -1;
+
+    int dataSock = createSocket(dataAddr, dataPort);
+    if (dataSock < 0)
+        return -1;
+
+    int result = -1;
+    if (requestFile(ctrlSock, url->resource) == 0 &&
+        downloadFileWith(ctrlSock, dataSock, url->file, opts) == 0)
+        result = finishTransfer(ctrlSock);
+
+    close(dataSock);
+    return result;
+}
+
+/**
+ * @brief Downloads a file over several parallel control+data sessions
+ *
+ * A probe session first asks for the file size with SIZE and checks
+ * that REST is accepted. The output file is then sized up front and
+ * each worker writes its range in place with pwrite(). The probe
+ * session is handed over to the first worker.
+ *
+ * Falls back to a single-stream download when SIZE or REST are not
+ * supported, when the file is too small to split, or when the server
+ * turns out to ignore REST during the transfer.
+ *
+ * @param url Parsed URL of the file to download
+ * @param segments Requested number of parallel segments
+ * @param opts Transfer options (progress reporting), may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int downloadSegmented(struct URL *url, int segments, const struct TransferOptions *opts)
+{
+    logMessage("\n=== SEGMENTED DOWNLOAD ===\n");
+    struct SegmentedJob job;
+    struct SegmentWorker workers[MAX_SEGMENTS];
+    struct TransferMetrics metrics;
+    char filepath[MAX_LENGTH + 16];
+    long long size;
+    int result;
+
+    int ctrlSock = openSegmentSession(url);
+    if (ctrlSock < 0)
+        return -1;
+
+    if (segments > MAX_SEGMENTS)
+        segments = MAX_SEGMENTS;
+
+    if (getFileSize(ctrlSock, url->resource, &size) != 0)
+    {
+        logMessage("Server cannot do ranged transfers, using a single stream\n");
+        result = downloadSingleStream(ctrlSock, url, opts);
+        closeConnection(ctrlSock);
+        return result;
+    }
+
+    if (size / MIN_SEGMENT_SIZE < segments)
+        segments = size / MIN_SEGMENT_SIZE;
+    if (segments < 2)
+    {
+        logMessage("File too small to split, using a single stream\n");
+        result = downloadSingleStream(ctrlSock, url, opts);
+        closeConnection(ctrlSock);
+        return result;
+    }
+
+    // Probe REST only once the file will be split; REST 0 clears the probe
+    // so the first range does not start at byte 1
+    if (restartAt(ctrlSock, 1) != 0 || restartAt(ctrlSock, 0) != 0)
+    {
+        logMessage("Server cannot do ranged transfers, using a single stream\n");
+        result = downloadSingleStream(ctrlSock, url, opts);
+        closeConnection(ctrlSock);
+        return result;
+    }
+
+    // The file is sized before its ranges arrive, so a sidecar left by an
+    // earlier -c run must not take its length for downloaded data
+    clearResume(url);
+    snprintf(filepath, sizeof(filepath), "downloads/%s", url->file);
+    memset(&job, 0, sizeof(job));
+    job.url = url;
+    job.opts = opts;
+    job.size = size;
+    job.count = segments;
+    if ((job.fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(job.fd, size) != 0)
+    {
+        logMessage("Cannot create file in Downloads folder: %s (Error: %s)\n",
+                   filepath, strerror(errno));
+        if (job.fd >= 0)
+            close(job.fd);
+        closeConnection(ctrlSock);
+        return -1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+
+    logMessage("Downloading %lld bytes to %s using %d segments\n", size, filepath, segments);
+
+    // Split the file evenly; the last segment also takes the remainder
+    long long share = size / segments;
+    for (int i = 0; i < segments; i++)
+    {
+        job.segs[i].pos = i * share;
+        job.segs[i].end = (i == segments - 1) ? size : (i + 1) * share;
+        job.segs[i].active = 1;
+        workers[i].job = &job;
+        workers[i].index = i;
+        workers[i].ctrlSock = (i == 0) ? ctrlSock : -1;
+        traceBegin(&workers[i].trace);
+    }
+
+    job.running = segments;
+    for (int i = 0; i < segments; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, segmentWorker, &workers[i]) != 0)
+        {
+            // Unstarted worker: its range is orphaned and will be stolen
+            pthread_mutex_lock(&job.lock);
+            job.segs[i].active = 0;
+            job.running--;
+            pthread_mutex_unlock(&job.lock);
+            if (workers[i].ctrlSock >= 0)
+                closeConnection(workers[i].ctrlSock);
+            workers[i].ctrlSock = -2;
+        }
+    }
+
+    // Workers trace their own sessions; the job trace sees the whole run as drain
+    traceStep(TRACE_SETUP);
+    struct SessionTrace *jobTrace = traceAttach(NULL);
+
+    // Report progress once per sample interval until every worker is done
+    metricsStart(&metrics, url->file, size, opts);
+    pthread_mutex_lock(&job.lock);
+    while (job.running > 0)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&job.done, &job.lock, &deadline);
+        metricsAdd(&metrics, job.received - metrics.bytes);
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    for (int i = 0; i < segments; i++)
+        if (workers[i].ctrlSock != -2)
+            pthread_join(workers[i].thread, NULL);
+    traceAttach(jobTrace);
+    traceStep(TRACE_DRAIN);
+
+    result = 0;
+    for (int i = 0; i < segments; i++)
+        if (job.segs[i].pos < job.segs[i].end)
+            result = -1;
+
+    close(job.fd);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.done);
+    metricsFinish(&metrics, result == 0 && !job.restIgnored);
+
+    if (job.restIgnored)
+    {
+        logMessage("\nServer ignored REST, restarting with a single stream\n");
+        if ((ctrlSock = openSegmentSession(url)) < 0)
+            return -1;
+        result = downloadSingleStream(ctrlSock, url, opts);
+        closeConnection(ctrlSock);
+        return result;
+    }
+
+    if (result == 0)
+        logMessage("\nDownload completed. Total: %.2f MB\n", size / (1024.0 * 1024.0));
+    else
+        logMessage("\nSegmented download incomplete\n");
+
+    for (int i = 0; i < segments; i++)
+    {
+        char label[32];
+        snprintf(label, sizeof(label), "segment %d", i);
+        if (workers[i].ctrlSock != -2)
+            tracePrint(&workers[i].trace, label);
+    }
+
+    return result;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file shaper.c
+ * @brief Token-bucket bandwidth limits for FTP client
+ *
+ * A transfer may be bound by two buckets: one shared by the whole run
+ * (-L) and one per host (-l). The receive loops charge every read to
+ * both and sleep until the slower one is back in credit. A bucket holds
+ * at most SHAPER_BURST_SECONDS of credit, so a transfer that was idle
+ * cannot burst far above the rate.
+ *
+ * Charging is a reservation: tokens go negative, and the reader sleeps
+ * until the time its bytes would have been earned. Concurrent readers
+ * therefore queue one behind the other, and transfers sharing a bucket
+ * get equal shares whatever their latency or the server's speed. Reads
+ * are capped at SHAPER_READ_SIZE while a limit applies, which keeps the
+ * queue fine-grained.
+ */
+
+#include "ftp_client.h"
+
+/**
+ * @brief Initializes a token bucket
+ *
+ * @param b Bucket
+ * @param rate Bytes per second, 0 for unlimited
+ */
+void bucketInit(struct TokenBucket *b, long long rate)
+{
+    memset(b, 0, sizeof(*b));
+    pthread_mutex_init(&b->lock, NULL);
+    b->rate = rate > 0 ? rate : 0;
+    b->burst = b->rate * SHAPER_BURST_SECONDS;
+    if (b->burst < SHAPER_READ_SIZE)
+        b->burst = SHAPER_READ_SIZE;
+    b->tokens = b->burst;
+    b->last = traceSeconds();
+}
+
+/**
+ * @brief Releases a token bucket
+ *
+ * @param b Bucket
+ */
+void bucketDestroy(struct TokenBucket *b)
+{
+    pthread_mutex_destroy(&b->lock);
+}
+
+/**
+ * @brief Charges bytes to a bucket
+ *
+ * @param b Bucket, may be NULL
+ * @param bytes Bytes received
+ * @return double Seconds the caller must wait before reading again
+ */
+static double bucketCharge(struct TokenBucket *b, size_t bytes)
+{
+    double wait = 0;
+
+    if (!b || b->rate <= 0)
+        return 0;
+
+    pthread_mutex_lock(&b->lock);
+    double now = traceSeconds();
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->last = now;
+    b->tokens -= bytes;
+    if (b->tokens < 0)
+        wait = -b->tokens / b->rate;
+    pthread_mutex_unlock(&b->lock);
+
+    return wait;
+}
+
+/**
+ * @brief Charges received bytes to the transfer's limits and sleeps off
+ *        the larger deficit
+ *
+ * @param opts Transfer options holding the limits, may be NULL
+ * @param bytes Bytes just received
+ */
+void throttleTransfer(const struct TransferOptions *opts, size_t bytes)
+{
+    if (!opts || (!opts->rateLimit && !opts->hostRateLimit))
+        return;
+
+    double wait = bucketCharge(opts->rateLimit, bytes);
+    double hostWait = bucketCharge(opts->hostRateLimit, bytes);
+    if (hostWait > wait)
+        wait = hostWait;
+
+    if (wait > 0)
+    {
+        struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+}
@@ -4,7 +4,8 @@
  *
  * This file implements the network socket operations required for FTP communication.
  * It handles:
- * - Socket creation and connection
+ * - Socket creation and connection, racing IPv4/IPv6 candidates
+ * - Connect and idle deadlines shared by every connection of the process
  * - Connection cleanup
  * - Error handling for network operations
  *
@@ -13,66 +14,309 @@
  */
 
 #include "ftp_client.h"
+#include <fcntl.h>
+#include <poll.h>
+
+/** Seconds allowed for connect(), 0 for no limit */
+static double connectDeadline;
+/** Seconds a connected socket may go without data, 0 for no limit */
+static double idleDeadline;
+
+/**
+ * @brief Sets the connect and idle deadlines of sockets created from now on
+ *
+ * The idle deadline becomes SO_RCVTIMEO and SO_SNDTIMEO of every
+ * connected socket, so a blocking read of a reply or of file data fails
+ * with EAGAIN once the peer has been silent that long.
+ *
+ * @param connectSeconds Time allowed to establish a connection, 0 for no limit
+ * @param idleSeconds Time a connection may stay silent, 0 for no limit
+ */
+void setSocketDeadlines(double connectSeconds, double idleSeconds)
+{
+    connectDeadline = connectSeconds;
+    idleDeadline = idleSeconds;
+}
+
+/**
+ * @brief Returns the idle deadline set by setSocketDeadlines()
+ *
+ * @return double Seconds, 0 for no limit
+ */
+double socketIdleDeadline(void)
+{
+    return idleDeadline;
+}
+
+/**
+ * @brief Formats a socket address as "address:port" for log messages
+ *
+ * @param addr Socket address
+ * @param text Buffer of at least INET6_ADDRSTRLEN + 8 bytes
+ * @param size Size of text
+ */
+static void formatAddress(const struct sockaddr_storage *addr, char *text, size_t size)
+{
+    char host[INET6_ADDRSTRLEN] = "?";
+    int port = 0;
+
+    if (addr->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        port = ntohs(in6->sin6_port);
+        snprintf(text, size, "[%s]:%d", host, port);
+        return;
+    }
+
+    const struct sockaddr_in *in4 = (const struct sockaddr_in *)addr;
+    inet_ntop(AF_INET, &in4->sin_addr, host, sizeof(host));
+    port = ntohs(in4->sin_port);
+    snprintf(text, size, "%s:%d", host, port);
+}
+
+/**
+ * @brief Sets the port of an IPv4 or IPv6 socket address
+ */
+static void setAddressPort(struct sockaddr_storage *addr, int port)
+{
+    if (addr->ss_family == AF_INET6)
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in *)addr)->sin_port = htons(port);
+}
+
+/**
+ * @brief Starts a non-blocking connect to one candidate address
+ *
+ * @param addr Address to connect to, port included
+ * @param length Length of addr
+ * @param opts Socket options, NULL for system defaults
+ * @param connected Set to 1 if the connection completed immediately
+ * @return int Socket on success, -1 if the attempt failed at once
+ */
+static int startAttempt(const struct sockaddr_storage *addr, socklen_t length,
+                        const struct SocketOptions *opts, int *connected)
+{
+    int sockfd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0)
+        return -1;
+
+    // Receive buffer must be set before the window scale is negotiated
+    if (opts && opts->rcvbuf > 0 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, sizeof(opts->rcvbuf)) != 0)
+        logMessage("setsockopt(SO_RCVBUF): %s\n", strerror(errno));
+
+    *connected = connect(sockfd, (const struct sockaddr *)addr, length) == 0;
+    if (!*connected && errno != EINPROGRESS)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * @brief Races connections to several addresses and keeps the first winner
+ *
+ * Implements the connection part of Happy Eyeballs (RFC 8305): the
+ * first candidate is tried at once and every HAPPY_EYEBALLS_DELAY_MS
+ * without a winner another one is started, in parallel with those still
+ * pending. A candidate that fails immediately makes the next one start
+ * without waiting. Losing attempts are closed. With a connect deadline,
+ * the whole race gives up with ETIMEDOUT once it expires.
+ *
+ * @param resolved Candidate addresses in preference order
+ * @param port Port to connect to
+ * @param opts Socket options, NULL for system defaults
+ * @return int Connected blocking socket, -1 if every candidate failed
+ */
+static int connectRace(const struct ResolvedHost *resolved, int port, const struct SocketOptions *opts)
+{
+    struct pollfd fds[RESOLVER_MAX_ADDRS];
+    int pending = 0, next = 0, winner = -1;
+    char text[INET6_ADDRSTRLEN + 8];
+    long long deadline = connectDeadline > 0 ? traceNow() / 1000000 + (long long)(connectDeadline * 1000) : 0;
+
+    while (winner < 0 && (next < resolved->count || pending > 0))
+    {
+        // Start the next candidate when nothing is pending or the delay expired
+        if (next < resolved->count)
+        {
+            struct sockaddr_storage addr = resolved->addrs[next];
+            int connected = 0;
+
+            setAddressPort(&addr, port);
+            formatAddress(&addr, text, sizeof(text));
+            logMessage("Debug: Attempting to connect to %s...\n", text);
+            int sockfd = startAttempt(&addr, resolved->lengths[next], opts, &connected);
+            next++;
+            if (connected)
+            {
+                winner = sockfd;
+                break;
+            }
+            if (sockfd < 0)
+            {
+                logMessage("Debug: Connection failed to %s: %s\n", text, strerror(errno));
+                continue;
+            }
+            fds[pending].fd = sockfd;
+            fds[pending].events = POLLOUT;
+            pending++;
+        }
+
+        int timeout = next < resolved->count ? HAPPY_EYEBALLS_DELAY_MS : -1;
+        if (deadline)
+        {
+            long long left = deadline - traceNow() / 1000000;
+            if (left <= 0)
+            {
+                logMessage("Debug: No connection within %.1f s\n", connectDeadline);
+                errno = ETIMEDOUT;
+                break;
+            }
+            if (timeout < 0 || left < timeout)
+                timeout = left;
+        }
+        int ready = poll(fds, pending, timeout);
+        if (ready < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; ready > 0 && i < pending; i++)
+        {
+            if (!fds[i].revents)
+                continue;
+
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0)
+            {
+                winner = fds[i].fd;
+                fds[i] = fds[--pending];
+                break;
+            }
+
+            logMessage("Debug: Connection attempt failed: %s\n", strerror(error));
+            close(fds[i].fd);
+            fds[i--] = fds[--pending];
+        }
+    }
+
+    // Losers of the race
+    for (int i = 0; i < pending; i++)
+        close(fds[i].fd);
+
+    if (winner >= 0)
+    {
+        int flags = fcntl(winner, F_GETFL);
+        fcntl(winner, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    if (winner >= 0 && idleDeadline > 0)
+    {
+        struct timeval tv = { (time_t)idleDeadline, (suseconds_t)((idleDeadline - (time_t)idleDeadline) * 1e6) };
+        setsockopt(winner, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(winner, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    return winner;
+}
 
 /**
  * @brief Creates and connects a TCP socket to a specified address
  *
  * This function performs the following steps:
- * 1. Validates the IP address format
- * 2. Creates a TCP socket
- * 3. Sets up the server address structure
- * 4. Establishes connection to the server
+ * 1. Resolves the host (cached, numeric addresses skip the resolver)
+ * 2. Races TCP connections to the resolved IPv4/IPv6 addresses
+ * 3. Returns the first connection to complete
  *
  * Debug messages are printed at each step to aid in troubleshooting
  * network connectivity issues.
  *
- * @param ip Server IP address in dot notation (e.g., "192.168.1.1")
+ * @param host Server host name or IPv4/IPv6 address
  * @param port Server port number
  * @return int Socket file descriptor on success, -1 on failure
  */
-int createSocket(char *ip, int port)
+int createSocket(char *host, int port)
 {
-    printf("\n=== SOCKET CREATION ===\n");
+    return createSocketWith(host, port, NULL);
+}
+
+/**
+ * @brief Creates and connects a TCP socket with explicit socket options
+ *
+ * Options are applied between socket() and connect(): the receive buffer
+ * size bounds the TCP window scale negotiated in the handshake, so it
+ * cannot be raised effectively once the connection is established.
+ *
+ * @param host Server host name or IPv4/IPv6 address
+ * @param port Server port number
+ * @param opts Socket options, NULL for system defaults
+ * @return int Socket file descriptor on success, -1 on failure
+ */
+int createSocketWith(char *host, int port, const struct SocketOptions *opts)
+{
+    logMessage("\n=== SOCKET CREATION ===\n");
+    struct ResolvedHost resolved;
     int sockfd;
-    struct sockaddr_in server_addr;
 
-    printf("Debug: Creating socket for %s:%d\n", ip, port);
+    logMessage("Debug: Creating socket for %s:%d\n", host, port);
 
-    // Validate IP address format
-    if (inet_addr(ip) == INADDR_NONE)
+    if (resolveHost(host, &resolved) != 0)
     {
-        printf("Error: Invalid IP address format: %s\n", ip);
+        logMessage("Error: Cannot resolve host: %s\n", host);
         return -1;
     }
+    if (!resolved.numeric)
+        traceStep(TRACE_DNS);
 
-    // Initialize server address structure
-    bzero((char *)&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(ip);
-    server_addr.sin_port = htons(port);
-
-    // Create TCP socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if ((sockfd = connectRace(&resolved, port, opts)) < 0)
     {
-        perror("socket()");
+        logMessage("Debug: Connection failed to %s:%d\n", host, port);
         return -1;
     }
 
-    printf("Debug: Socket created successfully\n");
-    printf("Debug: Attempting to connect to %s:%d...\n", ip, port);
+    // A recycled descriptor must not inherit buffered replies
+    releaseReplyReader(sockfd);
 
-    // Establish connection
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        perror("connect()");
-        printf("Debug: Connection failed to %s:%d\n", ip, port);
-        printf("Error code: %d\n", errno);
-        close(sockfd);
+    logMessage("Debug: Connection established\n");
+    return sockfd;
+}
+
+/**
+ * @brief Returns the numeric address of the peer of a connected socket
+ *
+ * Used as the data address for EPSV, whose reply only carries a port.
+ *
+ * @param sock Connected socket
+ * @param addr Buffer receiving the address
+ * @param size Size of addr
+ * @return int 0 on success, -1 on failure
+ */
+int socketPeerAddress(int sock, char *addr, size_t size)
+{
+    struct sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+
+    if (getpeername(sock, (struct sockaddr *)&peer, &length) != 0 ||
+        getnameinfo((struct sockaddr *)&peer, length, addr, size, NULL, 0, NI_NUMERICHOST) != 0)
         return -1;
-    }
+    return 0;
+}
 
-    printf("Debug: Connection established\n");
-    return sockfd;
+/**
+ * @brief Returns the address family of the peer of a connected socket
+ *
+ * @param sock Connected socket
+ * @return int AF_INET or AF_INET6, -1 on failure
+ */
+int socketPeerFamily(int sock)
+{
+    struct sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+
+    if (getpeername(sock, (struct sockaddr *)&peer, &length) != 0)
+        return -1;
+    return peer.ss_family;
 }
 
 /**
@@ -99,5 +343,6 @@ int closeConnection(int sock)
     // Wait for server acknowledgment
     getServerResponse(sock, answer);
 
+    releaseReplyReader(sock);
     return close(sock);
 } 
\ No newline at end of file
@@ -0,0 +1,298 @@
+/**
+ * @file trace.c
+ * @brief Per-phase latency tracing for FTP client
+ *
+ * This file implements the timing of every protocol phase of a session:
+ *
+ *   dns -> connect -> banner -> auth -> setup -> pasv -> data connect
+ *       -> first byte -> drain -> finish
+ *
+ * A SessionTrace keeps one nanosecond duration per phase. Marking a
+ * phase charges it with the time elapsed since the previous mark, so
+ * anything between two marks (e.g. TYPE I, SIZE and MDTM before PASV,
+ * or REST/RETR before the first data byte) is attributed to the phase
+ * that ends next. Marks accumulate: a segment worker that runs several
+ * PASV cycles reports their sum.
+ *
+ * Blocking code paths attach a trace to the calling thread with
+ * traceAttach(); protocol functions then call traceStep() without the
+ * trace being passed around. Code without an attached trace pays one
+ * thread-local load per step. The event engine marks its per-session
+ * traces explicitly with traceMark().
+ *
+ * Completed traces can be aggregated per host into log-linear
+ * histograms (LATENCY_SUB_BUCKETS per power of two, about 3% relative
+ * error) that report p50/p99/p999 for each phase.
+ */
+
+#include "ftp_client.h"
+
+/** Trace the calling thread reports its phases to, NULL if none */
+static __thread struct SessionTrace *currentTrace = NULL;
+
+/** Printable phase names, indexed by enum TracePhase */
+static const char *phaseNames[TRACE_PHASES] = {
+    "dns", "connect", "banner", "auth", "setup", "pasv",
+    "data connect", "first byte", "drain", "finish"
+};
+
+/**
+ * @brief Returns the monotonic clock in nanoseconds
+ */
+long long traceNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the monotonic clock in seconds
+ */
+double traceSeconds(void)
+{
+    return traceNow() / 1e9;
+}
+
+/**
+ * @brief Clears a trace and starts timing from now
+ *
+ * @param t Trace to reset
+ */
+void traceBegin(struct SessionTrace *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->last = traceNow();
+}
+
+/**
+ * @brief Restarts the clock of a trace without clearing its phases
+ *
+ * Used when a trace is picked up again after a pause that belongs to
+ * no phase (e.g. a batch entry waiting for its turn).
+ *
+ * @param t Trace to resume
+ */
+void traceResume(struct SessionTrace *t)
+{
+    t->last = traceNow();
+}
+
+/**
+ * @brief Charges a phase with the time elapsed since the previous mark
+ *
+ * @param t Trace
+ * @param phase Phase that just ended
+ */
+void traceMark(struct SessionTrace *t, enum TracePhase phase)
+{
+    long long now = traceNow();
+
+    t->phase[phase] += now - t->last;
+    t->seen |= 1u << phase;
+    t->last = now;
+}
+
+/**
+ * @brief Attaches a trace to the calling thread
+ *
+ * @param t Trace to report to, NULL to detach
+ * @return struct SessionTrace* Previously attached trace, so it can be restored
+ */
+struct SessionTrace *traceAttach(struct SessionTrace *t)
+{
+    struct SessionTrace *previous = currentTrace;
+
+    currentTrace = t;
+    return previous;
+}
+
+/**
+ * @brief Marks a phase on the calling thread's trace, if any
+ *
+ * @param phase Phase that just ended
+ */
+void traceStep(enum TracePhase phase)
+{
+    if (currentTrace)
+        traceMark(currentTrace, phase);
+}
+
+/**
+ * @brief Prints the per-phase breakdown of a trace
+ *
+ * @param t Trace
+ * @param label Name of the traced session or file
+ */
+void tracePrint(const struct SessionTrace *t, const char *label)
+{
+    long long total = 0;
+
+    logMessage("\n=== PHASE BREAKDOWN: %s ===\n", label);
+    for (int p = 0; p < TRACE_PHASES; p++)
+    {
+        if (!(t->seen & (1u << p)))
+            continue;
+        logMessage("%-14s %12.3f ms\n", phaseNames[p], t->phase[p] / 1e6);
+        total += t->phase[p];
+    }
+    logMessage("%-14s %12.3f ms\n", "total", total / 1e6);
+}
+
+/**
+ * @brief Maps a duration to its histogram bucket
+ *
+ * Values below 2 * LATENCY_SUB_BUCKETS have a bucket each; above that
+ * every power of two is split into LATENCY_SUB_BUCKETS equal buckets.
+ *
+ * @param ns Duration in nanoseconds
+ * @return int Bucket index
+ */
+static int bucketOf(long long ns)
+{
+    if (ns < 2 * LATENCY_SUB_BUCKETS)
+        return ns < 0 ? 0 : ns;
+
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - LATENCY_SUB_BITS;
+    return 2 * LATENCY_SUB_BUCKETS + (msb - LATENCY_SUB_BITS - 1) * LATENCY_SUB_BUCKETS +
+           (int)((ns >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+/**
+ * @brief Returns the midpoint of a histogram bucket
+ *
+ * @param bucket Bucket index
+ * @return double Representative duration in nanoseconds
+ */
+static double bucketValue(int bucket)
+{
+    if (bucket < 2 * LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    int k = bucket - 2 * LATENCY_SUB_BUCKETS;
+    int shift = k / LATENCY_SUB_BUCKETS + 1;
+    long long low = (long long)(k % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << shift;
+    return low + ((1LL << shift) - 1) / 2.0;
+}
+
+/**
+ * @brief Adds one duration to a histogram
+ */
+static void histogramAdd(struct LatencyHistogram *h, long long ns)
+{
+    h->counts[bucketOf(ns)]++;
+    h->count++;
+}
+
+/**
+ * @brief Returns the duration below which a fraction of samples fall
+ *
+ * @param h Histogram
+ * @param q Quantile in (0, 1]
+ * @return double Duration in nanoseconds, 0 for an empty histogram
+ */
+static double histogramQuantile(const struct LatencyHistogram *h, double q)
+{
+    long long rank = (long long)(q * h->count + 0.999999);
+    long long seen = 0;
+
+    if (rank < 1)
+        rank = 1;
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+        if ((seen += h->counts[b]) >= rank)
+            return bucketValue(b);
+    return 0;
+}
+
+/**
+ * @brief Adds a completed trace to the histograms of its host
+ *
+ * @param report Report to update
+ * @param host Host name the trace belongs to
+ * @param t Completed trace
+ * @return int 0 on success, -1 if out of memory
+ */
+int latencyRecord(struct LatencyReport *report, const char *host, const struct SessionTrace *t)
+{
+    struct HostLatency *entry = NULL;
+    long long total = 0;
+
+    for (int i = 0; i < report->count && !entry; i++)
+        if (strcmp(report->hosts[i]->host, host) == 0)
+            entry = report->hosts[i];
+
+    if (!entry)
+    {
+        if (report->count == report->capacity)
+        {
+            int capacity = report->capacity ? report->capacity * 2 : 8;
+            struct HostLatency **grown = realloc(report->hosts, capacity * sizeof(*grown));
+            if (!grown)
+                return -1;
+            report->hosts = grown;
+            report->capacity = capacity;
+        }
+        if (!(entry = calloc(1, sizeof(*entry))))
+            return -1;
+        snprintf(entry->host, sizeof(entry->host), "%s", host);
+        report->hosts[report->count++] = entry;
+    }
+
+    for (int p = 0; p < TRACE_PHASES; p++)
+    {
+        if (!(t->seen & (1u << p)))
+            continue;
+        histogramAdd(&entry->phase[p], t->phase[p]);
+        total += t->phase[p];
+    }
+    histogramAdd(&entry->total, total);
+    return 0;
+}
+
+/**
+ * @brief Prints one histogram row
+ */
+static void printRow(const char *name, const struct LatencyHistogram *h)
+{
+    logMessage("  %-14s %8lld %12.3f %12.3f %12.3f\n", name, h->count,
+               histogramQuantile(h, 0.50) / 1e6, histogramQuantile(h, 0.99) / 1e6,
+               histogramQuantile(h, 0.999) / 1e6);
+}
+
+/**
+ * @brief Prints p50/p99/p999 of every phase, per host
+ *
+ * @param report Report to print
+ */
+void latencyPrint(const struct LatencyReport *report)
+{
+    if (report->count == 0)
+        return;
+
+    logMessage("\n=== LATENCY BY HOST ===\n");
+    for (int i = 0; i < report->count; i++)
+    {
+        const struct HostLatency *entry = report->hosts[i];
+
+        logMessage("Host %s (%lld transfers)\n", entry->host, entry->total.count);
+        logMessage("  %-14s %8s %12s %12s %12s\n", "phase", "count", "p50 ms", "p99 ms", "p999 ms");
+        for (int p = 0; p < TRACE_PHASES; p++)
+            if (entry->phase[p].count > 0)
+                printRow(phaseNames[p], &entry->phase[p]);
+        printRow("total", &entry->total);
+    }
+}
+
+/**
+ * @brief Releases the histograms of a report
+ *
+ * @param report Report to release
+ */
+void latencyFree(struct LatencyReport *report)
+{
+    for (int i = 0; i < report->count; i++)
+        free(report->hosts[i]);
+    free(report->hosts);
+    memset(report, 0, sizeof(*report));
+}
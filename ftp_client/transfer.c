@@ -0,0 +1,622 @@
+/**
+ * @file transfer.c
+ * @brief Data-connection receive and send engines for FTP client
+ *
+ * This file implements the loops that move file data from the data
+ * socket to the destination file descriptor:
+ *
+ * - Stdio engine: read() into a BUFFER_SIZE stack buffer and fwrite()
+ *   (the original transfer path).
+ * - Splice engine: splice() from the socket into a pipe and from the
+ *   pipe into the file, so data never enters user space. When the
+ *   kernel or the destination does not support splice, the engine
+ *   falls back to read()/write() through a large page-aligned buffer.
+ * - Mmap engine: the file is sized up front from SIZE and mapped in
+ *   MMAP_WINDOW_SIZE windows; read() copies socket data straight into
+ *   the page cache, without a user buffer or a write() per chunk.
+ * - Inflate stage: with MODE Z the data connection carries a zlib
+ *   stream, which is inflated incrementally between read() and write().
+ *
+ * Every engine honours the read size in the transfer options, hashes
+ * each chunk while it is still in cache when a checksum is requested
+ * (see checksum.c), and reports each chunk to the transfer metrics,
+ * which sample progress on a timer (see metrics.c) instead of printing
+ * per chunk. The file can also be preallocated with fallocate() so
+ * that large downloads get contiguous extents instead of growing chunk
+ * by chunk.
+ *
+ * Uploads go the other way with sendfile(), which moves a byte range of
+ * the local file from the page cache to the data socket without a user
+ * space copy, falling back to pread()/write() where it is unsupported.
+ */
+
+#define _GNU_SOURCE
+#include "ftp_client.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <zlib.h>
+
+/**
+ * @brief Returns the read size requested in the options or a default
+ *
+ * @param opts Transfer options, may be NULL
+ * @param fallback Engine default
+ * @return size_t Bytes per read()
+ */
+static size_t readSizeOf(const struct TransferOptions *opts, size_t fallback)
+{
+    size_t size = opts && opts->readSize > 0 ? opts->readSize : fallback;
+
+    // Small reads keep rate-limited transfers smooth and their shares even
+    if (opts && (opts->rateLimit || opts->hostRateLimit) && size > SHAPER_READ_SIZE)
+        size = SHAPER_READ_SIZE;
+    return size;
+}
+
+/**
+ * @brief Reserves disk blocks for the rest of the file
+ *
+ * FALLOC_FL_KEEP_SIZE allocates the extents without changing the file
+ * length, so a download interrupted halfway still has the length of
+ * the data actually received and can be resumed.
+ *
+ * @param fd Destination file descriptor
+ * @param offset First byte to reserve
+ * @param size Final size of the file
+ * @return int 0 on success, -1 if the filesystem cannot preallocate
+ */
+int preallocateFile(int fd, long long offset, long long size)
+{
+    if (size <= offset)
+        return 0;
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size - offset) != 0)
+    {
+        logMessage("Preallocation not available: %s\n", strerror(errno));
+        return -1;
+    }
+
+    logMessage("Preallocated %lld bytes\n", size - offset);
+    return 0;
+}
+
+/**
+ * @brief Receives the file through stdio buffering
+ *
+ * Reads chunks of the configured size (BUFFER_SIZE by default) from the
+ * socket and writes them with fwrite().
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor
+ * @param opts Transfer options (read size)
+ * @param metrics Metrics updated per chunk
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveStdio(int dataSock, int fd, const struct TransferOptions *opts,
+                       struct TransferMetrics *metrics)
+{
+    FILE *file;
+    size_t size = readSizeOf(opts, BUFFER_SIZE);
+    char *buffer;
+    ssize_t bytes;
+    long long total_bytes = 0;
+
+    if (!(buffer = malloc(size)))
+        return -1;
+    if (!(file = fdopen(dup(fd), "wb")))
+    {
+        free(buffer);
+        return -1;
+    }
+
+    // Read data in chunks and write to file
+    while ((bytes = read(dataSock, buffer, size)) > 0)
+    {
+        fwrite(buffer, bytes, 1, file);
+        if (opts->checksum)
+            checksumUpdate(opts->checksum, buffer, bytes);
+        if (opts->unpack && unpackFeed(opts->unpack, buffer, bytes) != 0)
+        {
+            bytes = -1;
+            break;
+        }
+        total_bytes += bytes;
+        metricsAdd(metrics, bytes);
+        throttleTransfer(opts, bytes);
+    }
+
+    free(buffer);
+    if (fclose(file) != 0 || bytes < 0)
+        return -1;
+    return total_bytes;
+}
+
+/**
+ * @brief Receives the file through a large page-aligned buffer
+ *
+ * Used when splice() is not available. A single read() and write() of
+ * up to ALIGNED_BUFFER_SIZE bytes (or the configured read size) per
+ * chunk replaces the stdio double copy.
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor
+ * @param opts Transfer options (read size)
+ * @param metrics Metrics updated per chunk
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveAligned(int dataSock, int fd, const struct TransferOptions *opts,
+                         struct TransferMetrics *metrics)
+{
+    void *buffer;
+    size_t size = readSizeOf(opts, ALIGNED_BUFFER_SIZE);
+    ssize_t bytes;
+    long long total = 0;
+
+    if (posix_memalign(&buffer, BUFFER_ALIGNMENT, size) != 0)
+        return -1;
+
+    while ((bytes = read(dataSock, buffer, size)) != 0)
+    {
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (opts->checksum)
+            checksumUpdate(opts->checksum, buffer, bytes);
+        if (opts->unpack && unpackFeed(opts->unpack, buffer, bytes) != 0)
+        {
+            free(buffer);
+            return -1;
+        }
+
+        // Regular files may still accept fewer bytes than asked
+        for (ssize_t done = 0, n; done < bytes; done += n)
+        {
+            if ((n = write(fd, (char *)buffer + done, bytes - done)) < 0)
+            {
+                free(buffer);
+                return -1;
+            }
+        }
+        total += bytes;
+        metricsAdd(metrics, bytes);
+        throttleTransfer(opts, bytes);
+    }
+
+    free(buffer);
+    return bytes < 0 ? -1 : total;
+}
+
+/**
+ * @brief Copies bytes stuck in a pipe to the file with read()/write()
+ *
+ * @param pipeRead Read end of the pipe
+ * @param fd Destination file descriptor
+ * @param left Bytes held in the pipe
+ * @return int 0 on success, -1 on failure
+ */
+static int drainPipe(int pipeRead, int fd, ssize_t left)
+{
+    char buffer[BUFFER_SIZE * 16];
+
+    while (left > 0)
+    {
+        ssize_t n = read(pipeRead, buffer, left < (ssize_t)sizeof(buffer) ? left : (ssize_t)sizeof(buffer));
+        if (n <= 0 || write(fd, buffer, n) != n)
+            return -1;
+        left -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives the file with splice() through an intermediate pipe
+ *
+ * Each round moves up to SPLICE_CHUNK_SIZE bytes (or the configured read
+ * size) from the socket into the pipe and then drains the pipe into the
+ * file. If the very first splice() is refused (old kernel, unsupported
+ * socket or filesystem), nothing has been consumed yet and the
+ * aligned-buffer engine takes over. The same engine is used when a
+ * checksum is requested, since spliced data is never visible to the
+ * process.
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor
+ * @param opts Transfer options (read size)
+ * @param metrics Metrics updated per chunk
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveSplice(int dataSock, int fd, const struct TransferOptions *opts,
+                        struct TransferMetrics *metrics)
+{
+    int pipefd[2];
+    size_t size = readSizeOf(opts, SPLICE_CHUNK_SIZE);
+    ssize_t bytes;
+    long long total = 0;
+
+    if (opts->checksum || opts->unpack)
+    {
+        logMessage("%s needs the data in user space, using buffered copy\n",
+                   opts->checksum ? "Checksum" : "Unpacking");
+        return receiveAligned(dataSock, fd, opts, metrics);
+    }
+    if (pipe2(pipefd, O_CLOEXEC) != 0)
+        return receiveAligned(dataSock, fd, opts, metrics);
+
+    // A larger pipe means fewer splice() round trips; failure is harmless
+    fcntl(pipefd[1], F_SETPIPE_SZ, size);
+
+    while ((bytes = splice(dataSock, NULL, pipefd[1], NULL, size,
+                           SPLICE_F_MOVE | SPLICE_F_MORE)) != 0)
+    {
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                logMessage("splice() not supported, using buffered copy\n");
+                return receiveAligned(dataSock, fd, opts, metrics);
+            }
+            break;
+        }
+
+        // Drain everything that entered the pipe into the file
+        for (ssize_t left = bytes, n; left > 0; left -= n)
+        {
+            if ((n = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE)) <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                {
+                    n = 0;
+                    continue;
+                }
+
+                // Destination cannot be spliced into: finish with plain copies
+                int fallback = n < 0 && total == 0 && errno == EINVAL &&
+                               drainPipe(pipefd[0], fd, left) == 0;
+                close(pipefd[0]);
+                close(pipefd[1]);
+                if (!fallback)
+                    return -1;
+                logMessage("splice() to file not supported, using buffered copy\n");
+                long long rest = receiveAligned(dataSock, fd, opts, metrics);
+                return rest < 0 ? -1 : bytes + rest;
+            }
+        }
+        total += bytes;
+        metricsAdd(metrics, bytes);
+        throttleTransfer(opts, bytes);
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return bytes < 0 ? -1 : total;
+}
+
+/**
+ * @brief Receives the file by reading straight into a shared file mapping
+ *
+ * The file is extended to the size reported by SIZE and mapped one
+ * MMAP_WINDOW_SIZE window at a time with MADV_SEQUENTIAL, so the kernel
+ * reads ahead and reclaims written pages early. If the size is unknown
+ * or mapping fails, the aligned-buffer engine is used instead. A file
+ * that turns out shorter than announced is truncated to the bytes
+ * received; one that is longer is finished with plain writes.
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor, opened read-write and positioned at opts->offset
+ * @param opts Transfer options (expected size, offset, read size)
+ * @param metrics Metrics updated per chunk
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveMmap(int dataSock, int fd, const struct TransferOptions *opts,
+                      struct TransferMetrics *metrics)
+{
+    long long size = opts->expectedSize, pos = opts->offset;
+    long long page = sysconf(_SC_PAGESIZE);
+    size_t chunk = readSizeOf(opts, ALIGNED_BUFFER_SIZE);
+    ssize_t bytes = 1;
+
+    if (size <= pos || ftruncate(fd, size) != 0)
+    {
+        logMessage("File size unknown, using buffered copy\n");
+        return receiveAligned(dataSock, fd, opts, metrics);
+    }
+
+    while (pos < size && bytes > 0)
+    {
+        // Mappings must start on a page boundary
+        long long windowStart = pos & ~(page - 1);
+        size_t windowLength = size - windowStart < MMAP_WINDOW_SIZE ? size - windowStart : MMAP_WINDOW_SIZE;
+        char *map = mmap(NULL, windowLength, opts->checksum || opts->unpack ? PROT_READ | PROT_WRITE : PROT_WRITE,
+                         MAP_SHARED, fd, windowStart);
+        if (map == MAP_FAILED)
+        {
+            logMessage("mmap() failed (%s), using buffered copy\n", strerror(errno));
+            if (ftruncate(fd, pos) != 0 || lseek(fd, pos, SEEK_SET) < 0)
+                return -1;
+            long long rest = receiveAligned(dataSock, fd, opts, metrics);
+            return rest < 0 ? -1 : pos - opts->offset + rest;
+        }
+        madvise(map, windowLength, MADV_SEQUENTIAL);
+
+        long long windowEnd = windowStart + windowLength;
+        while (pos < windowEnd)
+        {
+            size_t want = windowEnd - pos < (long long)chunk ? windowEnd - pos : chunk;
+            if ((bytes = read(dataSock, map + (pos - windowStart), want)) < 0 && errno == EINTR)
+                continue;
+            if (bytes <= 0)
+                break;
+            if (opts->checksum)
+                checksumUpdate(opts->checksum, map + (pos - windowStart), bytes);
+            if (opts->unpack && unpackFeed(opts->unpack, map + (pos - windowStart), bytes) != 0)
+            {
+                bytes = -1;
+                break;
+            }
+            pos += bytes;
+            metricsAdd(metrics, bytes);
+            throttleTransfer(opts, bytes);
+        }
+        munmap(map, windowLength);
+    }
+
+    if (bytes < 0)
+    {
+        ftruncate(fd, pos);
+        return -1;
+    }
+
+    // Short file: drop the unwritten tail. Grown file: append the rest.
+    if (pos < size)
+        return ftruncate(fd, pos) == 0 ? pos - opts->offset : -1;
+    if (lseek(fd, pos, SEEK_SET) < 0)
+        return -1;
+    long long rest = receiveAligned(dataSock, fd, opts, metrics);
+    return rest < 0 ? -1 : pos - opts->offset + rest;
+}
+
+/**
+ * @brief Inflates a MODE Z data connection into a sink
+ *
+ * Compressed data is read in chunks of the configured read size (or
+ * INFLATE_BUFFER_SIZE) and each chunk is inflated completely, through a
+ * fixed INFLATE_BUFFER_SIZE output buffer, before the next read. Memory
+ * therefore stays bounded by the two buffers and the 32 KiB deflate
+ * window whatever the compression ratio. Servers that start a new zlib
+ * stream after finishing one are handled by resetting the inflater.
+ * A connection that closes before the stream ends is a failure.
+ *
+ * @param dataSock Data socket carrying the zlib stream
+ * @param opts Transfer options (read size, rate limits), may be NULL
+ * @param sink Called with every inflated block; returns 0, or -1 to abort
+ * @param ctx Passed to sink
+ * @param metrics Metrics updated with wire and inflated bytes, may be NULL
+ * @return long long Inflated bytes, -1 on failure
+ */
+long long inflateStream(int dataSock, const struct TransferOptions *opts,
+                        int (*sink)(void *ctx, const char *data, size_t length), void *ctx,
+                        struct TransferMetrics *metrics)
+{
+    size_t size = readSizeOf(opts, INFLATE_BUFFER_SIZE);
+    unsigned char *in = malloc(size), *out = malloc(INFLATE_BUFFER_SIZE);
+    long long total = 0;
+    int status = Z_OK, failed = 0;
+    ssize_t bytes = 0;
+    z_stream z;
+
+    memset(&z, 0, sizeof(z));
+    if (!in || !out || inflateInit(&z) != Z_OK)
+    {
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    while (!failed && (bytes = read(dataSock, in, size)) != 0)
+    {
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (metrics)
+            metricsAddWire(metrics, bytes);
+        // Limits apply to the bandwidth used, i.e. compressed bytes
+        throttleTransfer(opts, bytes);
+
+        // Inflate until the chunk is consumed and no output is pending
+        z.next_in = in;
+        z.avail_in = bytes;
+        do
+        {
+            if (status == Z_STREAM_END && z.avail_in > 0)
+                inflateReset(&z);
+            z.next_out = out;
+            z.avail_out = INFLATE_BUFFER_SIZE;
+            status = inflate(&z, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+            {
+                logMessage("Decompression failed: %s\n", z.msg ? z.msg : "corrupt stream");
+                errno = EPROTO;
+                failed = 1;
+                break;
+            }
+
+            size_t produced = INFLATE_BUFFER_SIZE - z.avail_out;
+            if (produced > 0)
+            {
+                if (sink(ctx, (const char *)out, produced) != 0)
+                    failed = 1;
+                total += produced;
+                if (metrics)
+                    metricsAdd(metrics, produced);
+            }
+        } while (!failed && (z.avail_in > 0 || z.avail_out == 0));
+    }
+
+    // EOF before the end of the zlib stream means the transfer was cut short
+    if (!failed && bytes == 0 && status != Z_STREAM_END)
+    {
+        logMessage("Decompression failed: compressed stream ended early\n");
+        errno = EPROTO;
+        failed = 1;
+    }
+
+    inflateEnd(&z);
+    free(in);
+    free(out);
+    return failed || bytes < 0 ? -1 : total;
+}
+
+/**
+ * @struct FileSink
+ * @brief Destination of inflated file data
+ */
+struct FileSink {
+    int fd;                     /**< Destination file descriptor */
+    struct Checksum *checksum;  /**< Digest of the inflated bytes, may be NULL */
+    struct Unpacker *unpack;    /**< Unpack stage fed the inflated bytes, may be NULL */
+};
+
+/**
+ * @brief Writes an inflated block to the destination file
+ */
+static int writeToFile(void *ctx, const char *data, size_t length)
+{
+    struct FileSink *sink = ctx;
+
+    if (sink->checksum)
+        checksumUpdate(sink->checksum, data, length);
+    if (sink->unpack && unpackFeed(sink->unpack, data, length) != 0)
+        return -1;
+    for (size_t done = 0; done < length;)
+    {
+        ssize_t n = write(sink->fd, data + done, length - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives a MODE Z transfer, inflating it on the way to the file
+ *
+ * Takes the place of the selected engine when MODE Z is active: data
+ * has to pass through user space to be inflated, so neither splice()
+ * nor the file mapping apply. The digest, if any, covers the inflated
+ * bytes, which is what the server hashes.
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor
+ * @param opts Transfer options (read size, checksum)
+ * @param metrics Metrics updated per chunk with wire and inflated bytes
+ * @return long long Inflated bytes written, -1 on failure
+ */
+long long receiveInflate(int dataSock, int fd, const struct TransferOptions *opts,
+                         struct TransferMetrics *metrics)
+{
+    struct FileSink sink = { fd, opts->checksum, opts->unpack };
+
+    return inflateStream(dataSock, opts, writeToFile, &sink, metrics);
+}
+
+/**
+ * @brief Sends a byte range through a page-aligned buffer
+ *
+ * Used when sendfile() cannot read the source file.
+ *
+ * @param dataSock Data socket
+ * @param fd Source file descriptor
+ * @param offset First byte to send
+ * @param length Bytes to send
+ * @param opts Transfer options (read size, rate limits)
+ * @param metrics Metrics updated per chunk, may be NULL
+ * @return long long Bytes sent, -1 on failure
+ */
+static long long sendAligned(int dataSock, int fd, long long offset, long long length,
+                             const struct TransferOptions *opts, struct TransferMetrics *metrics)
+{
+    size_t size = readSizeOf(opts, ALIGNED_BUFFER_SIZE);
+    char *buffer;
+    long long total_bytes = 0;
+
+    if (posix_memalign((void **)&buffer, BUFFER_ALIGNMENT, size) != 0)
+        return -1;
+
+    while (total_bytes < length)
+    {
+        size_t want = length - total_bytes < (long long)size ? length - total_bytes : size;
+        ssize_t bytes = pread(fd, buffer, want, offset + total_bytes);
+        if (bytes <= 0)
+            break;
+        for (ssize_t done = 0, n; done < bytes; done += n)
+            if ((n = write(dataSock, buffer + done, bytes - done)) <= 0)
+            {
+                free(buffer);
+                return -1;
+            }
+        total_bytes += bytes;
+        if (metrics)
+            metricsAdd(metrics, bytes);
+        throttleTransfer(opts, bytes);
+    }
+
+    free(buffer);
+    return total_bytes == length ? total_bytes : -1;
+}
+
+/**
+ * @brief Sends a byte range of a file over the data connection
+ *
+ * sendfile() hands the range from the page cache to the socket in
+ * SPLICE_CHUNK_SIZE steps (SHAPER_READ_SIZE while a rate limit
+ * applies), so the data never enters user space. Falls back to
+ * pread()/write() if the kernel cannot sendfile() from this file.
+ *
+ * @param dataSock Data socket
+ * @param fd Source file descriptor
+ * @param offset First byte to send
+ * @param length Bytes to send
+ * @param opts Transfer options (rate limits), may be NULL
+ * @param metrics Metrics updated per chunk, may be NULL
+ * @return long long Bytes sent, -1 on failure
+ */
+long long sendFileRange(int dataSock, int fd, long long offset, long long length,
+                        const struct TransferOptions *opts, struct TransferMetrics *metrics)
+{
+    size_t chunk = opts && (opts->rateLimit || opts->hostRateLimit) ? SHAPER_READ_SIZE : SPLICE_CHUNK_SIZE;
+    off_t position = offset;
+    long long total_bytes = 0;
+
+    while (total_bytes < length)
+    {
+        size_t want = length - total_bytes < (long long)chunk ? length - total_bytes : chunk;
+        ssize_t bytes = sendfile(dataSock, fd, &position, want);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes < 0 && total_bytes == 0 && (errno == EINVAL || errno == ENOSYS))
+            return sendAligned(dataSock, fd, offset, length, opts, metrics);
+        if (bytes <= 0)
+            return -1;
+        total_bytes += bytes;
+        if (metrics)
+            metricsAdd(metrics, bytes);
+        throttleTransfer(opts, bytes);
+    }
+    return total_bytes;
+}
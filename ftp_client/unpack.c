@@ -0,0 +1,720 @@
+/**
+ * @file unpack.c
+ * @brief Streaming archive extraction for FTP client
+ *
+ * This file implements an unpack stage that runs next to the receive
+ * loop. The receive loop copies every chunk into a bounded ring buffer;
+ * a thread drains the ring through a streaming decompressor and a tar
+ * reader, so the archive is extracted while it is still arriving:
+ *
+ *   socket -> receive loop -> ring (UNPACK_RING_SIZE) -> thread:
+ *             gzip (zlib) or xz (liblzma) -> tar reader -> files
+ *
+ * A full ring blocks the receive loop, which in turn lets TCP flow
+ * control slow the server down to the speed of the extraction.
+ *
+ * The archive type comes from the file name: .tar.gz/.tgz, .tar.xz/.txz
+ * and .tar are extracted, a lone .gz or .xz is decompressed to a file
+ * without the suffix. The tar reader handles ustar, GNU long names and
+ * pax path/size records. Entries with an absolute path or a ".."
+ * component are refused, and so are links pointing outside the tree;
+ * devices and FIFOs are skipped.
+ */
+
+#include "ftp_client.h"
+#include <fcntl.h>
+#include <lzma.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/**
+ * @enum UnpackFormat
+ * @brief Compression of the archive
+ */
+enum UnpackFormat {
+    UNPACK_PLAIN = 0,  /**< Not compressed */
+    UNPACK_GZIP,       /**< gzip, one or more members */
+    UNPACK_XZ          /**< xz, one or more streams */
+};
+
+/**
+ * @enum TarState
+ * @brief What the tar reader expects next
+ */
+enum TarState {
+    TAR_HEADER = 0,  /**< A 512-byte header block */
+    TAR_DATA,        /**< Member data, written to the current file */
+    TAR_META,        /**< GNU long name or pax record data, collected */
+    TAR_SKIP,        /**< Data of a skipped member, or block padding */
+    TAR_END          /**< The end-of-archive blocks were seen */
+};
+
+/**
+ * @struct TarReader
+ * @brief Incremental tar extractor
+ */
+struct TarReader {
+    enum TarState state;         /**< Expected input */
+    unsigned char header[512];   /**< Header being collected */
+    size_t have;                 /**< Bytes in header or meta */
+    long long left;              /**< Bytes left in the current member */
+    long long padding;           /**< Padding after the member's data */
+    char meta[MAX_LENGTH * 4];   /**< GNU long name or pax records */
+    size_t metaSize;             /**< Bytes of meta to collect */
+    char metaType;               /**< 'L' or 'x' while collecting meta */
+    char longName[MAX_LENGTH * 2]; /**< Name for the next member, empty if none */
+    long long paxSize;           /**< Size for the next member from pax, -1 if none */
+    int fd;                      /**< File being written, -1 if none */
+    int zeroBlocks;              /**< Consecutive all-zero headers */
+};
+
+/**
+ * @struct Unpacker
+ * @brief Unpack stage of one download
+ */
+struct Unpacker {
+    char dir[MAX_LENGTH];        /**< Extraction directory */
+    char name[MAX_LENGTH];       /**< Output name of a lone .gz/.xz */
+    enum UnpackFormat format;    /**< Compression */
+    int tar;                     /**< Contents are a tar archive */
+    int keep;                    /**< The archive is kept, so a failed stage does not fail the download */
+    char *ring;                  /**< Ring buffer */
+    size_t head;                 /**< Total bytes consumed */
+    size_t tail;                 /**< Total bytes produced */
+    int closed;                  /**< The download ended */
+    int failed;                  /**< The stage gave up */
+    pthread_mutex_t lock;        /**< Guards the ring indexes and flags */
+    pthread_cond_t readable;     /**< Signalled when bytes arrive or the download ends */
+    pthread_cond_t writable;     /**< Signalled when bytes are consumed or the stage fails */
+    pthread_t thread;            /**< Stage thread */
+    int started;                 /**< The thread is running */
+    z_stream zlib;               /**< gzip decoder */
+    lzma_stream xz;              /**< xz decoder */
+    int streamEnd;               /**< The decoder reached the end of a member */
+    struct TarReader reader;     /**< Tar state */
+    int out;                     /**< Output of a lone .gz/.xz */
+    int files;                   /**< Files written */
+    long long bytes;             /**< Bytes written */
+};
+
+/**
+ * @brief Tells whether a name ends with a suffix
+ */
+static int endsWith(const char *name, const char *suffix)
+{
+    size_t n = strlen(name), s = strlen(suffix);
+    return n > s && strcmp(name + n - s, suffix) == 0;
+}
+
+/**
+ * @brief Checks that an entry name stays inside the extraction directory
+ *
+ * @param name Entry name from the archive
+ * @return int Non-zero if the name is relative and has no ".." component
+ */
+static int safeName(const char *name)
+{
+    if (name[0] == '/' || name[0] == '\0')
+        return 0;
+    for (const char *p = name; *p; )
+    {
+        size_t length = strcspn(p, "/");
+        if (length == 2 && p[0] == '.' && p[1] == '.')
+            return 0;
+        p += length;
+        while (*p == '/')
+            p++;
+    }
+    return 1;
+}
+
+/**
+ * @brief Creates the parent directories of dir/name
+ *
+ * @param path Full path of the entry
+ * @param skip Length of the extraction directory prefix, which exists
+ * @return int 0 on success, -1 on failure
+ */
+static int makeParents(char *path, size_t skip)
+{
+    for (char *p = path + skip; *p; p++)
+    {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        int failed = mkdir(path, 0755) != 0 && errno != EEXIST;
+        *p = '/';
+        if (failed)
+        {
+            logMessage("Cannot create directory: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a whole buffer to a file
+ *
+ * @return int 0 on success, -1 on failure
+ */
+static int writeAll(int fd, const char *data, size_t length)
+{
+    for (size_t done = 0; done < length;)
+    {
+        ssize_t n = write(fd, data + done, length - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses an octal or base-256 number field of a tar header
+ *
+ * @param field Field
+ * @param length Field length
+ * @return long long Value, -1 if malformed
+ */
+static long long tarNumber(const unsigned char *field, size_t length)
+{
+    long long value = 0;
+
+    // GNU base-256 for sizes of 8 GiB and more
+    if (field[0] & 0x80)
+    {
+        value = field[0] & 0x3f;
+        for (size_t i = 1; i < length; i++)
+            value = value << 8 | field[i];
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < length && field[i] == ' ')
+        i++;
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return i < length && field[i] != ' ' && field[i] != '\0' ? -1 : value;
+}
+
+/**
+ * @brief Takes "path" and "size" from pax extended header records
+ *
+ * Records have the form "<length> <key>=<value>\n".
+ *
+ * @param r Tar reader holding the records in meta
+ */
+static void parsePax(struct TarReader *r)
+{
+    for (size_t pos = 0; pos < r->metaSize;)
+    {
+        char *record = r->meta + pos;
+        long length = strtol(record, NULL, 10);
+        char *key = memchr(record, ' ', r->metaSize - pos);
+        if (length <= 0 || pos + length > r->metaSize || !key || key >= record + length)
+            return;
+        key++;
+
+        char *value = memchr(key, '=', record + length - key);
+        if (value)
+        {
+            size_t valueLength = record + length - 1 - (value + 1);
+            if (strncmp(key, "path=", 5) == 0 && valueLength < sizeof(r->longName))
+            {
+                memcpy(r->longName, value + 1, valueLength);
+                r->longName[valueLength] = '\0';
+            }
+            else if (strncmp(key, "size=", 5) == 0)
+                r->paxSize = strtoll(value + 1, NULL, 10);
+        }
+        pos += length;
+    }
+}
+
+/**
+ * @brief Acts on a complete header block
+ *
+ * @param u Unpacker
+ * @return int 0 on success, -1 if the archive is corrupt or a file cannot be written
+ */
+static int tarHeader(struct Unpacker *u)
+{
+    struct TarReader *r = &u->reader;
+    const unsigned char *h = r->header;
+    char name[MAX_LENGTH * 2], path[MAX_LENGTH * 3];
+
+    // Two zero blocks end the archive
+    int zero = 1;
+    for (int i = 0; i < 512 && zero; i++)
+        zero = h[i] == 0;
+    if (zero)
+    {
+        if (++r->zeroBlocks == 2)
+            r->state = TAR_END;
+        return 0;
+    }
+    r->zeroBlocks = 0;
+
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    long long size = tarNumber(h + 124, 12);
+    if (tarNumber(h + 148, 8) != sum || size < 0)
+    {
+        logMessage("Corrupt tar header\n");
+        return -1;
+    }
+    if (r->paxSize >= 0)
+        size = r->paxSize;
+
+    char type = h[156];
+    r->left = size;
+    r->padding = (512 - size % 512) % 512;
+    r->state = size > 0 ? TAR_SKIP : TAR_HEADER;
+
+    // Long names and pax records describe the member that follows
+    if (type == 'L' || type == 'x')
+    {
+        if ((size_t)size >= sizeof(r->meta))
+            return 0;
+        r->metaType = type;
+        r->metaSize = size;
+        r->have = 0;
+        r->state = size > 0 ? TAR_META : TAR_HEADER;
+        return 0;
+    }
+    if (type == 'g' || type == 'K')
+        return 0;
+
+    // ustar splits long names into prefix and name
+    if (r->longName[0])
+        snprintf(name, sizeof(name), "%s", r->longName);
+    else if (memcmp(h + 257, "ustar", 6) == 0 && h[345])
+        snprintf(name, sizeof(name), "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+    else
+        snprintf(name, sizeof(name), "%.100s", (const char *)h);
+    r->longName[0] = '\0';
+    r->paxSize = -1;
+
+    if (!safeName(name))
+    {
+        logMessage("Skipping unsafe entry %s\n", name);
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/%s", u->dir, name);
+    if (makeParents(path, strlen(u->dir) + 1) != 0)
+        return -1;
+
+    int mode = tarNumber(h + 100, 8) & 0777;
+    switch (type)
+    {
+    case '0':
+    case '\0':
+    case '7':
+        unlink(path);
+        if ((r->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, mode ? mode : 0644)) < 0)
+        {
+            logMessage("Cannot create %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        u->files++;
+        r->state = size > 0 ? TAR_DATA : TAR_HEADER;
+        if (size == 0)
+        {
+            close(r->fd);
+            r->fd = -1;
+        }
+        return 0;
+    case '5':
+        if (mkdir(path, mode ? mode | 0700 : 0755) != 0 && errno != EEXIST)
+        {
+            logMessage("Cannot create directory %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        return 0;
+    case '2':
+    {
+        char target[101];
+        snprintf(target, sizeof(target), "%.100s", (const char *)h + 157);
+        // A link into the tree is safe to write through; one out of it is not
+        if (!safeName(target))
+        {
+            logMessage("Skipping link %s -> %s\n", name, target);
+            return 0;
+        }
+        unlink(path);
+        if (symlink(target, path) != 0)
+            logMessage("Cannot link %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    default:
+        logMessage("Skipping %s (type %c)\n", name, type);
+        return 0;
+    }
+}
+
+/**
+ * @brief Feeds decompressed bytes to the tar reader
+ *
+ * @param u Unpacker
+ * @param data Bytes
+ * @param length Number of bytes
+ * @return int 0 on success, -1 on failure
+ */
+static int tarFeed(struct Unpacker *u, const char *data, size_t length)
+{
+    struct TarReader *r = &u->reader;
+
+    while (length > 0 && r->state != TAR_END)
+    {
+        size_t n;
+        switch (r->state)
+        {
+        case TAR_HEADER:
+            n = 512 - r->have < length ? 512 - r->have : length;
+            memcpy(r->header + r->have, data, n);
+            if ((r->have += n) == 512)
+            {
+                r->have = 0;
+                if (tarHeader(u) != 0)
+                    return -1;
+            }
+            break;
+        case TAR_DATA:
+            n = (long long)length < r->left ? length : (size_t)r->left;
+            if (writeAll(r->fd, data, n) != 0)
+            {
+                logMessage("Cannot write extracted file: %s\n", strerror(errno));
+                return -1;
+            }
+            u->bytes += n;
+            if ((r->left -= n) == 0)
+            {
+                close(r->fd);
+                r->fd = -1;
+                r->state = r->padding ? TAR_SKIP : TAR_HEADER;
+            }
+            break;
+        case TAR_META:
+            n = r->metaSize - r->have < length ? r->metaSize - r->have : length;
+            memcpy(r->meta + r->have, data, n);
+            r->left -= n;
+            if ((r->have += n) == r->metaSize)
+            {
+                r->meta[r->metaSize] = '\0';
+                r->have = 0;
+                if (r->metaType == 'x')
+                    parsePax(r);
+                else
+                    snprintf(r->longName, sizeof(r->longName), "%.*s", (int)r->metaSize, r->meta);
+                r->state = r->padding ? TAR_SKIP : TAR_HEADER;
+            }
+            break;
+        default:
+            // Skipped member data first, then its padding
+            if (r->left == 0)
+            {
+                r->left = r->padding;
+                r->padding = 0;
+            }
+            n = (long long)length < r->left ? length : (size_t)r->left;
+            if ((r->left -= n) == 0 && r->padding == 0)
+                r->state = TAR_HEADER;
+            break;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Passes decompressed bytes to the tar reader or the output file
+ *
+ * @return int 0 on success, -1 on failure
+ */
+static int emit(struct Unpacker *u, const char *data, size_t length)
+{
+    if (u->tar)
+        return tarFeed(u, data, length);
+    if (writeAll(u->out, data, length) != 0)
+    {
+        logMessage("Cannot write %s: %s\n", u->name, strerror(errno));
+        return -1;
+    }
+    u->bytes += length;
+    return 0;
+}
+
+/**
+ * @brief Decompresses one block of archive bytes and emits the output
+ *
+ * @param u Unpacker
+ * @param data Compressed bytes
+ * @param length Number of bytes
+ * @return int 0 on success, -1 on corrupt input or an output failure
+ */
+static int decode(struct Unpacker *u, const char *data, size_t length)
+{
+    char out[INFLATE_BUFFER_SIZE];
+
+    if (u->format == UNPACK_PLAIN)
+        return emit(u, data, length);
+
+    if (u->format == UNPACK_XZ)
+    {
+        u->xz.next_in = (const uint8_t *)data;
+        u->xz.avail_in = length;
+        do {
+            u->xz.next_out = (uint8_t *)out;
+            u->xz.avail_out = sizeof(out);
+            lzma_ret ret = lzma_code(&u->xz, LZMA_RUN);
+            if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+            {
+                logMessage("xz decoding failed (error %d)\n", (int)ret);
+                return -1;
+            }
+            if (emit(u, out, sizeof(out) - u->xz.avail_out) != 0)
+                return -1;
+        } while (u->xz.avail_in > 0 || u->xz.avail_out == 0);
+        return 0;
+    }
+
+    u->zlib.next_in = (Bytef *)data;
+    u->zlib.avail_in = length;
+    do {
+        // A new gzip member follows the end of the previous one
+        if (u->streamEnd)
+        {
+            inflateReset(&u->zlib);
+            u->streamEnd = 0;
+        }
+        u->zlib.next_out = (Bytef *)out;
+        u->zlib.avail_out = sizeof(out);
+        int ret = inflate(&u->zlib, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+        {
+            logMessage("gzip decoding failed: %s\n", u->zlib.msg ? u->zlib.msg : "corrupt data");
+            return -1;
+        }
+        u->streamEnd = ret == Z_STREAM_END;
+        if (emit(u, out, sizeof(out) - u->zlib.avail_out) != 0)
+            return -1;
+    } while (u->zlib.avail_in > 0 || u->zlib.avail_out == 0);
+    return 0;
+}
+
+/**
+ * @brief Drains the ring into the decoder until the download ends
+ *
+ * @param arg Unpacker
+ * @return void* NULL
+ */
+static void *unpackThread(void *arg)
+{
+    struct Unpacker *u = arg;
+
+    pthread_mutex_lock(&u->lock);
+    for (;;)
+    {
+        while (u->head == u->tail && !u->closed)
+            pthread_cond_wait(&u->readable, &u->lock);
+        if (u->head == u->tail)
+            break;
+
+        // The largest contiguous run; the ring may wrap after it
+        size_t start = u->head % UNPACK_RING_SIZE;
+        size_t length = u->tail - u->head;
+        if (length > UNPACK_RING_SIZE - start)
+            length = UNPACK_RING_SIZE - start;
+        pthread_mutex_unlock(&u->lock);
+
+        int result = decode(u, u->ring + start, length);
+
+        pthread_mutex_lock(&u->lock);
+        u->head += length;
+        if (result != 0)
+            u->failed = 1;
+        pthread_cond_signal(&u->writable);
+        if (u->failed)
+            break;
+    }
+    pthread_mutex_unlock(&u->lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts the unpack stage for a file if its name is an archive
+ *
+ * @param name File name, which selects the format
+ * @param dir Directory to extract into, created if needed
+ * @param keep Non-zero if the archive itself is kept on disk
+ * @return struct Unpacker* Stage, NULL if the name is not an archive or the stage cannot start
+ */
+struct Unpacker *unpackStart(const char *name, const char *dir, int keep)
+{
+    const char *base = strrchr(name, '/');
+    struct Unpacker *u;
+
+    base = base ? base + 1 : name;
+    if (!(u = calloc(1, sizeof(*u))))
+        return NULL;
+    u->reader.fd = u->out = -1;
+    u->reader.paxSize = -1;
+    u->keep = keep;
+    snprintf(u->dir, sizeof(u->dir), "%s", dir);
+
+    if (endsWith(base, ".tar.gz") || endsWith(base, ".tgz"))
+        u->format = UNPACK_GZIP, u->tar = 1;
+    else if (endsWith(base, ".tar.xz") || endsWith(base, ".txz"))
+        u->format = UNPACK_XZ, u->tar = 1;
+    else if (endsWith(base, ".tar"))
+        u->format = UNPACK_PLAIN, u->tar = 1;
+    else if (endsWith(base, ".gz") || endsWith(base, ".xz"))
+    {
+        u->format = endsWith(base, ".gz") ? UNPACK_GZIP : UNPACK_XZ;
+        snprintf(u->name, sizeof(u->name), "%s/%.*s", dir, (int)strlen(base) - 3, base);
+    }
+    else
+    {
+        free(u);
+        return NULL;
+    }
+
+    lzma_stream init = LZMA_STREAM_INIT;
+    u->xz = init;
+    if ((mkdir(dir, 0755) != 0 && errno != EEXIST) ||
+        (!u->tar && (u->out = open(u->name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644)) < 0) ||
+        !(u->ring = malloc(UNPACK_RING_SIZE)) ||
+        (u->format == UNPACK_GZIP && inflateInit2(&u->zlib, 16 + MAX_WBITS) != Z_OK) ||
+        (u->format == UNPACK_XZ && lzma_stream_decoder(&u->xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK))
+    {
+        logMessage("Cannot start unpacking into %s: %s\n", dir, strerror(errno));
+        if (u->out >= 0)
+            close(u->out);
+        free(u->ring);
+        free(u);
+        return NULL;
+    }
+
+    pthread_mutex_init(&u->lock, NULL);
+    pthread_cond_init(&u->readable, NULL);
+    pthread_cond_init(&u->writable, NULL);
+    if (pthread_create(&u->thread, NULL, unpackThread, u) != 0)
+    {
+        unpackFinish(u, 0);
+        return NULL;
+    }
+    u->started = 1;
+
+    logMessage("Unpacking %s into %s while downloading\n", base, dir);
+    return u;
+}
+
+/**
+ * @brief Hands received bytes to the unpack stage
+ *
+ * Copies the bytes into the ring, waiting while it is full.
+ *
+ * @param u Unpacker
+ * @param data Bytes received
+ * @param length Number of bytes
+ * @return int 0 on success, -1 if the stage failed and the archive is not kept
+ */
+int unpackFeed(struct Unpacker *u, const void *data, size_t length)
+{
+    const char *p = data;
+
+    pthread_mutex_lock(&u->lock);
+    while (length > 0 && !u->failed)
+    {
+        while (u->tail - u->head == UNPACK_RING_SIZE && !u->failed)
+            pthread_cond_wait(&u->writable, &u->lock);
+        if (u->failed)
+            break;
+
+        size_t start = u->tail % UNPACK_RING_SIZE;
+        size_t n = UNPACK_RING_SIZE - (u->tail - u->head);
+        if (n > UNPACK_RING_SIZE - start)
+            n = UNPACK_RING_SIZE - start;
+        if (n > length)
+            n = length;
+        pthread_mutex_unlock(&u->lock);
+
+        // Only this thread writes past tail, so the copy needs no lock
+        memcpy(u->ring + start, p, n);
+
+        pthread_mutex_lock(&u->lock);
+        u->tail += n;
+        p += n;
+        length -= n;
+        pthread_cond_signal(&u->readable);
+    }
+    int failed = u->failed && !u->keep;
+    pthread_mutex_unlock(&u->lock);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Ends the unpack stage and reports what it extracted
+ *
+ * @param u Unpacker from unpackStart()
+ * @param ok Non-zero if the whole file was received
+ * @return int 0 if the archive was fully extracted, -1 otherwise
+ */
+int unpackFinish(struct Unpacker *u, int ok)
+{
+    pthread_mutex_lock(&u->lock);
+    u->closed = 1;
+    pthread_cond_signal(&u->readable);
+    pthread_mutex_unlock(&u->lock);
+    if (u->started)
+        pthread_join(u->thread, NULL);
+
+    // Concatenated xz streams only end when told there is no more input
+    if (ok && !u->failed && u->format == UNPACK_XZ)
+    {
+        char out[INFLATE_BUFFER_SIZE];
+        lzma_ret ret;
+        do {
+            u->xz.next_out = (uint8_t *)out;
+            u->xz.avail_out = sizeof(out);
+            ret = lzma_code(&u->xz, LZMA_FINISH);
+            if ((ret != LZMA_OK && ret != LZMA_STREAM_END) || emit(u, out, sizeof(out) - u->xz.avail_out) != 0)
+                u->failed = 1;
+        } while (ret == LZMA_OK && !u->failed);
+        u->streamEnd = ret == LZMA_STREAM_END;
+    }
+
+    // A truncated stream or archive is a failure even if every read succeeded
+    int complete = ok && u->started && !u->failed &&
+                   (u->format == UNPACK_PLAIN || u->streamEnd) &&
+                   (!u->tar || u->reader.state == TAR_END ||
+                    (u->reader.state == TAR_HEADER && u->reader.have == 0));
+
+    logMessage("\n=== UNPACK ===\n");
+    if (complete)
+        logMessage("%s %d file(s), %.2f MB, into %s\n", u->tar ? "Extracted" : "Decompressed",
+                   u->tar ? u->files : 1, u->bytes / (1024.0 * 1024.0), u->dir);
+    else
+        logMessage("Unpacking into %s failed after %.2f MB\n", u->dir, u->bytes / (1024.0 * 1024.0));
+
+    if (u->reader.fd >= 0)
+        close(u->reader.fd);
+    if (u->out >= 0)
+        close(u->out);
+    if (u->format == UNPACK_GZIP)
+        inflateEnd(&u->zlib);
+    lzma_end(&u->xz);
+    pthread_mutex_destroy(&u->lock);
+    pthread_cond_destroy(&u->readable);
+    pthread_cond_destroy(&u->writable);
+    free(u->ring);
+    free(u);
+    return complete ? 0 : -1;
+}
@@ -0,0 +1,511 @@
+/**
+ * @file upload.c
+ * @brief Uploads (STOR/APPE) for FTP client
+ *
+ * This file implements sending a local file to the path of a URL over
+ * the same session functions the downloads use:
+ *
+ *   connect -> USER/PASS -> TYPE I -> PASV -> [REST] -> STOR|APPE
+ *           -> sendfile() -> close data connection -> 226
+ *
+ * The data goes from the page cache to the socket with sendfile(), so
+ * it is never copied through user space. In resume mode SIZE tells how
+ * much of the file the server already holds and only the rest is sent,
+ * with APPE.
+ *
+ * A segmented upload splits the file into ranges stored in parallel,
+ * each over its own session with REST <offset> + STOR. The first range
+ * is stored without REST, which creates or truncates the remote file,
+ * and the other sessions only send STOR once the server has accepted
+ * that one. Servers that reject REST before STOR get a single stream;
+ * the assembled file is checked with SIZE afterwards, and one the server
+ * did not put together correctly is sent again as a single stream.
+ */
+
+#include "ftp_client.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/**
+ * @struct UploadJob
+ * @brief Shared state for all workers of one segmented upload
+ */
+struct UploadJob {
+    struct URL *url;                     /**< Destination */
+    const struct TransferOptions *opts;  /**< Socket options and rate limits */
+    int fd;                              /**< Local file */
+    long long sent;                      /**< Bytes sent by all workers */
+    int running;                         /**< Workers still alive */
+    pthread_mutex_t lock;                /**< Protects sent and running */
+    pthread_cond_t done;                 /**< Signalled when a worker exits */
+};
+
+/**
+ * @struct UploadWorker
+ * @brief Per-thread state of a segment upload worker
+ */
+struct UploadWorker {
+    struct UploadJob *job;     /**< Job the worker belongs to */
+    int index;                 /**< Index of the worker's range */
+    long long offset;          /**< First byte of the range */
+    long long length;          /**< Bytes in the range */
+    int ctrlSock;              /**< Control connection, -1 if not connected */
+    int dataSock;              /**< Data connection once STOR was accepted, -1 before */
+    int result;                /**< 0 once the range was stored */
+    pthread_t thread;          /**< Worker thread */
+    struct SessionTrace trace; /**< Phase timings of the worker's session */
+};
+
+/**
+ * @brief Opens an authenticated binary-mode control connection
+ *
+ * @param url Parsed URL holding the server address and credentials
+ * @return int Control socket on success, -1 on failure
+ */
+static int openUploadSession(struct URL *url)
+{
+    int sock = createSocket(url->host, url->port);
+    if (sock < 0)
+        return -1;
+    traceStep(TRACE_CONNECT);
+
+    if (authenticate(sock, url->user, url->password) != 0 || setBinaryMode(sock) != 0)
+    {
+        closeConnection(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * @brief Opens a data connection and asks the server to receive a file
+ *
+ * @param ctrlSock Control socket
+ * @param path Remote path
+ * @param offset REST offset for STOR, 0 for none
+ * @param append Use APPE instead of STOR
+ * @param opts Transfer options (data socket settings), may be NULL
+ * @return int Data socket once the server is ready, -1 on failure
+ */
+static int openStore(int ctrlSock, const char *path, long long offset, int append,
+                     const struct TransferOptions *opts)
+{
+    struct SocketOptions defaults = {0};
+    char dataAddr[BUFFER_SIZE];
+    int dataPort;
+
+    if (enterPassiveMode(ctrlSock, dataAddr, &dataPort) != 0)
+        return -1;
+
+    int dataSock = createSocketWith(dataAddr, dataPort, opts ? &opts->socket : &defaults);
+    if (dataSock < 0)
+        return -1;
+    traceStep(TRACE_DATA_CONNECT);
+
+    if ((offset > 0 && restartAt(ctrlSock, offset) != 0) || requestStore(ctrlSock, path, append) != 0)
+    {
+        close(dataSock);
+        return -1;
+    }
+    return dataSock;
+}
+
+/**
+ * @brief Sends a range on an accepted data connection and waits for 226
+ *
+ * Closing the data connection marks the end of the file for the
+ * server, which then confirms it on the control connection.
+ *
+ * @param ctrlSock Control socket
+ * @param dataSock Data socket returned by openStore()
+ * @param fd Local file
+ * @param offset First byte to send
+ * @param length Bytes to send
+ * @param opts Transfer options (rate limits), may be NULL
+ * @param metrics Metrics updated per chunk, may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+static int sendStore(int ctrlSock, int dataSock, int fd, long long offset, long long length,
+                     const struct TransferOptions *opts, struct TransferMetrics *metrics)
+{
+    long long sent = sendFileRange(dataSock, fd, offset, length, opts, metrics);
+    close(dataSock);
+    traceStep(TRACE_DRAIN);
+
+    if (sent != length)
+    {
+        logMessage("\nUpload failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return finishTransfer(ctrlSock);
+}
+
+/**
+ * @brief Checks an uploaded file against the local one
+ *
+ * @param ctrlSock Control socket
+ * @param url Destination
+ * @param fd Local file
+ * @param size Local size
+ * @param opts Transfer options (checksum type), may be NULL
+ * @return int 0 if the remote file matches or cannot be checked, -1 otherwise
+ */
+static int verifyUpload(int ctrlSock, struct URL *url, int fd, long long size,
+                        const struct TransferOptions *opts)
+{
+    if (!opts || opts->checksumType == CHECKSUM_NONE)
+        return 0;
+
+    // The digest is computed from the file, not on the sendfile() path
+    struct Checksum sum;
+    checksumInit(&sum, opts->checksumType);
+    if (checksumFile(&sum, fd, size) != 0)
+    {
+        logMessage("Cannot read the local file to checksum it\n");
+        return -1;
+    }
+    return compareChecksum(ctrlSock, url->resource, &sum) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Uploads the whole file over one already-authenticated session
+ *
+ * @param ctrlSock Control socket
+ * @param url Destination
+ * @param fd Local file
+ * @param size Local size
+ * @param offset Bytes the server already holds; sent with APPE when non-zero
+ * @param opts Transfer options, may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+static int uploadSingleStream(int ctrlSock, struct URL *url, int fd, long long size,
+                              long long offset, const struct TransferOptions *opts)
+{
+    struct TransferMetrics metrics;
+
+    int dataSock = openStore(ctrlSock, url->resource, 0, offset > 0, opts);
+    if (dataSock < 0)
+        return -1;
+
+    metricsStart(&metrics, url->file, size - offset, opts);
+    metrics.upload = 1;
+    int result = sendStore(ctrlSock, dataSock, fd, offset, size - offset, opts, &metrics);
+    metricsFinish(&metrics, result == 0);
+
+    if (result == 0)
+        logMessage("\nUpload completed. Total: %.2f MB\n", (size - offset) / (1024.0 * 1024.0));
+    return result == 0 ? verifyUpload(ctrlSock, url, fd, size, opts) : -1;
+}
+
+/**
+ * @brief Opens a local file for upload
+ *
+ * @param localPath Path of the file
+ * @param size Receives its size
+ * @return int File descriptor, -1 on failure
+ */
+static int openLocalFile(const char *localPath, long long *size)
+{
+    struct stat st;
+    int fd = open(localPath, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        logMessage("Cannot upload %s: %s\n", localPath, fd < 0 ? strerror(errno) : "not a regular file");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    *size = st.st_size;
+    return fd;
+}
+
+/**
+ * @brief Asks how much of a file the server already holds
+ *
+ * A remote file as large as the local one is left alone, a shorter one
+ * is completed with APPE, and a larger one is replaced.
+ *
+ * @param ctrlSock Control socket
+ * @param url Destination
+ * @param size Size of the local file
+ * @param offset Receives the byte to continue from, 0 to send everything
+ * @return int 1 if the remote file is already complete, 0 otherwise
+ */
+static int uploadResumeOffset(int ctrlSock, struct URL *url, long long size, long long *offset)
+{
+    long long remote;
+
+    *offset = 0;
+    if (getFileSize(ctrlSock, url->resource, &remote) != 0)
+        return 0;
+    if (remote == size)
+    {
+        logMessage("Remote file is already complete (%lld bytes)\n", size);
+        return 1;
+    }
+    if (remote < size)
+        *offset = remote;
+    else
+        logMessage("Remote file is larger than the local one, replacing it\n");
+    return 0;
+}
+
+/**
+ * @brief Uploads a local file to the path of a URL
+ *
+ * With opts->resume the remote size is asked first, see
+ * uploadResumeOffset().
+ *
+ * @param url Destination
+ * @param localPath File to send
+ * @param opts Transfer options, may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int uploadFile(struct URL *url, const char *localPath, const struct TransferOptions *opts)
+{
+    logMessage("\n=== FILE UPLOAD ===\n");
+    long long size, offset = 0;
+
+    int fd = openLocalFile(localPath, &size);
+    if (fd < 0)
+        return -1;
+
+    int ctrlSock = openUploadSession(url);
+    if (ctrlSock < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (opts && opts->resume && uploadResumeOffset(ctrlSock, url, size, &offset))
+    {
+        close(fd);
+        closeConnection(ctrlSock);
+        return 0;
+    }
+
+    logMessage("Uploading %s (%lld bytes) to %s", localPath, size, url->resource);
+    if (offset > 0)
+        logMessage(", continuing at byte %lld", offset);
+    logMessage("\n");
+
+    int result = uploadSingleStream(ctrlSock, url, fd, size, offset, opts);
+    close(fd);
+    closeConnection(ctrlSock);
+    return result;
+}
+
+/**
+ * @brief Thread body of a segment upload worker
+ *
+ * Workers other than the first open their own session and store their
+ * range with REST + STOR; the first one arrives with its data connection
+ * already accepted.
+ *
+ * @param arg Pointer to the worker's UploadWorker
+ * @return void* Always NULL
+ */
+static void *uploadWorker(void *arg)
+{
+    struct UploadWorker *w = arg;
+    struct UploadJob *job = w->job;
+    struct TransferMetrics *none = NULL;
+
+    traceAttach(&w->trace);
+    w->result = -1;
+    if (w->ctrlSock < 0)
+        w->ctrlSock = openUploadSession(job->url);
+    if (w->ctrlSock >= 0 && w->dataSock < 0)
+        w->dataSock = openStore(w->ctrlSock, job->url->resource, w->offset, 0, job->opts);
+    if (w->dataSock >= 0)
+        w->result = sendStore(w->ctrlSock, w->dataSock, job->fd, w->offset, w->length, job->opts, none);
+    if (w->ctrlSock >= 0)
+        closeConnection(w->ctrlSock);
+    w->ctrlSock = -1;
+
+    pthread_mutex_lock(&job->lock);
+    if (w->result == 0)
+        job->sent += w->length;
+    job->running--;
+    pthread_cond_signal(&job->done);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/**
+ * @brief Uploads a file over several parallel control+data sessions
+ *
+ * A probe session checks that REST is accepted, then stores the first
+ * range; once the server has accepted that STOR, the remaining ranges
+ * are stored by one worker session each. SIZE must report the local
+ * size at the end, otherwise the file is uploaded again as a single
+ * stream. With opts->resume a partial remote file is completed with
+ * APPE over a single stream instead of being split and sent again.
+ *
+ * @param url Destination
+ * @param localPath File to send
+ * @param segments Requested number of parallel segments
+ * @param opts Transfer options, may be NULL
+ * @return int 0 on success, -1 on failure
+ */
+int uploadSegmented(struct URL *url, const char *localPath, int segments,
+                    const struct TransferOptions *opts)
+{
+    logMessage("\n=== SEGMENTED UPLOAD ===\n");
+    struct UploadJob job;
+    struct UploadWorker workers[MAX_SEGMENTS];
+    struct TransferMetrics metrics;
+    long long size, remote, offset = 0;
+    int result;
+
+    int fd = openLocalFile(localPath, &size);
+    if (fd < 0)
+        return -1;
+
+    int ctrlSock = openUploadSession(url);
+    if (ctrlSock < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (opts && opts->resume && uploadResumeOffset(ctrlSock, url, size, &offset))
+    {
+        close(fd);
+        closeConnection(ctrlSock);
+        return 0;
+    }
+
+    if (segments > MAX_SEGMENTS)
+        segments = MAX_SEGMENTS;
+    if (size / MIN_SEGMENT_SIZE < segments)
+        segments = size / MIN_SEGMENT_SIZE;
+
+    // REST 0 clears the probe's marker so the first STOR truncates
+    if (offset > 0 || segments < 2 || restartAt(ctrlSock, 1) != 0 || restartAt(ctrlSock, 0) != 0)
+    {
+        if (offset > 0)
+            logMessage("Continuing at byte %lld, using a single stream\n", offset);
+        else
+            logMessage(segments < 2 ? "File too small to split, using a single stream\n"
+                                    : "Server cannot do ranged uploads, using a single stream\n");
+        result = uploadSingleStream(ctrlSock, url, fd, size, offset, opts);
+        close(fd);
+        closeConnection(ctrlSock);
+        return result;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.url = url;
+    job.opts = opts;
+    job.fd = fd;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+
+    long long share = size / segments;
+    for (int i = 0; i < segments; i++)
+    {
+        workers[i].job = &job;
+        workers[i].index = i;
+        workers[i].offset = i * share;
+        workers[i].length = (i == segments - 1) ? size - i * share : share;
+        workers[i].ctrlSock = (i == 0) ? ctrlSock : -1;
+        workers[i].dataSock = -1;
+        workers[i].result = -1;
+        traceBegin(&workers[i].trace);
+    }
+
+    logMessage("Uploading %s (%lld bytes) to %s using %d segments\n", localPath, size, url->resource, segments);
+
+    // The first STOR creates the file; the other ranges must not race it
+    struct SessionTrace *jobTrace = traceAttach(&workers[0].trace);
+    workers[0].dataSock = openStore(ctrlSock, url->resource, 0, 0, opts);
+    traceAttach(jobTrace);
+    if (workers[0].dataSock < 0)
+    {
+        close(fd);
+        closeConnection(ctrlSock);
+        pthread_mutex_destroy(&job.lock);
+        pthread_cond_destroy(&job.done);
+        return -1;
+    }
+
+    for (int i = 0; i < segments; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, uploadWorker, &workers[i]) != 0)
+        {
+            if (workers[i].dataSock >= 0)
+                close(workers[i].dataSock);
+            if (workers[i].ctrlSock >= 0)
+                closeConnection(workers[i].ctrlSock);
+            workers[i].ctrlSock = -2;
+            continue;
+        }
+        job.running++;
+    }
+
+    traceStep(TRACE_SETUP);
+    jobTrace = traceAttach(NULL);
+
+    // Report progress as ranges complete until every worker is done
+    metricsStart(&metrics, url->file, size, opts);
+    metrics.upload = 1;
+    pthread_mutex_lock(&job.lock);
+    while (job.running > 0)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&job.done, &job.lock, &deadline);
+        metricsAdd(&metrics, job.sent - metrics.bytes);
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    result = 0;
+    for (int i = 0; i < segments; i++)
+    {
+        if (workers[i].ctrlSock != -2)
+            pthread_join(workers[i].thread, NULL);
+        if (workers[i].result != 0)
+            result = -1;
+    }
+    traceAttach(jobTrace);
+    traceStep(TRACE_DRAIN);
+    metricsFinish(&metrics, result == 0);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.done);
+
+    // A server that ignored REST wrote every range at the start
+    if ((ctrlSock = openUploadSession(url)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (result == 0 && getFileSize(ctrlSock, url->resource, &remote) == 0 && remote != size)
+    {
+        logMessage("\nServer assembled %lld of %lld bytes, restarting with a single stream\n", remote, size);
+        result = uploadSingleStream(ctrlSock, url, fd, size, 0, opts);
+    }
+    else if (result == 0)
+    {
+        logMessage("\nUpload completed. Total: %.2f MB\n", size / (1024.0 * 1024.0));
+        result = verifyUpload(ctrlSock, url, fd, size, opts);
+    }
+    else
+        logMessage("\nSegmented upload incomplete\n");
+
+    close(fd);
+    closeConnection(ctrlSock);
+
+    for (int i = 0; i < segments; i++)
+    {
+        char label[32];
+        snprintf(label, sizeof(label), "segment %d", i);
+        if (workers[i].ctrlSock != -2)
+            tracePrint(&workers[i].trace, label);
+    }
+    return result;
+}
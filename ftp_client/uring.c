@@ -0,0 +1,439 @@
+/**
+ * @file uring.c
+ * @brief io_uring receive engine for FTP client
+ *
+ * This file implements a receive engine that moves the data connection
+ * to the file through an io_uring instance, driven with the raw
+ * io_uring_setup/io_uring_register/io_uring_enter system calls:
+ *
+ * - The data socket and the file are registered as fixed files, and the
+ *   receive buffers as fixed buffers, so the kernel does not look them
+ *   up again for every request.
+ * - Each batch queues URING_DEPTH linked pairs: a RECV with MSG_WAITALL
+ *   into a buffer, then a WRITE_FIXED of that buffer at its file offset.
+ *   The whole batch is submitted and reaped with one io_uring_enter(),
+ *   where the read()/write() loop makes two system calls per chunk.
+ * - A short receive breaks the chain: the writes after it are cancelled,
+ *   its own bytes are written with pwrite(), and the next batch starts
+ *   right after them. Only an empty receive marks the end of the file,
+ *   since kernels without the MSG_WAITALL retry fix complete receives
+ *   short in the middle of a stream.
+ *
+ * The idle deadline is not left to SO_RCVTIMEO, which would cut a
+ * MSG_WAITALL receive short and make it look like the end of the file.
+ * It bounds the wait for completions instead: a wait that expires
+ * without any completion shuts the socket down, reaps the batch and
+ * fails with EAGAIN like a blocking read() would. Completions are only
+ * seen when a wait returns, so a stall is caught within one to two
+ * deadlines.
+ *
+ * When the kernel has no io_uring (ENOSYS), forbids it (EPERM, sysctl
+ * kernel.io_uring_disabled) or rejects the first receive, nothing has
+ * been consumed yet and the aligned-buffer engine takes over.
+ */
+
+#include "ftp_client.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * @struct UringRing
+ * @brief io_uring instance with its queues mapped into the process
+ */
+struct UringRing {
+    int fd;                     /**< Ring file descriptor */
+    unsigned *sqHead;           /**< Submission queue head (kernel) */
+    unsigned *sqTail;           /**< Submission queue tail (process) */
+    unsigned *sqMask;           /**< Submission queue index mask */
+    unsigned *sqArray;          /**< Submission queue index array */
+    unsigned *cqHead;           /**< Completion queue head (process) */
+    unsigned *cqTail;           /**< Completion queue tail (kernel) */
+    unsigned *cqMask;           /**< Completion queue index mask */
+    struct io_uring_sqe *sqes;  /**< Submission queue entries */
+    struct io_uring_cqe *cqes;  /**< Completion queue entries */
+    void *sqMap;                /**< Mapping of the submission queue ring */
+    void *cqMap;                /**< Mapping of the completion queue ring, may equal sqMap */
+    size_t sqMapSize;           /**< Bytes mapped at sqMap */
+    size_t cqMapSize;           /**< Bytes mapped at cqMap */
+    size_t sqesSize;            /**< Bytes mapped at sqes */
+    int fixedFiles;             /**< Socket and file registered (slots 0 and 1) */
+    int fixedBuffers;           /**< Buffers registered */
+    int noTimeout;              /**< Kernel cannot bound the wait (no IORING_ENTER_EXT_ARG) */
+};
+
+/**
+ * @brief Creates an io_uring instance and maps its queues
+ *
+ * @param ring Ring to set up
+ * @param entries Submission queue entries
+ * @return int 0 on success, -1 if io_uring is unavailable (errno set)
+ */
+static int uringSetup(struct UringRing *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+        return -1;
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cqMapSize > ring->sqMapSize)
+            ring->sqMapSize = ring->cqMapSize;
+        ring->cqMapSize = 0;
+    }
+
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    ring->cqMap = ring->cqMapSize == 0 ? ring->sqMap
+                                       : mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqMap == MAP_FAILED || ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        int saved = errno;
+        if (ring->sqMap != MAP_FAILED)
+            munmap(ring->sqMap, ring->sqMapSize);
+        if (ring->cqMapSize && ring->cqMap != MAP_FAILED)
+            munmap(ring->cqMap, ring->cqMapSize);
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqesSize);
+        close(ring->fd);
+        errno = saved;
+        return -1;
+    }
+
+    char *sq = ring->sqMap, *cq = ring->cqMap;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Unmaps and closes a ring set up by uringSetup()
+ *
+ * Closing the ring also drops its registered files and buffers.
+ *
+ * @param ring Ring to release
+ */
+static void uringFree(struct UringRing *ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqMapSize)
+        munmap(ring->cqMap, ring->cqMapSize);
+    munmap(ring->sqMap, ring->sqMapSize);
+    close(ring->fd);
+}
+
+/**
+ * @brief Takes the next free submission queue entry
+ *
+ * The caller never queues more entries than the ring holds, so a free
+ * entry is always available.
+ *
+ * @param ring Ring
+ * @return struct io_uring_sqe* Cleared entry
+ */
+static struct io_uring_sqe *uringNext(struct UringRing *ring)
+{
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    // Published to the kernel only once the entry is filled in, by uringSubmit()
+    *ring->sqTail = tail + 1;
+    return sqe;
+}
+
+/**
+ * @brief Submits the queued entries and waits for a number of completions
+ *
+ * @param ring Ring
+ * @param submit Entries queued since the last call
+ * @param wait Completions to wait for
+ * @param idle Seconds without a completion before giving up, 0 for no limit
+ * @return int 0 on success, -1 on failure (ETIME when idle expired)
+ */
+static int uringSubmit(struct UringRing *ring, unsigned submit, unsigned wait, double idle)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = { .ts = (uintptr_t)&ts };
+    unsigned seen = ~0u;
+    double progress = 0;
+
+    __atomic_store_n(ring->sqTail, *ring->sqTail, __ATOMIC_RELEASE);
+    for (;;)
+    {
+        unsigned ready = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead;
+        if (submit == 0 && ready >= wait)
+            return 0;
+
+        // Completions seen since the last wait are progress and restart the deadline
+        int timed = idle > 0 && !ring->noTimeout;
+        if (timed)
+        {
+            double now = traceSeconds();
+            if (ready != seen)
+            {
+                seen = ready;
+                progress = now;
+            }
+            double left = progress + idle - now;
+            if (left <= 0 && submit == 0)
+            {
+                errno = ETIME;
+                return -1;
+            }
+            left = left > 0 ? left : 0;
+            ts.tv_sec = (long long)left;
+            ts.tv_nsec = (long long)((left - ts.tv_sec) * 1e9);
+        }
+
+        int done = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                           IORING_ENTER_GETEVENTS | (timed ? IORING_ENTER_EXT_ARG : 0),
+                           timed ? (void *)&arg : NULL, timed ? sizeof(arg) : 0);
+        if (done < 0 && errno == EINVAL && timed)
+        {
+            // Kernels before 5.11 have no timed wait
+            ring->noTimeout = 1;
+            continue;
+        }
+        if (done < 0 && (errno == EINTR || errno == ETIME))
+        {
+            // Entries the kernel already consumed are not submitted again
+            submit = *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if (done < 0)
+            return -1;
+        submit -= done;
+    }
+}
+
+/**
+ * @brief Queues a linked receive + write pair for one buffer
+ *
+ * @param ring Ring
+ * @param dataSock Data socket, used when files are not registered
+ * @param fd Destination file, used when files are not registered
+ * @param buffer Buffer of the pair
+ * @param index Index of the buffer among the registered ones
+ * @param size Bytes to receive and write
+ * @param offset File offset of the buffer's bytes
+ * @param last Do not link the write to the next pair
+ */
+static void queuePair(struct UringRing *ring, int dataSock, int fd, char *buffer, unsigned index,
+                      size_t size, long long offset, int last)
+{
+    struct io_uring_sqe *sqe = uringNext(ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ring->fixedFiles ? 0 : dataSock;
+    sqe->flags = IOSQE_IO_LINK | (ring->fixedFiles ? IOSQE_FIXED_FILE : 0);
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = size;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->user_data = index * 2;
+
+    sqe = uringNext(ring);
+    sqe->opcode = ring->fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = ring->fixedFiles ? 1 : fd;
+    sqe->flags = (last ? 0 : IOSQE_IO_LINK) | (ring->fixedFiles ? IOSQE_FIXED_FILE : 0);
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->buf_index = index;
+    sqe->user_data = index * 2 + 1;
+}
+
+/**
+ * @brief Writes the bytes of a buffer the ring did not write
+ *
+ * @param fd Destination file
+ * @param buffer Buffer
+ * @param length Bytes in the buffer
+ * @param offset File offset of the buffer's first byte
+ * @return int 0 on success, -1 on failure
+ */
+static int writeRest(int fd, const char *buffer, size_t length, long long offset)
+{
+    for (size_t done = 0; done < length; )
+    {
+        ssize_t n = pwrite(fd, buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives the file through io_uring in linked receive/write batches
+ *
+ * Falls back to receiveAligned() when io_uring cannot be used. Each
+ * batch holds URING_DEPTH buffers of the configured read size (or
+ * ALIGNED_BUFFER_SIZE); with a rate limit, one buffer of
+ * SHAPER_READ_SIZE is in flight at a time.
+ *
+ * @param dataSock Data socket
+ * @param fd Destination file descriptor, positioned where the data goes
+ * @param opts Transfer options (read size, checksum, rate limits)
+ * @param metrics Metrics updated per buffer
+ * @return long long Bytes received, -1 on failure
+ */
+long long receiveUring(int dataSock, int fd, const struct TransferOptions *opts,
+                       struct TransferMetrics *metrics)
+{
+    struct UringRing ring;
+    struct iovec iov[URING_DEPTH];
+    size_t size = opts && opts->readSize > 0 ? opts->readSize : ALIGNED_BUFFER_SIZE;
+    unsigned depth = URING_DEPTH;
+    long long offset = lseek(fd, 0, SEEK_CUR), total = 0;
+    char *buffers;
+    int eof = 0;
+
+    // Small reads keep rate-limited transfers smooth and their shares even
+    if (opts && (opts->rateLimit || opts->hostRateLimit))
+    {
+        size = size > SHAPER_READ_SIZE ? SHAPER_READ_SIZE : size;
+        depth = 1;
+    }
+
+    if (offset < 0 || uringSetup(&ring, URING_DEPTH * 2) != 0)
+        return receiveAligned(dataSock, fd, opts, metrics);
+
+    // A receive cut short by SO_RCVTIMEO would pass for the end of the file
+    if (socketIdleDeadline() > 0)
+    {
+        struct timeval none = { 0, 0 };
+        setsockopt(dataSock, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    }
+    if (posix_memalign((void **)&buffers, BUFFER_ALIGNMENT, size * depth) != 0)
+    {
+        uringFree(&ring);
+        return -1;
+    }
+
+    // Registration only saves per-request lookups; the ring works without it
+    int files[2] = { dataSock, fd };
+    ring.fixedFiles = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, 2) == 0;
+    for (unsigned i = 0; i < depth; i++)
+    {
+        iov[i].iov_base = buffers + i * size;
+        iov[i].iov_len = size;
+    }
+    ring.fixedBuffers = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, depth) == 0;
+
+    while (!eof)
+    {
+        ssize_t received[URING_DEPTH], written[URING_DEPTH];
+
+        for (unsigned i = 0; i < depth; i++)
+            queuePair(&ring, dataSock, fd, buffers + i * size, i, size, offset + i * size, i == depth - 1);
+        if (uringSubmit(&ring, depth * 2, depth * 2, socketIdleDeadline()) != 0)
+        {
+            // Cut the stalled receives short and reap the batch before failing
+            if (errno == ETIME)
+            {
+                shutdown(dataSock, SHUT_RDWR);
+                uringSubmit(&ring, 0, depth * 2, 0);
+                errno = EAGAIN;
+            }
+            break;
+        }
+
+        // Every entry of the batch completes, cancelled ones with -ECANCELED
+        unsigned head = *ring.cqHead;
+        for (unsigned n = 0; n < depth * 2; n++, head++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            unsigned index = cqe->user_data / 2;
+            if (cqe->user_data % 2)
+                written[index] = cqe->res;
+            else
+                received[index] = cqe->res;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+        // A kernel without IORING_OP_RECV refuses it before touching the socket
+        if (total == 0 && received[0] == -EINVAL)
+        {
+            free(buffers);
+            uringFree(&ring);
+            return receiveAligned(dataSock, fd, opts, metrics);
+        }
+
+        for (unsigned i = 0; i < depth && !eof; i++)
+        {
+            char *buffer = buffers + i * size;
+            if (received[i] < 0)
+            {
+                errno = -received[i];
+                free(buffers);
+                uringFree(&ring);
+                return -1;
+            }
+
+            // The chain stops at a short receive, which some kernels complete
+            // mid-stream despite MSG_WAITALL; only an empty one ends the file
+            if (received[i] == 0)
+                eof = 1;
+            size_t done = written[i] > 0 ? written[i] : 0;
+            if (written[i] < 0 && written[i] != -ECANCELED)
+            {
+                errno = -written[i];
+                free(buffers);
+                uringFree(&ring);
+                return -1;
+            }
+            if (done < (size_t)received[i] &&
+                writeRest(fd, buffer + done, received[i] - done, offset + done) != 0)
+            {
+                free(buffers);
+                uringFree(&ring);
+                return -1;
+            }
+
+            if (opts && opts->checksum)
+                checksumUpdate(opts->checksum, buffer, received[i]);
+            if (opts && opts->unpack && unpackFeed(opts->unpack, buffer, received[i]) != 0)
+            {
+                free(buffers);
+                uringFree(&ring);
+                return -1;
+            }
+            offset += received[i];
+            total += received[i];
+            metricsAdd(metrics, received[i]);
+            throttleTransfer(opts, received[i]);
+
+            // The rest of the batch was cancelled; the next one starts here
+            if (received[i] < (ssize_t)size)
+                break;
+        }
+    }
+
+    free(buffers);
+    uringFree(&ring);
+    if (!eof)
+        return -1;
+    // Leave the descriptor where a write() loop would have left it
+    lseek(fd, offset, SEEK_SET);
+    return total;
+}